@@ -5,14 +5,48 @@
 #endif
 #include "xsys.h"
 #include <inttypes.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <atomic>
+
+#ifdef XV6_USER
+#include "types.h"
+#include "user.h"
+#include "kstats.hh"
+#else
+struct kstats
+{
+  kstats operator-(const kstats &o) {
+    return kstats{};
+  }
+};
+#endif
 
 static pthread_barrier_t bar;
 static int niter;
+// If non-zero, benchmark kernel kmalloc/kmfree of this size instead
+// of mmap.
+static int ksize;
+static int kbatch = 32;
+static std::atomic<uint64_t> kcycles;
+
+static void
+read_kstats(struct kstats *out)
+{
+#ifdef XV6_USER
+  int fd = open("/dev/kstats", O_RDONLY);
+  if (fd < 0)
+    die("Couldn't open /dev/kstats");
+  int r = xread(fd, out, sizeof *out);
+  if (r != sizeof *out)
+    die("Short read from /dev/kstats");
+  close(fd);
+#endif
+}
 
 void*
 thr(void *arg)
@@ -24,6 +58,18 @@ thr(void *arg)
 
   pthread_barrier_wait(&bar);
 
+  if (ksize) {
+#ifdef XV6_USER
+    long r = kmallocbench(ksize, kbatch, niter);
+    if (r < 0)
+      die("%d: kmallocbench failed", tid);
+    kcycles += r;
+#else
+    die("kmalloc benchmark requires xv6");
+#endif
+    return 0;
+  }
+
   for (int i = 0; i < niter; i++) {
     if ((i % 100) == 0)
       printf("%d: %d ops\n", tid, i);
@@ -36,25 +82,63 @@ thr(void *arg)
   return 0;
 }
 
+static void
+usage(const char *argv0)
+{
+  die("usage: %s [-k size [-b batch]] nthreads [nloop]", argv0);
+}
+
 int
 main(int ac, char **av)
 {
-  if (ac < 2)
-    die("usage: %s nthreads [nloop]", av[0]);
+  int opt;
+  while ((opt = getopt(ac, av, "k:b:")) != -1) {
+    switch (opt) {
+    case 'k':
+      ksize = atoi(optarg);
+      break;
+    case 'b':
+      kbatch = atoi(optarg);
+      break;
+    default:
+      usage(av[0]);
+    }
+  }
+
+  if (optind >= ac)
+    usage(av[0]);
 
-  int nthread = atoi(av[1]);
+  int nthread = atoi(av[optind]);
   niter = 100;
-  if (ac > 2)
-    niter = atoi(av[2]);
+  if (optind + 1 < ac)
+    niter = atoi(av[optind + 1]);
 
   pthread_t* tid = (pthread_t*) malloc(sizeof(*tid)*nthread);
 
   pthread_barrier_init(&bar, 0, nthread);
 
+  struct kstats kstats_before, kstats_after;
+  read_kstats(&kstats_before);
+
   for(uint64_t i = 0; i < nthread; i++)
     xthread_create(&tid[i], 0, thr, (void*) i);
 
   for(int i = 0; i < nthread; i++)
     xpthread_join(tid[i]);
+
+  read_kstats(&kstats_after);
+
+  if (ksize) {
+#ifdef XV6_USER
+    struct kstats kstats = kstats_after - kstats_before;
+    uint64_t nops = (uint64_t)nthread * niter * kbatch * 2;
+    printf("%d threads, %d byte objects, batches of %d\n",
+           nthread, ksize, kbatch);
+    printf("%lu cycles/op\n", kcycles.load() / nops);
+    printf("%lu depot gets\n", kstats.kmalloc_depot_get_count);
+    printf("%lu depot puts\n", kstats.kmalloc_depot_put_count);
+    printf("%lu depot grows\n", kstats.kmalloc_depot_grow_count);
+#endif
+  }
   return 0;
 }
@@ -19,21 +19,19 @@ du(int fd)
 
   int size = st.st_size;
   if (S_ISDIR(st.st_mode)) {
-    struct dirent de;
-    while (read(fd, &de, sizeof(de)) == sizeof(de)) {
-      if (de.inum == 0)
-        continue;
-
-      char buf[DIRSIZ+1];
-      memmove(buf, de.name, DIRSIZ);
-      buf[DIRSIZ] = 0;
-
-      if (!strcmp(buf, ".") || !strcmp(buf, ".."))
-        continue;
-
-      int nfd = openat(fd, buf, 0);
-      if (nfd >= 0)
-        size += du(nfd);  // should go into work queue
+    struct getdents_cursor cur = {};
+    struct getdents_ent ents[64];
+    ssize_t n;
+    while ((n = getdents(fd, &cur, ents, 64)) > 0) {
+      for (ssize_t i = 0; i < n; i++) {
+        const char *name = ents[i].name;
+        if (!strcmp(name, ".") || !strcmp(name, ".."))
+          continue;
+
+        int nfd = openat(fd, name, 0);
+        if (nfd >= 0)
+          size += du(nfd);  // should go into work queue
+      }
     }
   }
 
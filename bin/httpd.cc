@@ -8,6 +8,9 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#if defined(XV6_USER)
+#include <sys/resource.h>
+#endif
 
 #include "sockutil.h"
 
@@ -361,6 +364,12 @@ main(void)
 
   fprintf(stderr, "httpd: port 80\n");
 
+#if defined(XV6_USER)
+  // Don't let batch work delay accepting connections.
+  if (setpriority(PRIO_CLASS, 0, PRIO_LATENCY) < 0)
+    fprintf(stderr, "httpd: setpriority failed\n");
+#endif
+
   for (;;) {
     socklen_t socklen;
     int ss;
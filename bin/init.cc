@@ -45,6 +45,7 @@ static struct {
   { "/dev/mfsstats",    MAJ_MFSSTATS},
   { "/dev/blkstats",    MAJ_BLKSTATS},
   { "/dev/evict_caches",    MAJ_EVICTCACHES},
+  { "/dev/writeback",    MAJ_WRITEBACK},
 };
 #endif
 
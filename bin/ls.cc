@@ -70,11 +70,12 @@ ls(const std::string &path)
   case S_IFDIR:
     std::vector<std::string> names;
 #ifdef XV6_USER
-    char namebuf[DIRSIZ+1];
-    char *prev = nullptr;
-    while(readdir(fd, prev, namebuf) > 0) {
-      prev = namebuf;
-      names.push_back(path + '/' + namebuf);
+    struct getdents_cursor cur = {};
+    struct getdents_ent ents[64];
+    ssize_t n;
+    while((n = getdents(fd, &cur, ents, 64)) > 0) {
+      for (ssize_t i = 0; i < n; i++)
+        names.push_back(path + '/' + ents[i].name);
     }
 #else
     DIR *dir = fdopendir(fd);
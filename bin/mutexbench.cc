@@ -0,0 +1,122 @@
+// Benchmark contended pthread mutex handoff, barrier rounds and
+// condition variable broadcasts.  Each of nthreads threads is pinned
+// to its own CPU.
+//
+//  mutex:     every thread repeatedly takes one mutex and increments
+//             a counter; reports cycles per acquisition.
+//  barrier:   all threads pass through one barrier iters times;
+//             reports cycles per round.
+//  broadcast: one thread repeatedly broadcasts to the others waiting
+//             on a condition variable; reports cycles per round.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "types.h"
+#include "user.h"
+#include "amd64.h"
+#include "pthread.h"
+#include "libutil.h"
+
+static int nthreads;
+static int iters;
+
+static pthread_mutex_t mu;
+static pthread_cond_t cond;
+static pthread_barrier_t start_bar, bar;
+static volatile u64 counter;
+static u64 round_, arrived;
+
+static void*
+mutex_thread(void *arg)
+{
+  setaffinity((int)(u64)arg);
+  pthread_barrier_wait(&start_bar);
+  for (int i = 0; i < iters; i++) {
+    pthread_mutex_lock(&mu);
+    counter = counter + 1;
+    pthread_mutex_unlock(&mu);
+  }
+  return nullptr;
+}
+
+static void*
+barrier_thread(void *arg)
+{
+  setaffinity((int)(u64)arg);
+  pthread_barrier_wait(&start_bar);
+  for (int i = 0; i < iters; i++)
+    pthread_barrier_wait(&bar);
+  return nullptr;
+}
+
+// Threads other than 0 wait for each round; thread 0 starts a round
+// once they have all arrived.
+static void*
+broadcast_thread(void *arg)
+{
+  int id = (int)(u64)arg;
+  setaffinity(id);
+  pthread_barrier_wait(&start_bar);
+  for (u64 r = 0; r < (u64)iters; r++) {
+    pthread_mutex_lock(&mu);
+    if (id == 0) {
+      while (arrived < (u64)nthreads - 1)
+        pthread_cond_wait(&cond, &mu);
+      arrived = 0;
+      round_ = r + 1;
+      pthread_cond_broadcast(&cond);
+    } else {
+      if (++arrived == (u64)nthreads - 1)
+        pthread_cond_broadcast(&cond);
+      while (round_ <= r)
+        pthread_cond_wait(&cond, &mu);
+    }
+    pthread_mutex_unlock(&mu);
+  }
+  return nullptr;
+}
+
+static u64
+run(void* (*fn)(void*))
+{
+  pthread_t *tids = (pthread_t*)malloc(sizeof(*tids) * nthreads);
+  pthread_barrier_init(&start_bar, 0, nthreads + 1);
+  for (int i = 0; i < nthreads; i++)
+    if (pthread_create(&tids[i], nullptr, fn, (void*)(u64)i) < 0)
+      die("mutexbench: pthread_create");
+  pthread_barrier_wait(&start_bar);
+  u64 t0 = rdtsc();
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(tids[i], nullptr);
+  u64 t1 = rdtsc();
+  free(tids);
+  return t1 - t0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  if (argc < 2 || argc > 3)
+    die("usage: %s nthreads [iters]", argv[0]);
+  nthreads = atoi(argv[1]);
+  iters = argc > 2 ? atoi(argv[2]) : 100000;
+  if (nthreads < 2 || iters <= 0)
+    die("mutexbench: need at least 2 threads and 1 iteration");
+
+  pthread_mutex_init(&mu, nullptr);
+  u64 t = run(mutex_thread);
+  if (counter != (u64)nthreads * iters)
+    die("mutexbench: counter %lu, expected %lu", counter,
+        (u64)nthreads * iters);
+  printf("mutex: %lu cycles/acquire\n", t / ((u64)nthreads * iters));
+
+  pthread_barrier_init(&bar, 0, nthreads);
+  t = run(barrier_thread);
+  printf("barrier: %lu cycles/round\n", t / iters);
+
+  pthread_cond_init(&cond, nullptr);
+  t = run(broadcast_thread);
+  printf("broadcast: %lu cycles/round\n", t / iters);
+  return 0;
+}
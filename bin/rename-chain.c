@@ -1,8 +1,12 @@
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <fcntl.h>
 #include "libutil.h"
 
@@ -82,9 +86,90 @@ void rename_test(void)
   close(fd);
 }
 
+/*
+ * Rename benchmark: each of nprocs processes moves its own directory back and
+ * forth between two staging directories, iters times in each direction. With
+ * "shared", all processes move their directories between the same two staging
+ * directories, so their ancestries overlap; otherwise each process has its own
+ * staging tree.
+ */
+void rename_bench(int nprocs, unsigned long iters, int shared)
+{
+  int p;
+  unsigned long i, usec;
+  char a[128], b[128], src[128], dst[128];
+  struct timeval before, after;
+
+  for (p = 0; p < nprocs; p++) {
+    snprintf(a, 128, "stage-%d", shared ? 0 : p);
+    if ((!shared || p == 0) && mkdir(a, 0777) < 0)
+      die("mkdir %s failed\n", a);
+    snprintf(a, 128, "stage-%d/a", shared ? 0 : p);
+    snprintf(b, 128, "stage-%d/b", shared ? 0 : p);
+    if ((!shared || p == 0) && (mkdir(a, 0777) < 0 || mkdir(b, 0777) < 0))
+      die("mkdir %s failed\n", a);
+    snprintf(src, 128, "%s/d%d", a, p);
+    if (mkdir(src, 0777) < 0)
+      die("mkdir %s failed\n", src);
+  }
+
+  gettimeofday(&before, NULL);
+  for (p = 0; p < nprocs; p++) {
+    int pid = fork();
+    if (pid < 0)
+      die("fork failed\n");
+    if (pid == 0) {
+      snprintf(src, 128, "stage-%d/a/d%d", shared ? 0 : p, p);
+      snprintf(dst, 128, "stage-%d/b/d%d", shared ? 0 : p, p);
+      for (i = 0; i < iters; i++) {
+        if (rename(src, dst) < 0)
+          die("rename %s -> %s failed\n", src, dst);
+        if (rename(dst, src) < 0)
+          die("rename %s -> %s failed\n", dst, src);
+      }
+      exit(0);
+    }
+  }
+  for (p = 0; p < nprocs; p++)
+    wait(NULL);
+  gettimeofday(&after, NULL);
+
+  usec = (after.tv_sec - before.tv_sec) * 1000000 +
+         (after.tv_usec - before.tv_usec);
+  printf("%d procs, %s staging: %lu renames in %lu usec, %lu renames/sec\n",
+         nprocs, shared ? "shared" : "private", 2 * iters * nprocs, usec,
+         usec ? 2 * iters * nprocs * 1000000 / usec : 0);
+
+  for (p = 0; p < nprocs; p++) {
+    snprintf(src, 128, "stage-%d/a/d%d", shared ? 0 : p, p);
+    rmdir(src);
+    if (shared && p != nprocs - 1)
+      continue;
+    snprintf(a, 128, "stage-%d/a", shared ? 0 : p);
+    snprintf(b, 128, "stage-%d/b", shared ? 0 : p);
+    rmdir(a);
+    rmdir(b);
+    snprintf(a, 128, "stage-%d", shared ? 0 : p);
+    rmdir(a);
+  }
+}
 
-int main(void)
+int main(int argc, char **argv)
 {
-  rename_test();
+  if (argc == 1) {
+    rename_test();
+    return 0;
+  }
+
+  if (argc > 4)
+    die("usage: %s [nprocs [iters [shared]]]\n", argv[0]);
+
+  int nprocs = atoi(argv[1]);
+  unsigned long iters = argc > 2 ? strtoul(argv[2], NULL, 10) : 10000;
+  int shared = argc > 3 && strcmp(argv[3], "shared") == 0;
+  if (nprocs <= 0)
+    die("usage: %s [nprocs [iters [shared]]]\n", argv[0]);
+
+  rename_bench(nprocs, iters, shared);
   return 0;
 }
@@ -6,9 +6,13 @@
 #include "errno.h"
 #include "mtrace.h"
 
+#include <sys/resource.h>
+
+#include <algorithm>
 #include <atomic>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 static volatile std::atomic<u64> waiting;
 static volatile std::atomic<u64> waking __attribute__((unused));
@@ -36,19 +40,19 @@ void* worker0(void* x)
 
   if (id & 0x1) {
     for (u64 i = 0; i < iters; i++) {
-      r = futex(f, FUTEX_WAIT, (u64)(i<<1), 0);
+      r = futex(f, FUTEX_WAIT, (u64)(i<<1), 0, 0, 0);
       if (r < 0 && r != -EWOULDBLOCK)
         die("futex: %ld", r);
       *f = (i<<1)+2;
-      r = futex(f, FUTEX_WAKE, 1, 0);
-      assert(r == 0);
+      r = futex(f, FUTEX_WAKE, 1, 0, 0, 0);
+      assert(r >= 0);
     }
   } else {
     for (u64 i = 0; i < iters; i++) {
       *f = (i<<1)+1;
-      r = futex(f, FUTEX_WAKE, 1, 0);
-      assert(r == 0);
-      r = futex(f, FUTEX_WAIT, (u64)(i<<1)+1, 0);
+      r = futex(f, FUTEX_WAKE, 1, 0, 0, 0);
+      assert(r >= 0);
+      r = futex(f, FUTEX_WAIT, (u64)(i<<1)+1, 0, 0, 0);
       if (r < 0 && r != -EWOULDBLOCK)
         die("futex: %ld", r);
     }
@@ -65,13 +69,117 @@ void master0(void)
     wait(NULL);
 }
 
+// Wakeup-to-run latency.  The main thread, on CPU 0, repeatedly wakes
+// a waiter pinned to CPU 1, where batch-class spinners keep the CPU
+// busy, and the waiter records how long it took to run after each
+// wakeup.  This runs once with the waiter in each scheduling class.
+static volatile u64 lat_seq;
+static volatile u64 lat_t0;
+static std::atomic<u64> lat_done;
+static volatile int lat_stop;
+static u64* lat_samples;
+
+static
+void* lat_spinner(void* x)
+{
+  setaffinity(1);
+  while (!lat_stop)
+    nop_pause();
+  return nullptr;
+}
+
+static
+void* lat_waiter(void* x)
+{
+  if (setpriority(PRIO_CLASS, 0, (int)(u64)x) < 0)
+    die("setpriority");
+  setaffinity(1);
+
+  for (u64 i = 0; i < iters; i++) {
+    while (lat_seq == i) {
+      long r = futex((u64*)&lat_seq, FUTEX_WAIT, i, 0, 0, 0);
+      if (r < 0 && r != -EWOULDBLOCK)
+        die("futex: %ld", r);
+    }
+    lat_samples[i] = rdtsc() - lat_t0;
+    lat_done.store(i + 1);
+  }
+  return nullptr;
+}
+
+static
+void lat_run(int prio, const char* name, u64 hz)
+{
+  pthread_t th;
+  long r;
+
+  lat_seq = 0;
+  lat_done.store(0);
+  r = pthread_create(&th, nullptr, lat_waiter, (void*)(u64)prio);
+  if (r < 0)
+    die("pthread_create");
+
+  for (u64 i = 0; i < iters; i++) {
+    // Give the waiter time to block behind the spinners.
+    nsleep(1000*1000);
+    lat_t0 = rdtsc();
+    lat_seq = i + 1;
+    r = futex((u64*)&lat_seq, FUTEX_WAKE, 1, 0, 0, 0);
+    assert(r >= 0);
+    while (lat_done.load() < i + 1)
+      nop_pause();
+  }
+  wait(NULL);
+
+  std::sort(lat_samples, lat_samples + iters);
+  auto us = [&](u64 cycles) { return cycles * 1000000 / hz; };
+  printf("%s: p50 %lu us p99 %lu us max %lu us\n", name,
+         us(lat_samples[iters / 2]), us(lat_samples[iters * 99 / 100]),
+         us(lat_samples[iters - 1]));
+}
+
+static
+void lat_main(int nspinners)
+{
+  u64 hz = cpuhz();
+
+  lat_samples = (u64*)malloc(iters * sizeof(u64));
+  if (!lat_samples)
+    die("malloc");
+  setaffinity(0);
+
+  for (int i = 0; i < nspinners; i++) {
+    pthread_t th;
+    if (pthread_create(&th, nullptr, lat_spinner, nullptr) < 0)
+      die("pthread_create");
+  }
+  nsleep(1000*1000);
+
+  lat_run(PRIO_LATENCY, "latency", hz);
+  lat_run(PRIO_BATCH, "batch", hz);
+
+  lat_stop = 1;
+  for (int i = 0; i < nspinners; i++)
+    wait(NULL);
+  free(lat_samples);
+}
+
 int
 main(int ac, char** av)
 {
   long r;
 
+  if (ac == 4 && strcmp(av[1], "-l") == 0) {
+    iters = atoi(av[2]);
+    if (iters <= 0)
+      die("schedbench: iters must be positive");
+    lat_main(atoi(av[3]));
+    return 0;
+  }
+
   if (ac < 3)
-    die("usage: %s iters nworkers", av[0]);
+    die("usage: %s iters nworkers\n"
+        "       %s -l iters nspinners", av[0], av[0]);
 
   iters = atoi(av[1]);
   nworkers = atoi(av[2]);
@@ -106,7 +214,7 @@ void* worker0(void* x)
 
   for (i = 0; i < iters; i++) {
     ++waiting;
-    r = futex((u64*)&ftx, FUTEX_WAIT, (u64)i, 0);
+    r = futex((u64*)&ftx, FUTEX_WAIT, (u64)i, 0, 0, 0);
     if (r < 0 && r != -EWOULDBLOCK)
       die("FUTEX_WAIT: %d", r);
     while (waking.load() == 1)
@@ -127,8 +235,8 @@ void master0(void)
     
     waking.store(1);
     ftx = i+1;
-    r = futex((u64*)&ftx, FUTEX_WAKE, nworkers, 0);  
-    assert(r == 0);
+    r = futex((u64*)&ftx, FUTEX_WAKE, nworkers, 0, 0, 0);  
+    assert(r >= 0);
     waking.store(0);
   }
 }
@@ -26,7 +26,7 @@ main(int argc, char **argv)
     fds[i] = fd;
   }
 
-  char buf[1024];
+  char buf[4096];
   while (1) {
     int r = read(0, buf, sizeof buf);
     if (r < 0)
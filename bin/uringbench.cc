@@ -0,0 +1,132 @@
+// Create, write, fsync, close and unlink nfiles files, once with one
+// system call per operation and once through the submission ring, and
+// report the cycles per file for each.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uring.h>
+
+#include "types.h"
+#include "amd64.h"
+#include "libutil.h"
+
+static char buf[512];
+static char names[4096][16];
+
+static void
+run_syscalls(int nfiles)
+{
+  for (int i = 0; i < nfiles; i++) {
+    int fd = open(names[i], O_RDWR | O_CREAT);
+    if (fd < 0)
+      die("uringbench: open %s", names[i]);
+    if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+      die("uringbench: write");
+    fsync(fd);
+    close(fd);
+  }
+  for (int i = 0; i < nfiles; i++)
+    unlink(names[i]);
+}
+
+// Queue one entry per file from fill, submit them, and wait for all
+// their completions.  Returns the first failing result, or 0.
+template<class Fill>
+static s64
+run_batch(struct uring_ctl *r, bool sqpoll, int nfiles, s64 *res, Fill fill)
+{
+  int done = 0, queued = 0;
+  u32 tail = r->sq_tail;
+  while (done < nfiles) {
+    struct uring_sqe *sqe;
+    while (queued < nfiles && (sqe = uring_get_sqe(r, &tail))) {
+      memset(sqe, 0, sizeof(*sqe));
+      fill(sqe, queued);
+      sqe->user_data = queued++;
+    }
+    uring_submit(r, tail, sqpoll);
+    if (!sqpoll)
+      uring_enter(0, 1);
+    struct uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(r))) {
+      res[cqe->user_data] = cqe->res;
+      uring_cqe_seen(r);
+      done++;
+    }
+  }
+  for (int i = 0; i < nfiles; i++)
+    if (res[i] < 0)
+      return res[i];
+  return 0;
+}
+
+static void
+run_ring(struct uring_ctl *r, bool sqpoll, int nfiles)
+{
+  static s64 fds[4096], res[4096];
+
+  if (run_batch(r, sqpoll, nfiles, fds, [](struct uring_sqe *sqe, int i) {
+        sqe->opcode = URING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (u64)names[i];
+        sqe->oflags = O_RDWR | O_CREAT;
+      }) < 0)
+    die("uringbench: open");
+  if (run_batch(r, sqpoll, nfiles, res, [](struct uring_sqe *sqe, int i) {
+        sqe->opcode = URING_OP_WRITE;
+        sqe->fd = fds[i];
+        sqe->addr = (u64)buf;
+        sqe->len = sizeof(buf);
+      }) < 0)
+    die("uringbench: write");
+  if (run_batch(r, sqpoll, nfiles, res, [](struct uring_sqe *sqe, int i) {
+        sqe->opcode = URING_OP_FSYNC;
+        sqe->fd = fds[i];
+      }) < 0)
+    die("uringbench: fsync");
+  if (run_batch(r, sqpoll, nfiles, res, [](struct uring_sqe *sqe, int i) {
+        sqe->opcode = URING_OP_CLOSE;
+        sqe->fd = fds[i];
+      }) < 0)
+    die("uringbench: close");
+  if (run_batch(r, sqpoll, nfiles, res, [](struct uring_sqe *sqe, int i) {
+        sqe->opcode = URING_OP_UNLINK;
+        sqe->addr = (u64)names[i];
+      }) < 0)
+    die("uringbench: unlink");
+}
+
+int
+main(int argc, char *argv[])
+{
+  if (argc < 2 || argc > 4)
+    die("usage: %s nfiles [entries [pollcpu]]", argv[0]);
+  int nfiles = atoi(argv[1]);
+  int entries = argc > 2 ? atoi(argv[2]) : 64;
+  int pollcpu = argc > 3 ? atoi(argv[3]) : -1;
+  if (nfiles <= 0 || nfiles > 4096)
+    die("uringbench: nfiles must be 1..4096");
+
+  memset(buf, 'x', sizeof(buf));
+  for (int i = 0; i < nfiles; i++)
+    snprintf(names[i], sizeof(names[i]), "ub.%d", i);
+
+  u64 t0 = rdtsc();
+  run_syscalls(nfiles);
+  u64 t1 = rdtsc();
+  printf("syscalls: %lu cycles/file\n", (t1 - t0) / nfiles);
+
+  bool sqpoll = pollcpu >= 0;
+  void *ring = uring_setup(entries, sqpoll ? URING_SETUP_SQPOLL : 0, pollcpu);
+  if (ring == (void*)-1)
+    die("uringbench: uring_setup");
+  t0 = rdtsc();
+  run_ring((struct uring_ctl*)ring, sqpoll, nfiles);
+  t1 = rdtsc();
+  printf("ring%s: %lu cycles/file\n", sqpoll ? " (sqpoll)" : "",
+         (t1 - t0) / nfiles);
+  return 0;
+}
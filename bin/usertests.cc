@@ -1764,6 +1764,52 @@ test_fault(char *p)
   return faulted;
 }
 
+// Pages of small objects go back to the large allocator once all of
+// their objects are freed, so they can be used for other size classes
+// (or unmapped, if they merge into a big enough free run).
+void
+malloctest(void)
+{
+  enum { NOBJ = 4096, PAGE = 4096 };
+  static char *objs[NOBJ];
+  static uptr pages[NOBJ];
+  int npages = 0;
+
+  printf("malloc test\n");
+
+  for (int i = 0; i < NOBJ; i++) {
+    if ((objs[i] = (char*) malloc(64)) == 0)
+      die("malloctest: malloc failed");
+    uptr page = (uptr)objs[i] & ~(uptr)(PAGE - 1);
+    if (npages == 0 || pages[npages - 1] != page)
+      pages[npages++] = page;
+  }
+  for (int i = 0; i < NOBJ; i++)
+    free(objs[i]);
+
+  for (int i = 0; i < NOBJ; i++)
+    if ((objs[i] = (char*) malloc(256)) == 0)
+      die("malloctest: malloc failed");
+
+  int returned = 0;
+  for (int p = 0; p < npages; p++) {
+    bool reused = false;
+    for (int i = 0; i < NOBJ && !reused; i++)
+      reused = ((uptr)objs[i] & ~(uptr)(PAGE - 1)) == pages[p];
+    if (reused || test_fault((char*) pages[p]))
+      returned++;
+  }
+  for (int i = 0; i < NOBJ; i++)
+    free(objs[i]);
+
+  // One page per size class is kept as a spare, and a page may also sit
+  // in a free run that the 256-byte objects didn't need.
+  if (returned < npages / 2)
+    die("malloctest: only %d of %d freed pages were returned",
+        returned, npages);
+  printf("malloc test OK\n");
+}
+
 void
 vmoverlap(void)
 {
@@ -2071,6 +2117,7 @@ main(int argc, char *argv[])
 #define TEST(name) run_test(#name, name)
 
   TEST(memtest);
+  TEST(malloctest);
   // TEST(unopentest);
   TEST(bigargtest);
   TEST(bsstest);
@@ -95,17 +95,13 @@ private:
 
   bufdata *data_;
 
-  buf(u32 dev, u64 block)
-    : dev_(dev), block_(block), dirty_(false)
-  {
-    data_ = (bufdata *) kmalloc(sizeof(bufdata), "bufdata");
-  }
+  buf(u32 dev, u64 block);
   void onzero() override;
   NEW_DELETE_OPS(buf);
 
   ~buf()
   {
-    kmfree(data_, sizeof(bufdata));
+    kfree(data_);
   }
 
   void mark_dirty() {
@@ -11,6 +11,9 @@
 #include "ilist.hh"
 #include "hpet.hh"
 #include "cpuid.hh"
+#include "kalloc.hh"
+#include <vector>
+#include <algorithm>
 
 template<class K, class V>
 class chainhash {
@@ -20,7 +23,7 @@ private:
       : rcu_freed("chainhash::item", this, sizeof(*this)),
         key(k), val(v) {}
     void do_gc() override { delete this; }
-    NEW_DELETE_OPS(item);
+    NEW_DELETE_OPS_CACHED(item);
 
     islink<item> link;
     seqcount<u32> seq;
@@ -262,6 +265,36 @@ public:
     return false;
   }
 
+  // Collect the keys in bucket b that are greater than *prev (all of them if
+  // prev is null), with their values, in increasing key order.  Since a key
+  // never moves between buckets, (bucket, last key) is an enumeration
+  // position that stays valid while the table changes.  Returns false if b
+  // is past the last bucket.
+  bool bucket_entries(u64 b, const K* prev,
+                      std::vector<std::pair<K, V>>* out) const {
+    if (b >= nbuckets_)
+      return false;
+
+    // std::pair can't be assigned, so sort the entries as a local struct.
+    struct entry {
+      K key;
+      V val;
+    };
+    std::vector<entry> entries;
+
+    scoped_gc_epoch rcu_read;
+    for (const item& i: buckets_[b].chain)
+      if (!prev || *prev < i.key)
+        entries.push_back({i.key, *seq_reader<V>(&i.val, &i.seq)});
+    std::sort(entries.begin(), entries.end(),
+              [](const entry& x, const entry& y) {
+                return x.key < y.key;
+              });
+    for (auto& e : entries)
+      out->emplace_back(e.key, e.val);
+    return true;
+  }
+
   template<class CB>
   void enumerate(CB cb) const {
     scoped_gc_epoch rcu_read;
@@ -28,6 +28,8 @@ struct cpu {
   __mpalign__
   atomic<u64> tlbflush_done;   // last tlb flush req done on this cpu
   atomic<u64> tlb_cr3;         // current value of cr3 on this cpu
+  atomic<bool> resched;        // A latency-class proc should preempt
+                               // this cpu's proc; see need_resched
   __padout__;
   struct proc *prev;           // The previously-running process
   atomic<struct proc*> fpu_owner; // The proc with the current FPU state
@@ -2,6 +2,7 @@
 
 #include "spinlock.hh"
 #include "condvar.hh"
+#include "kalloc.hh"
 
 #define IOV_MAX     65535    // Limited by MAX_PRD_ENTRIES
 #define SG_IO_SIZE  64*1024  // Size used for scatter-gather I/O
@@ -16,7 +17,7 @@ class disk_completion : public referenced
 {
 public:
   disk_completion() : done_(false) {}
-  NEW_DELETE_OPS(disk_completion);
+  NEW_DELETE_OPS_CACHED(disk_completion);
 
   void notify() {
     scoped_acquire a(&lock_);
@@ -103,6 +104,10 @@ u32 blknum_to_dev(u32 blknum);
 u32 remap_blknum(u32 blknum);
 u32 num_disks();
 
+// Total bytes addressable through disk_read/disk_write, given the
+// striping across all disks.
+u64 disk_capacity();
+
 void disk_register(disk* d);
 
 void disk_read(u32 dev, char* buf, u64 nbytes, u64 offset,
@@ -146,15 +151,19 @@ void disk_flush(u32 dev, sref<disk_completion> dc = sref<disk_completion>());
 // all processes/threads so as to exploit opportunities for contiguous disk I/O
 // across process boundaries. And of course, any combination of these techniques
 // can be used as well.
+//
+// A synchronous block-queue still coalesces contiguous writes, but issues each
+// batch with synchronous I/O instead of waiting on a disk_completion, so that
+// it can be used at early boot, before the process is set up for sleeping.
 class block_queue {
 
 public:
   NEW_DELETE_OPS(block_queue);
 
-  block_queue()
+  explicit block_queue(bool sync = false)
   {
     for (int i = 0; i < num_disks(); i++)
-      dqueue[i] = new disk_queue(i);
+      dqueue[i] = new disk_queue(i, sync);
   }
 
   ~block_queue()
@@ -187,7 +196,7 @@ private:
   public:
     NEW_DELETE_OPS(disk_queue);
 
-    explicit disk_queue(u32 dev) : iovec_idx(0), dev_(dev)
+    disk_queue(u32 dev, bool sync) : iovec_idx(0), dev_(dev), sync_(sync)
     {
       for (int i = 0; i < AHCI_QUEUE_DEPTH; i++) {
         start_offset[i] = 0;
@@ -227,7 +236,12 @@ private:
 
     void flush_queue(int iovec_idx, bool sync = false)
     {
-      if (!iovec[iovec_idx].empty()) {
+      if (!iovec[iovec_idx].empty() && sync_) {
+        disk_writev(dev_, &iovec[iovec_idx][0], iovec[iovec_idx].size(),
+                    start_offset[iovec_idx]);
+        iovec[iovec_idx].clear();
+        iovec[iovec_idx].reserve(SG_IO_SIZE/BSIZE);
+      } else if (!iovec[iovec_idx].empty()) {
 
 	// Wait for any previous write issued via this command slot to complete,
 	// before issuing a new write via the same slot. (Note: This is an
@@ -271,6 +285,7 @@ private:
     u64 start_offset[AHCI_QUEUE_DEPTH];
     int iovec_idx; // Indicates which iovec to add items to next.
     u32 dev_;
+    bool sync_;    // Issue writes synchronously, without sleeping.
   };
 
 private:
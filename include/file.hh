@@ -16,6 +16,9 @@ class dir_entries;
 
 struct file {
   virtual int fsync() { return -1; }
+  // Start an fsync and fill in *tok, which fsync_wait() can later
+  // wait for, without waiting for the disk.
+  virtual int fsync_async(struct fsync_token *tok) { return -1; }
   // Duplicate this file so it can be bound to a FD.
   virtual file* dup() { inc(); return this; }
 
@@ -54,6 +57,10 @@ struct file {
 
   virtual sref<mnode> get_mnode() { return sref<mnode>(); }
 
+  // If this file is the write end (if write is true) or the read end
+  // of a pipe, return that pipe.  Used by splice.
+  virtual struct pipe* get_pipe(bool write) { return nullptr; }
+
   virtual void inc() = 0;
   virtual void dec() = 0;
 
@@ -78,6 +85,12 @@ public:
   sleeplock off_lock;
 
   int fsync() override;
+  // Queue the transactions that make this file durable on cpu's
+  // journal, without committing them.  fsync() is fsync_queue()
+  // followed by a commit; callers syncing several files can commit
+  // them all at once.
+  int fsync_queue(int cpu);
+  int fsync_async(struct fsync_token *tok) override;
   int stat(struct stat*, enum stat_flags) override;
   ssize_t read(char *addr, size_t n) override;
   ssize_t write(const char *addr, size_t n) override;
@@ -101,6 +114,7 @@ public:
 
   int stat(struct stat*, enum stat_flags) override;
   ssize_t read(char *addr, size_t n) override;
+  struct pipe* get_pipe(bool write) override { return write ? nullptr : pipe; }
   void onzero() override;
 
 private:
@@ -156,6 +170,10 @@ public:
     return inner->write(addr, n);
   }
 
+  struct pipe* get_pipe(bool write) override {
+    return inner->get_pipe(write);
+  }
+
   void pre_close() override {
     // This FD is being closed.  Now we need to know the moment its
     // reference count actually drops to zero so we can immediately
@@ -201,6 +219,7 @@ public:
 
   int stat(struct stat*, enum stat_flags) override;
   ssize_t write(const char *addr, size_t n) override;
+  struct pipe* get_pipe(bool write) override { return write ? pipe : nullptr; }
   void onzero() override;
 
 private:
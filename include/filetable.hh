@@ -10,43 +10,67 @@ private:
   static const int cpushift = 16;
   static const int fdmask = (1 << cpushift) - 1;
 
+  // Each CPU's FDs live in a sparse radix tree: a fixed root of
+  // directories, each pointing to chunks of chunkfds FDs.
+  // Directories and chunks are allocated when an FD in them is first
+  // opened and are never freed before the table itself, so lookups
+  // can walk the tree without locks, and copying the table only
+  // visits chunks that hold open FDs.
+  static const int chunkfds = 64;       // One bitmap word per chunk
+  static const int dirchunks = 64;
+  static const int nchunks = NOFILE / chunkfds;
+  static const int ndirs = (nchunks + dirchunks - 1) / dirchunks;
+  static_assert(NOFILE <= (1 << cpushift), "NOFILE too large for FD encoding");
+  static_assert(NOFILE % chunkfds == 0, "NOFILE must be a multiple of chunkfds");
+
 public:
   static sref<filetable> alloc() {
     return sref<filetable>::transfer(new filetable());
   }
 
   sref<filetable> copy(bool close_cloexec = false) {
-    filetable* t = new filetable(false);
-
-    fdinfo init(nullptr, false);
-    for(int cpu = 0; cpu < NCPU; cpu++) {
-      for(int fd = 0; fd < NOFILE; fd++) {
-        // XXX Relaxed load?
-        fdinfo info;
-        // Avoid reading info_ altogether if we're closing cloexec FDs
+    sref<filetable> t = sref<filetable>::transfer(new filetable());
+
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+      int limit = root_[cpu].limit.load(std::memory_order_acquire);
+      for (int c = 0; c < limit; c++) {
+        fdchunk *ch = get_chunk(cpu, c);
+        if (!ch)
+          continue;
+        // Avoid reading info altogether if we're closing cloexec FDs
         // and this is a cloexec FD.
-        if (close_cloexec && cloexec_[cpu][fd])
-          info = init;
-        else
-          info = info_[cpu][fd].load();
-        file *f = info.get_file();
-        if (f && (!close_cloexec || !info.get_cloexec())) {
+        u64 bits = ch->used.load(std::memory_order_relaxed);
+        if (close_cloexec)
+          bits &= ch->keepexec.load(std::memory_order_relaxed);
+        if (!bits)
+          continue;
+
+        fdchunk *nch = t->make_chunk(cpu, c);
+        if (!nch)
+          throw_bad_alloc();
+        u64 nused = 0, nkeepexec = 0;
+        for (; bits; bits &= bits - 1) {
+          int i = __builtin_ctzll(bits);
+          // XXX Relaxed load?
+          fdinfo info = ch->info[i].load();
+          file *f = info.get_file();
+          if (!f || (close_cloexec && info.get_cloexec()))
+            continue;
           // XXX f's refcount could have dropped to zero between the
           // load and here
           file* newf = f->dup();
-          fdinfo newinfo(newf, info.get_cloexec());
-
-          t->info_[cpu][fd].store(newinfo, std::memory_order_relaxed);
-          t->cloexec_[cpu][fd].store(
-            info.get_cloexec(), std::memory_order_relaxed);
-        } else {
-          t->info_[cpu][fd].store(init, std::memory_order_relaxed);
-          t->cloexec_[cpu][fd].store(true, std::memory_order_relaxed);
+          nch->info[i].store(fdinfo(newf, info.get_cloexec()),
+                             std::memory_order_relaxed);
+          nused |= 1ull << i;
+          if (!info.get_cloexec())
+            nkeepexec |= 1ull << i;
         }
+        nch->used.store(nused, std::memory_order_relaxed);
+        nch->keepexec.store(nkeepexec, std::memory_order_relaxed);
       }
     }
     std::atomic_thread_fence(std::memory_order_release);
-    return sref<filetable>::transfer(t);
+    return t;
   }
 
   // Return the file referenced by FD fd.  If fd is not open, returns
@@ -61,9 +85,13 @@ public:
     if (fd < 0 || fd >= NOFILE)
       return sref<file>();
 
+    fdchunk *ch = get_chunk(cpu, fd / chunkfds);
+    if (!ch)
+      return sref<file>();
+
     // XXX This isn't safe: there could be a concurrent close that
     // drops the reference count to zero.
-    file* f = info_[cpu][fd].load().get_file();
+    file* f = ch->info[fd % chunkfds].load().get_file();
     return sref<file>::newref(f);
   }
 
@@ -71,25 +99,47 @@ public:
   // to f from the caller.
   int allocfd(sref<file>&& f, bool percpu = false, bool cloexec = false) {
     int cpu = percpu ? myid() : 0;
-    fdinfo none(nullptr, false);
+    fdroot &r = root_[cpu];
     // Transfer f to manual reference counting since we can't store
     // sref's in the info table.
     file *fptr = f->dup();
-    fdinfo newinfo(fptr, cloexec, true);
-    for (int fd = 0; fd < NOFILE; fd++) {
-      // Note that we skip over locked FDs because that means they're
-      // either non-null or about to be.
-      if (info_[cpu][fd].load(std::memory_order_relaxed) == none &&
-          cmpxch(&info_[cpu][fd], none, newinfo)) {
-        // The default state of cloexec_ is 'true', so we only need to
+    fdinfo newinfo(fptr, cloexec);
+    for (int c = r.hint.load(std::memory_order_relaxed); c < nchunks; c++) {
+      fdchunk *ch = make_chunk(cpu, c);
+      if (!ch)
+        break;
+      u64 used = ch->used.load(std::memory_order_relaxed);
+      while (~used) {
+        int i = __builtin_ctzll(~used);
+        u64 bit = 1ull << i;
+        // Reserve the FD number.  Losing this race just means
+        // retrying with the fresh bitmap.
+        u64 prev = ch->used.fetch_or(bit);
+        used = prev | bit;
+        if (prev & bit)
+          continue;
+
+        // A concurrent replace may have installed a file here since
+        // the bit was last clear.  If so, the bit is rightly set and
+        // we keep looking.
+        std::atomic<fdinfo> *infop = &ch->info[i];
+        fdinfo old = lock_fdinfo(infop);
+        if (old.get_file()) {
+          infop->store(old, std::memory_order_release);
+          continue;
+        }
+        // The default state of keepexec is clear, so we only need to
         // write to it if this is a keep-exec FD.
         if (!cloexec)
-          cloexec_[cpu][fd] = cloexec;
-        // Unlock FD
-        info_[cpu][fd].store(newinfo.with_locked(false),
-                             std::memory_order_release);
-        return (cpu << cpushift) | fd;
+          ch->keepexec.fetch_or(bit);
+        // Update and unlock the FD
+        infop->store(newinfo, std::memory_order_release);
+        return (cpu << cpushift) | (c * chunkfds + i);
       }
+      // Chunk c is full.  Move the hint past it, unless a close has
+      // moved it meanwhile.
+      int h = c;
+      r.hint.compare_exchange_strong(h, c + 1, std::memory_order_relaxed);
     }
     cprintf("filetable::allocfd: failed\n");
     // The "dup" call told f that we're binding it to a FD.  That
@@ -117,13 +167,27 @@ public:
       return;
     }
 
+    fdchunk *ch = get_chunk(cpu, fd / chunkfds);
+    if (!ch) {
+      cprintf("filetable::close: bad fd %u\n", fd);
+      return;
+    }
+
     // Lock the FD to prevent concurrent modifications
-    std::atomic<fdinfo> *infop = &info_[cpu][fd];
+    u64 bit = 1ull << (fd % chunkfds);
+    std::atomic<fdinfo> *infop = &ch->info[fd % chunkfds];
     fdinfo info = lock_fdinfo(infop);
 
-    // Clear cloexec_ back to default state of 'true'
-    if (!cloexec_[cpu][fd])
-      cloexec_[cpu][fd] = true;
+    // Clear keepexec back to its default state
+    if (ch->keepexec.load(std::memory_order_relaxed) & bit)
+      ch->keepexec.fetch_and(~bit);
+
+    // Release the FD number while the FD is still locked, so an
+    // allocfd that reserves it waits for us to clear it.  An empty FD
+    // may be reserved by an allocfd that hasn't locked it yet, so
+    // leave its bit alone.
+    if (info.get_file())
+      ch->used.fetch_and(~bit);
 
     // Update and unlock the FD
     fdinfo newinfo(nullptr, false);
@@ -131,6 +195,7 @@ public:
 
     // Close old file
     if (info.get_file()) {
+      lower_hint(cpu, fd / chunkfds);
       info.get_file()->pre_close();
       info.get_file()->dec();
     } else {
@@ -154,17 +219,26 @@ public:
       return false;
     }
 
+    fdchunk *ch = make_chunk(cpu, fd / chunkfds);
+    if (!ch) {
+      cprintf("filetable::replace: out of memory\n");
+      return false;
+    }
+
     // Lock the FD to prevent concurrent modifications
-    std::atomic<fdinfo> *infop = &info_[cpu][fd];
+    u64 bit = 1ull << (fd % chunkfds);
+    std::atomic<fdinfo> *infop = &ch->info[fd % chunkfds];
     fdinfo oldinfo = lock_fdinfo(infop);
 
-    // Update to new info and unlock.  It's safe to update cloexec_
+    // Update to new info and unlock.  It's safe to update the bitmaps
     // non-atomically with info even with concurrent lock-free readers
     // because any that care will double-check the fdinfo bit.
+    if (!(ch->used.load(std::memory_order_relaxed) & bit))
+      ch->used.fetch_or(bit);
+    if (!cloexec != !!(ch->keepexec.load(std::memory_order_relaxed) & bit))
+      ch->keepexec.fetch_xor(bit);
     file *newfptr = newf->dup();
     fdinfo newinfo(newfptr, cloexec);
-    if (cloexec != cloexec_[cpu][fd])
-      cloexec_[cpu][fd] = cloexec;
     infop->store(newinfo, std::memory_order_release);
 
     // Close the old FD
@@ -176,28 +250,38 @@ public:
   }
 
 private:
-  filetable(bool clear = true) {
-    if (!clear)
-      return;
-    fdinfo none(nullptr, false);
-    for(int cpu = 0; cpu < NCPU; cpu++) {
-      for(int fd = 0; fd < NOFILE; fd++) {
-        info_[cpu][fd].store(none, std::memory_order_relaxed);
-        cloexec_[cpu][fd].store(true, std::memory_order_relaxed);
-      }
+  filetable() {
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+      fdroot &r = root_[cpu];
+      for (auto &d : r.dirs)
+        d.store(nullptr, std::memory_order_relaxed);
+      r.hint.store(0, std::memory_order_relaxed);
+      r.limit.store(0, std::memory_order_relaxed);
     }
     std::atomic_thread_fence(std::memory_order_release);
   }
 
   ~filetable() {
     // Close all FDs
-    for(int cpu = 0; cpu < NCPU; cpu++){
-      for(int fd = 0; fd < NOFILE; fd++){
-        fdinfo info = info_[cpu][fd].load();
-        if (info.get_file()) {
-          info.get_file()->pre_close();
-          info.get_file()->dec();
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+      for (auto &dp : root_[cpu].dirs) {
+        fddir *d = dp.load();
+        if (!d)
+          continue;
+        for (auto &chp : d->chunks) {
+          fdchunk *ch = chp.load();
+          if (!ch)
+            continue;
+          for (u64 bits = ch->used.load(); bits; bits &= bits - 1) {
+            fdinfo info = ch->info[__builtin_ctzll(bits)].load();
+            if (info.get_file()) {
+              info.get_file()->pre_close();
+              info.get_file()->dec();
+            }
+          }
+          delete ch;
         }
+        delete d;
       }
     }
   }
@@ -267,16 +351,104 @@ private:
     return info;
   }
 
-  percpu<std::atomic<fdinfo>[NOFILE]> info_;
-  // In addition to storing O_CLOEXEC with each fdinfo so it can be
-  // read atomically with the FD, we store it separately so we can
-  // scan for keep-exec FDs without reading from info_, which would
-  // cause unnecessary sharing between the scan and creating O_CLOEXEC
-  // FDs.  To avoid unnecessary sharing on this array itself, the
-  // *default* state of this array for closed FDs must be 'true', so
-  // we only have to write to it when opening a keep-exec FD.
-  // Modifications to this array are protected by the fdinfo lock.
-  // Lock-free readers should double-check the O_CLOEXEC bit in
-  // fdinfo.
-  percpu<std::atomic<bool>[NOFILE]> cloexec_;
+  struct fdchunk
+  {
+    // Bit i is set if FD i of this chunk is open or reserved by an
+    // allocfd.  It is only cleared by close, with the FD locked.
+    std::atomic<u64> used;
+    // Bit i is set if FD i is keep-exec.  We store O_CLOEXEC here in
+    // addition to in each fdinfo so exec can find the FDs it keeps
+    // without reading any others.  The *default* state for closed
+    // FDs is clear, so creating O_CLOEXEC FDs never writes it.
+    // Modifications are protected by the fdinfo lock.  Lock-free
+    // readers should double-check the O_CLOEXEC bit in fdinfo.
+    std::atomic<u64> keepexec;
+    std::atomic<fdinfo> info[chunkfds];
+
+    fdchunk() : used(0), keepexec(0)
+    {
+      for (auto &i : info)
+        i.store(fdinfo(nullptr, false), std::memory_order_relaxed);
+    }
+
+    NEW_DELETE_OPS(fdchunk);
+  };
+
+  struct fddir
+  {
+    std::atomic<fdchunk*> chunks[dirchunks];
+
+    fddir()
+    {
+      for (auto &c : chunks)
+        c.store(nullptr, std::memory_order_relaxed);
+    }
+
+    NEW_DELETE_OPS(fddir);
+  };
+
+  struct fdroot
+  {
+    std::atomic<fddir*> dirs[ndirs];
+    // The lowest chunk that may have a free FD.  allocfd starts
+    // searching here and close lowers it, so allocation usually
+    // succeeds in the first chunk it looks at.
+    std::atomic<int> hint;
+    // One past the highest chunk ever allocated.
+    std::atomic<int> limit;
+  };
+
+  // Return chunk c of cpu's FDs, or null if it hasn't been allocated.
+  fdchunk* get_chunk(int cpu, int c) const
+  {
+    fddir *d = root_[cpu].dirs[c / dirchunks].load(std::memory_order_acquire);
+    if (!d)
+      return nullptr;
+    return d->chunks[c % dirchunks].load(std::memory_order_acquire);
+  }
+
+  // Return chunk c of cpu's FDs, allocating it if necessary.  Returns
+  // null if out of memory.
+  fdchunk* make_chunk(int cpu, int c)
+  {
+    fdroot &r = root_[cpu];
+    std::atomic<fddir*> *dp = &r.dirs[c / dirchunks];
+    fddir *d = dp->load(std::memory_order_acquire);
+    if (!d) {
+      fddir *nd = new (std::nothrow) fddir();
+      if (!nd)
+        return nullptr;
+      if (dp->compare_exchange_strong(d, nd))
+        d = nd;
+      else
+        delete nd;
+    }
+
+    std::atomic<fdchunk*> *chp = &d->chunks[c % dirchunks];
+    fdchunk *ch = chp->load(std::memory_order_acquire);
+    if (!ch) {
+      fdchunk *nch = new (std::nothrow) fdchunk();
+      if (!nch)
+        return nullptr;
+      if (chp->compare_exchange_strong(ch, nch))
+        ch = nch;
+      else
+        delete nch;
+    }
+
+    int limit = r.limit.load(std::memory_order_relaxed);
+    while (limit <= c && !r.limit.compare_exchange_weak(limit, c + 1))
+      ;
+    return ch;
+  }
+
+  void lower_hint(int cpu, int c)
+  {
+    std::atomic<int> &hint = root_[cpu].hint;
+    int h = hint.load(std::memory_order_relaxed);
+    while (h > c && !hint.compare_exchange_weak(h, c, std::memory_order_relaxed))
+      ;
+  }
+
+  percpu<fdroot> root_;
 };
@@ -101,6 +101,17 @@ struct dinode {
 // Block containing bit for block b
 #define BBLOCK(b, ninodes) ((b)/BPB + (ninodes)/IPB + 3)
 
+// The orphan list follows the bitmap blocks. It records the inodes that are
+// allocated on the disk but not linked from any directory (freshly created
+// ones whose link has not been flushed yet, and unlinked ones that are still
+// open), so that crash-recovery can reclaim them without scanning every inode.
+// It is a bitmap with one bit per inode, so it never fills up.
+#define NORPHANBLKS(ninodes) ((ninodes) / BPB + 1)
+
+// Block containing the orphan-list bit for inode i
+#define OBLOCK(i, size, ninodes) \
+  (BBLOCK((size) - 1, ninodes) + 1 + (i) / BPB)
+
 // Number of inodes to create in the filesystem. Consumed by tools/mkfs.c
 // as well as kernel/scalefs.cc (to decide the size of the inum<->mnode
 // lookup tables). If you change this number, remember to update NINODES_PRIME
@@ -126,6 +137,26 @@ struct dinode {
 #define NINODEBITMAP_BLKS_PRIME	30011
 #endif
 
+// Sparse filesystem image, generated from fs.img by "mkfs -s" and embedded
+// (compressed) in the kernel. It is a sequence of extents, each made of one
+// header block followed by the extent's data blocks, and it ends with an
+// extent of 0 blocks. Extents of allocated blocks that are all zeroes carry
+// no data blocks. Blocks that are not in any extent are free, and their
+// contents don't matter.
+#define SPARSE_MAGIC  0x73366d69  // "im6s"
+
+enum {
+  SPARSE_DATA = 1,  // Followed by nblocks data blocks
+  SPARSE_ZERO,      // nblocks zero blocks, not stored in the image
+};
+
+struct sparse_extent {
+  u32 magic;
+  u32 type;         // SPARSE_DATA or SPARSE_ZERO
+  u32 blknum;       // First disk block of the extent
+  u32 nblocks;
+};
+
 // Directory is a file containing a sequence of dirent structures.
 #define DIRSIZ 14
 
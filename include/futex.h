@@ -1,2 +1,36 @@
-#define FUTEX_WAIT 0
-#define FUTEX_WAKE 1
+// futex operations.  Futex words are 64 bits.
+#define FUTEX_WAIT         0    // Sleep while *addr == val, for up to
+                                // val2 nsec if val2 != 0
+#define FUTEX_WAKE         1    // Wake up to val waiters on addr
+#define FUTEX_REQUEUE      2    // Wake up to val waiters on addr and
+                                // move up to val2 others to addr2
+#define FUTEX_CMP_REQUEUE  3    // FUTEX_REQUEUE if *addr == val3
+#define FUTEX_WAKE_OP      4    // Apply the FUTEX_OP val3 to *addr2,
+                                // wake up to val waiters on addr and,
+                                // if the comparison holds, up to val2
+                                // waiters on addr2
+#define FUTEX_WAIT_BITSET  5    // FUTEX_WAIT for wakeups matching val3
+#define FUTEX_WAKE_BITSET  6    // FUTEX_WAKE of waiters matching val3
+
+#define FUTEX_BITSET_MATCH_ANY  (~0ull)
+
+// FUTEX_WAKE_OP operations
+#define FUTEX_OP_SET        0   // *addr2 = oparg
+#define FUTEX_OP_ADD        1   // *addr2 += oparg
+#define FUTEX_OP_OR         2   // *addr2 |= oparg
+#define FUTEX_OP_ANDN       3   // *addr2 &= ~oparg
+#define FUTEX_OP_XOR        4   // *addr2 ^= oparg
+#define FUTEX_OP_OPARG_SHIFT 8  // Use (1 << oparg) as the operand
+
+// FUTEX_WAKE_OP comparisons of the old value of *addr2 with cmparg
+#define FUTEX_OP_CMP_EQ     0
+#define FUTEX_OP_CMP_NE     1
+#define FUTEX_OP_CMP_LT     2
+#define FUTEX_OP_CMP_LE     3
+#define FUTEX_OP_CMP_GT     4
+#define FUTEX_OP_CMP_GE     5
+
+// Encode a FUTEX_WAKE_OP operation.  oparg and cmparg are 12 bits.
+#define FUTEX_OP(op, oparg, cmp, cmparg)                        \
+  ((((op) & 0xf) << 28) | (((cmp) & 0xf) << 24) |              \
+   (((oparg) & 0xfff) << 12) | ((cmparg) & 0xfff))
@@ -7,6 +7,95 @@
 
 struct pgmap;
 
+// A set of virtual address ranges to be invalidated, accumulated over
+// an operation so it can be shot down in one round of IPIs.
+// Overlapping and adjacent ranges are merged.  Once max_ranges
+// disjoint ranges have been added, a new range is merged into the
+// nearest existing one, so the set may cover more than was added, but
+// never less.
+class shootdown_ranges
+{
+public:
+  enum { max_ranges = 8 };
+
+  struct range
+  {
+    uintptr_t start, end;
+  };
+
+  constexpr shootdown_ranges() : ranges_(), n_(0) { }
+
+  void add(uintptr_t start, uintptr_t end)
+  {
+    if (start >= end)
+      return;
+    // Most operations invalidate in increasing address order, so
+    // check the most recent range first.
+    for (size_t i = n_; i-- > 0; ) {
+      if (start <= ranges_[i].end && ranges_[i].start <= end) {
+        grow(&ranges_[i], start, end);
+        return;
+      }
+    }
+    if (n_ < max_ranges) {
+      ranges_[n_++] = range{start, end};
+      return;
+    }
+    range *nearest = &ranges_[0];
+    uintptr_t nearest_gap = ~(uintptr_t)0;
+    for (size_t i = 0; i < n_; ++i) {
+      uintptr_t gap = start > ranges_[i].end ? start - ranges_[i].end
+        : ranges_[i].start - end;
+      if (gap < nearest_gap) {
+        nearest = &ranges_[i];
+        nearest_gap = gap;
+      }
+    }
+    grow(nearest, start, end);
+  }
+
+  bool empty() const
+  {
+    return n_ == 0;
+  }
+
+  // The number of pages covered by this set.
+  size_t pages() const
+  {
+    size_t n = 0;
+    for (auto &r : *this)
+      n += (r.end - r.start + PGSIZE - 1) / PGSIZE;
+    return n;
+  }
+
+  const range *begin() const
+  {
+    return ranges_;
+  }
+
+  const range *end() const
+  {
+    return ranges_ + n_;
+  }
+
+private:
+  static void grow(range *r, uintptr_t start, uintptr_t end)
+  {
+    if (start < r->start)
+      r->start = start;
+    if (r->end < end)
+      r->end = end;
+  }
+
+  range ranges_[max_ranges];
+  size_t n_;
+};
+
+// Invalidate ranges in this core's TLB, using invlpg for small sets
+// and a full (non-global) TLB flush for sets of more than
+// TLB_FLUSH_THRESHOLD pages.
+void flush_tlb_ranges(const shootdown_ranges &ranges);
+
 // A TLB shootdown gatherer that doesn't track anything, but as a
 // result can be batched with other TLB shootdowns.
 class batched_shootdown
@@ -43,7 +132,7 @@ public:
 class core_tracking_shootdown
 {
 public:
-  constexpr core_tracking_shootdown() : t_(nullptr), start_(~0), end_(0) {}
+  constexpr core_tracking_shootdown() : t_(nullptr), ranges_() {}
 
   // Track the set of cores that are using the page_map_cache.
   class cache_tracker {
@@ -65,10 +154,7 @@ public:
   }
 
   void add_range(uintptr_t start, uintptr_t end) {
-    if (start < start_)
-      start_ = start;
-    if (end_ < end)
-      end_ = end;
+    ranges_.add(start, end);
   }
 
   void perform() const;
@@ -76,9 +162,8 @@ public:
   static void on_ipi() { panic("core_tracking_shootdown::on_ipi\n"); }
 
 private:
-  void clear_tlb() const;
   class cache_tracker *t_;
-  uintptr_t start_, end_;
+  shootdown_ranges ranges_;
 };
 
 // An MMU implementation based on shared page tables, where each vmap
@@ -179,13 +264,13 @@ namespace mmu_per_core_page_table {
   class shootdown
   {
     class page_map_cache *cache;
-    uintptr_t start, end;
+    shootdown_ranges ranges;
     bitset<NCPU> targets;
 
     friend class page_map_cache;
 
   public:
-    constexpr shootdown() : cache(nullptr), start(~0), end(0), targets() { }
+    constexpr shootdown() : cache(nullptr), ranges(), targets() { }
 
     void perform() const;
 
@@ -203,8 +288,8 @@ namespace mmu_per_core_page_table {
     percpu<struct pgmap*> pml4;
     friend class shootdown;
 
-    // Clear and TLB flush a region of this core's page table.
-    void clear(uintptr_t start, uintptr_t end);
+    // Clear and TLB flush regions of this core's page table.
+    void clear(const shootdown_ranges &ranges);
 
   public:
     page_map_cache()
@@ -242,21 +327,20 @@ namespace mmu_per_core_page_table {
       // shooting down its own insert).
       assert(check_critical(NO_SCHED));
       if (present[myid()]) {
-        clear(start, start + len);
+        shootdown_ranges local;
+        local.add(start, start + len);
+        clear(local);
         present.reset(myid());
       }
 
-      // Update shootdown bounds
-      // XXX(Austin) For fork, this may cause us to zero huge regions
-      // of the page table because of sparse invalidates.  Maybe keep
-      // a fixed-size list of regions in the shootdown?
+      // Add to the shootdown's ranges.  Sparse invalidates (e.g., from
+      // fork or truncate) stay separate up to max_ranges, so remote
+      // cores don't have to walk the page table between them.
       if (present.any()) {
+        assert(!sd->cache || sd->cache == this);
         sd->targets |= present;
         sd->cache = this;
-        if (start < sd->start)
-          sd->start = start;
-        if (sd->end < start + len)
-          sd->end = start + len;
+        sd->ranges.add(start, start + len);
       }
     }
 
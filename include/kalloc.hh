@@ -2,6 +2,7 @@
 
 #include "percpu.hh"
 #include "atomic_util.hh"
+#include "numa.hh"
 
 #include <atomic>
 #include <typeinfo>
@@ -58,6 +59,107 @@ enum {
   slab_type_max
 };
 
+// Magazine-based object caching (Bonwick and Adams, "Magazines and
+// Vmem", USENIX 2001).  A magazine is a fixed-size stack of free
+// objects.  Each CPU keeps a loaded and a previous magazine per
+// object size, which it manipulates with interrupts disabled and no
+// locks.  Only when both are exhausted (or both are full) does a CPU
+// exchange a magazine with the shared, spinlock-protected depot, so
+// objects freed on one CPU flow back to allocating CPUs a magazine
+// at a time.
+#define KMMAG_ROUNDS 62
+
+struct kmem_magazine {
+  kmem_magazine *next;
+  u64 nrounds;
+  void *rounds[KMMAG_ROUNDS];
+};
+
+struct kmem_depot {
+  spinlock lock;
+  // Magazines with at least one round.  Not necessarily full.
+  kmem_magazine *full = nullptr;
+  // Magazines with no rounds.
+  kmem_magazine *empty = nullptr;
+  u64 nfull = 0;
+  u64 nempty = 0;
+  // Objects that didn't fit in any magazine because we ran out of
+  // memory for magazines, linked through their first word.
+  void *loose = nullptr;
+};
+
+struct kmem_cpu_cache {
+  kmem_magazine *loaded = nullptr;
+  kmem_magazine *previous = nullptr;
+};
+
+// A cache of objects of one exact size, for types that are allocated
+// and freed at high rates.  Unlike kmalloc, this doesn't round the
+// object size up to a power of two.  Use NEW_DELETE_OPS_CACHED to
+// give a class a dedicated cache.
+class kmem_cache
+{
+public:
+  kmem_cache(const char *name, size_t size);
+  kmem_cache(const kmem_cache&) = delete;
+  kmem_cache &operator=(const kmem_cache&) = delete;
+
+  void *alloc();
+  void free(void *p);
+
+  const char *name() const
+  {
+    return name_;
+  }
+
+  size_t size() const
+  {
+    return size_;
+  }
+
+private:
+  const char *name_;
+  size_t size_;
+  // One depot per NUMA node, indexed by numa_node::id.
+  kmem_depot depots_[MAX_NUMA_NODES];
+  percpu<kmem_cpu_cache, NO_INT> cpus_;
+};
+
+// Like NEW_DELETE_OPS, but allocate objects of classname from a
+// dedicated kmem_cache.  The cache is constructed on first use.
+#define NEW_DELETE_OPS_CACHED(classname)                            \
+  static kmem_cache *kmem_cache_for_class() {                       \
+    static kmem_cache cache(#classname, sizeof(classname));         \
+    return &cache;                                                  \
+  }                                                                 \
+                                                                    \
+  static void* operator new(unsigned long nbytes,                   \
+                            const std::nothrow_t&) noexcept {       \
+    assert(nbytes == sizeof(classname));                            \
+    return kmem_cache_for_class()->alloc();                         \
+  }                                                                 \
+                                                                    \
+  static void* operator new(unsigned long nbytes) {                 \
+    void *p = classname::operator new(nbytes, std::nothrow);        \
+    if (p == nullptr)                                               \
+      throw_bad_alloc();                                            \
+    return p;                                                       \
+  }                                                                 \
+                                                                    \
+  static void* operator new(unsigned long nbytes, classname *buf) { \
+    assert(nbytes == sizeof(classname));                            \
+    return buf;                                                     \
+  }                                                                 \
+                                                                    \
+  static void operator delete(void *p,                              \
+                              const std::nothrow_t&) noexcept {     \
+    kmem_cache_for_class()->free(p);                                \
+  }                                                                 \
+                                                                    \
+  static void operator delete(void *p) {                            \
+    classname::operator delete(p, std::nothrow);                    \
+  }
+
 // std allocator
 
 template<class T>
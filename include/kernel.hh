@@ -134,8 +134,12 @@ void		balloc_free_on_disk(std::vector<u32>& blocks, transaction *trans, bool all
 // futex.cc
 typedef u64* futexkey_t;
 int             futexkey(const u64* useraddr, vmap* vmap, futexkey_t* key);
-long            futexwait(futexkey_t key, u64 val, u64 timer);
-long            futexwake(futexkey_t key, u64 nwake);
+long            futexwait(futexkey_t key, u64 val, u64 timer, u64 bitset);
+long            futexwake(futexkey_t key, u64 nwake, u64 bitset);
+long            futexrequeue(futexkey_t key, u64 nwake, u64 nrequeue,
+                             futexkey_t key2, bool cmp, u64 cmpval);
+long            futexwakeop(futexkey_t key, u64 nwake, const u64* uaddr2,
+                            futexkey_t key2, u64 nwake2, u64 op);
 
 // hz.c
 void            microdelay(u64);
@@ -190,6 +194,10 @@ int             pipealloc(sref<file>*, sref<file>*, int flags);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, char*, int);
 int             pipewrite(struct pipe*, const char*, int);
+ssize_t         pipesplice(struct pipe*, struct pipe*, size_t, int);
+ssize_t         pipesplicein(struct file*, off_t*, struct pipe*, size_t, int);
+ssize_t         pipespliceout(struct pipe*, struct file*, off_t*, size_t, int);
+ssize_t         pipevmsplice(struct pipe*, uptr, size_t, int);
 struct pipe*    pipesockalloc();
 void            pipesockclose(struct pipe *);
 
@@ -232,11 +240,12 @@ void            sched(void);
 void            post_swtch(void);
 void            scheddump(void);
 int             steal(void);
+bool            need_resched(void);
 void            addrun(struct proc*);
-int             dwork_push(struct dwork*, int);
 
 // syscall.c
 int             fetchint64(uptr, u64*);
+int             cmpxchgint64(uptr, u64*, u64);
 int             fetchstr(char*, const char*, u64);
 int             fetchmem(void*, const void*, u64);
 int             putmem(void*, const void*, u64);
@@ -265,6 +274,9 @@ void            getcallerpcs(void*, uptr*, int);
 void            uartputc(char c);
 void            uartintr(void);
 
+// uring.cc
+void            uring_exit(struct proc*);
+
 // vm.c
 void            switchvm(struct proc*);
 int             pagefault(struct vmap*, uptr, u32);
@@ -278,6 +290,9 @@ void*           pagelookup(struct vmap*, uptr);
 size_t          safe_read_hw(void *dst, uintptr_t src, size_t n);
 size_t          safe_read_vm(void *dst, uintptr_t src, size_t n);
 
+// work.cc
+int             dwork_push(struct dwork*, int);
+
 // zalloc.cc
 char*           zalloc(const char* name);
 void            zfree(void* p);
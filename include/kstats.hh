@@ -24,6 +24,9 @@
   X(uint64_t, tlb_shootdown_targets)                                   \
   /* Total number of cycles spent in TLB shootdown operations. */      \
   X(uint64_t, tlb_shootdown_cycles)                                    \
+  /* # of times a core flushed its whole TLB rather than invalidating  \
+   * more than TLB_FLUSH_THRESHOLD pages one at a time. */             \
+  X(uint64_t, tlb_full_flush_count)                                    \
 
 #define KSTATS_VM(X)                            \
   X(uint64_t, page_fault_count)                 \
@@ -38,6 +41,13 @@
                                                 \
   X(uint64_t, munmap_count)                     \
   X(uint64_t, munmap_cycles)                    \
+                                                \
+  /* Resident anonymous pages examined by       \
+   * kswapd's clock hand. */                    \
+  X(uint64_t, swap_scan_count)                  \
+  X(uint64_t, swap_out_count)                   \
+  X(uint64_t, swap_in_count)                    \
+  X(uint64_t, swap_in_cycles)                   \
 
 #define KSTATS_KALLOC(X)                        \
   X(uint64_t, kalloc_page_alloc_count)          \
@@ -46,6 +56,12 @@
   X(uint64_t, kalloc_hot_list_flush_count)      \
   X(uint64_t, kalloc_hot_list_steal_count)      \
   X(uint64_t, kalloc_hot_list_remote_free_count)        \
+  /* Magazine exchanges between a CPU and a     \
+   * kmalloc or kmem_cache depot. */            \
+  X(uint64_t, kmalloc_depot_get_count)          \
+  X(uint64_t, kmalloc_depot_put_count)          \
+  /* Pages carved up to grow a depot. */        \
+  X(uint64_t, kmalloc_depot_grow_count)         \
 
 #define KSTATS_REFCACHE(X)                      \
   X(uint64_t, refcache_review_count)            \
@@ -72,17 +88,53 @@
   X(uint64_t, socket_local_client_sendto_cnt)   \
   X(uint64_t, socket_local_recvfrom_cycles)   \
   X(uint64_t, socket_local_recvfrom_cnt)   \
+  X(uint64_t, socket_local_inline_cnt)   \
+  X(uint64_t, socket_local_zerocopy_bytes)   \
 
 #define KSTATS_FILE(X)                          \
   X(uint64_t, write_cycles)                     \
   X(uint64_t, write_count)                      \
   X(uint64_t, mnode_alloc)                      \
   X(uint64_t, mnode_free)                       \
+  /* Page and buffer cache hits on a page in    \
+   * the local or a remote NUMA node. */        \
+  X(uint64_t, pagecache_local_access_count)     \
+  X(uint64_t, pagecache_remote_access_count)    \
+  /* Page cache pages moved to a new node by    \
+   * NUMA_POLICY_MIGRATE. */                    \
+  X(uint64_t, pagecache_migrate_count)          \
+  X(uint64_t, bufcache_local_access_count)      \
+  X(uint64_t, bufcache_remote_access_count)     \
+  /* Submission ring entries run, and journal   \
+   * commits for batches of their fsyncs. */    \
+  X(uint64_t, uring_sqe_count)                  \
+  X(uint64_t, uring_fsync_batch_count)          \
+  /* Background writeback passes, the dirty     \
+   * mnodes they found (the backlog), and the   \
+   * mnodes and page-cache pages they flushed.  \
+   */                                           \
+  X(uint64_t, writeback_pass_count)             \
+  X(uint64_t, writeback_pass_cycles)            \
+  X(uint64_t, writeback_backlog_count)          \
+  X(uint64_t, writeback_mnode_count)            \
+  X(uint64_t, writeback_page_count)             \
+  /* Logged metadata operations (links,         \
+   * unlinks and renames) that cancelled out    \
+   * and never reached the journal. */          \
+  X(uint64_t, fs_absorbed_op_count)             \
 
 #define KSTATS_SCHED(X)                         \
   X(uint64_t, sched_tick_count)                 \
   X(uint64_t, sched_blocked_tick_count)         \
   X(uint64_t, sched_delayed_tick_count)         \
+  /* Deferred work items run, and the total     \
+   * cycles they waited in run queues. */       \
+  X(uint64_t, dwork_run_count)                  \
+  X(uint64_t, dwork_delay_cycles)               \
+  X(uint64_t, dwork_run_cycles)                 \
+  /* Work queued while already pending. */      \
+  X(uint64_t, dwork_coalesced_count)            \
+  X(uint64_t, dwork_timer_count)                \
 
 #define KSTATS_ALL(X)                           \
   KSTATS_TLB(X)                                 \
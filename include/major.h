@@ -11,3 +11,4 @@
 #define MAJ_MFSSTATS 11
 #define MAJ_BLKSTATS 12
 #define MAJ_EVICTCACHES 13
+#define MAJ_WRITEBACK 14
@@ -8,8 +8,14 @@
 #include "kalloc.hh"
 #include "fs.h"
 #include "scalefs.hh"
+#include "swap.hh"
+#include "gc.hh"
+#include "seqlock.hh"
+#include "elf.hh"
 
 #include <limits.h>
+#include <vector>
+#include <uk/fcntl.h>
 
 class mdir;
 class mfile;
@@ -18,6 +24,7 @@ class msock;
 class mlinkref;
 class mfs;
 class mfs_interface;
+class rmap_batch;
 
 extern mfs *root_fs;
 extern mfs_interface *rootfs_interface;
@@ -43,6 +50,10 @@ private:
     u8 type() {
       return v_ & ((1 << type_bits) - 1);
     }
+
+    u8 cpu() {
+      return (v_ >> type_bits) & ((1 << cpu_bits) - 1);
+    }
   };
 
 public:
@@ -58,8 +69,14 @@ public:
   void cache_pin(bool flag);
   void dirty(bool flag);
   bool is_dirty();
+  bool leave_dirty_list();
+  // nsectime() when the mnode last became dirty, or 0 if it is clean.
+  u64 dirty_since() const { return dirty_nsec_; }
   void mark_inode_for_deletion();
   u8 type() const { return mnumber(mnum_).type(); }
+  static u8 type_of(u64 mnum) { return mnumber(mnum).type(); }
+  // The CPU that allocated mnum.
+  static u8 cpu_of(u64 mnum) { return mnumber(mnum).cpu(); }
   void initialized(bool flag) { initialized_ = flag; }
   bool is_initialized() { return initialized_; }
 
@@ -92,6 +109,8 @@ private:
 
   std::atomic<bool> cache_pin_;
   std::atomic<bool> dirty_;
+  std::atomic<u64> dirty_nsec_;
+  std::atomic<bool> on_dirty_list_;
   std::atomic<bool> valid_;
   bool delete_inode_;
 };
@@ -156,8 +175,8 @@ public:
   NEW_DELETE_OPS(mfs);
 
   sref<mnode> mget(u64 mnum);
+  mnode* mpeek(u64 mnum);
   mlinkref alloc(u8 type, u64 parent_mnum = 0);
-  sleeplock dir_rename_lock __mpalign__;
 };
 
 
@@ -178,6 +197,12 @@ private:
   chainhash<strbuf<DIRSIZ>, u64> map_;
 
 public:
+  // Written while this directory is moved to a new parent by a
+  // cross-directory rename, which holds rename_lock.  Renames read it to
+  // validate their view of a directory's ancestors (see sys_rename).
+  seqcount<u64> rename_seq;
+  sleeplock rename_lock;
+
   bool insert(const strbuf<DIRSIZ>& name, mlinkref* mlink, u64 *tsc = NULL) {
     if (name == ".")
       return false;
@@ -239,6 +264,16 @@ public:
     return map_.lookup(name);
   }
 
+  // Like lookup(), but returns the mnode number of name without
+  // taking a reference to its mnode.
+  bool lookup_mnum(const strbuf<DIRSIZ>& name, u64 *mnum) const {
+    if (name == ".") {
+      *mnum = mnum_;
+      return true;
+    }
+    return map_.lookup(name, mnum);
+  }
+
   sref<mnode> lookup(const strbuf<DIRSIZ>& name) const {
     if (name == ".")
       return fs_->mget(mnum_);
@@ -330,6 +365,20 @@ public:
     return map_.enumerate(prev, name);
   }
 
+  // Collect the names in enumeration bucket b that sort after *prev (all
+  // of them if prev is null), with their mnode numbers, in name order.
+  // Bucket 0 holds just "."; bucket b + 1 is bucket b of the name hash
+  // table.  Returns false past the last bucket.  See sys_getdents.
+  bool enumerate_bucket(u64 b, const strbuf<DIRSIZ>* prev,
+                        std::vector<std::pair<strbuf<DIRSIZ>, u64>>* out) const {
+    if (b == 0) {
+      if (!prev)
+        out->emplace_back(strbuf<DIRSIZ>("."), mnum_);
+      return true;
+    }
+    return map_.bucket_entries(b - 1, prev, out);
+  }
+
   bool kill(sref<mnode> parent) {
     if (!map_.remove_and_kill("..", parent->mnum_))
       return false;
@@ -369,7 +418,9 @@ mnode::as_dir() const
 class mfile : public mnode {
 private:
   mfile(mfs* fs, u64 mnum, u64 parent_mnum) : mnode(fs, mnum),
-        parent_mnum_(parent_mnum), size_(0) {}
+        parent_mnum_(parent_mnum), size_(0),
+        numa_policy_(NUMA_POLICY_FIRST_TOUCH), dirty_pages_(0),
+        content_gen_(0), exec_hdr_(nullptr) {}
   NEW_DELETE_OPS(mfile);
   friend class mnode;
   friend class mfs;
@@ -521,6 +572,68 @@ private:
   // Only one fsync can execute on the mnode at a time
   sleeplock fsync_lock_;
 
+  // Page placement policy; one of NUMA_POLICY_*.
+  std::atomic<int> numa_policy_;
+
+  // Pages dirtied since the last sync_file.  Approximate: it is only
+  // used to decide when writeback should flush this file.
+  std::atomic<u64> dirty_pages_;
+
+  void migrate_page(u64 pageidx, page_info* old);
+
+public:
+  u64 dirty_bytes() const { return dirty_pages_ * PGSIZE; }
+
+  // The ELF headers of this file as parsed by exec, so that exec'ing
+  // the same binary again need not re-read and re-parse them.
+  struct exec_header : public rcu_freed {
+    u64 gen;                    // content_gen() these were parsed at
+    u64 entry;
+    u64 phoff;
+    u64 phnum;
+    std::vector<proghdr> loads; // The ELF_PROG_LOAD program headers
+
+    exec_header() : rcu_freed("mfile::exec_header", this, sizeof(*this)) {}
+    void do_gc() override { delete this; }
+    NEW_DELETE_OPS(exec_header);
+  };
+
+  // Incremented by every change to the file's contents through the
+  // file system.  (Stores through shared writable mappings are not
+  // tracked.)
+  u64 content_gen() const
+  {
+    return content_gen_.load(std::memory_order_acquire);
+  }
+
+  // Return the cached exec headers if they are still current, or
+  // null.  The caller must be in an RCU epoch.
+  const exec_header* get_exec_header() const
+  {
+    exec_header *h = exec_hdr_.load(std::memory_order_acquire);
+    if (h && h->gen != content_gen())
+      return nullptr;
+    return h;
+  }
+
+  // Replace the cached exec headers with h, which was parsed from the
+  // contents at h->gen.
+  void set_exec_header(exec_header *h)
+  {
+    exec_header *old = exec_hdr_.exchange(h);
+    if (old)
+      gc_delayed(old);
+  }
+
+private:
+  std::atomic<u64> content_gen_;
+  std::atomic<exec_header*> exec_hdr_;
+
+  void contents_changed()
+  {
+    content_gen_.fetch_add(1, std::memory_order_release);
+  }
+
 public:
   class resizer : public lock_guard<sleeplock>,
                   public seq_writer {
@@ -548,9 +661,25 @@ public:
     return seq_reader<u64>(&size_, &size_seq_);
   }
 
-  page_state get_page(u64 pageidx);
-  void put_page(u64 pageidx);
-  void set_page_dirty(u64 pageidx);
+  // If migrate is true and this file's policy is NUMA_POLICY_MIGRATE,
+  // get_page may move a page that is repeatedly accessed from a remote
+  // NUMA node to this CPU's node.  This clears page table mappings of
+  // the page, so callers must not hold any vmap locks.
+  page_state get_page(u64 pageidx, bool migrate = false);
+  void put_page(u64 pageidx, rmap_batch *batch = nullptr);
+  // Mark page pageidx dirty if it is still backed by pi.  Returns
+  // false if the page was migrated to a different physical page, in
+  // which case the caller must redo its write.
+  bool set_page_dirty(u64 pageidx, page_info* pi);
+  // Add map to pi's rmap if page pageidx is still backed by pi.
+  // Returns false if the page was migrated to a different physical
+  // page, in which case the caller must look it up again.
+  bool add_mapping(u64 pageidx, page_info* pi, page_info::rmap_entry map);
+  // Allocate a zeroed page for page pageidx of this file, placed
+  // according to the file's NUMA policy.
+  char* alloc_page(u64 pageidx);
+  void set_numa_policy(int policy) { numa_policy_ = policy; }
+  int numa_policy() const { return numa_policy_; }
   void sync_file(int cpu);
   void remove_pgtable_mappings(u64 start_offset);
   void drop_pagecache();
@@ -644,33 +773,44 @@ mnode::as_sock() const
   return static_cast<const msock*>(this);
 }
 
-// Exception thrown by mfile::get_page if IO is required but
-// scheduling is disabled.  The exception allows the get_page to be
-// retried outside the holder of the lock or scoped_critical.
+// Exception thrown by mfile::get_page or swap_entry::get_page if IO
+// is required but scheduling is disabled.  The exception allows the
+// get_page to be retried outside the holder of the lock or
+// scoped_critical.
 class blocking_io : public std::exception
 {
   sref<mfile> mf_;
   u64 pageidx_;
+  sref<swap_entry> swap_;
 
 public:
   blocking_io(sref<mfile> mf, u64 pageidx)
     : mf_(std::move(mf)), pageidx_(pageidx) { }
 
+  explicit blocking_io(sref<swap_entry> swap)
+    : pageidx_(0), swap_(std::move(swap)) { }
+
   ~blocking_io() noexcept
   {
-    if (mf_)
+    if (mf_ || swap_)
       panic("blocking_io not retried or aborted");
   }
 
   void retry()
   {
-    mf_->get_page(pageidx_);
-    mf_.reset();
+    // Swap-in may throw bad_alloc, so give up our references first.
+    sref<mfile> mf(std::move(mf_));
+    sref<swap_entry> swap(std::move(swap_));
+    if (mf)
+      mf->get_page(pageidx_);
+    else
+      swap->load();
   }
 
   void abort()
   {
     mf_.reset();
+    swap_.reset();
   }
 
   const char *what() const throw() override
@@ -38,3 +38,16 @@ enum {
 };
 
 extern static_vector<numa_node, MAX_NUMA_NODES> numa_nodes;
+
+// Return the NUMA node whose memory contains the direct-mapped
+// address va, or nullptr if no node claims it.
+numa_node *numa_node_of(const void *va);
+
+// Return true if va is in the memory of this CPU's NUMA node.
+bool numa_is_local(const void *va);
+
+// Return a CPU on NUMA node (idx % number of nodes), suitable as the
+// cpu argument to kalloc to spread allocations round-robin across
+// nodes.  Successive idx values that map to the same node also rotate
+// through that node's CPUs.  Returns -1 if there is no such CPU.
+int numa_interleave_cpu(uint64_t idx);
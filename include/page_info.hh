@@ -144,11 +144,16 @@ public:
         auto guard = synchronize_with_spinlock();
       }
 
+      bool empty() {
+        auto guard = synchronize_with_spinlock();
+        return rmap_vec.empty();
+      }
+
     protected:
       std::vector<rmap_entry> rmap_vec;
   };
 
-  page_info() {
+  page_info() : remote_accesses_(0) {
     rmap_pte = new rmap(false); // use_sleeplock = false.
     for (int cpu = 0; cpu < NCPU; cpu++)
       outstanding_ops[cpu] = 0;
@@ -233,9 +238,22 @@ public:
     outstanding_ops[cpu] = 0;
   }
 
+  // Returns true if any vmap has this page mapped.
+  bool is_mapped() {
+    assert(rmap_pte);
+    return !rmap_pte->empty();
+  }
+
+  // Record an access to this page from a CPU on a remote NUMA node
+  // and return the number of such accesses so far.
+  u32 note_remote_access() {
+    return ++remote_accesses_;
+  }
+
 private:
   rmap *rmap_pte;
   percpu<u64> outstanding_ops;
+  std::atomic<u32> remote_accesses_;
 
 } __attribute__((aligned(16)));
 
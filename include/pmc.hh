@@ -74,6 +74,8 @@ struct sys_stat {
       that->stats[i].misses = stats[i].misses - o->stats[i].misses;
       that->stats[i].idle = stats[i].idle - o->stats[i].idle;
       that->stats[i].busy = stats[i].busy - o->stats[i].busy;
+      that->stats[i].halts = stats[i].halts - o->stats[i].halts;
+      that->stats[i].preempts = stats[i].preempts - o->stats[i].preempts;
     }
 
     return that;
@@ -6,6 +6,7 @@
 #include "fs.h"
 #include "sched.hh"
 #include <uk/signal.h>
+#include <uk/resource.h>
 #include "ilist.hh"
 #include <stdexcept>
 #include "vmalloc.hh"
@@ -85,6 +86,8 @@ struct proc {
   struct gc_handle *gc;
   char lockname[16];
   int cpu_pin;
+  int sched_class;             // PRIO_LATENCY or PRIO_BATCH
+  bool sched_expired_;         // Used a whole quantum when last descheduled
 #if MTRACE
   struct mtrace_stacks mtrace_stacks;
 #endif
@@ -100,6 +103,7 @@ struct proc {
   int in_exec_;
   int uaccess_;
   bool yield_;                 // yield cpu up when returning to user space
+  struct uring *uring_;        // System call submission ring, if any
 
   userptr_str upath;
   userptr<userptr_str> uargv;
@@ -118,10 +122,13 @@ struct proc {
   int          set_cpu_pin(int cpu);
   static int   kill(int pid);
   int          kill();
+  // A proc that has never run (tsc == 0) has no cache footprint and
+  // can always move; otherwise it must have run a while since it last
+  // moved.
   bool         cansteal(bool nonexec) {
     return (get_state() == RUNNABLE && !cpu_pin && 
           (in_exec_ || nonexec) &&
-          curcycles != 0 && curcycles > VICTIMAGE);
+          (tsc == 0 || curcycles > VICTIMAGE));
   };
 
 
@@ -158,6 +158,7 @@
 #include "seqlock.hh"
 #include "condvar.hh"
 #include "critical.hh"
+#include "work.hh"
 
 #include <stdexcept>
 #include <limits.h>
@@ -384,6 +385,15 @@ namespace refcache {
     // Convert this weak reference into a regular reference.  If the
     // pointed-to object has been collected, this will return sref().
     sref<T> get() const;
+
+    // Return the pointed-to object without taking a reference, or
+    // nullptr if it has been collected or is being reviewed.  The
+    // caller must otherwise ensure the object outlives its use.
+    T* peek() const
+    {
+      ptr_and_state cur(ptr_and_state_.load());
+      return cur.dying_ ? nullptr : cur.ptr_;
+    }
   };
 
   // The reference delta cache.  There is one instance of class cache
@@ -413,11 +423,17 @@ namespace refcache {
     referenced::list review_;
 
     // The list of objects whose onzero() method should be called.  Call
-    // onzero() from a separate thread, instead of the timer interrupt,
-    // to avoid deadlock with the thread preempted by the timer.
+    // onzero() from this core's dwork thread, instead of the timer
+    // interrupt, to avoid deadlock with the thread preempted by the
+    // timer.
     referenced::list reap_;
     spinlock reap_lock_;
-    condvar reap_cv_;
+
+    struct reap_work : public dwork
+    {
+      virtual void run() override;
+    };
+    reap_work reap_work_;
 
     // The last global epoch number observed by this core.
     uint64_t local_epoch;
@@ -492,9 +508,9 @@ namespace refcache {
     // three times the delay between calls to tic.
     void tick();
 
-    // Reap dead objects.  This is done in a dedicated thread to
-    // avoid deadlock with threads preempted by the timer interrupt.
-    void reaper() __attribute__((noreturn));
+    // Reap dead objects.  This is done in the dwork thread to avoid
+    // deadlock with threads preempted by the timer interrupt.
+    void reap();
   };
 
   // Per-CPU reference delta cache.  In general this has to be
@@ -6,6 +6,8 @@
 #include "oplog.hh"
 #include "bitset.hh"
 #include "disk.hh"
+#include "kalloc.hh"
+#include "work.hh"
 #include <vector>
 #include <algorithm>
 
@@ -66,7 +68,7 @@ struct transaction_diskblock {
 
   sref<disk_completion> dc;
 
-  NEW_DELETE_OPS(transaction_diskblock);
+  NEW_DELETE_OPS_CACHED(transaction_diskblock);
 
   transaction_diskblock(u32 n, char buf[BSIZE])
   {
@@ -207,6 +209,16 @@ class transaction {
       free_inum_list.push_back(inum);
     }
 
+    void add_orphan(u32 inum)
+    {
+      orphan_updates.push_back({inum, true});
+    }
+
+    void remove_orphan(u32 inum)
+    {
+      orphan_updates.push_back({inum, false});
+    }
+
     void add_dirty_blocks_lazy()
     {
       deduplicate_dirty_blocknums();
@@ -278,6 +290,35 @@ class transaction {
         free_inum_list.erase(free_inum_list.begin() + idx);
     }
 
+    // Reduces orphan_updates to the last update to each inode, sorted by
+    // inode number. An inode that this transaction adds and then removes
+    // again is dropped altogether, so it costs no orphan block lock. If it
+    // was already listed, the stale entry is harmless, since recovery checks
+    // the link counts before reclaiming anything.
+    void cancel_orphan_updates()
+    {
+      std::vector<u32> order;
+      order.reserve(orphan_updates.size());
+      for (u32 i = 0; i < orphan_updates.size(); i++)
+        order.push_back(i);
+
+      std::sort(order.begin(), order.end(), [this](u32 a, u32 b) {
+        u32 ainum = orphan_updates[a].inum, binum = orphan_updates[b].inum;
+        return ainum < binum || (ainum == binum && a < b);
+      });
+
+      std::vector<orphan_update> net;
+      for (auto o = order.begin(); o != order.end(); ) {
+        const orphan_update &first = orphan_updates[*o];
+        u32 last = *o;
+        while (++o != order.end() && orphan_updates[*o].inum == first.inum)
+          last = *o;
+        if (!first.add || orphan_updates[last].add)
+          net.push_back(orphan_updates[last]);
+      }
+      orphan_updates = std::move(net);
+    }
+
     void deduplicate_blocks()
     {
       // Sort the diskblocks in increasing timestamp order.
@@ -454,6 +495,16 @@ class transaction {
     // available for reuse only after this transaction commits successfully.
     std::vector<u32> free_inum_list;
 
+    // Inodes added to (add == true) or removed from the on-disk orphan list
+    // within this transaction, in order until cancel_orphan_updates(). Like
+    // the free bitmap, the orphan list blocks are updated only when the
+    // transaction is enqueued.
+    struct orphan_update {
+      u32 inum;
+      bool add;
+    };
+    std::vector<orphan_update> orphan_updates;
+
     // Set of inode-block and bitmap-block locks that this transaction owns.
     std::vector<u32> inodebitmap_blk_list;
     std::vector<sleeplock*> inodebitmap_locks;
@@ -471,8 +522,9 @@ class journal {
   friend mfs_interface;
   public:
     NEW_DELETE_OPS(journal);
-    journal() : last_applied_commit_tsc(0), current_off(0),
-                committed_trans_tsc(0), applied_trans_tsc(0)
+    journal(int cpu) : last_applied_commit_tsc(0), commit_work_(cpu),
+                       current_off(0), enqueued_trans_tsc(0),
+                       committed_trans_tsc(0), applied_trans_tsc(0)
     {
       apply_dedup_trans = new transaction();
     }
@@ -484,9 +536,11 @@ class journal {
     }
 
     // Add a new transaction to the journal's transaction commit queue.
+    // The caller holds tx_commit_queue_lock.
     void enqueue_transaction(transaction *tr)
     {
       tx_commit_queue.push_back(tr);
+      enqueued_trans_tsc = tr->enq_tsc;
     }
 
     // comparison function to order journal transactions in timestamp order
@@ -542,6 +596,14 @@ class journal {
       return applied_trans_tsc;
     }
 
+    // The timestamp of the last transaction added to the commit queue.
+    // Once get_committed_tsc() reaches it, everything queued so far is
+    // durable.
+    u64 get_enqueued_tsc() {
+      scoped_acquire a(&tx_commit_queue_lock);
+      return enqueued_trans_tsc;
+    }
+
   private:
     std::vector<transaction*> tx_commit_queue;
     std::vector<transaction*> tx_apply_queue;
@@ -565,6 +627,16 @@ class journal {
   private:
     transaction *apply_dedup_trans;
 
+    // Commits this journal from its core's dwork thread, on behalf of
+    // fsync_async().
+    struct commit_work : public dwork
+    {
+      commit_work(int cpu) : cpu_(cpu) {}
+      void run() override;
+      const int cpu_;
+    };
+    commit_work commit_work_;
+
     // Ensures that there is only one process/thread driving
     // flush_transaction_queue() on a given per-core journal at a time.
     // This is used for efficiency reasons: it avoids redundant attempts
@@ -577,6 +649,10 @@ class journal {
     u32 current_off;
     spinlock offset_lock; // Protects access to current_off.
 
+    // The timestamp of the last transaction added to tx_commit_queue.
+    // Protected by tx_commit_queue_lock.
+    u64 enqueued_trans_tsc;
+
     // The timestamp of the last transaction that was committed to the on-disk
     // filesystem via this journal.
     u64 committed_trans_tsc;
@@ -636,6 +712,13 @@ class mfs_interface
       JOURNAL_TXN_SKIP,          // Skip block
     };
 
+    // Phases of a parallel sync, run by every core in turn.
+    enum {
+      SYNC_PROCESS_LOGS = 1,     // Process the oplogs of dirty mnodes
+      SYNC_FILES,                // Sync dirty files and commit
+      SYNC_FLUSH,                // Delete dead inodes, commit and apply
+    };
+
     struct pending_metadata {
       u64 mnum;
       u64 max_tsc;
@@ -750,6 +833,10 @@ class mfs_interface
     void commit_all_transactions(int cpu);
     void apply_all_transactions(int cpu);
     void flush_transaction_queue(int cpu, bool apply_transactions = false);
+    // Commit cpu's journal from that core's dwork thread within
+    // FSYNC_ASYNC_DELAY msec, so that requests arriving meanwhile
+    // share the flush.
+    void flush_transaction_queue_async(int cpu);
     void print_txq_stats();
     bool fits_in_journal(size_t num_trans_blocks, int cpu);
     void write_journal(char *buf, size_t size, transaction *tr, int cpu);
@@ -766,6 +853,7 @@ class mfs_interface
                              transaction *trans);
     bool get_txn_commit_block(int cpu, transaction *trans);
     void recover_journal(int cpu, std::vector<transaction*> &trans_vec);
+    u64  apply_recovered_transactions(std::vector<transaction*> &trans_vec);
     void reset_journal(int cpu);
     void init_journal(int cpu);
 
@@ -785,6 +873,9 @@ class mfs_interface
     void evict_bufcache();
     void evict_pagecache();
     void process_metadata_log_and_flush(int cpu);
+    void run_sync_phase(int cpu, int phase, std::vector<u64> &mnum_list);
+    void writeback(int cpu);
+    void note_dirty(u64 mnum);
     void process_metadata_log(u64 max_tsc, u64 mnode_mnum, int cpu);
     void add_op_to_transaction_queue(mfs_operation *op, int cpu,
                                      transaction *tr = nullptr,
@@ -807,6 +898,8 @@ class mfs_interface
     void mfs_unlink(mfs_operation_unlink *op, transaction *tr);
     void mfs_rename_link(mfs_operation_rename_link *op, transaction *tr);
     void mfs_rename_unlink(mfs_operation_rename_unlink *op, transaction *tr);
+    void orphan_update_on_disk(transaction *tr);
+    void reclaim_orphan_inode(sref<inode> ip, transaction *tr);
     void reclaim_unreachable_inodes();
 
     // Block allocator functionality
@@ -818,6 +911,7 @@ class mfs_interface
     enum {
       INODE_BLOCK = 1,
       BITMAP_BLOCK,
+      ORPHAN_BLOCK,
     };
 
     void alloc_inodebitmap_locks();
@@ -903,11 +997,25 @@ class mfs_operation
     int operation_type; // MFS_OP_CREATE_FILE, MFS_OP_LINK_DIR etc.
 };
 
+// Returns op as a T if it is one, and null otherwise. Like dynamic_cast, but
+// decided by operation_type alone, which is all the fsync path needs.
+template<class T>
+T*
+mfs_op_cast(mfs_operation *op)
+{
+  return T::has_type(op->operation_type) ? static_cast<T*>(op) : nullptr;
+}
+
 class mfs_operation_create: public mfs_operation
 {
   friend mfs_interface;
   public:
-    NEW_DELETE_OPS(mfs_operation_create);
+    NEW_DELETE_OPS_CACHED(mfs_operation_create);
+
+    static bool has_type(int type)
+    {
+      return type == MFS_OP_CREATE_FILE || type == MFS_OP_CREATE_DIR;
+    }
 
     mfs_operation_create(mfs_interface *p, u64 t, u64 mnum, u64 pt, char nm[],
                          short m_type)
@@ -951,7 +1059,12 @@ class mfs_operation_link: public mfs_operation
 {
   friend mfs_interface;
   public:
-    NEW_DELETE_OPS(mfs_operation_link);
+    NEW_DELETE_OPS_CACHED(mfs_operation_link);
+
+    static bool has_type(int type)
+    {
+      return type == MFS_OP_LINK_FILE || type == MFS_OP_LINK_DIR;
+    }
 
     mfs_operation_link(mfs_interface *p, u64 t, u64 mnum, u64 pt, char nm[],
                        short m_type)
@@ -995,7 +1108,12 @@ class mfs_operation_unlink: public mfs_operation
 {
   friend mfs_interface;
   public:
-    NEW_DELETE_OPS(mfs_operation_unlink);
+    NEW_DELETE_OPS_CACHED(mfs_operation_unlink);
+
+    static bool has_type(int type)
+    {
+      return type == MFS_OP_UNLINK_FILE || type == MFS_OP_UNLINK_DIR;
+    }
 
     mfs_operation_unlink(mfs_interface *p, u64 t, u64 mnum, u64 pt, char nm[],
                          short m_type)
@@ -1039,7 +1157,12 @@ class mfs_operation_rename_link: public mfs_operation
 {
   friend mfs_interface;
   public:
-    NEW_DELETE_OPS(mfs_operation_rename_link);
+    NEW_DELETE_OPS_CACHED(mfs_operation_rename_link);
+
+    static bool has_type(int type)
+    {
+      return type == MFS_OP_RENAME_LINK_FILE || type == MFS_OP_RENAME_LINK_DIR;
+    }
 
     mfs_operation_rename_link(mfs_interface *p, u64 t, char oldnm[], u64 mnum,
                               u64 src_pt, char newnm[], u64 dst_pt, u8 m_type)
@@ -1091,7 +1214,12 @@ class mfs_operation_rename_unlink: public mfs_operation
 {
   friend mfs_interface;
   public:
-    NEW_DELETE_OPS(mfs_operation_rename_unlink);
+    NEW_DELETE_OPS_CACHED(mfs_operation_rename_unlink);
+
+    static bool has_type(int type)
+    {
+      return type == MFS_OP_RENAME_UNLINK_FILE || type == MFS_OP_RENAME_UNLINK_DIR;
+    }
 
     mfs_operation_rename_unlink(mfs_interface *p, u64 t, char oldnm[], u64 mnum,
                                 u64 src_pt, char newnm[], u64 dst_pt, u8 m_type)
@@ -1145,7 +1273,12 @@ class mfs_operation_rename_barrier: public mfs_operation
 {
   friend mfs_interface;
   public:
-    NEW_DELETE_OPS(mfs_operation_rename_barrier);
+    NEW_DELETE_OPS_CACHED(mfs_operation_rename_barrier);
+
+    static bool has_type(int type)
+    {
+      return type == MFS_OP_RENAME_BARRIER;
+    }
 
     mfs_operation_rename_barrier(mfs_interface *p, u64 t, u64 mnum,
                                 u64 parent, u8 m_type)
@@ -1183,7 +1316,7 @@ class mfs_logical_log: public mfs_logged_object
     NEW_DELETE_OPS(mfs_logical_log);
     // Set 'use_sleeplock' to false in mfs_logged_object.
     mfs_logical_log(u64 mnum) : mfs_logged_object(false), mnode_mnum(mnum),
-                                last_synced_tsc(0) {}
+                                last_synced_tsc(0), absorbed(false) {}
     ~mfs_logical_log()
     {
       for (auto it = operation_vec.begin(); it != operation_vec.end(); it++)
@@ -1202,6 +1335,7 @@ class mfs_logical_log: public mfs_logged_object
         assert(operation->timestamp >= parent->last_synced_tsc);
         parent->last_synced_tsc = operation->timestamp;
         parent->operation_vec.push_back(std::move(operation));
+        parent->absorbed = false;
       }
 
       void print()
@@ -1238,6 +1372,12 @@ class mfs_logical_log: public mfs_logged_object
     u64 mnode_mnum;
     u64 last_synced_tsc;
 
+    // True if absorb_file_link_unlink() has run over the operations up to the
+    // first cross-directory rename in operation_vec, and none have been added
+    // since; running it again would find nothing. This keeps fsync linear when
+    // it has to return to this log repeatedly to resolve its dependencies.
+    bool absorbed;
+
     // This link-count is used to perform a hand-shake between MemFS and
     // fsync/sync for accurate zero-detection of file link-counts, which helps
     // determine when it is safe to delete the inode on the disk.
@@ -1,5 +1,8 @@
 #pragma once
 
+// Number of scheduling classes (see uk/resource.h)
+#define NPRIO 2
+
 struct sched_stat
 {
   u64 enqs;
@@ -9,4 +12,6 @@ struct sched_stat
   u64 idle;
   u64 busy;
   u64 schedstart;
+  u64 halts;                    // Idle with nothing to steal
+  u64 preempts;                 // Wakeup preemptions
 };
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "spinlock.hh"
+#include "kalloc.hh"
+#include "page_info.hh"
+
+// Anonymous memory swapping.
+//
+// When memory runs low, the kswapd thread walks every address space
+// with a clock hand, clearing the software reference bit
+// (vmdesc::FLAG_ACCESSED) of recently used pages and evicting those
+// whose bit is already clear.  An evicted page's vmdesc trades its
+// page for a swap_entry, which owns a page-sized slot in a swap area
+// placed on disk right after the file system image.  kswapd writes
+// each batch of evicted pages with one block_queue, so contiguous
+// slots go to the disk as large scatter-gather writes.
+//
+// Swap slots are handed out from per-CPU ranges of the swap area, so
+// evictions and frees on different cores do not contend.  A CPU
+// whose range is full steals slots from other CPUs' ranges.
+
+class swap_entry : public referenced
+{
+public:
+  // Move page out to a newly allocated swap slot.  The entry caches
+  // page until written() is called, so the page can be faulted back
+  // in without IO while it is being written.  Returns null if swap
+  // is disabled or full.
+  static sref<swap_entry> alloc(sref<page_info> page);
+
+  // Return this entry's page, reading it from the swap area if it is
+  // not cached.  If IO is required and scheduling is disabled, throws
+  // blocking_io so the caller can drop its locks and retry.  Throws
+  // bad_alloc if a page cannot be allocated.
+  sref<page_info> get_page();
+
+  // Read this entry's page in to the cache.  May block.
+  void load();
+
+  // The byte offset of this entry's slot on disk.
+  u64 offset() const;
+
+  // Start writing the cached page to this entry's slot.
+  void write(class block_queue *bq);
+
+  // Called once the write started by write() has completed.  Drops
+  // the cached page.
+  void written();
+
+  NEW_DELETE_OPS_CACHED(swap_entry);
+
+private:
+  swap_entry(u64 slot, sref<page_info> page)
+    : slot_(slot), lock_("swap_entry", false), page_(std::move(page)) { }
+  ~swap_entry();
+
+  u64 slot_;
+  spinlock lock_;
+  sref<page_info> page_;
+};
+
+// Ask kswapd to evict pages.  This must not be called with
+// scheduling disabled.
+void swap_wakeup(void);
+
+// Note that an allocation failed.  Unlike swap_wakeup, this is safe to
+// call from any context, including kalloc itself; kswapd notices on
+// its next periodic check.
+void swap_note_pressure(void);
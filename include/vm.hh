@@ -9,6 +9,8 @@
 #include "kalloc.hh"
 #include "page_info.hh"
 #include "mfs.hh"
+#include "swap.hh"
+#include "ilist.hh"
 
 struct padded_length;
 
@@ -48,6 +50,11 @@ struct vmdesc : public mmu::page_tracker
 
     // Set if the page should be shared across fork().
     FLAG_SHARED = 1<<5,
+
+    // Software reference bit.  Set when this page frame faults and
+    // cleared (along with its PTE) by kswapd's clock hand; a page
+    // whose bit is still clear on the next pass is evicted.
+    FLAG_ACCESSED = 1<<6,
   };
 
   // Flags
@@ -57,6 +64,10 @@ struct vmdesc : public mmu::page_tracker
   // been allocated for this frame.
   sref<class page_info> page;
 
+  // For anonymous memory whose page has been swapped out, the swap
+  // entry holding its contents.  At most one of page and swap is set.
+  sref<swap_entry> swap;
+
   // XXX We could pack the following fields into a union if there's
   // anything we can overlap with them for anonymous memory.  However,
   // then we have to use C++11 unrestricted unions because of the
@@ -104,7 +115,7 @@ struct vmdesc : public mmu::page_tracker
   // any core).
   vmdesc dup() const
   {
-    return vmdesc(flags & ~FLAG_LOCK, page, inode, start);
+    return vmdesc(flags & ~FLAG_LOCK, page, swap, inode, start);
   }
 
   // We need new/delete so the radix_array can allocate external nodes
@@ -113,12 +124,13 @@ struct vmdesc : public mmu::page_tracker
 
 private:
   vmdesc(u64 flags)
-    : flags(flags), page(), inode(), start() { }
+    : flags(flags), page(), swap(), inode(), start() { }
 
   // Create a new vmdesc with an empty page tracker.
   vmdesc(u64 flags, const sref<class page_info> &page,
-         const sref<mnode> &inode, intptr_t start)
-    : flags(flags), page(page), inode(inode), start(start) { }
+         const sref<swap_entry> &swap, const sref<mnode> &inode,
+         intptr_t start)
+    : flags(flags), page(page), swap(swap), inode(inode), start(start) { }
 };
 
 void to_stream(class print_stream *s, const vmdesc &vmd);
@@ -146,6 +158,11 @@ struct vmap : public referenced {
   // mapping from vmdesc. Used while evicting pages from the page-cache.
   void clear_mapping(uptr addr);
 
+  // Like delete_mapping and clear_mapping, but for n pages, with a
+  // single TLB shootdown.  Usually called through rmap_batch.
+  void delete_mappings(const uptr *addrs, size_t n);
+  void clear_mappings(const uptr *addrs, size_t n);
+
   // Populate vmdesc's.
   int willneed(uptr start, uptr len);
 
@@ -167,6 +184,26 @@ struct vmap : public referenced {
   // say, this mapping is only valid within the returned page.
   void* pagelookup(uptr va);
 
+  // Like pagelookup, but return a reference to the page backing va,
+  // which stays valid even if va is later unmapped.  Returns null if
+  // va is not mapped.
+  sref<class page_info> pageref(uptr va);
+
+  // Share the pages backing the page-aligned range start to start+len
+  // copy-on-write, appending a reference to each page to out.  A later
+  // write to the range copies the page, so the references capture the
+  // range as of this call.  Only private anonymous memory is shared;
+  // this stops at the first page that is not.  Returns the number of
+  // bytes shared.
+  size_t share_cow(uptr start, uptr len,
+                   std::vector<sref<class page_info> > *out);
+
+  // Map npages pages copy-on-write at the page-aligned address start,
+  // replacing the pages there.  The range must be mapped writable
+  // private anonymous memory; returns -1 without changing anything if
+  // it is not.
+  int map_cow(uptr start, const sref<class page_info> *pages, size_t npages);
+
   // Copy len bytes from p to user address va in vmap.  Most useful
   // when vmap is not the current page table.
   int copyout(uptr va, const void *p, u64 len);
@@ -185,6 +222,17 @@ struct vmap : public referenced {
   // Set write permission bit in vmdesc
   int set_write_permission(uptr start, uptr len, bool is_readonly, bool is_cow);
 
+  // Advance this vmap's clock hand, evicting up to want anonymous
+  // pages that have not been accessed since the hand last passed
+  // them.  Appends the new swap entries, which still need to be
+  // written, to out.  Returns the number of pages evicted.
+  size_t swap_out(std::vector<sref<swap_entry> > *out, size_t want);
+
+  // Call swap_out on every vmap in the system until want pages have
+  // been evicted or every vmap has been scanned.
+  static size_t swap_out_all(std::vector<sref<swap_entry> > *out,
+                             size_t want);
+
   uptr brk_;                    // Top of heap
 
 private:
@@ -198,6 +246,16 @@ private:
   mmu::page_map_cache cache;
   friend void switchvm(struct proc *);
 
+  // Link in the per-CPU list of vmaps that swap_out_all walks, and
+  // the CPU whose list this vmap is on.
+  ilink<vmap> all_link_;
+  int all_cpu_;
+  struct all_list;
+  static all_list all_[NCPU];
+
+  // Virtual address where swap_out resumes scanning.
+  uptr swap_hand_;
+
   // Virtual page frames
   typedef radix_array<vmdesc, USERTOP / PGSIZE, PGSIZE,
                       kalloc_allocator<vmdesc>, scoped_no_sched> vpf_array;
@@ -216,4 +274,35 @@ private:
   // allocated and cannot be.
   page_info *ensure_page(const vpf_array::iterator &it, access_type type,
                          bool *allocated = nullptr);
+
+  void unmap_pages(const uptr *addrs, size_t n, bool unset);
+};
+
+// Collects the page table mappings of file pages that are being
+// truncated or evicted, so that each vmap mapping any of them removes
+// all of its mappings with one TLB shootdown rather than one per page.
+class rmap_batch
+{
+public:
+  rmap_batch() = default;
+  rmap_batch(const rmap_batch&) = delete;
+  rmap_batch &operator=(const rmap_batch&) = delete;
+
+  // Take all of pi's rmap entries.
+  void add(page_info *pi)
+  {
+    pi->get_rmap_vector(entries_);
+  }
+
+  // Unmap the collected mappings and unset them from their vmaps,
+  // as for vmap::delete_mapping.
+  void delete_mappings();
+
+  // Unmap the collected mappings, as for vmap::clear_mapping.
+  void clear_mappings();
+
+private:
+  template<class F> void for_each_vmap(F fn);
+
+  std::vector<page_info::rmap_entry> entries_;
 };
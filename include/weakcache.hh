@@ -54,6 +54,17 @@ private:
       return sref<V>();
     }
 
+    V*
+    peek(const K& k) const
+    {
+      for (auto &i: chain_) {
+        if (!(i.key_ == k))
+          continue;
+        return i.weakref_.peek();
+      }
+      return nullptr;
+    }
+
     bool
     insert(const K& k, V* v)
     {
@@ -130,6 +141,15 @@ public:
     return buckets_[hash(k) & mask_].lookup(k);
   }
 
+  // Like lookup, but without taking a reference.  Must be called in a
+  // GC epoch, which keeps the cache's items alive; the value itself is
+  // only protected by whatever protects it from being freed.
+  V*
+  peek(const K& k) const
+  {
+    return buckets_[hash(k) & mask_].peek(k);
+  }
+
   bool
   insert(const K& k, V* v)
   {
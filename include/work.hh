@@ -3,20 +3,60 @@
 #include "sched.hh"
 #include "ilist.hh"
 
-// Structures for deferring work.  The deferrred work must not go to block/sleep.
-// If it goes to sleep, create a thread and pin it on the desired core.
+// Structures for deferring work.
+//
+// Each core has a work engine with a run queue per priority and a
+// hierarchical timer wheel for delayed work.  DWORK_HIGH and
+// DWORK_NORMAL work runs in the core's dwork thread, so it may block,
+// though blocking delays the rest of the core's queue.  DWORK_IDLE work
+// runs from the idle loop only when the core has nothing else to do,
+// and must not block.
+//
+// Queueing a work item that is already pending is a no-op, so a
+// long-lived item can be queued whenever there may be something to do
+// and runs once for any number of requests.  Such an item must always
+// be queued on the same core.  The engine marks an item idle before
+// calling run(), so run() may queue the item again or delete it.
+
+enum dwork_prio {
+  DWORK_HIGH,
+  DWORK_NORMAL,
+  DWORK_IDLE,
+  NDWORK_PRIO
+};
 
 struct dwork {
-  dwork() {}
+  dwork(dwork_prio prio = DWORK_NORMAL)
+    : prio_(prio), state_(IDLE), cpu_(-1), expires_(0), queued_(0) {}
   virtual void run() = 0;
-  islink<dwork> link_;
-};
 
-struct dwframe {
-  dwframe(int v = 0) : v_(v) {}
-  void clear() { v_ = 0; }
-  int inc() { return __sync_add_and_fetch(&v_, 1); }
-  int dec() { return __sync_sub_and_fetch(&v_, 1); }
-  bool zero() volatile { return v_ == 0; };
-  volatile int v_;
+  ilink<dwork> link_;
+
+private:
+  friend struct dwork_engine;
+
+  enum state { IDLE, QUEUED, TIMER };
+
+  dwork_prio prio_;
+  state state_;                 // Protected by cpu_'s engine lock
+  int cpu_;
+  u64 expires_;                 // Tick at which a TIMER item fires
+  u64 queued_;                  // TSC when queued, for queue delay
 };
+
+// Run w on cpu as soon as possible.  Returns false if w was already
+// queued.  If w was waiting on a timer, it runs now instead.
+bool dwork_queue(dwork *w, int cpu);
+
+// Run w on cpu after msec milliseconds (rounded up to a tick).  If w
+// is already pending, it keeps its earlier deadline and this returns
+// false.
+bool dwork_delay(dwork *w, int cpu, u64 msec);
+
+// Run one piece of DWORK_IDLE work on this core, if there is any.
+// Called from the idle loop.  Returns true if it ran something.
+bool dwork_run_idle(void);
+
+// Advance this core's timer wheel by one tick.  Called from the timer
+// interrupt.
+void dwork_tick(void);
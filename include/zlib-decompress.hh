@@ -4,3 +4,9 @@
 
 int zlib_decompress(unsigned char *src, u64 srclen, u64 dstlen,
                     void (*copy_output)(const char *buf, u64 offset, u64 size));
+
+// Decompress a sparse filesystem image (see struct sparse_extent), calling
+// copy_block for every allocated block, with a null buf for the blocks that
+// are all zeroes. Free blocks are skipped.
+int sparse_decompress(unsigned char *src, u64 srclen,
+                      void (*copy_block)(const char *buf, u64 blknum));
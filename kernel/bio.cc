@@ -4,6 +4,8 @@
 #include "weakcache.hh"
 #include "mfs.hh"
 #include "scalefs.hh"
+#include "numa.hh"
+#include "kstats.hh"
 
 
 static weakcache<buf::key_t, buf> bufcache(64 << 20);
@@ -19,6 +21,17 @@ buf::in_bufcache(u32 dev, u64 block)
   return (b ? true : false);
 }
 
+buf::buf(u32 dev, u64 block)
+  : dev_(dev), block_(block), dirty_(false)
+{
+  static_assert(sizeof(bufdata) == PGSIZE, "bufdata must be one page");
+  // Metadata blocks are shared by every core, so by default spread
+  // them over all nodes rather than piling them up on whichever node
+  // happened to read them first.
+  int cpu = BUFCACHE_NUMA_INTERLEAVE ? numa_interleave_cpu(block) : -1;
+  data_ = (bufdata *) kalloc("bufdata", PGSIZE, cpu);
+}
+
 // The caller sets @skip_disk_read to true if it is going to overwrite the
 // entire block shortly.
 sref<buf>
@@ -31,6 +44,12 @@ buf::get(u32 dev, u64 block, bool skip_disk_read)
       // Wait for buffer to load, by getting a read seqlock,
       // which waits for the write seqlock bit to be cleared.
       b->seq_.read_begin();
+      if (numa_nodes.size() > 1) {
+        if (numa_is_local(b->data_))
+          kstats::inc(&kstats::bufcache_local_access_count);
+        else
+          kstats::inc(&kstats::bufcache_remote_access_count);
+      }
       return b;
     }
 
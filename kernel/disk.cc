@@ -16,12 +16,28 @@ extern u64 _fs_imgz_size;
 static u64 nblocks = NMEGS * BLKS_PER_MEG;
 static const u64 _fs_img_size = nblocks * BSIZE;
 
+// WB_SIZE matches the stripe size (STRIPE_SIZE_BLKS below), so a buffered run
+// that starts on a WB_SIZE boundary never straddles two disks.
 #define WB_SIZE	64*1024
+#define WB_BLKS	(WB_SIZE / BSIZE)
 static char write_buffer[WB_SIZE];
-static u64 wb_offset;
+static u64 wb_start;  // Disk block of the first buffered block
+static u64 wb_len;    // Number of bytes buffered
+static u64 nflashed;
 
-void
-write_output(const char *buf, u64 offset, u64 size)
+static void
+flush_write_buffer()
+{
+  if (!wb_len)
+    return;
+
+  kiovec iov = { (void *) write_buffer, wb_len };
+  disk_writev(1, &iov, 1, wb_start * BSIZE);
+  wb_len = 0;
+}
+
+static void
+write_output(const char *buf, u64 blknum)
 {
    // TODO: Use disk_write in the asynchronous mode to make this faster. At the
    // moment, the scheduler panics ("EMBRYO -> 1") when the AHCI driver tries to
@@ -29,24 +45,26 @@ write_output(const char *buf, u64 offset, u64 size)
    // alloc_cmdslot(). This is probably because we are doing this way too early
    // in the boot sequence.
 
-   assert(size == BSIZE);
-   if ((offset/BSIZE) % 100000 == 0)
-     cprintf("Writing block %8lu / %lu\r", offset/BSIZE, _fs_img_size/BSIZE);
-
-   // We use disk_writev() to write out the data in bigger (accumulated) chunks
-   // to the disk below, but its correctness heavily depends on the assumption
-   // that all the writes are going to be sequential/contiguous (which holds
-   // good for zlib_decompress(), the way it is implemented).
-   memcpy(write_buffer + wb_offset, buf, size);
-   wb_offset += size;
-
-   // If the write-buffer is full or if this is the last write, write out all
-   // the buffered data to the disk.
-   if (wb_offset == WB_SIZE || offset == (_fs_img_size - BSIZE)) {
-     kiovec iov = { (void *) write_buffer, wb_offset };
-     disk_writev(1, &iov, 1, offset - (wb_offset - BSIZE));
-     wb_offset = 0;
-   }
+   if (blknum % 100000 == 0)
+     cprintf("Writing block %8lu / %lu\r", blknum, _fs_img_size/BSIZE);
+
+   // The sparse image skips the free blocks, so the blocks only come in
+   // contiguous runs. Accumulate each run into bigger chunks for disk_writev(),
+   // breaking at discontinuities and at WB_SIZE boundaries.
+   if (wb_len && (blknum != wb_start + wb_len/BSIZE || blknum % WB_BLKS == 0))
+     flush_write_buffer();
+
+   if (!wb_len)
+     wb_start = blknum;
+
+   // Allocated blocks that are all zeroes still have to be written, since the
+   // disk may hold stale data from an earlier run.
+   if (buf)
+     memcpy(write_buffer + wb_len, buf, BSIZE);
+   else
+     memset(write_buffer + wb_len, 0, BSIZE);
+   wb_len += BSIZE;
+   nflashed++;
 }
 
 void
@@ -62,13 +80,14 @@ initdisk()
   cprintf("initdisk: Flashing the filesystem image on the disk(s)\n");
 
   gettimeofday(&before, NULL);
-  zlib_decompress(_fs_imgz_start, _fs_imgz_size,
-                  _fs_img_size, write_output);
-
+  sparse_decompress(_fs_imgz_start, _fs_imgz_size, write_output);
+  flush_write_buffer();
   gettimeofday(&after, NULL);
 
-  cprintf("Writing block %8lu / %lu\n", _fs_img_size/BSIZE, _fs_img_size/BSIZE);
-  cprintf("Writing blocks ... done! (%d seconds)\n", after.tv_sec - before.tv_sec);
+  u64 ms = (after.tv_sec - before.tv_sec) * 1000 +
+           (after.tv_usec - before.tv_usec) / 1000;
+  cprintf("Writing blocks ... done! (%lu / %lu blocks, %lu ms)\n",
+          nflashed, _fs_img_size/BSIZE, ms);
 }
 
 #endif
@@ -143,6 +162,19 @@ u32 num_disks()
   return (u32) disks.size();
 }
 
+u64 disk_capacity()
+{
+  if (disks.empty())
+    return 0;
+  u64 min = disks[0]->dk_nbytes;
+  for (disk* d : disks)
+    if (d->dk_nbytes < min)
+      min = d->dk_nbytes;
+  // Only whole stripes of the smallest disk are usable on every disk.
+  u64 stripe = STRIPE_SIZE_BLKS * BSIZE;
+  return (min / stripe) * stripe * disks.size();
+}
+
 void
 disk_readv(u32 dev, kiovec *iov, int iov_cnt, u64 offset,
            sref<disk_completion> dc)
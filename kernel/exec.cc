@@ -19,13 +19,8 @@
 #define BRK (USERTOP >> 1)
 
 static int
-dosegment(sref<mnode> m, vmap* vmp, u64 off, u64 *load_addr)
+dosegment(sref<mnode> m, vmap* vmp, const proghdr &ph, u64 *load_addr)
 {
-  struct proghdr ph;
-  if(readm(m, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
-    return -1;
-  if(ph.type != ELF_PROG_LOAD)
-    return -1;
   if(ph.memsz < ph.filesz)
     return -1;
   if (ph.offset < PGOFFSET(ph.vaddr))
@@ -68,21 +63,21 @@ dosegment(sref<mnode> m, vmap* vmp, u64 off, u64 *load_addr)
   if (mapped_end != backed_end) {
     // There's some file data that we can't directly map because
     // another segment may begin on the same page as this segment
-    // ends.
+    // ends.  Copy it straight from the page cache.
     if (vmp->insert(vmdesc::anon_desc, mapped_end, backed_end - mapped_end) < 0)
       return -1;
     size_t seg_pos = mapped_end >= ph.vaddr ? mapped_end - ph.vaddr : 0;
-    char buf[512];
     while (seg_pos < ph.filesz) {
-      size_t to_read = ph.filesz - seg_pos;
-      if (to_read > sizeof(buf))
-        to_read = sizeof(buf);
-      int res = readm(m, buf, ph.offset + seg_pos, to_read);
-      if (res <= 0)
+      u64 pos = ph.offset + seg_pos;
+      mfile::page_state ps = m->as_file()->get_page(pos / PGSIZE);
+      sref<page_info> pi = ps.get_page_info();
+      if (!pi)
         return -1;
-      if (vmp->copyout(ph.vaddr + seg_pos, buf, res) < 0)
+      size_t n = std::min<size_t>(ph.filesz - seg_pos, PGSIZE - PGOFFSET(pos));
+      if (vmp->copyout(ph.vaddr + seg_pos, (char*)pi->va() + PGOFFSET(pos),
+                       n) < 0)
         return -1;
-      seg_pos += res;
+      seg_pos += n;
     }
   }
 
@@ -176,6 +171,9 @@ exec(const char *path, const char * const *argv)
     return r;
   }
 
+  // The ring's threads run entries in the old image.
+  uring_exit(myproc());
+
   // Close O_CLOEXEC file descriptors.
   //
   // exec, CLOEXEC, and FD table sharing interact in strange ways.
@@ -197,32 +195,26 @@ exec(const char *path, const char * const *argv)
   return 0;
 }
 
-// Load an ELF image or script into the given process.  p->cwd_m must
-// be set (path is resolved relative to this) and p->tf must be a
-// valid pointer.  This sets p->vmap, *p->tf, p->run_cpuid_,
-// p->data_cpuid, and p->name.  If this fails, p will not be modified.
-// This does not switch to the new vmap.  If p already has a vmap and
-// this call succeeds, *oldvmap_out will be set to the old vmap.
-int
-load_image(proc *p, const char *path, const char * const *argv,
-           sref<vmap> *oldvmap_out)
+// Read and parse the headers of the executable m.  If it is an ELF
+// file, parse its headers, cache them on m, set *out to them and
+// return 0.  If it is a script, copy its interpreter path into
+// script and return 1.  The caller must be in an RCU epoch.
+static int
+parse_image(sref<mnode> m, const mfile::exec_header **out,
+            char *script, size_t scriptsz)
 {
-  sref<mnode> m = namei(p->cwd_m, path);
-  if (!m)
-    return -1;
-
-  scoped_gc_epoch rcu;
+  // Note the generation before reading anything, so a concurrent
+  // write makes the cached headers stale rather than wrong.
+  u64 gen = m->as_file()->content_gen();
 
   // Check header
   char buf[1024];
-  if (m->type() != mnode::types::file)
-    return -1;
-  size_t sz = readm(m, buf, 0, sizeof(buf));
+  s64 sz = readm(m, buf, 0, sizeof(buf));
   if (sz < 0)
     return -1;
 
   // Script?
-  if (strncmp(buf, "#!", 2) == 0) {
+  if (sz >= 2 && strncmp(buf, "#!", 2) == 0) {
     int i;
     for (i = 2; i < sz; ++i) {
       if (buf[i] == '\n') {
@@ -230,42 +222,78 @@ load_image(proc *p, const char *path, const char * const *argv,
         break;
       }
     }
-    if (i == sz)
+    if (i == sz || i - 2 >= scriptsz)
       return -1;
-    const char *argv[] = {&buf[2], path, NULL};
-    return load_image(p, argv[0], argv, oldvmap_out);
+    strncpy(script, &buf[2], scriptsz);
+    return 1;
   }
 
   // ELF?
   struct elfhdr *elf = reinterpret_cast<elfhdr*>(&buf);
-  static_assert(sizeof(elf) <= sizeof(buf), "buf too small for ELF header");
-  if (sz < sizeof(elf))
+  static_assert(sizeof(*elf) <= sizeof(buf), "buf too small for ELF header");
+  if (sz < sizeof(*elf))
     return -1;
   if(elf->magic != ELF_MAGIC)
     return -1;
 
+  mfile::exec_header *h = new mfile::exec_header();
+  h->gen = gen;
+  h->entry = elf->entry;
+  h->phoff = elf->phoff;
+  h->phnum = elf->phnum;
+  for (size_t i=0, off=elf->phoff; i<elf->phnum; i++, off+=sizeof(proghdr)){
+    proghdr ph;
+    if(readm(m, (char*)&ph, off, sizeof(ph)) != sizeof(ph)) {
+      delete h;
+      return -1;
+    }
+    if (ph.type == ELF_PROG_LOAD)
+      h->loads.push_back(ph);
+  }
+  m->as_file()->set_exec_header(h);
+  *out = h;
+  return 0;
+}
+
+// Load an ELF image or script into the given process.  p->cwd_m must
+// be set (path is resolved relative to this) and p->tf must be a
+// valid pointer.  This sets p->vmap, *p->tf, p->run_cpuid_,
+// p->data_cpuid, and p->name.  If this fails, p will not be modified.
+// This does not switch to the new vmap.  If p already has a vmap and
+// this call succeeds, *oldvmap_out will be set to the old vmap.
+int
+load_image(proc *p, const char *path, const char * const *argv,
+           sref<vmap> *oldvmap_out)
+{
+  sref<mnode> m = namei(p->cwd_m, path);
+  if (!m)
+    return -1;
+  if (m->type() != mnode::types::file)
+    return -1;
+
+  scoped_gc_epoch rcu;
+
+  const mfile::exec_header *h = m->as_file()->get_exec_header();
+  if (!h) {
+    char script[1024];
+    int r = parse_image(m, &h, script, sizeof(script));
+    if (r < 0)
+      return -1;
+    if (r > 0) {
+      const char *argv[] = {script, path, NULL};
+      return load_image(p, argv[0], argv, oldvmap_out);
+    }
+  }
+
   sref<vmap> vmp = vmap::alloc();
   if (!vmp)
     return -1;
 
   u64 load_addr = -1;
-  for (size_t i=0, off=elf->phoff; i<elf->phnum; i++, off+=sizeof(proghdr)){
-    Elf64_Word type;
-    if(readm(m, (char*)&type, 
-             off+__offsetof(struct proghdr, type), 
-             sizeof(type)) != sizeof(type))
+  for (const proghdr &ph : h->loads)
+    if (dosegment(m, vmp.get(), ph, &load_addr) < 0)
       return -1;
 
-    switch (type) {
-    case ELF_PROG_LOAD:
-      if (dosegment(m, vmp.get(), off, &load_addr) < 0)
-        return -1;
-      break;
-    default:
-      continue;
-    }
-  }
-
   if (doheap(vmp.get()) < 0)
     return -1;
 
@@ -277,7 +305,7 @@ load_image(proc *p, const char *path, const char * const *argv,
   // for usetup
   uintptr_t phdr = 0;
   if (load_addr != -1)
-    phdr = load_addr + elf->phoff;
+    phdr = load_addr + h->phoff;
 
   // Commit to the user image.
   if (p->vmap)
@@ -286,12 +314,12 @@ load_image(proc *p, const char *path, const char * const *argv,
     *oldvmap_out = std::move(p->vmap);
 
   p->vmap = vmp;
-  p->tf->rip = elf->entry;
+  p->tf->rip = h->entry;
   p->tf->rsp = sp;
   // Additional arguments.  We can't pass these in ABI argument
   // registers because the sysentry return path doesn't restore those.
   p->tf->r12 = phdr;         // AT_PHDR
-  p->tf->r13 = elf->phnum;   // AT_PHNUM
+  p->tf->r13 = h->phnum;     // AT_PHNUM
   p->run_cpuid_ = myid();
   p->data_cpuid = myid();
   memset(p->sig, 0, sizeof(p->sig));
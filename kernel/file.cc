@@ -11,11 +11,37 @@ struct devsw __mpalign__ devsw[NDEV];
 
 int
 file_mnode::fsync() {
+  int cpu = myid();
+  if (fsync_queue(cpu) < 0)
+    return -1;
+  rootfs_interface->flush_transaction_queue(cpu);
+  return 0;
+}
+
+// Queue the file's transactions like fsync(), but leave the commit to
+// the journal's commit work (or to an fsync_wait() that gets there
+// first).  The token is the journal's latest enqueued timestamp, which
+// covers the transactions just queued.
+int
+file_mnode::fsync_async(struct fsync_token *tok) {
+  int cpu = myid();
+  if (fsync_queue(cpu) < 0)
+    return -1;
+
+  journal *j = rootfs_interface->fs_journal[cpu];
+  tok->cpu = cpu;
+  tok->tsc = j->get_enqueued_tsc();
+  if (j->get_committed_tsc() < tok->tsc)
+    rootfs_interface->flush_transaction_queue_async(cpu);
+  return 0;
+}
+
+int
+file_mnode::fsync_queue(int cpu) {
 
   if (!m)
     return -1;
 
-  int cpu = myid();
   u64 fsync_tsc = get_tsc();
   rootfs_interface->process_metadata_log(fsync_tsc, m->mnum_, cpu);
 
@@ -23,8 +49,6 @@ file_mnode::fsync() {
     m->as_file()->sync_file(cpu);
   else if (m->type() == mnode::types::dir)
     m->as_dir()->sync_dir(cpu);
-
-  rootfs_interface->flush_transaction_queue(cpu);
   return 0;
 }
 
@@ -103,6 +103,11 @@ throw_out_of_blocks()
 
 // Allocate a disk block. This makes changes only to the in-memory
 // free-bit-vector (maintained by rootfs_interface), not the one on the disk.
+//
+// Free blocks on the disk hold stale data (boot doesn't flash them, and we
+// don't zero blocks when freeing them), so every allocated block must be
+// written out in full: callers that fill only part of the block pass
+// zero_on_alloc, and the zeroed buffer is what gets logged.
 static u32
 balloc(u32 dev, transaction *trans = NULL, bool zero_on_alloc = false)
 {
@@ -813,6 +818,46 @@ bmap(sref<inode> ip, u32 bn, transaction *trans = NULL, bool zero_on_alloc = fal
   return ap[bn % NINDIRECT];
 }
 
+// Return the disk block address of the nth block in inode ip, or 0 if the
+// block has not been allocated (a hole in the file). Unlike bmap(), this never
+// allocates.
+static u32
+bmap_lookup(sref<inode> ip, u32 bn)
+{
+  scoped_gc_epoch e;
+
+  if (bn < NDIRECT)
+    return ip->addrs[bn];
+  bn -= NDIRECT;
+
+  if (bn < NINDIRECT) {
+    if (ip->addrs[NDIRECT] == 0)
+      return 0;
+    sref<buf> bp = buf::get(ip->dev, ip->addrs[NDIRECT]);
+    auto copy = bp->read();
+    return ((const u32 *)copy->data)[bn];
+  }
+  bn -= NINDIRECT;
+
+  if (bn >= NINDIRECT * NINDIRECT)
+    panic("bmap_lookup: %d out of range", bn);
+
+  if (ip->addrs[NDIRECT+1] == 0)
+    return 0;
+  u32 addr;
+  {
+    sref<buf> fp = buf::get(ip->dev, ip->addrs[NDIRECT+1]);
+    auto copy = fp->read();
+    addr = ((const u32 *)copy->data)[bn / NINDIRECT];
+  }
+  if (addr == 0)
+    return 0;
+
+  sref<buf> sp = buf::get(ip->dev, addr);
+  auto copy = sp->read();
+  return ((const u32 *)copy->data)[bn % NINDIRECT];
+}
+
 // Caller must hold ilock for write. The caller must also arrange to invoke
 // iupdate() when suitable, to flush the new inode size to the disk.
 void
@@ -1033,14 +1078,18 @@ readi(sref<inode> ip, char *dst, u32 off, u32 n)
     n = ip->size - off;
 
   for (tot=0; tot<n; tot+=m, off+=m, dst+=m) {
-    try {
-      bp = buf::get(ip->dev, bmap(ip, off/BSIZE, NULL, true));
-    } catch (out_of_blocks& e) {
-      // Read operations should never cause out-of-blocks conditions
-      panic("readi: out of blocks");
-    }
     m = std::min(n - tot, BSIZE - off%BSIZE);
 
+    // Holes read as zeroes. Don't allocate blocks for them here: the
+    // allocation would not be logged in any transaction, and the block's
+    // on-disk contents are whatever it held when it was last freed.
+    u32 blocknum = bmap_lookup(ip, off/BSIZE);
+    if (!blocknum) {
+      memset(dst, 0, m);
+      continue;
+    }
+
+    bp = buf::get(ip->dev, blocknum);
     auto copy = bp->read();
     memmove(dst, copy->data + off%BSIZE, m);
   }
@@ -2,13 +2,15 @@
 #include "kernel.hh"
 #include "spinlock.hh"
 #include "cpputil.hh"
-#include "ns.hh"
 #include "errno.h"
 #include "condvar.hh"
 #include "proc.hh"
 #include "cpu.hh"
-#include "spercpu.hh"
+#include "numa.hh"
+#include "ilist.hh"
+#include "futex.h"
 #include "kmtrace.hh"
+#include <atomic>
 
 //
 // futexkey
@@ -18,18 +20,17 @@
 // on a user address, then another thread might unmap that
 // address.
 
-typedef u64* futexkey_t;
-
 u64
 futexkey_hash(futexkey_t const& key)
 {
-  return (u64)key;
+  u64 h = (u64)key >> 3;
+  return h ^ (h >> 9) ^ (h >> 18);
 }
 
 u64
 futexkey_val(futexkey_t const& key)
 {
-  return *key;
+  return *(volatile u64*)key;
 }
 
 int
@@ -47,222 +48,282 @@ futexkey(const u64* useraddr, vmap* vmap, futexkey_t* key)
 }
 
 //
-// nscache
+// futex table
+//
+// Waiters are queued in a hash table of buckets, each with its own
+// lock.  The table is sharded by NUMA node: a futex hashes into the
+// table of the node whose memory holds the futex word, so threads
+// sharing a futex mostly touch lines on that node, and futexes on
+// different nodes never share a bucket.
 //
-struct nscache {
-  struct spinlock lock_;
-  volatile u64 head_;
-  volatile u64 tail_;
-  xns<u32, proc*, proc::hash>* ns_[16];
-
-  nscache();
-  xns<u32, proc*, proc::hash>* alloc();
-  bool cache(xns<u32, proc*, proc::hash>* ns);
 
-  NEW_DELETE_OPS(nscache);
+enum { FUTEX_BUCKETS = 256 };   // Per NUMA node
+
+// A thread blocked in futexwait.  It lives on the waiter's stack.
+struct futexwaiter {
+  // The futex being waited on.  Requeue changes it while holding the
+  // locks of the old and new buckets, so it can be read without a
+  // lock only to find the bucket to lock.
+  std::atomic<futexkey_t> key;
+  const u64 bitset;
+  proc* const p;
+  bool queued;                  // Protected by key's bucket lock
+  ilink<futexwaiter> link;
+
+  futexwaiter(futexkey_t key, u64 bitset, proc *p)
+    : key(key), bitset(bitset), p(p), queued(false) {}
 };
 
-// XXX(austin) If we used percpu_safety::cli here, would nscache no
-// longer need the lock?
-DEFINE_PERCPU(nscache, nscache_, NO_CRITICAL);
+struct futexbucket {
+  spinlock lock;
+  ilist<futexwaiter, &futexwaiter::link> waiters;
 
-nscache::nscache(void)
-  : lock_("nscache::lock_", LOCKSTAT_FUTEX), head_(0), tail_(0)
-{
-}
+  futexbucket() : lock("futexbucket::lock", LOCKSTAT_FUTEX) {}
+} __mpalign__;
 
-xns<u32, proc*, proc::hash>*
-nscache::alloc(void)
-{
-  xns<u32, proc*, proc::hash>* ns = nullptr;
-  
-  acquire(&lock_);
-  if (head_ - tail_ > 0) {
-    u64 i = tail_%NELEM(ns_);
-    ++tail_;
-    ns = ns_[i];
-  }
-  release(&lock_);
-  return ns;
-}
+static futexbucket* futextab[MAX_NUMA_NODES];
 
-bool
-nscache::cache(xns<u32, proc*, proc::hash>* ns)
+static futexbucket*
+futexbucket_of(futexkey_t key)
 {
-  bool cached = false;
-
-  acquire(&lock_);
-  if (head_ - tail_ < NELEM(ns_)) {
-    u64 i = head_%NELEM(ns_);
-    ++head_;
-    ns_[i] = ns;
-    cached = true;
-  }
-  release(&lock_);
-  return cached;
+  numa_node *node = numa_node_of(key);
+  futexbucket *tab = futextab[node ? node->id : 0];
+  return &tab[futexkey_hash(key) % FUTEX_BUCKETS];
 }
 
-//
-// futexaddr
-//
-struct futexaddr : public referenced, public rcu_freed
-{
-  static futexaddr* alloc(futexkey_t key);
+// Lock the buckets of two futexes in a fixed order, so concurrent
+// requeues between them cannot deadlock.
+class futexlock2 {
+  futexbucket *a_, *b_;
 
-  virtual void do_gc() override;
-  virtual void onzero() override;
+public:
+  futexlock2(futexbucket *a, futexbucket *b)
+    : a_(a < b ? a : b), b_(a < b ? b : a)
+  {
+    acquire(&a_->lock);
+    if (b_ != a_)
+      acquire(&b_->lock);
+  }
 
-  futexkey_t key_;
-  bool inserted_;
-  xns<u32, proc*, proc::hash>* const nspid_;
+  ~futexlock2()
+  {
+    if (b_ != a_)
+      release(&b_->lock);
+    release(&a_->lock);
+  }
 
-private:
-  futexaddr(futexkey_t key, xns<u32, proc*, proc::hash>* nspid);
-  NEW_DELETE_OPS(futexaddr);
+  futexlock2(const futexlock2 &) = delete;
+  futexlock2 &operator=(const futexlock2 &) = delete;
 };
 
-xns<futexkey_t, futexaddr*, futexkey_hash> *nsfutex __mpalign__;
-
-futexaddr*
-futexaddr::alloc(futexkey_t key)
+// Remove w from b, which the caller has locked, and wake its thread.
+// Holding the bucket lock keeps w alive: the waiter cannot return
+// from futexwait until it has locked the bucket to unqueue itself.
+static void
+futexdequeue_wake(futexbucket *b, futexwaiter *w)
 {
-  xns<u32, proc*, proc::hash>* nspid;
-  futexaddr* fa;
-
-  nspid = nscache_->alloc();
-  if (nspid == nullptr)
-    nspid = new xns<u32, proc*, proc::hash>(false);
-
-  if (nspid == nullptr)
-    return nullptr;
-  fa = new futexaddr(key, nspid);
-  if (fa == nullptr) {
-    delete nspid;
-    return nullptr;
-  }
+  b->waiters.erase(b->waiters.iterator_to(w));
+  w->queued = false;
 
-  return fa;
+  proc *p = w->p;
+  acquire(&p->futex_lock);
+  p->cv->wake_all();
+  release(&p->futex_lock);
 }
 
-futexaddr::futexaddr(futexkey_t key, xns<u32, proc*, proc::hash>* nspid)
-  : rcu_freed("futexaddr", this, sizeof(*this)),
-    key_(key), inserted_(false), nspid_(nspid)
+// Remove w from whichever bucket it is queued on, if it is still
+// queued after a timeout or an unrelated wakeup.
+static void
+futexunqueue(futexwaiter *w)
 {
+  for (;;) {
+    futexkey_t key = w->key.load(std::memory_order_relaxed);
+    futexbucket *b = futexbucket_of(key);
+    scoped_acquire l(&b->lock);
+    if (w->key.load(std::memory_order_relaxed) != key)
+      continue;                 // Requeued meanwhile
+    if (w->queued) {
+      b->waiters.erase(b->waiters.iterator_to(w));
+      w->queued = false;
+    }
+    return;
+  }
 }
 
-void
-futexaddr::do_gc(void)
+long
+futexwait(futexkey_t key, u64 val, u64 timer, u64 bitset)
 {
-  delete this;
+  proc *p = myproc();
+  futexbucket *b = futexbucket_of(key);
+  futexwaiter w(key, bitset, p);
+
+  if (bitset == 0)
+    return -1;
+
+  mtwriteavar("futex:%p", key);
+  acquire(&b->lock);
+  if (futexkey_val(key) != val) {
+    release(&b->lock);
+    return -EWOULDBLOCK;
+  }
+  b->waiters.push_back(&w);
+  w.queued = true;
+  // Wakers take the bucket lock and then futex_lock, so holding
+  // futex_lock from here until we sleep closes the window in which a
+  // wakeup could be lost.
+  acquire(&p->futex_lock);
+  release(&b->lock);
+
+  auto cleanup = scoped_cleanup([&w, p](){
+    release(&p->futex_lock);
+    futexunqueue(&w);
+  });
+
+  u64 nsecto = timer == 0 ? 0 : timer+nsectime();
+  p->cv->sleep_to(&p->futex_lock, nsecto);
+  return 0;
 }
 
-void
-futexaddr::onzero(void)
+long
+futexwake(futexkey_t key, u64 nwake, u64 bitset)
 {
-  if (inserted_)
-    assert(nsfutex->remove(key_, nullptr));
-  // Normally deallocate members in the destructor, but in this case
-  // we don't want to wait for the gc to fill the cache
-  if (!nscache_->cache(nspid_))
-    delete nspid_;
-  gc_delayed((futexaddr*)this);
+  futexbucket *b = futexbucket_of(key);
+  u64 nwoke = 0;
+
+  if (nwake == 0 || bitset == 0)
+    return -1;
+
+  mtwriteavar("futex:%p", key);
+  scoped_acquire l(&b->lock);
+  for (auto it = b->waiters.begin(); it != b->waiters.end() && nwoke < nwake; ) {
+    futexwaiter *w = &*it++;
+    if (w->key.load(std::memory_order_relaxed) != key || !(w->bitset & bitset))
+      continue;
+    futexdequeue_wake(b, w);
+    ++nwoke;
+  }
+  return nwoke;
 }
 
 long
-futexwait(futexkey_t key, u64 val, u64 timer)
+futexrequeue(futexkey_t key, u64 nwake, u64 nrequeue, futexkey_t key2,
+             bool cmp, u64 cmpval)
 {
-  futexaddr* fa;
+  futexbucket *b = futexbucket_of(key);
+  futexbucket *b2 = futexbucket_of(key2);
+  u64 nwoke = 0, nmoved = 0;
+
+  mtwriteavar("futex:%p", key);
+  mtwriteavar("futex:%p", key2);
+  futexlock2 l(b, b2);
+  if (cmp && futexkey_val(key) != cmpval)
+    return -EWOULDBLOCK;
 
-  mtreadavar("futex:ns:%p", key);
-  {
-    scoped_gc_epoch gc;
-  again:
-    fa = nsfutex->lookup(key);
-    if (fa == nullptr) {
-      fa = futexaddr::alloc(key);
-      if (fa == nullptr) {
-        cprintf("futexwait futexaddr::alloc failed\n");
-        return -1;
+  for (auto it = b->waiters.begin(); it != b->waiters.end(); ) {
+    futexwaiter *w = &*it++;
+    if (w->key.load(std::memory_order_relaxed) != key)
+      continue;
+    if (nwoke < nwake) {
+      futexdequeue_wake(b, w);
+      ++nwoke;
+    } else if (nmoved < nrequeue) {
+      if (b2 != b) {
+        b->waiters.erase(b->waiters.iterator_to(w));
+        b2->waiters.push_back(w);
       }
-      if (!nsfutex->insert(key, fa)) {
-        fa->dec();
-        goto again;
-      }
-      mtwriteavar("futex:ns:%p", key);
-      fa->inserted_ = true;
+      w->key.store(key2, std::memory_order_relaxed);
+      ++nmoved;
     } else {
-      if (!fa->tryinc()) {
-        goto again;
-      }
+      break;
     }
   }
-  assert(fa->key_ == key);
-  mtwriteavar("futex:%p.%p", key, fa);
-
-  acquire(&myproc()->futex_lock);  
-  auto cleanup = scoped_cleanup([&fa](){
-    release(&myproc()->futex_lock);
-    fa->dec();
-  });
+  return nwoke + nmoved;
+}
 
-  // This first check is an optimization
-  if (futexkey_val(fa->key_) != val)
-    return -EWOULDBLOCK;
+// Atomically apply the operation encoded in op by FUTEX_OP to the
+// user word at uaddr, and return whether its old value passes the
+// encoded comparison, or -1 if uaddr cannot be written.
+static int
+futexop(const u64* uaddr, u64 op)
+{
+  u64 fop = (op >> 28) & 0xf;
+  u64 cmp = (op >> 24) & 0xf;
+  u64 oparg = (op >> 12) & 0xfff;
+  u64 cmparg = op & 0xfff;
+  u64 old, nval;
+
+  if (fop & FUTEX_OP_OPARG_SHIFT) {
+    fop &= ~FUTEX_OP_OPARG_SHIFT;
+    if (oparg >= 64)
+      return -1;
+    oparg = 1ull << oparg;
+  }
 
-  if (!fa->nspid_->insert(myproc()->pid, myproc()))
+  if (fetchint64((uptr)uaddr, &old) < 0)
     return -1;
-
-  if (futexkey_val(fa->key_) != val) {
-    fa->nspid_->remove(myproc()->pid, nullptr);
-    return -EWOULDBLOCK;
+  for (;;) {
+    switch (fop) {
+    case FUTEX_OP_SET:  nval = oparg; break;
+    case FUTEX_OP_ADD:  nval = old + oparg; break;
+    case FUTEX_OP_OR:   nval = old | oparg; break;
+    case FUTEX_OP_ANDN: nval = old & ~oparg; break;
+    case FUTEX_OP_XOR:  nval = old ^ oparg; break;
+    default:            return -1;
+    }
+    // On failure, old is updated to the word's current value.
+    int r = cmpxchgint64((uptr)uaddr, &old, nval);
+    if (r < 0)
+      return -1;
+    if (r == 0)
+      break;
   }
 
-  u64 nsecto = timer == 0 ? 0 : timer+nsectime();
-  myproc()->cv->sleep_to(&myproc()->futex_lock, nsecto);
-
-  assert(fa->nspid_->remove(myproc()->pid, nullptr));
-  return 0;
+  switch (cmp) {
+  case FUTEX_OP_CMP_EQ: return old == cmparg;
+  case FUTEX_OP_CMP_NE: return old != cmparg;
+  case FUTEX_OP_CMP_LT: return old < cmparg;
+  case FUTEX_OP_CMP_LE: return old <= cmparg;
+  case FUTEX_OP_CMP_GT: return old > cmparg;
+  case FUTEX_OP_CMP_GE: return old >= cmparg;
+  default:              return -1;
+  }
 }
 
 long
-futexwake(futexkey_t key, u64 nwake)
+futexwakeop(futexkey_t key, u64 nwake, const u64* uaddr2, futexkey_t key2,
+            u64 nwake2, u64 op)
 {
-  futexaddr* fa;
-  u64 nwoke = 0;
-
-  if (nwake == 0)
+  // Apply the operation before taking any bucket lock, since it may
+  // fault.  A waiter on key2 checks its value and queues atomically
+  // under the bucket lock, so it either saw the old value and is
+  // queued by the time we wake below, or it sees the new value.
+  int cmp = futexop(uaddr2, op);
+  if (cmp < 0)
     return -1;
 
-  mtreadavar("futex:ns:%p", key);
-  {
-    scoped_gc_epoch gc;
-    fa = nsfutex->lookup(key);
-    if (fa == nullptr || !fa->tryinc())
-      return 0;
-  }
-
-  auto cleanup = scoped_cleanup([&fa](){
-    fa->dec();
-  });
-  mtwriteavar("futex:%p.%p", key, fa);
-
-  fa->nspid_->enumerate([&nwoke, &nwake](u32 pid, proc* p) {
-    acquire(&p->futex_lock);
-    p->cv->wake_all();
-    release(&p->futex_lock);
-    ++nwoke;
-    if (nwoke >= nwake)
-      return 1;
-    return 0;
-  });
-
-  return 0;
+  long nwoke = 0;
+  if (nwake)
+    nwoke += futexwake(key, nwake, FUTEX_BITSET_MATCH_ANY);
+  if (cmp && nwake2)
+    nwoke += futexwake(key2, nwake2, FUTEX_BITSET_MATCH_ANY);
+  return nwoke;
 }
 
 void
 initfutex(void)
 {
-  nsfutex = new xns<futexkey_t, futexaddr*, futexkey_hash>(false);
-  if (nsfutex == 0)
-    panic("initfutex");
+  size_t ntabs = numa_nodes.empty() ? 1 : numa_nodes.size();
+  for (size_t i = 0; i < ntabs; i++) {
+    // Allocate each node's table from that node's memory.
+    int cpu = -1;
+    if (i < numa_nodes.size() && !numa_nodes[i].cpuids.empty())
+      cpu = numa_nodes[i].cpuids[0];
+    void *mem = kalloc("futextab", FUTEX_BUCKETS * sizeof(futexbucket), cpu);
+    if (mem == nullptr)
+      panic("initfutex");
+    futexbucket *tab = (futexbucket*)mem;
+    for (int j = 0; j < FUTEX_BUCKETS; j++)
+      new (&tab[j]) futexbucket();
+    futextab[i] = tab;
+  }
 }
@@ -12,6 +12,7 @@
 #include "mtrace.h"
 #include "file.hh"
 #include "uk/gcstat.h"
+#include "work.hh"
 
 using std::atomic;
 
@@ -60,7 +61,6 @@ struct gc_state {
   atomic<u64> cur_epoch;        // the current epoch this core is running in
   atomic<u64> global_min;       // used to compute global_min over nexttofree
   struct spinlock lock_ __mpalign__;
-  struct condvar cv;
   headinfo delayed[NEPOCH];     // NEPOCH delayed-free lists
   gc_handle proclist;           // list of process in an epoch on this core
 public:
@@ -150,7 +150,7 @@ gc_state::inc_cur_epoch(void)
 }
 
 gc_state::gc_state() :
-  lock_("gc_state", LOCKSTAT_GC), cv(condvar("gc_cv"))
+  lock_("gc_state", LOCKSTAT_GC)
 {
   proclist.next = &proclist;
   proclist.prev = &proclist;
@@ -213,7 +213,7 @@ gc_state::gc_free(rcu_freed *r, u64 epoch)
 }
 
 // Caller must hold lock_.  This function cannot be called recursively,
-// but it won't if only gc_worker() runs do_gc.
+// but it won't if only gc_work runs do_gc.
 void
 gc_state::do_gc(void)
 {
@@ -246,27 +246,30 @@ gc_state::do_gc(void)
   else inc_cur_epoch();
 }
 
-static void
-gc_worker(void *x)
+// Runs a core's garbage collection every GCINTERVAL, or sooner when
+// woken by gc_wakeup or a full batch of delayed frees.
+struct gc_work : public dwork
 {
-  if (VERBOSE)
-    cprintf("gc_worker: %d\n", mycpu()->id);
-
-  acquire(&gc_states->lock_);
-  for (;;) {
-    gc_states->cv.sleep_to(&gc_states->lock_,
-                          nsectime() + ((u64)GCINTERVAL)*1000000ull);
-
-    // if no processes are running on this core, update min_epoch
-    if (gc_states->proclist.next == &gc_states->proclist) {
-      gc_states->min_epoch = gc_global ? global_epoch.load() :
-        gc_states->cur_epoch.load();
+  virtual void run() override
+  {
+    {
+      scoped_acquire l(&gc_states->lock_);
+
+      // if no processes are running on this core, update min_epoch
+      if (gc_states->proclist.next == &gc_states->proclist) {
+        gc_states->min_epoch = gc_global ? global_epoch.load() :
+          gc_states->cur_epoch.load();
+      }
+
+      gc_states->do_gc();
     }
-
-    gc_states->do_gc();
-
+    dwork_delay(this, myid(), GCINTERVAL);
   }
-}
+} __mpalign__;
+
+// Not in gc_state because initgc arms every CPU's timer before the
+// other CPUs boot and construct their per-CPU variables.
+static gc_work gc_works[NCPU];
 
 static int
 readstat(mdev*, char *dst, u32 off, u32 n)
@@ -314,11 +317,8 @@ initgc(void)
   devsw[MAJ_GC].write = writectrl;
   devsw[MAJ_GC].pread = readstat;
 
-  for (int c = 0; c < ncpu; c++) {
-    char namebuf[32];
-    snprintf(namebuf, sizeof(namebuf), "gc_%u", c);
-    threadpin(gc_worker, 0, namebuf, c);
-  }
+  for (int c = 0; c < ncpu; c++)
+    dwork_delay(&gc_works[c], c, GCINTERVAL);
 }
 
 void
@@ -399,16 +399,15 @@ gc_end_epoch(void)
     stat[c].lastwake = stat[c].ndelay;
     // calling gs->do_gc() works for gcbench, because gcbench threads are pinned
     // to a core.  do_gc is correct when it uses one core's gc_state, so better
-    // to wakeup this core's gc thread, and yield the core to it.
-    gs->cv.wake_all(true);
+    // to queue this core's gc work, and yield the core to its dwork thread.
+    dwork_queue(&gc_works[c], c);
+    myproc()->yield_ = true;
   }
 }
 
 void
 gc_wakeup(void)
 {
-  // cprintf("%d: wakeup gcc thread\n", mycpu()->id);
-  for (int i = 0; i < ncpu; i++) {
-    gc_states[i].cv.wake_all();
-  }
+  for (int i = 0; i < ncpu; i++)
+    dwork_queue(&gc_works[i], i);
 }
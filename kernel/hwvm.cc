@@ -525,20 +525,22 @@ core_tracking_shootdown::cache_tracker::track_switch_from() const
 }
 
 void
-core_tracking_shootdown::clear_tlb() const
+flush_tlb_ranges(const shootdown_ranges &ranges)
 {
-  if (end_ > start_ && end_ - start_ > 4 * PGSIZE) {
+  if (ranges.pages() > TLB_FLUSH_THRESHOLD) {
+    kstats::inc(&kstats::tlb_full_flush_count);
     lcr3(rcr3());
   } else {
-    for (uintptr_t va = start_; va < end_; va += PGSIZE)
-      invlpg((void*) va);
+    for (auto &r : ranges)
+      for (uintptr_t va = r.start; va < r.end; va += PGSIZE)
+        invlpg((void*) va);
   }
 }
 
 void
 core_tracking_shootdown::perform() const
 {
-  if (!t_ || start_ >= end_)
+  if (!t_ || ranges_.empty())
     return;
 
   // Ensure that cache invalidations happen before reading the tracker;
@@ -549,7 +551,7 @@ core_tracking_shootdown::perform() const
   {
     scoped_cli cli;
     if (targets[myid()]) {
-      clear_tlb();
+      flush_tlb_ranges(ranges_);
       targets.reset(myid());
     }
   }
@@ -560,7 +562,7 @@ core_tracking_shootdown::perform() const
   kstats::inc(&kstats::tlb_shootdown_count);
   kstats::inc(&kstats::tlb_shootdown_targets, targets.count());
   kstats::timer timer(&kstats::tlb_shootdown_cycles);
-  run_on_cpus(targets, [this]() { clear_tlb(); });
+  run_on_cpus(targets, [this]() { flush_tlb_ranges(ranges_); });
 }
 
 namespace mmu_shared_page_table {
@@ -654,7 +656,7 @@ namespace mmu_per_core_page_table {
   }
 
   void
-  page_map_cache::clear(uintptr_t start, uintptr_t end)
+  page_map_cache::clear(const shootdown_ranges &ranges)
   {
     // Are we the current page_map_cache on this core?  (Depending on
     // MMU_SCHEME, *cur_page_map_cache may not be this type of
@@ -667,13 +669,23 @@ namespace mmu_per_core_page_table {
     // inserted something into it previously.  (Note that this may
     // not hold if we start tracking shootdowns conservatively.)
     assert(mypml4);
-    for (auto it = mypml4->find(start); it.index() < end; it += it.span()) {
-      if (it.is_set()) {
-        it->store(0, memory_order_relaxed);
-        if (current)
-          invlpg((void*)it.index());
+    // Past TLB_FLUSH_THRESHOLD pages, one full flush is cheaper than
+    // an invlpg per page.
+    bool flush_all = current && ranges.pages() > TLB_FLUSH_THRESHOLD;
+    for (auto &r : ranges) {
+      for (auto it = mypml4->find(r.start); it.index() < r.end;
+           it += it.span()) {
+        if (it.is_set()) {
+          it->store(0, memory_order_relaxed);
+          if (current && !flush_all)
+            invlpg((void*)it.index());
+        }
       }
     }
+    if (flush_all) {
+      kstats::inc(&kstats::tlb_full_flush_count);
+      lcr3(rcr3());
+    }
   }
 
   void
@@ -685,12 +697,12 @@ namespace mmu_per_core_page_table {
     // tracker), but it would probably require more communication.
     if (targets.none())
       return;
-    assert(start < end && end <= USERTOP);
+    assert(!ranges.empty());
     kstats::inc(&kstats::tlb_shootdown_count);
     kstats::inc(&kstats::tlb_shootdown_targets, targets.count());
     kstats::timer timer(&kstats::tlb_shootdown_cycles);
     run_on_cpus(targets, [this]() {
-        cache->clear(start, end);
+        cache->clear(ranges);
       });
   }
 }
@@ -12,6 +12,7 @@
 #include "benchcodex.hh"
 #include "cpuid.hh"
 #include "ilist.hh"
+#include "work.hh"
 
 struct idle {
   struct proc *cur;
@@ -77,7 +78,7 @@ idleloop(void)
     myproc()->set_state(RUNNABLE);
     sched();
     finishzombies();
-    if (steal() == 0) {
+    if (!dwork_run_idle() && steal() == 0) {
         // XXX(Austin) This will prevent us from immediately picking
         // up work that's trying to push itself to this core (pinned
         // thread).  Use an IPI to poke idle cores.
@@ -22,6 +22,7 @@
 #include "file.hh"
 #include "major.h"
 #include "heapprof.hh"
+#include "swap.hh"
 
 #include <algorithm>
 #include <iterator>
@@ -354,6 +355,7 @@ struct memory {
       return (char*)res;
     } else {
       cprintf("kalloc: out of memory\n");
+      swap_note_pressure();
       return nullptr;
     }
   }
@@ -795,6 +797,7 @@ kalloc(const char *name, size_t size, int cpu)
     return (char*)res;
   } else {
     cprintf("kalloc: out of memory\n");
+    swap_note_pressure();
     if (KERNEL_HEAP_PROFILE)
       heap_profile_print(&console);
     return nullptr;
@@ -821,6 +824,34 @@ node_usable_map(const numa_node &node)
   return node_mem;
 }
 
+numa_node *
+numa_node_of(const void *va)
+{
+  paddr pa = v2p(const_cast<void*>(va));
+  for (auto &node : numa_nodes)
+    for (auto &reg : node.mems)
+      if (reg.base <= pa && pa - reg.base < reg.length)
+        return &node;
+  return nullptr;
+}
+
+bool
+numa_is_local(const void *va)
+{
+  return numa_node_of(va) == mycpu()->node;
+}
+
+int
+numa_interleave_cpu(uint64_t idx)
+{
+  if (numa_nodes.empty())
+    return -1;
+  auto &node = numa_nodes[idx % numa_nodes.size()];
+  if (node.cpuids.empty())
+    return -1;
+  return node.cpuids[(idx / numa_nodes.size()) % node.cpuids.size()];
+}
+
 // Assign per-CPU memory from each CPU's NUMA node.
 void
 initpercpu(void)
@@ -16,7 +16,10 @@
 #include "page_info.hh"
 #include "heapprof.hh"
 #include "numa.hh"
+#include "kstats.hh"
 
+#include <algorithm>
+#include <initializer_list>
 #include <type_traits>
 
 // allocate in power-of-two sizes up to 2^KMMAX (PGSIZE)
@@ -26,6 +29,371 @@ struct header {
   struct header *next;
 };
 
+// Carve a fresh page from cpu's memory into objects of size bytes
+// and return it, or nullptr if we're out of memory.  *first is set to
+// the address of the first object.
+static char *
+carve_page(size_t size, int cpu, char **first)
+{
+  char *p = kalloc("kmalloc", PGSIZE, cpu);
+  if(p == 0)
+    return nullptr;
+
+  if (ALLOC_MEMSET)
+    memset(p, 3, PGSIZE);
+
+#if RANDOMIZE_KMALLOC
+#if CODEX
+  u8 r = rnd() % 11;
+#else
+  u8 r = rdtsc() % 11;
+#endif
+#else
+  u8 r = 0;
+#endif
+
+  // Don't let the offset leave us without a single object
+  while (r && CACHELINE * r + size > PGSIZE)
+    r--;
+
+  assert(size >= sizeof(header));
+  *first = p + CACHELINE * r;
+  return p;
+}
+
+// Check that a free object was not written to since it was freed and
+// fill it with junk.
+static void
+check_free(void *p, size_t size)
+{
+  if (ALLOC_MEMSET) {
+    // Ignore the link word, which is in use for objects on a depot's
+    // loose list.
+    char* chk = (char*)p + sizeof(struct header);
+    for (int i = 0; i < size-sizeof(struct header); i++)
+      if (chk[i] != 3) {
+        console.print(shexdump(chk, size));
+        panic("kmalloc: free memory was overwritten %p+%x", chk, i);
+      }
+    memset(p, 4, size);
+  }
+}
+
+//
+// Magazines and depots
+//
+
+// Empty magazines are carved out of whole pages and are never
+// returned to the page allocator.
+static spinlock magazine_lock("kmem_magazine");
+static kmem_magazine *free_magazines;
+
+static kmem_magazine *
+magazine_new(void)
+{
+  kmem_magazine *m;
+  {
+    scoped_acquire guard(&magazine_lock);
+    if ((m = free_magazines) != nullptr) {
+      free_magazines = m->next;
+      m->next = nullptr;
+      m->nrounds = 0;
+      return m;
+    }
+  }
+
+  char *p = kalloc("kmem_magazine");
+  if (!p)
+    return nullptr;
+  static_assert(PGSIZE % sizeof(kmem_magazine) == 0,
+                "kmem_magazine does not evenly divide a page");
+  m = (kmem_magazine*)p;
+  scoped_acquire guard(&magazine_lock);
+  for (kmem_magazine *x = m + 1; (char*)(x + 1) <= p + PGSIZE; x++) {
+    x->next = free_magazines;
+    free_magazines = x;
+  }
+  m->next = nullptr;
+  m->nrounds = 0;
+  return m;
+}
+
+// Return an empty magazine, preferring one from depot d.  Interrupts
+// may be disabled.
+static kmem_magazine *
+depot_get_empty(kmem_depot *d)
+{
+  {
+    scoped_acquire guard(&d->lock);
+    kmem_magazine *m = d->empty;
+    if (m) {
+      d->empty = m->next;
+      d->nempty--;
+      return m;
+    }
+  }
+  return magazine_new();
+}
+
+// Grow depot d by one page of objects of size bytes allocated from
+// cpu's memory.  Returns 0 on success, -1 if we're out of memory.
+static int
+depot_grow(kmem_depot *d, size_t size, int cpu)
+{
+  char *first;
+  char *p = carve_page(size, cpu, &first);
+  if (!p)
+    return -1;
+  kstats::inc(&kstats::kmalloc_depot_grow_count);
+
+  // Fill as many magazines as the page needs.  Any objects we can't
+  // find a magazine for go on the depot's loose list.
+  kmem_magazine *chain = nullptr;
+  header *loose = nullptr;
+  u64 nmag = 0;
+  for (char *q = first; q + size <= p + PGSIZE; q += size) {
+    if (!loose && (!chain || chain->nrounds == KMMAG_ROUNDS)) {
+      kmem_magazine *m = depot_get_empty(d);
+      if (m) {
+        m->next = chain;
+        chain = m;
+        nmag++;
+      }
+    }
+    if (chain && chain->nrounds < KMMAG_ROUNDS) {
+      chain->rounds[chain->nrounds++] = q;
+    } else {
+      header *h = (header*)q;
+      h->next = loose;
+      loose = h;
+    }
+  }
+
+  scoped_acquire guard(&d->lock);
+  while (chain) {
+    kmem_magazine *m = chain;
+    chain = m->next;
+    m->next = d->full;
+    d->full = m;
+  }
+  d->nfull += nmag;
+  while (loose) {
+    header *h = loose;
+    loose = h->next;
+    h->next = (header*)d->loose;
+    d->loose = h;
+  }
+  return 0;
+}
+
+// Allocate an object of size bytes through CPU cache cc, exchanging
+// magazines with depot d as necessary.  Interrupts must be disabled.
+static void *
+magazine_alloc(kmem_cpu_cache *cc, kmem_depot *d, size_t size)
+{
+  for (;;) {
+    kmem_magazine *m = cc->loaded;
+    if (m && m->nrounds)
+      return m->rounds[--m->nrounds];
+    if (cc->previous && cc->previous->nrounds) {
+      std::swap(cc->loaded, cc->previous);
+      continue;
+    }
+
+    // Both of our magazines are empty.  Trade one for a full
+    // magazine from the depot.
+    {
+      scoped_acquire guard(&d->lock);
+      if (d->full) {
+        kmem_magazine *full = d->full;
+        d->full = full->next;
+        d->nfull--;
+        if (cc->previous) {
+          cc->previous->next = d->empty;
+          d->empty = cc->previous;
+          d->nempty++;
+        }
+        cc->previous = cc->loaded;
+        cc->loaded = full;
+        kstats::inc(&kstats::kmalloc_depot_get_count);
+        continue;
+      }
+      if (d->loose) {
+        header *h = (header*)d->loose;
+        d->loose = h->next;
+        return h;
+      }
+    }
+
+    if (depot_grow(d, size, myid()) < 0)
+      return nullptr;
+  }
+}
+
+// Free p through CPU cache cc, exchanging magazines with depot d as
+// necessary.  Interrupts must be disabled.
+static void
+magazine_free(kmem_cpu_cache *cc, kmem_depot *d, void *p)
+{
+  for (;;) {
+    kmem_magazine *m = cc->loaded;
+    if (m && m->nrounds < KMMAG_ROUNDS) {
+      m->rounds[m->nrounds++] = p;
+      return;
+    }
+    if (cc->previous && cc->previous->nrounds < KMMAG_ROUNDS) {
+      std::swap(cc->loaded, cc->previous);
+      continue;
+    }
+
+    // Both of our magazines are full.  Hand one to the depot and
+    // trade it for an empty one.
+    kmem_magazine *empty = depot_get_empty(d);
+    scoped_acquire guard(&d->lock);
+    if (cc->previous) {
+      cc->previous->next = d->full;
+      d->full = cc->previous;
+      d->nfull++;
+      cc->previous = nullptr;
+      kstats::inc(&kstats::kmalloc_depot_put_count);
+    }
+    if (!empty) {
+      // Out of memory for magazines.  Put p on the loose list, where
+      // it will still be found by the next depot refill.
+      header *h = (header*)p;
+      h->next = (header*)d->loose;
+      d->loose = h;
+      return;
+    }
+    cc->previous = cc->loaded;
+    cc->loaded = empty;
+  }
+}
+
+// Return the depot for cpu's NUMA node from depots, an array with one
+// depot per node.  Depots are per node so that a CPU refilling its
+// magazines, or allocating on behalf of another CPU, gets objects
+// carved from memory on that CPU's node.
+static kmem_depot *
+node_depot(kmem_depot *depots, int cpu)
+{
+  numa_node *node = cpus[cpu].node;
+  return &depots[node ? node->id : 0];
+}
+
+// Allocate an object of size bytes directly from depot d, growing it
+// from cpu's memory if necessary.  This is used for allocations on
+// behalf of a CPU other than our own, whose magazines we can't touch.
+static void *
+depot_alloc(kmem_depot *d, size_t size, int cpu)
+{
+  for (;;) {
+    {
+      scoped_acquire guard(&d->lock);
+      kmem_magazine *m = d->full;
+      if (m) {
+        void *p = m->rounds[--m->nrounds];
+        if (m->nrounds == 0) {
+          d->full = m->next;
+          d->nfull--;
+          m->next = d->empty;
+          d->empty = m;
+          d->nempty++;
+        }
+        return p;
+      }
+      if (d->loose) {
+        header *h = (header*)d->loose;
+        d->loose = h->next;
+        return h;
+      }
+    }
+
+    if (depot_grow(d, size, cpu) < 0)
+      return nullptr;
+  }
+}
+
+// Return both of cc's magazines to depot d.  Interrupts must be
+// disabled.
+static void
+magazine_flush(kmem_cpu_cache *cc, kmem_depot *d)
+{
+  scoped_acquire guard(&d->lock);
+  for (kmem_magazine *m : {cc->loaded, cc->previous}) {
+    if (!m)
+      continue;
+    if (m->nrounds) {
+      m->next = d->full;
+      d->full = m;
+      d->nfull++;
+    } else {
+      m->next = d->empty;
+      d->empty = m;
+      d->nempty++;
+    }
+  }
+  cc->loaded = cc->previous = nullptr;
+}
+
+kmem_cache::kmem_cache(const char *name, size_t size)
+  : name_(name)
+{
+  // Keep objects naturally aligned for anything up to a 16 byte type.
+  size_ = (std::max(size, sizeof(header)) + 15) & ~(size_t)15;
+  assert(size_ <= PGSIZE / 2);
+  for (auto &d : depots_)
+    d.lock = spinlock("kmem_cache depot");
+}
+
+void *
+kmem_cache::alloc()
+{
+  void *p;
+  {
+    scoped_cli cli;
+    p = magazine_alloc(&*cpus_, node_depot(depots_, myid()), size_);
+  }
+  if (!p) {
+    cprintf("kmem_cache_alloc(%s) failed\n", name_);
+    return nullptr;
+  }
+  check_free(p, size_);
+  mtlabel(mtrace_label_heap, p, size_, name_, strlen(name_));
+  return p;
+}
+
+void
+kmem_cache::free(void *p)
+{
+  mtunlabel(mtrace_label_heap, p);
+  if (ALLOC_MEMSET)
+    memset(p, 3, size_);
+  scoped_cli cli;
+  magazine_free(&*cpus_, node_depot(depots_, myid()), p);
+}
+
+//
+// kmalloc
+//
+
+#if KMALLOC_MAGAZINES
+struct kmcpu {
+  kmem_cpu_cache buckets[KMMAX+1];
+};
+
+DEFINE_PERCPU(struct kmcpu, kmcpus, NO_INT);
+
+static kmem_depot kmdepots[KMMAX+1][MAX_NUMA_NODES];
+
+void
+kminit(void)
+{
+  for (int b = 0; b < KMMAX+1; b++)
+    for (auto &d : kmdepots[b])
+      d.lock = spinlock("kmalloc depot");
+}
+#else
 struct bucket {
   spinlock lock;
   header* hdr;
@@ -57,27 +425,14 @@ kminit(void)
 static int
 morecore(int c, int b)
 {
-  char *p = kalloc("kmalloc", PGSIZE, c);
+  int sz = 1 << b;
+  char *q;
+  char *p = carve_page(sz, c, &q);
   if(p == 0)
     return -1;
 
-  if (ALLOC_MEMSET)
-    memset(p, 3, PGSIZE);
-
-#if RANDOMIZE_KMALLOC
-#if CODEX
-  u8 r = rnd() % 11;
-#else
-  u8 r = rdtsc() % 11;
-#endif
-#else
-  u8 r = 0;
-#endif
-
-  int sz = 1 << b;
-  assert(sz >= sizeof(header));
   scoped_acquire guard(&freelists[c].buckets[b].lock);
-  for(char *q = p + CACHELINE * r; q + sz <= p + PGSIZE; q += sz){
+  for(; q + sz <= p + PGSIZE; q += sz){
     struct header *h = (struct header *) q;
     h->next = freelists[c].buckets[b].hdr;
     freelists[c].buckets[b].hdr = h;
@@ -86,6 +441,7 @@ morecore(int c, int b)
 
   return 0;
 }
+#endif
 
 static int
 bucket(u64 nbytes)
@@ -98,6 +454,38 @@ bucket(u64 nbytes)
   return b;
 }
 
+#if KMALLOC_MAGAZINES
+static void *
+kmalloc_small(size_t b, const char *name, int cpu)
+{
+  void *h;
+
+  if (cpu >= 0 && cpu != myid()) {
+    h = depot_alloc(node_depot(kmdepots[b], cpu), 1 << b, cpu);
+  } else {
+    scoped_cli cli;
+    h = magazine_alloc(&kmcpus->buckets[b], node_depot(kmdepots[b], myid()),
+                       1 << b);
+  }
+  if (!h) {
+    cprintf("kmalloc(%d) failed\n", 1 << b);
+    return 0;
+  }
+
+  check_free(h, 1 << b);
+  return h;
+}
+
+static void
+kmfree_small(void *ap, size_t b)
+{
+  if (ALLOC_MEMSET)
+    memset(ap, 3, (1<<b));
+
+  scoped_cli cli;
+  magazine_free(&kmcpus->buckets[b], node_depot(kmdepots[b], myid()), ap);
+}
+#else
 static void *
 kmalloc_small(size_t b, const char *name, int cpu)
 {
@@ -120,19 +508,26 @@ kmalloc_small(size_t b, const char *name, int cpu)
     }
   }
 
-  if (ALLOC_MEMSET) {
-    char* chk = (char*)h + sizeof(struct header);
-    for (int i = 0; i < (1<<b)-sizeof(struct header); i++)
-      if (chk[i] != 3) {
-        console.print(shexdump(chk, 1<<b));
-        panic("kmalloc: free memory was overwritten %p+%x", chk, i);
-      }
-    memset(h, 4, (1<<b));
-  }
-
+  check_free(h, 1 << b);
   return h;
 }
 
+static void
+kmfree_small(void *ap, size_t b)
+{
+  struct header *h = (struct header *) ap;
+
+  if (ALLOC_MEMSET)
+    memset(ap, 3, (1<<b));
+
+  int c = mycpu()->id;
+  scoped_acquire guard(&freelists[c].buckets[b].lock);
+  h->next = freelists[c].buckets[b].hdr;
+  freelists[c].buckets[b].hdr = h;
+  freelists[c].buckets[b].count++;
+}
+#endif
+
 void *
 kmalloc(u64 nbytes, const char *name, int cpu)
 {
@@ -168,7 +563,6 @@ kmalloc(u64 nbytes, const char *name, int cpu)
 void
 kmfree(void *ap, u64 nbytes)
 {
-  struct header *h = (struct header *) ap;
   mtunlabel(mtrace_label_heap, ap);
 
   // Update debug_info
@@ -184,16 +578,7 @@ kmfree(void *ap, u64 nbytes)
     kfree(ap, round_up_to_pow2(nbytes));
   } else {
     // Free sub-page allocation
-    int b = bucket(nbytes);
-
-    if (ALLOC_MEMSET)
-      memset(ap, 3, (1<<b));
-
-    int c = mycpu()->id;
-    scoped_acquire guard(&freelists[c].buckets[b].lock);
-    h->next = freelists[c].buckets[b].hdr;
-    freelists[c].buckets[b].hdr = h;
-    freelists[c].buckets[b].count++;
+    kmfree_small(ap, bucket(nbytes));
   }
 }
 
@@ -259,6 +644,18 @@ alloc_debug_info::of(void *p, size_t size)
   return (alloc_debug_info*)((char*)p + aligned);
 }
 
+#if KMALLOC_MAGAZINES
+// With magazines, objects freed on one CPU already reach the other
+// CPUs on its node through the node's depot.  All that's left to do is hand this CPU's
+// partially used magazines back so that others can draw on them.
+void
+kmbalance(void)
+{
+  scoped_cli cli;
+  for (int b = 0; b < KMMAX+1; b++)
+    magazine_flush(&kmcpus->buckets[b], node_depot(kmdepots[b], myid()));
+}
+#else
 void
 kmbalance(void)
 {
@@ -309,3 +706,4 @@ kmbalance(void)
     assert(!extras);
   }
 }
+#endif
@@ -49,6 +49,7 @@ void initahci(void);
 void initpci(void);
 void initnet(void);
 void initsched(void);
+void initwork(void);
 void initlockstat(void);
 void initidle(void);
 void initcpprt(void);
@@ -66,6 +67,7 @@ void initdev(void);
 void inithpet(void);
 void initrtc(void);
 void initmfs(void);
+void initswap(void);
 void idleloop(void);
 void init_scalefs(void);
 
@@ -233,8 +235,9 @@ cmain(u64 mbmagic, u64 mbaddr)
   initproc();      // process table
   initsched();     // scheduler run queues
   initidle();
-  initgc();        // gc epochs and threads
-  initrefcache();  // Requires initsched
+  initwork();      // deferred work threads
+  initgc();        // gc epochs, requires initwork
+  initrefcache();  // Requires initsched, initwork
   initconsole();
   initfutex();
   initsamp();
@@ -253,6 +256,7 @@ cmain(u64 mbmagic, u64 mbaddr)
   initinode_late();
 
   initmfs();
+  initswap();      // Requires initdisk
 
   if (VERBOSE)
     cprintf("ncpu %d %lu MHz\n", ncpu, cpuhz / 1000000);
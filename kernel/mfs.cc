@@ -59,6 +59,56 @@ skipelem(const char **rpath, char *name)
   return 1;
 }
 
+// Path walk without reference counting: look up every path element inside
+// one GC epoch by mnode number, and take a reference only on the result, so
+// walking shared prefixes like "/" writes no shared cache lines.  Directory
+// mnodes are freed only after a GC epoch, so intermediate directories can be
+// used without a reference; other mnodes are never dereferenced here.
+// Returns false if an mnode on the path was not cached or was being
+// collected, in which case the caller should use the slow walk.
+static bool
+namex_rcu(sref<mnode> cwd, const char* path, bool nameiparent,
+          strbuf<DIRSIZ>* name, sref<mnode>* out)
+{
+  scoped_gc_epoch e;
+  mnode *m = (*path == '/') ? root_fs->mpeek(root_mnum) : cwd.get();
+  if (!m)
+    return false;
+  mfs *fs = m->fs_;
+  u64 mnum = m->mnum_;
+
+  int r;
+  while ((r = skipelem(&path, name->buf_)) == 1) {
+    if (mnode::type_of(mnum) != mnode::types::dir) {
+      *out = sref<mnode>();
+      return true;
+    }
+
+    if (nameiparent && *path == '\0') {
+      // Stop one level early.
+      *out = fs->mget(mnum);
+      return (bool)*out;
+    }
+
+    if (!m && !(m = fs->mpeek(mnum)))
+      return false;
+
+    if (!m->as_dir()->lookup_mnum(*name, &mnum)) {
+      *out = sref<mnode>();
+      return true;
+    }
+    m = nullptr;
+  }
+
+  if (r == -1 || nameiparent) {
+    *out = sref<mnode>();
+    return true;
+  }
+
+  *out = fs->mget(mnum);
+  return (bool)*out;
+}
+
 // Look up and return the mnode for a path name.  If nameiparent is true,
 // return the mnode for the parent and copy the final path element into name.
 static sref<mnode>
@@ -66,6 +116,9 @@ namex(sref<mnode> cwd, const char* path, bool nameiparent, strbuf<DIRSIZ>* name)
 {
   sref<mnode> m;
 
+  if (namex_rcu(cwd, path, nameiparent, name, &m))
+    return m;
+
   if (*path == '/')
     m = root_fs->mget(root_mnum);
   else
@@ -119,7 +172,7 @@ readm(sref<mnode> m, char* buf, u64 start, u64 nbytes)
     u64 pos = start + off;
     u64 pgbase = PGROUNDDOWN(pos);
 
-    mfile::page_state ps = m->as_file()->get_page(pgbase / PGSIZE);
+    mfile::page_state ps = m->as_file()->get_page(pgbase / PGSIZE, true);
     sref<page_info> pi = ps.get_page_info();
     if (!pi)
       break;
@@ -165,7 +218,7 @@ writem(sref<mnode> m, const char* buf, u64 start, u64 nbytes,
     mfile::resizer *resize = parentresize;
     mfile::resizer scoped_resize;
 
-    mfile::page_state ps = m->as_file()->get_page(pgbase / PGSIZE);
+    mfile::page_state ps = m->as_file()->get_page(pgbase / PGSIZE, true);
     sref<page_info> pi = ps.get_page_info();
     if (pi) {
       /* File already has the page we are about to update */
@@ -187,7 +240,10 @@ writem(sref<mnode> m, const char* buf, u64 start, u64 nbytes,
 
       memmove((char*) pi->va() + pgoff, buf + off, pgend - pgoff);
       m->as_file()->dirty(true);
-      m->as_file()->set_page_dirty(pgbase / PGSIZE);
+      if (!m->as_file()->set_page_dirty(pgbase / PGSIZE, pi.get()))
+        // The page moved to another NUMA node while we were writing
+        // it; redo the write on the new page.
+        continue;
 
       if (resize && *resize)
         resize->resize_nogrow(pos + pgend - pgoff);
@@ -209,7 +265,7 @@ writem(sref<mnode> m, const char* buf, u64 start, u64 nbytes,
         if (msize % PGSIZE) {
           resize->resize_nogrow(msize - (msize % PGSIZE) + PGSIZE);
         } else {
-          char* p = zalloc("file page");
+          char* p = m->as_file()->alloc_page(msize / PGSIZE);
           if (!p)
             break;
 
@@ -220,7 +276,7 @@ writem(sref<mnode> m, const char* buf, u64 start, u64 nbytes,
         msize = resize->read_size();
       }
 
-      char* p = zalloc("file page");
+      char* p = m->as_file()->alloc_page(pgbase / PGSIZE);
       if (!p)
         break;
 
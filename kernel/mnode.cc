@@ -6,10 +6,24 @@
 #include "percpu.hh"
 #include "vm.hh"
 #include "file.hh"
+#include "numa.hh"
+#include "kstats.hh"
 
 namespace {
   // 32MB mcache (XXX make this proportional to physical RAM)
   weakcache<pair<mfs*, u64>, mnode> mnode_cache(32 << 20);
+
+  // Frees a directory mnode after the current GC epoch, since path walks
+  // may still be using it without a reference (see mfs::mpeek).
+  struct mdir_free : public rcu_freed
+  {
+    mnode *m_;
+
+    mdir_free(mnode *m)
+      : rcu_freed("mdir_free", this, sizeof(*this)), m_(m) {}
+    void do_gc() override { delete m_; delete this; }
+    NEW_DELETE_OPS(mdir_free)
+  };
 };
 
 sref<mnode>
@@ -29,6 +43,20 @@ mfs::mget(u64 mnum)
   }
 }
 
+// Return the directory mnode for mnum if it is cached and not being
+// collected, without taking a reference.  The caller must be in a GC
+// epoch.  Only directories are freed after a GC epoch (see
+// mnode::onzero), so mnum must name a directory.
+mnode*
+mfs::mpeek(u64 mnum)
+{
+  assert(mnode::type_of(mnum) == mnode::types::dir);
+  mnode *m = mnode_cache.peek(make_pair(this, mnum));
+  if (m && !m->valid_)
+    return nullptr;
+  return m;
+}
+
 mlinkref
 mfs::alloc(u8 type, u64 parent_mnum)
 {
@@ -78,7 +106,7 @@ mfs::alloc(u8 type, u64 parent_mnum)
 
 mnode::mnode(mfs* fs, u64 mnum)
   : fs_(fs), mnum_(mnum), initialized_(false), cache_pin_(false), dirty_(false),
-    valid_(false), delete_inode_(false)
+    dirty_nsec_(0), on_dirty_list_(false), valid_(false), delete_inode_(false)
 {
   kstats::inc(&kstats::mnode_alloc);
 }
@@ -100,7 +128,25 @@ mnode::dirty(bool flag)
 {
   if (dirty_ == flag)
     return;
-  cmpxch(&dirty_, !flag, flag);
+  if (!cmpxch(&dirty_, !flag, flag))
+    return;
+  dirty_nsec_ = flag ? nsectime() : 0;
+
+  // Queue the mnode for background writeback, unless it is still on a dirty
+  // list from an earlier time it was dirty.
+  if (flag && fs_ == root_fs && cmpxch(&on_dirty_list_, false, true))
+    rootfs_interface->note_dirty(mnum_);
+}
+
+// Called by writeback when it drops the mnode from a dirty list. Returns false
+// if the mnode became dirty again meanwhile and must stay on the list.
+bool
+mnode::leave_dirty_list()
+{
+  on_dirty_list_ = false;
+  if (dirty_ && cmpxch(&on_dirty_list_, false, true))
+    return false;
+  return true;
 }
 
 bool
@@ -129,12 +175,17 @@ mnode::onzero()
     rootfs_interface->delete_inums[cpu].mnum_list.push_back(mnum_);
   }
 
-  if (type() == types::file)
+  if (type() == types::file) {
     this->as_file()->remove_pgtable_mappings(0);
+    this->as_file()->set_exec_header(nullptr);
+  }
 
   mnode_cache.cleanup(weakref_);
   kstats::inc(&kstats::mnode_free);
-  delete this;
+  if (type() == types::dir)
+    gc_delayed(new mdir_free(this));
+  else
+    delete this;
 }
 
 void
@@ -168,6 +219,7 @@ mfile::resizer::resize_nogrow(u64 newsize)
     /* Shrunk, and last page is partial */
     mf_->pages_.find(newsize / PGSIZE)->set_partial_page(true);
   }
+  mf_->contents_changed();
   mf_->dirty(true);
 }
 
@@ -191,16 +243,55 @@ mfile::resizer::resize_append(u64 size, sref<page_info> pi)
     ps.set_partial_page(true);
   ps.set_dirty_bit(true);
   mf_->pages_.fill(it, ps);
+  mf_->dirty_pages_++;
   mf_->size_ = size;
+  mf_->contents_changed();
   mf_->dirty(true);
 }
 
-void
-mfile::set_page_dirty(u64 pageidx)
+bool
+mfile::set_page_dirty(u64 pageidx, page_info* pi)
 {
   auto it = pages_.find(pageidx);
   auto lock = pages_.acquire(it);
+  if (it->get_page_info().get() != pi)
+    return false;
+  if (!it->is_dirty_page())
+    dirty_pages_++;
   it->set_dirty_bit(true);
+  contents_changed();
+  return true;
+}
+
+// The rmap is updated under the page's lock, which migrate_page holds
+// from its is_mapped check to the replacement, so a page is either
+// seen as mapped there or already replaced here.
+bool
+mfile::add_mapping(u64 pageidx, page_info* pi, page_info::rmap_entry map)
+{
+  auto it = pages_.find(pageidx);
+  auto lock = pages_.acquire(it);
+  if (it->get_page_info().get() != pi)
+    return false;
+  pi->add_pte(map);
+  return true;
+}
+
+char*
+mfile::alloc_page(u64 pageidx)
+{
+  if (numa_policy_ == NUMA_POLICY_INTERLEAVE && numa_nodes.size() > 1) {
+    // Offset by the mnode number so the first pages of every file
+    // don't all land on node 0.
+    int cpu = numa_interleave_cpu(mnum_ + pageidx);
+    if (cpu >= 0) {
+      char *p = kalloc("file page", PGSIZE, cpu);
+      if (p)
+        memset(p, 0, PGSIZE);
+      return p;
+    }
+  }
+  return zalloc("file page");
 }
 
 void
@@ -215,7 +306,7 @@ mfile::resizer::initialize_from_disk(u64 size)
 }
 
 mfile::page_state
-mfile::get_page(u64 pageidx)
+mfile::get_page(u64 pageidx, bool migrate)
 {
   auto it = pages_.find(pageidx);
   if (!it.is_set())
@@ -229,7 +320,7 @@ mfile::get_page(u64 pageidx)
         throw blocking_io(sref<mfile>::newref(this), pageidx);
 
       // Read page from disk
-      char *p = zalloc("file page");
+      char *p = alloc_page(pageidx);
       assert(p);
 
       auto pi = sref<page_info>::transfer(new (page_info::of(p)) page_info());
@@ -245,14 +336,65 @@ mfile::get_page(u64 pageidx)
       if (PGOFFSET(nbytes))
         ps.set_partial_page(true);
       pages_.fill(it, ps);
+      return it->copy_consistent();
+  }
+
+  page_state ps = it->copy_consistent();
+  page_info* pi = ps.get_page_info().get();
+  if (pi && numa_nodes.size() > 1) {
+    if (numa_is_local(pi->va())) {
+      kstats::inc(&kstats::pagecache_local_access_count);
+    } else {
+      kstats::inc(&kstats::pagecache_remote_access_count);
+      if (migrate && numa_policy_ == NUMA_POLICY_MIGRATE &&
+          pi->note_remote_access() >= NUMA_MIGRATE_THRESHOLD) {
+        migrate_page(pageidx, pi);
+        return it->copy_consistent();
+      }
+    }
   }
+  return ps;
+}
+
+// Move page pageidx, currently backed by old, to this CPU's NUMA
+// node.  Dirty pages are left in place, since a writer may still be
+// filling them in; writem notices a concurrent migration of a clean
+// page via set_page_dirty and redoes its write.  Mapped pages are left
+// in place too: stores through a mapping don't dirty the page, and any
+// made after the copy would be lost.
+void
+mfile::migrate_page(u64 pageidx, page_info* old)
+{
+  if (old->is_mapped())
+    return;
+
+  char *p = kalloc("file page");
+  if (!p)
+    return;
 
-  return it->copy_consistent();
+  auto pi = sref<page_info>::transfer(new (page_info::of(p)) page_info());
+  {
+    auto it = pages_.find(pageidx);
+    auto lock = pages_.acquire(it);
+    // Check again under the lock that add_mapping takes, so the page
+    // can't be mapped between the check and the replacement.
+    if (!it.is_set() || it->get_page_info().get() != old ||
+        it->is_dirty_page() || old->is_mapped())
+      return;
+    memmove(p, old->va(), PGSIZE);
+    page_state ps(pi);
+    if (it->is_partial_page())
+      ps.set_partial_page(true);
+    pages_.fill(it, ps);
+  }
+  kstats::inc(&kstats::pagecache_migrate_count);
 }
 
-// Evict a (clean) page from the page-cache.
+// Evict a (clean) page from the page-cache.  If batch is non-null, the
+// page's mappings are added to batch instead of being cleared
+// immediately, and the caller must call batch->clear_mappings().
 void
-mfile::put_page(u64 pageidx)
+mfile::put_page(u64 pageidx, rmap_batch *batch)
 {
   auto it = pages_.find(pageidx);
   if (!it.is_set())
@@ -266,10 +408,13 @@ mfile::put_page(u64 pageidx)
 
     it->reset_page_info();
 
-    std::vector<page_info::rmap_entry> rmap_vec;
-    pi->get_rmap_vector(rmap_vec);
-    for (auto rmap_it = rmap_vec.begin(); rmap_it != rmap_vec.end(); rmap_it++)
-      rmap_it->first->clear_mapping(rmap_it->second);
+    if (batch) {
+      batch->add(pi.get());
+    } else {
+      rmap_batch rmaps;
+      rmaps.add(pi.get());
+      rmaps.clear_mappings();
+    }
 
     pi->dec();
 
@@ -280,9 +425,12 @@ mfile::put_page(u64 pageidx)
 // any pages that are no longer a part of the file need to be cleared from vmaps
 // that have the file mmapped. Each page_info object keeps track of these vmaps
 // via an oplog-maintained reverse map. This rmap is now traversed to unmap the
-// truncated pages from the vmaps in question.
+// truncated pages from the vmaps in question.  The mappings of all
+// truncated pages are removed together, so each vmap performs a single
+// TLB shootdown for the whole truncate.
 void
 mfile::remove_pgtable_mappings(u64 start_offset) {
+  rmap_batch rmaps;
   auto page_trunc_start = pages_.find(PGROUNDUP(start_offset) / PGSIZE);
   for (auto it = page_trunc_start; it != pages_.end(); ) {
     // Skip unset spans
@@ -291,20 +439,18 @@ mfile::remove_pgtable_mappings(u64 start_offset) {
       continue;
     }
     auto pg_info = it->get_page_info();
-    if (pg_info) {
-      std::vector<page_info::rmap_entry> rmap_vec;
-      pg_info->get_rmap_vector(rmap_vec);
-      for (auto rmap_it = rmap_vec.begin(); rmap_it != rmap_vec.end(); rmap_it++)
-        rmap_it->first->delete_mapping(rmap_it->second);
-    }
+    if (pg_info)
+      rmaps.add(pg_info.get());
     ++it;
   }
+  rmaps.delete_mappings();
 }
 
 // Drop the (clean) page-cache pages associated with this file.
 void
 mfile::drop_pagecache()
 {
+  rmap_batch rmaps;
   u64 mlen = *read_size();
   auto page_end = pages_.find(PGROUNDUP(mlen) / PGSIZE);
   for (auto it = pages_.begin(); it != page_end; ) {
@@ -325,9 +471,10 @@ mfile::drop_pagecache()
       continue;
     }
 
-    put_page(it.index());
+    put_page(it.index(), &rmaps);
     ++it;
   }
+  rmaps.clear_mappings();
 }
 
 void
@@ -340,6 +487,9 @@ mfile::sync_file(int cpu)
 
   auto guard = rootfs_interface->fs_journal[cpu]->commitq_insert_lock.guard();
 
+  // Pages dirtied from here on may be missed by this sync.
+  dirty_pages_ = 0;
+
   transaction *trans = new transaction();
   u64 mlen = *read_size();
 
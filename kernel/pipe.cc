@@ -7,8 +7,12 @@
 #include "fs.h"
 #include "file.hh"
 #include "cpu.hh"
+#include "sleeplock.hh"
+#include "vm.hh"
+#include "page_info.hh"
 #include "uk/unistd.h"
 #include "uk/fcntl.h"
+#include <algorithm>
 
 #define PIPESIZE (16*4096)
 
@@ -20,24 +24,53 @@ struct pipe {
   NEW_DELETE_OPS(pipe);
 };
 
+// One page of pipe data.  The bytes in [off, end) of page have been
+// written but not yet read.
+struct pipe_buf {
+  sref<page_info> page;
+  // Next byte to read.  Only the reader modifies this once the
+  // buffer is published.
+  u32 off;
+  // End of valid data.  The writer may advance this (appending to the
+  // newest buffer) while the reader is reading it.
+  std::atomic<u32> end;
+  // The page is shared with a file, user memory, or another pipe, so
+  // the writer must never append to it.
+  bool shared;
+};
+
+// A ring of page-sized buffers.  Writers are serialized by wlock and
+// readers by rlock, so the ring itself is single-producer,
+// single-consumer: the writer publishes buffers by advancing head and
+// the reader frees them by advancing tail, with no lock shared
+// between the two.  Data moves with one memmove per page, and each
+// side wakes the other at most once per call.  Pages can also be
+// passed through the ring by reference (see the splice functions
+// below).
 struct ordered : pipe {
+  enum { NBUF = PIPESIZE / PGSIZE };
+
+  sleeplock wlock;
+  sleeplock rlock;
+  // Protects sleeping and the open flags.
   struct spinlock lock;
-  struct spinlock lock_close;
   struct condvar  empty;
   struct condvar  full;
   std::atomic<bool> readopen;   // read fd is still open
-  int writeopen;  // write fd is still open
-  std::atomic<size_t> nread;  // number of bytes read
-  std::atomic<size_t> nwrite; // number of bytes written
+  std::atomic<bool> writeopen;  // write fd is still open
+  std::atomic<size_t> head;     // buffers published by the writer
+  std::atomic<size_t> tail;     // buffers freed by the reader
+  std::atomic<bool> reader_waiting;
+  std::atomic<bool> writer_waiting;
   bool nonblock;
-  char data[PIPESIZE];
+  pipe_buf bufs[NBUF];
 
   ordered(int flags)
-    : readopen(true), writeopen(1), nread(0), nwrite(0),
+    : readopen(true), writeopen(true), head(0), tail(0),
+      reader_waiting(false), writer_waiting(false),
       nonblock(flags & O_NONBLOCK)
   {
     lock = spinlock("pipe", LOCKSTAT_PIPE);
-    lock_close = spinlock("pipe:close", LOCKSTAT_PIPE);
     empty = condvar("pipe:empty");
     full = condvar("pipe:full");
   };
@@ -45,83 +78,237 @@ struct ordered : pipe {
   };
   NEW_DELETE_OPS(ordered);
 
+  // Wake the other side if it is sleeping.  The waker publishes its
+  // index update before checking the flag and the sleeper sets the
+  // flag before checking the index, so one of them sees the other.
+  void wake(std::atomic<bool> &waiting, condvar &cv) {
+    if (waiting) {
+      scoped_acquire l(&lock);
+      cv.wake_all();
+    }
+  }
+
+  // Whether the reader has any unread bytes.
+  bool readable() {
+    size_t t = tail, h = head;
+    if (t == h)
+      return false;
+    pipe_buf &b = bufs[t % NBUF];
+    return t + 1 != h || b.off != b.end;
+  }
+
+  // Sleep until there is data to read.  Returns 1 if there is, 0 at
+  // end of file, or -1 if this process was killed.
+  int wait_readable() {
+    scoped_acquire l(&lock);
+    int r = 1;
+    reader_waiting = true;
+    while (!readable()) {
+      if (!writeopen) {
+        r = 0;
+        break;
+      }
+      if (myproc()->killed) {
+        r = -1;
+        break;
+      }
+      empty.sleep(&lock);
+    }
+    reader_waiting = false;
+    return r;
+  }
+
+  // Sleep until there is a free buffer.  Returns false if the read
+  // end has closed or this process was killed.
+  bool wait_writable() {
+    scoped_acquire l(&lock);
+    bool r = true;
+    writer_waiting = true;
+    while (head - tail == NBUF) {
+      if (!readopen || myproc()->killed) {
+        r = false;
+        break;
+      }
+      full.sleep(&lock);
+    }
+    writer_waiting = false;
+    return r;
+  }
+
+  // Publish a new buffer.  The caller holds wlock and has checked
+  // that a buffer is free.
+  void push(sref<page_info> page, u32 off, u32 len, bool shared) {
+    size_t h = head.load(std::memory_order_relaxed);
+    pipe_buf &b = bufs[h % NBUF];
+    b.page = std::move(page);
+    b.off = off;
+    b.end.store(off + len, std::memory_order_relaxed);
+    b.shared = shared;
+    head = h + 1;
+  }
+
   virtual int write(const char *addr, int n) override {
-    if (nonblock) {
-      for (;;) {
-        size_t nr = nread;
-        size_t nw = nwrite;
-        if (nr == nread) {
-          // use nread sort-of like a seqlock
-          if (nw == nr + PIPESIZE)
-            return -1;
-          break;
+    if (!readopen)
+      return -1;
+
+    auto wl = wlock.guard();
+    int done = 0;
+    while (done < n) {
+      size_t h = head.load(std::memory_order_relaxed);
+      size_t t = tail;
+
+      // Append to the newest buffer if it is ours and not full.  The
+      // reader never frees the newest buffer until it is full, so it
+      // is safe to write to.
+      if (h != t) {
+        pipe_buf &b = bufs[(h - 1) % NBUF];
+        u32 end = b.end.load(std::memory_order_relaxed);
+        if (!b.shared && end < PGSIZE) {
+          u32 c = std::min((u32)(n - done), PGSIZE - end);
+          memmove((char*)b.page->va() + end, addr + done, c);
+          b.end = end + c;
+          done += c;
+          continue;
         }
       }
+
+      if (h - t == NBUF) {
+        if (nonblock)
+          break;
+        wake(reader_waiting, empty);
+        if (!wait_writable())
+          return done ?: -1;
+        continue;
+      }
+
+      char *p = kalloc("pipe buf");
+      if (!p)
+        break;
+      auto page = sref<page_info>::transfer(new(page_info::of(p)) page_info());
+      u32 c = std::min((u32)(n - done), (u32)PGSIZE);
+      memmove(p, addr + done, c);
+      push(std::move(page), 0, c, false);
+      done += c;
     }
 
+    if (done > 0)
+      wake(reader_waiting, empty);
+    return done ?: (n ? -1 : 0);
+  }
+
+  // Append pages by reference.  next(&page, &off, &len) is called
+  // once there is room for a buffer and returns 1 if it produced a
+  // page, 0 if there is nothing more to write, or -1 on error.
+  // Returns the number of bytes appended, or 0 or -1 if none were.
+  template<class F>
+  ssize_t write_pages(F next, bool nonblock) {
     if (!readopen)
       return -1;
 
-    scoped_acquire l(&lock);
-    for(int i = 0; i < n; i++){
-      while(nwrite == nread + PIPESIZE){ 
-        if (nonblock || myproc()->killed)
-          return -1;
-        scoped_acquire lclose(&lock_close);
-        if (!readopen)
-          return -1;
-        full.sleep(&lock, &lock_close);
+    auto wl = wlock.guard();
+    ssize_t done = 0, err = 0;
+    for (;;) {
+      if (head - tail == NBUF) {
+        wake(reader_waiting, empty);
+        if (nonblock || this->nonblock || !wait_writable()) {
+          err = -1;
+          break;
+        }
       }
-      data[nwrite++ % PIPESIZE] = addr[i];
+      sref<page_info> page;
+      u32 off, len;
+      int r = next(&page, &off, &len);
+      if (r <= 0) {
+        err = r;
+        break;
+      }
+      push(std::move(page), off, len, true);
+      done += len;
     }
-    if (n > 0)
-      empty.wake_all();
-    return n;
+
+    if (done > 0)
+      wake(reader_waiting, empty);
+    return done ?: err;
   }
 
-  virtual int read(char *addr, int n) override {
-    if (nonblock) {
-      for (;;) {
-        size_t nr = nread;
-        size_t nw = nwrite;
-        if (nr == nread) {
-          // use nread sort-of like a seqlock
-          if (nw == nr)
-            return -1;
+  // Consume up to n bytes.  fn(buf, off, len) is given each run of
+  // unread bytes in turn and returns how many of them it consumed,
+  // or -1 on error; it is called again only if it consumed them all.
+  // Returns the number of bytes consumed, 0 at end of file, or -1.
+  template<class F>
+  ssize_t consume(size_t n, F fn, bool nonblock) {
+    auto rl = rlock.guard();
+    ssize_t done = 0;
+    bool freed = false;
+
+    for (;;) {
+      while (done < n) {
+        // Load head before the buffer's end, so that if this buffer
+        // is no longer the newest, we see everything written to it.
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t h = head.load(std::memory_order_acquire);
+        if (t == h)
           break;
+        pipe_buf &b = bufs[t % NBUF];
+        u32 end = b.end.load(std::memory_order_acquire);
+        if (b.off < end) {
+          u32 c = std::min(n - done, (size_t)(end - b.off));
+          ssize_t r = fn(b, b.off, c);
+          if (r < 0) {
+            if (done == 0)
+              done = -1;
+            goto out;
+          }
+          b.off += r;
+          done += r;
+          if (r < c || b.off < end)
+            goto out;
         }
+        // The writer may still append to the newest buffer.
+        if (!(b.shared || end == PGSIZE || t + 1 != h))
+          break;
+        b.page.reset();
+        tail = t + 1;
+        freed = true;
       }
-    }
+      if (done != 0 || n == 0)
+        break;
 
-    scoped_acquire l(&lock);
-    while(nread == nwrite) {
-      if (nonblock || myproc()->killed)
-        return -1;
-      scoped_acquire lclose(&lock_close);
-      if (writeopen == 0)
-        return 0;
-      empty.sleep(&lock, &lock_close);
-    }
-    int i;
-    for(i = 0; i < n; i++) { 
-      if(nread == nwrite)
+      if (nonblock || this->nonblock) {
+        done = -1;
+        break;
+      }
+      int r = wait_readable();
+      if (r <= 0) {
+        done = r;
         break;
-      addr[i] = data[nread++ % PIPESIZE];
+      }
     }
-    if (i > 0)
-      full.wake_all();
-    return i;
+
+  out:
+    if (freed)
+      wake(writer_waiting, full);
+    return done;
+  }
+
+  virtual int read(char *addr, int n) override {
+    return consume(n, [&](pipe_buf &b, u32 off, u32 len) -> ssize_t {
+        memmove(addr, (char*)b.page->va() + off, len);
+        addr += len;
+        return len;
+      }, false);
   }
 
   virtual int close(int writable) override {
-    scoped_acquire l(&lock_close);
+    scoped_acquire l(&lock);
     if(writable){
-      writeopen = 0;
+      writeopen = false;
     } else {
-      readopen = 0;
+      readopen = false;
     }
     empty.wake_all();
-    if(readopen == 0 && writeopen == 0){
+    full.wake_all();
+    if(!readopen && !writeopen){
       return 1;
     }
     return 0;
@@ -163,3 +350,161 @@ piperead(struct pipe *p, char *addr, int n)
 {
   return p->read(addr, n);
 }
+
+//
+// Zero-copy transfers.  These move page references into or out of a
+// pipe's ring instead of copying data.
+//
+
+// Move up to n bytes from pipe in to pipe out.  Whole buffers are
+// passed by reference.
+ssize_t
+pipesplice(struct pipe *in, struct pipe *out, size_t n, int flags)
+{
+  ordered *pin = static_cast<ordered*>(in);
+  ordered *pout = static_cast<ordered*>(out);
+  bool nonblock = flags & SPLICE_F_NONBLOCK;
+  if (in == out)
+    return -1;
+
+  return pin->consume(n, [&](pipe_buf &b, u32 off, u32 len) -> ssize_t {
+      bool given = false;
+      ssize_t r = pout->write_pages(
+        [&](sref<page_info> *page, u32 *poff, u32 *plen) {
+          if (given)
+            return 0;
+          given = true;
+          *page = b.page;
+          *poff = off;
+          *plen = len;
+          return 1;
+        }, nonblock);
+      return r < 0 ? -1 : r;
+    }, nonblock);
+}
+
+// Move up to n bytes from file in to pipe out.  Regular files pass
+// their page cache pages by reference; other files are read into
+// fresh pages.  If off is null, in's file offset is used.
+ssize_t
+pipesplicein(file *in, off_t *off, struct pipe *out, size_t n, int flags)
+{
+  ordered *pout = static_cast<ordered*>(out);
+  bool nonblock = flags & SPLICE_F_NONBLOCK;
+  size_t left = n;
+
+  file *inf = in;
+  if (&typeid(*inf) == &typeid(file_mnode)) {
+    file_mnode *fm = static_cast<file_mnode*>(inf);
+    if (!fm->readable)
+      return -1;
+    if (fm->m->type() == mnode::types::file) {
+      lock_guard<sleeplock> l;
+      u64 pos;
+      if (off) {
+        pos = *off;
+      } else {
+        l = fm->off_lock.guard();
+        pos = fm->off;
+      }
+      mfile *mf = fm->m->as_file();
+      ssize_t r = pout->write_pages(
+        [&](sref<page_info> *page, u32 *poff, u32 *plen) {
+          if (left == 0)
+            return 0;
+          mfile::page_state ps = mf->get_page(pos / PGSIZE, true);
+          *page = ps.get_page_info();
+          if (!*page)
+            return 0;
+          u64 end = pos + std::min(left, (size_t)(PGSIZE - pos % PGSIZE));
+          if (ps.is_partial_page())
+            end = std::min(end, (u64)*mf->read_size());
+          if (end <= pos)
+            return 0;
+          *poff = pos % PGSIZE;
+          *plen = end - pos;
+          pos = end;
+          left -= *plen;
+          return 1;
+        }, nonblock);
+      if (r > 0) {
+        if (off)
+          *off += r;
+        else
+          fm->off += r;
+      }
+      return r < 0 && left == n ? -1 : n - left;
+    }
+  }
+
+  // Copy into pages the pipe takes ownership of.  Stop at a short
+  // read so we never block on the input while holding the pipe.
+  bool eof = false;
+  ssize_t r = pout->write_pages(
+    [&](sref<page_info> *page, u32 *poff, u32 *plen) {
+      if (left == 0 || eof)
+        return 0;
+      char *p = kalloc("pipe buf");
+      if (!p)
+        return -1;
+      *page = sref<page_info>::transfer(new(page_info::of(p)) page_info());
+      size_t want = std::min(left, (size_t)PGSIZE);
+      ssize_t got = off ? in->pread(p, want, *off) : in->read(p, want);
+      if (got <= 0)
+        return (int)got;
+      if (off)
+        *off += got;
+      eof = got < want;
+      *poff = 0;
+      *plen = got;
+      left -= got;
+      return 1;
+    }, nonblock);
+  return r < 0 && left == n ? -1 : n - left;
+}
+
+// Move up to n bytes from pipe in to file out.  Files have no way to
+// take a page by reference, so this copies once, straight from the
+// pipe's pages.
+ssize_t
+pipespliceout(struct pipe *in, file *out, off_t *off, size_t n, int flags)
+{
+  ordered *pin = static_cast<ordered*>(in);
+  return pin->consume(n, [&](pipe_buf &b, u32 boff, u32 len) -> ssize_t {
+      const char *p = (const char*)b.page->va() + boff;
+      ssize_t r;
+      if (off) {
+        r = out->pwrite(p, len, *off);
+        if (r > 0)
+          *off += r;
+      } else {
+        r = out->write(p, len);
+      }
+      return r;
+    }, flags & SPLICE_F_NONBLOCK);
+}
+
+// Append n bytes of user memory at va to pipe out, by reference to
+// the user's pages.  As with Linux's vmsplice, the caller must not
+// modify the memory until the reader has consumed it.
+ssize_t
+pipevmsplice(struct pipe *out, uptr va, size_t n, int flags)
+{
+  ordered *pout = static_cast<ordered*>(out);
+  sref<vmap> vm = myproc()->vmap;
+  size_t left = n;
+  ssize_t r = pout->write_pages(
+    [&](sref<page_info> *page, u32 *poff, u32 *plen) {
+      if (left == 0)
+        return 0;
+      *page = vm->pageref(va);
+      if (!*page)
+        return -1;
+      *poff = va % PGSIZE;
+      *plen = std::min(left, (size_t)(PGSIZE - *poff));
+      va += *plen;
+      left -= *plen;
+      return 1;
+    }, flags & SPLICE_F_NONBLOCK);
+  return r < 0 && left == n ? -1 : n - left;
+}
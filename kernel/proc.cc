@@ -35,10 +35,11 @@ enum { sched_debug = 0 };
 proc::proc(int npid) :
   kstack(0), pid(npid), parent(0), tf(0), context(0), killed(0),
   tsc(0), curcycles(0), cpuid(0), fpu_state(nullptr),
-  cpu_pin(0), oncv(0), cv_wakeup(0),
+  cpu_pin(0), sched_class(PRIO_BATCH), sched_expired_(false),
+  oncv(0), cv_wakeup(0),
   futex_lock("proc::futex_lock", LOCKSTAT_PROC),
   user_fs_(0), unmap_tlbreq_(0), data_cpuid(-1), in_exec_(0), 
-  uaccess_(0), yield_(false),
+  uaccess_(0), yield_(false), uring_(nullptr),
   upath(nullptr), uargv(nullptr),
   exception_inuse(0), magic(PROC_MAGIC), unmapped_hint(0), state_(EMBRYO)
 {
@@ -152,6 +153,8 @@ exit(int status)
   if(myproc() == bootproc)
     panic("init exiting");
 
+  uring_exit(myproc());
+
   myproc()->ftable.reset();
 
   myproc()->cwd.reset();
@@ -407,6 +410,7 @@ doclone(clone_flags flags)
   np->parent = myproc();
   *np->tf = *myproc()->tf;
   np->cpu_pin = myproc()->cpu_pin;
+  np->sched_class = myproc()->sched_class;
   np->data_cpuid = myproc()->data_cpuid;
   np->run_cpuid_ = myproc()->run_cpuid_;
   np->user_fs_ = myproc()->user_fs_;
@@ -188,7 +188,7 @@ refcache::cache::review()
 
         scoped_acquire rl(&reap_lock_);
         reap_.push_back(&*obj);
-        reap_cv_.wake_all();
+        dwork_queue(&reap_work_, myid());
       }
     } else {
       // The count is now non-zero and hence clearly unstable.  Drop
@@ -279,33 +279,35 @@ refcache::cache::tick()
 }
 
 void
-refcache::cache::reaper()
+refcache::cache::reap()
 {
-  for (;;) {
-    referenced::list reapable;
-    for (;;) {
-      scoped_acquire l(&reap_lock_);
-      reapable = std::move(reap_);
-      if (reapable.begin() != reapable.end())
-        break;
-
-      reap_cv_.sleep(&reap_lock_);
-    }
-
-    kstats::inc(&kstats::refcache_reap_count);
-    kstats::timer timer(&kstats::refcache_reap_cycles);
+  referenced::list reapable;
+  {
+    scoped_acquire l(&reap_lock_);
+    reapable = std::move(reap_);
+  }
 
-    auto reap = reapable.begin();
-    auto reap_end = reapable.end();
-    uint64_t nfreed = 0;
-    while (reap != reap_end) {
-      auto obj = reap++;
-      obj->onzero();
-      ++nfreed;
-    }
+  kstats::inc(&kstats::refcache_reap_count);
+  kstats::timer timer(&kstats::refcache_reap_cycles);
 
-    kstats::inc(&kstats::refcache_item_freed_count, nfreed);
+  auto reap = reapable.begin();
+  auto reap_end = reapable.end();
+  uint64_t nfreed = 0;
+  while (reap != reap_end) {
+    auto obj = reap++;
+    obj->onzero();
+    ++nfreed;
   }
+
+  kstats::inc(&kstats::refcache_item_freed_count, nfreed);
+}
+
+void
+refcache::cache::reap_work::run()
+{
+  // Reap work is only queued on its own core, and the dwork thread is
+  // pinned.
+  refcache::mycache.get_unchecked()->reap();
 }
 
 uint64_t
@@ -379,13 +381,6 @@ test(void *)
 }
 #endif
 
-static void
-refcache_reaper(void*)
-{
-  refcache::cache* c = refcache::mycache.get_unchecked();
-  c->reaper();
-}
-
 void
 initrefcache(void)
 {
@@ -394,9 +389,6 @@ initrefcache(void)
   refcache::global_epoch = 1;
   refcache::global_epoch_left = ncpu;
 
-  for (int i = 0; i < NCPU; i++)
-    threadpin(refcache_reaper, nullptr, "refcache reaper", i);
-
 #ifdef TEST
   threadpin(test, nullptr, "refcache test", 0);
 #endif
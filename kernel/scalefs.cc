@@ -7,12 +7,14 @@
 #include "scalefs.hh"
 #include "kstream.hh"
 #include "major.h"
+#include "kstats.hh"
+#include <memory>
 
 
 mfs_interface::mfs_interface()
 {
   for (int cpu = 0; cpu < NCPU; cpu++)
-    fs_journal[cpu] = new journal();
+    fs_journal[cpu] = new journal(cpu);
 
   inum_to_mnum = new chainhash<u64, u64>(NINODES_PRIME);
   mnum_to_inum = new chainhash<u64, u64>(NINODES_PRIME);
@@ -241,6 +243,10 @@ mfs_interface::create_file(u64 mnum, u8 type, transaction *tr)
   // Buffer-cache updates start here.
   ilock(ip, WRITELOCK);
   iupdate(ip, tr);
+  // The file stays unreachable on the disk until its link in the parent
+  // directory is flushed.
+  if (!ip->nlink())
+    tr->add_orphan(ip->inum);
   iunlock(ip);
 }
 
@@ -275,11 +281,14 @@ mfs_interface::create_dir(u64 mnum, u64 parent_mnum, u8 type, transaction *tr)
   // Buffer-cache updates start here.
   ilock(subdir_ip, WRITELOCK);
   dirlink(subdir_ip, "..", parent_inum, false, tr);
+  if (!subdir_ip->nlink())
+    tr->add_orphan(subdir_ip->inum);
 
   // Flush parent inode too, if it was newly created above.
   if (parent_ip) {
     ilock(parent_ip, WRITELOCK);
     iupdate(parent_ip, tr);
+    tr->add_orphan(parent_ip->inum);
     iunlock(parent_ip);
   }
 
@@ -332,6 +341,10 @@ mfs_interface::add_dir_entry(u64 mdir_mnum, char *name, u64 dirent_mnum,
   // Buffer-cache updates start here.
   ilock(mdir_ip, WRITELOCK);
   ilock(dirent_ip, WRITELOCK);
+  // An inode that had no links (or a directory, whose link count also covers
+  // its sub-directories) may be in the orphan list; it is reachable now.
+  if (!dirent_ip->nlink() || type == mnode::types::dir)
+    tr->remove_orphan(dirent_inum);
   dirlink(mdir_ip, name, dirent_inum, (type == mnode::types::dir)?true:false, tr);
   iunlock(dirent_ip);
   iunlock(mdir_ip);
@@ -424,8 +437,10 @@ mfs_interface::delete_mnum_inode_safe(u64 mnum, transaction *tr,
     // It looks like userspace still has open file descriptors referring to
     // this mnode, so it is not safe to delete its on-disk inode just yet.
     // So mark it for deletion and postpone it until this mnode's onzero()
-    // function is invoked.
+    // function is invoked. Meanwhile, record it in the orphan list so that
+    // it gets reclaimed on reboot if we crash before that.
     m->mark_inode_for_deletion();
+    tr->add_orphan(inum);
   } else {
     // The mnode is gone (which also implies that all its open file
     // descriptors have been closed as well). So it is safe to delete its
@@ -455,6 +470,7 @@ mfs_interface::__delete_mnum_inode(u64 mnum, transaction *tr)
   sref<inode> ip = iget(1, inum);
 
   ilock(ip, WRITELOCK);
+  tr->remove_orphan(inum);
   itrunc(ip, 0, tr);
   iunlock(ip);
 
@@ -553,12 +569,101 @@ mfs_interface::get_mfslog_linkcount(u64 mnum)
   return count;
 }
 
+// Sync splits its work among the cores by the CPU that allocated each mnode.
+static int
+mnum_owner(u64 mnum)
+{
+  return mnode::cpu_of(mnum) % ncpu;
+}
+
+// One core's share of a phase of a parallel sync.
+struct sync_request
+{
+  std::vector<u64> *mnum_list; // The dirty mnodes allocated on this core
+  int phase;
+  semaphore *done;
+  sync_request *next;
+};
+
+// Each core has a flusher thread pinned to it, which runs the core's share of
+// every sync and its background writeback. Both block on journal I/O, so they
+// don't run on the core's dwork thread, where they would hold up all other
+// deferred work.
+struct fsflush_core
+{
+  spinlock lock;
+  condvar cv;
+  sync_request *requests;       // Protected by lock
+  // The mnodes that became dirty on this core, for writeback. An mnode is on
+  // at most one list at a time (mnode::on_dirty_list_). Protected by lock.
+  std::vector<u64> dirty;
+
+  fsflush_core()
+    : lock("fsflush"), cv("fsflush"), requests(nullptr) {}
+} __mpalign__;
+
+// Not per-CPU variables because init_scalefs starts every CPU's thread before
+// the other CPUs boot and construct their per-CPU variables.
+static fsflush_core fsflush[NCPU];
+
+// Background writeback tunables, set through /dev/writeback.
+static std::atomic<u64> writeback_interval(WRITEBACK_INTERVAL);
+static std::atomic<u64> writeback_age(WRITEBACK_AGE);
+static std::atomic<u64> writeback_bytes(WRITEBACK_BYTES);
+
+static void
+fsflush_thread(void *x)
+{
+  int cpu = myid();
+  fsflush_core *f = &fsflush[cpu];
+  u64 next_writeback = nsectime() + writeback_interval * 1000000ull;
+
+  for (;;) {
+    sync_request *req;
+    {
+      scoped_acquire l(&f->lock);
+      while (!f->requests && nsectime() < next_writeback)
+        f->cv.sleep_to(&f->lock, next_writeback);
+      req = f->requests;
+      if (req)
+        f->requests = req->next;
+    }
+
+    if (req) {
+      rootfs_interface->run_sync_phase(cpu, req->phase, *req->mnum_list);
+      req->done->release();
+    } else {
+      rootfs_interface->writeback(cpu);
+      next_writeback = nsectime() + writeback_interval * 1000000ull;
+    }
+  }
+}
+
+// Called by mnode::dirty() when an mnode that is not on any dirty list
+// becomes dirty.
+void
+mfs_interface::note_dirty(u64 mnum)
+{
+  fsflush_core *f = &fsflush[myid()];
+  scoped_acquire l(&f->lock);
+  f->dirty.push_back(mnum);
+}
+
 // Applies all metadata operations logged in the logical logs. Called on sync.
+//
+// The dirty mnodes are partitioned by the CPU that allocated them, and every
+// core processes, syncs and commits its share via its own per-core journal,
+// concurrently with the others. The phases are separated by barriers so that
+// we keep the ordering of a serial sync: every oplog is processed before any
+// file is synced, and all the resulting transactions are committed before the
+// lazy inode deletions are queued. Commits still wait for their cross-queue
+// dependencies (dependent_txq), which cannot deadlock since every journal is
+// being flushed at the same time.
 void
 mfs_interface::process_metadata_log_and_flush(int cpu)
 {
-  // Invoke process_metadata_log() on every dirty mnode.
-  std::vector<u64> mnum_list;
+  std::unique_ptr<std::vector<u64>[]> mnum_lists(new std::vector<u64>[ncpu]);
+
   metadata_log_htab->enumerate([&](const u64 &mnum, mfs_logical_log* &mfs_log)->bool {
 
     sref<mnode> m = root_fs->mget(mnum);
@@ -568,7 +673,7 @@ mfs_interface::process_metadata_log_and_flush(int cpu)
       // reboot). So to avoid interference with the refcount, we store the mnode
       // numbers here, and not references to the mnodes themselves (which would
       // have bumped up the refcount inadvertently!).
-      mnum_list.push_back(mnum);
+      mnum_lists[mnum_owner(mnum)].push_back(mnum);
     }
 
       // We call process_metadata_log() outside enumerate() because it does a
@@ -577,50 +682,149 @@ mfs_interface::process_metadata_log_and_flush(int cpu)
     return false;
   });
 
-  for (auto &mnum : mnum_list) {
-    sref<mnode> m = root_fs->mget(mnum);
-    if (m && m->is_dirty())
-      process_metadata_log(get_tsc(), m->mnum_, cpu);
+  std::unique_ptr<sync_request[]> reqs(new sync_request[ncpu]);
+  semaphore done("sync_done", 0);
+  for (int phase : {SYNC_PROCESS_LOGS, SYNC_FILES, SYNC_FLUSH}) {
+    for (int c = 0; c < ncpu; c++) {
+      // Run our own share here rather than wait for our flusher thread.
+      if (c == cpu)
+        continue;
+      reqs[c].mnum_list = &mnum_lists[c];
+      reqs[c].phase = phase;
+      reqs[c].done = &done;
+      scoped_acquire l(&fsflush[c].lock);
+      reqs[c].next = fsflush[c].requests;
+      fsflush[c].requests = &reqs[c];
+      fsflush[c].cv.wake_all();
+    }
+    run_sync_phase(cpu, phase, mnum_lists[cpu]);
+    done.acquire(ncpu - 1);
   }
+}
 
-  // Transactions enqueued to the same journal queue (indexed by the cpu number)
-  // are always flushed in the order they are enqueued. Hence the transactions
-  // generated by process_metadata_log() above go to disk first, followed by
-  // those generated by sync_dirty_files_and_dirs().
+// Runs one phase of process_metadata_log_and_flush() for the dirty mnodes in
+// mnum_list, via cpu's journal. cpu also stands in for the journals of CPUs
+// that are not online.
+void
+mfs_interface::run_sync_phase(int cpu, int phase, std::vector<u64> &mnum_list)
+{
+  switch (phase) {
+  case SYNC_PROCESS_LOGS:
+    for (auto &mnum : mnum_list) {
+      sref<mnode> m = root_fs->mget(mnum);
+      if (m && m->is_dirty())
+        process_metadata_log(get_tsc(), m->mnum_, cpu);
+    }
+    break;
 
-  sync_dirty_files_and_dirs(cpu, mnum_list);
+  case SYNC_FILES:
+    // Transactions enqueued to the same journal queue (indexed by the cpu
+    // number) are always flushed in the order they are enqueued. Hence the
+    // transactions generated by process_metadata_log() in the previous phase
+    // go to disk first, followed by those generated here.
+    sync_dirty_files_and_dirs(cpu, mnum_list);
 
-  {
-    // Commit all these transactions via our CPU's per-core journal.
-    auto commit_insert_guard = fs_journal[cpu]->commitq_insert_lock.guard();
+    // Commit them, so that they precede the inode deletions on the disk.
+    for (int i = cpu; i < NCPU; i += ncpu)
+      flush_transaction_queue(i);
+    break;
 
-    for (int i = 0; i < NCPU; i++)  {
-      // Delete all the inodes marked for lazy deletion by mnode::onzero()
-      std::vector<u64> del_mnum_list;
-      {
-        auto l = delete_inums[i].lock.guard();
-        del_mnum_list = std::move(delete_inums[i].mnum_list);
+  case SYNC_FLUSH:
+    {
+      auto commit_insert_guard = fs_journal[cpu]->commitq_insert_lock.guard();
+
+      for (int i = cpu; i < NCPU; i += ncpu)  {
+        // Delete all the inodes marked for lazy deletion by mnode::onzero()
+        std::vector<u64> del_mnum_list;
+        {
+          auto l = delete_inums[i].lock.guard();
+          del_mnum_list = std::move(delete_inums[i].mnum_list);
+        }
+
+        for (auto &del_mnum : del_mnum_list) {
+          transaction *tr = new transaction();
+          delete_mnum_inode_safe(del_mnum, tr, true, true);
+          add_transaction_to_queue(tr, cpu);
+        }
       }
+    }
+
+    // Commit and apply pending transactions from all the per-core queues we
+    // stand for, not just the queue we added transactions to above.
+    for (int i = cpu; i < NCPU; i += ncpu)
+      flush_transaction_queue(i, true);
+    break;
+  }
+}
+
+// Flushes the mnodes on this core's dirty list that have been dirty for longer
+// than writeback_age, or (for files) hold more than writeback_bytes of dirty
+// pages, and commits them via our per-core journal. Called periodically from
+// each core's flusher thread, so that dirty state does not pile up until
+// userspace calls sync, and fsync finds little left to do.
+void
+mfs_interface::writeback(int cpu)
+{
+  kstats::inc(&kstats::writeback_pass_count);
+  kstats::timer timer(&kstats::writeback_pass_cycles);
 
-      for (auto &del_mnum : del_mnum_list) {
-        transaction *tr = new transaction();
-        delete_mnum_inode_safe(del_mnum, tr, true, true);
-
-	// Note: Queueing dependent transactions on different journals will
-	// cause a deadlock here (because we try to flush each journal
-	// completely before moving onto the next one). We sidestep this
-	// deadlock by committing all these transactions via the same journal
-	// (our per-core journal); that's why the second argument has to be
-	// 'cpu', as opposed to 'i'.
-        add_transaction_to_queue(tr, cpu);
+  fsflush_core *f = &fsflush[cpu];
+  std::vector<u64> dirty;
+  {
+    scoped_acquire l(&f->lock);
+    dirty.swap(f->dirty);
+  }
+
+  u64 now = nsectime();
+  u64 age = writeback_age * 1000000ull;
+  u64 bytes = writeback_bytes;
+  std::vector<u64> mnum_list, keep;
+  for (auto &mnum : dirty) {
+    sref<mnode> m = root_fs->mget(mnum);
+    if (!m)
+      continue;
+    if (!m->is_dirty() && m->leave_dirty_list())
+      continue;
+
+    u64 since = m->dirty_since();
+    if ((since && since + age <= now) ||
+        (m->type() == mnode::types::file && m->as_file()->dirty_bytes() >= bytes))
+      mnum_list.push_back(mnum);
+    else
+      keep.push_back(mnum);
+  }
+  kstats::inc(&kstats::writeback_backlog_count, mnum_list.size() + keep.size());
+
+  // As in fsync, but committing all of them together below.
+  for (auto &mnum : mnum_list) {
+    sref<mnode> m = root_fs->mget(mnum);
+    if (!m)
+      continue;
+
+    if (m->is_dirty()) {
+      process_metadata_log(get_tsc(), mnum, cpu);
+      if (m->type() == mnode::types::file) {
+        kstats::inc(&kstats::writeback_page_count,
+                    m->as_file()->dirty_bytes() / PGSIZE);
+        m->as_file()->sync_file(cpu);
+      } else if (m->type() == mnode::types::dir) {
+        m->as_dir()->sync_dir(cpu);
       }
+      kstats::inc(&kstats::writeback_mnode_count);
     }
+
+    if (m->is_dirty() || !m->leave_dirty_list())
+      keep.push_back(mnum);
   }
 
-  // Commit and apply pending transactions from ALL the per-core queues, not
-  // just the queue we added transactions to above.
-  for (int i = 0; i < NCPU; i++)
-    flush_transaction_queue(i, true);
+  if (!mnum_list.empty())
+    flush_transaction_queue(cpu);
+
+  if (!keep.empty()) {
+    scoped_acquire l(&f->lock);
+    for (auto &mnum : keep)
+      f->dirty.push_back(mnum);
+  }
 }
 
 void
@@ -716,6 +920,51 @@ evict_caches(mdev*, const char *buf, u32 n)
   return n;
 }
 
+// To read the writeback tunables, do:
+// $ cat /dev/writeback
+//
+// To set them, write the pass interval (msec), the dirty age (msec) and the
+// dirty-bytes threshold, e.g.:
+// $ echo 500 2000 1048576 > /dev/writeback
+static int
+writebackread(mdev*, char *dst, u32 off, u32 n)
+{
+  window_stream s(dst, off, n);
+  s.println("interval ", writeback_interval.load(), " msec");
+  s.println("age ", writeback_age.load(), " msec");
+  s.println("bytes ", writeback_bytes.load());
+  return s.get_used();
+}
+
+static int
+writebackwrite(mdev*, const char *buf, u32 n)
+{
+  u64 vals[3];
+  int nvals = 0;
+  u32 i = 0;
+
+  while (nvals < 3) {
+    while (i < n && (buf[i] == ' ' || buf[i] == '\n'))
+      i++;
+    if (i == n || buf[i] < '0' || buf[i] > '9')
+      break;
+    u64 v = 0;
+    while (i < n && buf[i] >= '0' && buf[i] <= '9')
+      v = v * 10 + (buf[i++] - '0');
+    vals[nvals++] = v;
+  }
+
+  if (nvals != 3 || vals[0] == 0) {
+    cprintf("writeback: expected \"interval age bytes\"\n");
+    return -1;
+  }
+
+  writeback_interval = vals[0];
+  writeback_age = vals[1];
+  writeback_bytes = vals[2];
+  return n;
+}
+
 void
 mfs_interface::apply_rename_pair(std::vector<rename_metadata> &rename_stack,
                                  int cpu)
@@ -766,9 +1015,9 @@ mfs_interface::apply_rename_pair(std::vector<rename_metadata> &rename_stack,
         !mfs_log_dst->operation_vec.size())
       goto unlock;
 
-    link_op =   dynamic_cast<mfs_operation_rename_link*>(
+    link_op =   mfs_op_cast<mfs_operation_rename_link>(
                                     mfs_log_dst->operation_vec.front());
-    unlink_op = dynamic_cast<mfs_operation_rename_unlink*>(
+    unlink_op = mfs_op_cast<mfs_operation_rename_unlink>(
                                     mfs_log_src->operation_vec.front());
 
     if (!(link_op && unlink_op &&
@@ -797,6 +1046,10 @@ mfs_interface::apply_rename_pair(std::vector<rename_metadata> &rename_stack,
     mfs_log_src->operation_vec.erase(mfs_log_src->operation_vec.begin());
     mfs_log_dst->operation_vec.erase(mfs_log_dst->operation_vec.begin());
 
+    // The operations past the rename can now be absorbed with those before it.
+    mfs_log_src->absorbed = false;
+    mfs_log_dst->absorbed = false;
+
   unlock:
     ; // release the locks held by src_guard and dst_guard
   }
@@ -832,67 +1085,134 @@ mfs_interface::add_op_to_transaction_queue(mfs_operation *op, int cpu,
   delete op;
 }
 
-// Absorbs file link and unlink operations that cancel each other. Absorption
-// is aborted if renames are encountered (i.e., operations are not cancelled
-// across renames).
-//
-// TODO: Perform absorption across file renames that don't cross directory
-// boundaries.
+// Absorbs file link and unlink operations that cancel each other, so that
+// names that are created and removed before they reach the disk never generate
+// journal traffic. A same-directory rename of a file that was linked earlier in
+// the log is folded into that link (link a; rename a->b becomes link b), so
+// create->rename->unlink chains and temp-file-then-rename patterns are absorbed
+// too. Absorption stops at cross-directory renames and rename barriers, which
+// have to be processed together with the operations in other logs.
 //
 // Called with mfs_log's lock and the oplog's sync_lock_ held.
 void
 mfs_interface::absorb_file_link_unlink(mfs_logical_log *mfs_log,
                                        std::vector<u64> &absorb_mnum_list)
 {
-  std::vector<unsigned long> erase_indices;
-  u64 htable_size = mfs_log->operation_vec.size() * 5;
+  if (mfs_log->absorbed)
+    return;
+  mfs_log->absorbed = true;
+
+  auto &ops = mfs_log->operation_vec;
+  std::vector<bool> erase;
+  erase.reserve(ops.size());
+  for (size_t i = 0; i < ops.size(); i++)
+    erase.push_back(false);
+
+  u64 nabsorbed = 0;
+  u64 htable_size = ops.size() * 5;
   auto linkname_to_index =
                    new chainhash<strbuf<DIRSIZ>, unsigned long>(htable_size);
 
-  for (auto it = mfs_log->operation_vec.begin();
-       it != mfs_log->operation_vec.end(); it++) {
+  for (unsigned long i = 0; i < ops.size(); i++) {
 
-    switch ((*it)->operation_type) {
+    switch (ops[i]->operation_type) {
 
     case MFS_OP_LINK_FILE:
       {
-        auto link_op = dynamic_cast<mfs_operation_link*>(*it);
+        auto link_op = mfs_op_cast<mfs_operation_link>(ops[i]);
         strbuf<DIRSIZ> name(link_op->name);
-        linkname_to_index->insert(name, it - mfs_log->operation_vec.begin());
+        linkname_to_index->insert(name, i);
       }
       break;
 
     case MFS_OP_UNLINK_FILE:
       {
         unsigned long index;
-        auto unlink_op = dynamic_cast<mfs_operation_unlink*>(*it);
+        auto unlink_op = mfs_op_cast<mfs_operation_unlink>(ops[i]);
         strbuf<DIRSIZ> name(unlink_op->name);
-        if (linkname_to_index->lookup(name, &index)) {
-          // Mark these link and unlink ops for absorption.
-          erase_indices.push_back(it - mfs_log->operation_vec.begin());
-          erase_indices.push_back(index);
-
-          dec_mfslog_linkcount(unlink_op->mnode_mnum);
-          if (!get_mfslog_linkcount(unlink_op->mnode_mnum)) {
-
-	    // The global link-count of this inode has dropped to zero, which
-	    // means that this really is the last unlink of that inode; there
-	    // are no other pending links for this inode waiting to be flushed
-	    // from other directories/oplogs. So absorb its 'create' operation
-	    // if it has not yet been flushed; and delete the inode on the disk
-	    // otherwise.
-            absorb_mnum_list.push_back(unlink_op->mnode_mnum);
-          }
+        if (!linkname_to_index->lookup(name, &index))
+          break;
+
+        // The name is free again; a later link may reuse it.
+        linkname_to_index->remove(name);
+        if (mfs_op_cast<mfs_operation_link>(ops[index])->mnode_mnum !=
+            unlink_op->mnode_mnum)
+          break;
+
+        // Mark these link and unlink ops for absorption.
+        erase[i] = true;
+        erase[index] = true;
+        nabsorbed += 2;
+
+        dec_mfslog_linkcount(unlink_op->mnode_mnum);
+        if (!get_mfslog_linkcount(unlink_op->mnode_mnum)) {
+
+	  // The global link-count of this inode has dropped to zero, which
+	  // means that this really is the last unlink of that inode; there
+	  // are no other pending links for this inode waiting to be flushed
+	  // from other directories/oplogs. So absorb its 'create' operation
+	  // if it has not yet been flushed; and delete the inode on the disk
+	  // otherwise.
+          absorb_mnum_list.push_back(unlink_op->mnode_mnum);
         }
       }
       break;
 
     case MFS_OP_RENAME_LINK_FILE:
     case MFS_OP_RENAME_LINK_DIR:
+      {
+        auto rename_link_op = mfs_op_cast<mfs_operation_rename_link>(ops[i]);
+        if (rename_link_op->src_parent_mnum != rename_link_op->dst_parent_mnum)
+          goto out;
+
+        // A same-directory rename is logged as a rename-link immediately
+        // followed by its rename-unlink (see sys_rename()).
+        assert(i + 1 < ops.size() &&
+               mfs_op_cast<mfs_operation_rename_unlink>(ops[i + 1]) &&
+               ops[i + 1]->timestamp == rename_link_op->timestamp);
+
+        unsigned long index;
+        strbuf<DIRSIZ> oldname(rename_link_op->name);
+        strbuf<DIRSIZ> newname(rename_link_op->newname);
+        bool linked = linkname_to_index->lookup(oldname, &index);
+        bool replaces = linkname_to_index->lookup(newname);
+        linkname_to_index->remove(oldname);
+        linkname_to_index->remove(newname);
+
+        // Fold the rename into the link of the old name, unless the new name
+        // still refers to another file linked in this log (the rename replaces
+        // it, which has to reach the disk as a rename).
+        if (rename_link_op->operation_type == MFS_OP_RENAME_LINK_FILE &&
+            linked && !replaces &&
+            mfs_op_cast<mfs_operation_link>(ops[index])->mnode_mnum ==
+            rename_link_op->mnode_mnum) {
+
+          // The new link takes the rename's place in the log, since operations
+          // in between may have freed the new name.
+          auto link_op = new mfs_operation_link(this, rename_link_op->timestamp,
+                                                rename_link_op->mnode_mnum,
+                                                rename_link_op->dst_parent_mnum,
+                                                rename_link_op->newname,
+                                                rename_link_op->mnode_type);
+          delete ops[i];
+          ops[i] = link_op;
+
+          erase[index] = true;
+          erase[i + 1] = true;
+          nabsorbed += 2;
+
+          linkname_to_index->insert(newname, i);
+        }
+
+        // Skip over the rename-unlink.
+        i++;
+      }
+      break;
+
     case MFS_OP_RENAME_UNLINK_FILE:
     case MFS_OP_RENAME_UNLINK_DIR:
     case MFS_OP_RENAME_BARRIER:
-      // Don't absorb operations across a rename boundary.
+      // Don't absorb operations across a cross-directory rename boundary.
       goto out;
 
     default:
@@ -901,15 +1221,21 @@ mfs_interface::absorb_file_link_unlink(mfs_logical_log *mfs_log,
   }
 
 out:
-  std::sort(erase_indices.begin(), erase_indices.end(),
-            std::greater<unsigned long>());
-
-  for (auto &idx : erase_indices) {
-    mfs_operation *op = mfs_log->operation_vec.at(idx);
-    delete op;
-    mfs_log->operation_vec.erase(mfs_log->operation_vec.begin() + idx);
+  // Remove the absorbed operations in a single pass over the log.
+  if (nabsorbed) {
+    size_t keep = 0;
+    for (size_t i = 0; i < ops.size(); i++) {
+      if (erase[i])
+        delete ops[i];
+      else
+        ops[keep++] = ops[i];
+    }
+    ops.erase(ops.begin() + keep, ops.end());
   }
 
+  if (nabsorbed)
+    kstats::inc(&kstats::fs_absorbed_op_count, nabsorbed);
+
   delete linkname_to_index;
 }
 
@@ -1009,6 +1335,11 @@ mfs_interface::process_ops_from_oplog(
   };
   std::vector<mfs_ops> op_vec;
 
+  // Number of operations consumed from the front of mfs_log. They are erased
+  // together, since erasing them one at a time from the front of the vector
+  // would make this quadratic in the length of the log.
+  size_t consumed = 0;
+
   // Synchronize the oplog loggers.
   auto guard = mfs_log->synchronize_upto_tsc(max_tsc);
 
@@ -1022,7 +1353,7 @@ mfs_interface::process_ops_from_oplog(
   // in the mfs_log (upto and including max_tsc).
   if (count == 1) {
     auto it = mfs_log->operation_vec.begin();
-    auto create_op = dynamic_cast<mfs_operation_create*>(*it);
+    auto create_op = mfs_op_cast<mfs_operation_create>(*it);
     if (create_op) {
       op_vec.push_back({*it, false});
       mfs_log->operation_vec.erase(it);
@@ -1034,15 +1365,17 @@ mfs_interface::process_ops_from_oplog(
   if (mfs_log->operation_vec.size() > 1)
     absorb_file_link_unlink(mfs_log, absorb_mnum_list);
 
-  for (auto it = mfs_log->operation_vec.begin();
-       it != mfs_log->operation_vec.end() && (*it)->timestamp <= max_tsc; ) {
+  while (consumed < mfs_log->operation_vec.size() &&
+         mfs_log->operation_vec[consumed]->timestamp <= max_tsc) {
+
+    auto it = mfs_log->operation_vec.begin() + consumed;
 
     switch ((*it)->operation_type) {
 
     case MFS_OP_LINK_FILE:
     case MFS_OP_LINK_DIR:
       {
-        auto link_op = dynamic_cast<mfs_operation_link*>(*it);
+        auto link_op = mfs_op_cast<mfs_operation_link>(*it);
         u64 mnode_inum = 0;
         if (!inum_lookup(link_op->mnode_mnum, &mnode_inum)) {
           // Add the create operation of the mnode being linked as a dependency.
@@ -1056,7 +1389,7 @@ mfs_interface::process_ops_from_oplog(
     case MFS_OP_UNLINK_FILE:
     case MFS_OP_UNLINK_DIR:
       {
-        auto unlink_op = dynamic_cast<mfs_operation_unlink*>(*it);
+        auto unlink_op = mfs_op_cast<mfs_operation_unlink>(*it);
         if (unlink_op->mnode_type == mnode::types::dir) {
           // Flush out all the directory's operations first, before unlinking it.
           auto mnum = unlink_op->mnode_mnum;
@@ -1069,7 +1402,7 @@ mfs_interface::process_ops_from_oplog(
             if (m && m->is_dirty())
               m->dirty(false);
             op_vec.push_back({*it, false});
-            it = mfs_log->operation_vec.erase(it);
+            consumed++;
             continue;
           }
 
@@ -1085,17 +1418,17 @@ mfs_interface::process_ops_from_oplog(
 
     case MFS_OP_RENAME_BARRIER:
       {
-        auto rename_barrier_op = dynamic_cast<mfs_operation_rename_barrier*>(*it);
+        auto rename_barrier_op = mfs_op_cast<mfs_operation_rename_barrier>(*it);
         if (rename_barrier_op->mnode_mnum == root_mnum) {
           // Nothing to be done.
-          it = mfs_log->operation_vec.erase(it);
+          mfs_log->operation_vec.erase(mfs_log->operation_vec.begin(), it + 1);
+          consumed = 0;
 
           // Retry absorption after processing a rename, if we are not exiting
           // this function.
-          if (mfs_log->operation_vec.size() > 1) {
+          mfs_log->absorbed = false;
+          if (mfs_log->operation_vec.size() > 1)
             absorb_file_link_unlink(mfs_log, absorb_mnum_list);
-            it = mfs_log->operation_vec.begin();
-          }
           continue;
         }
 
@@ -1108,14 +1441,14 @@ mfs_interface::process_ops_from_oplog(
             timestamp == rename_barrier_stack.back().timestamp) {
           // Already processed.
           rename_barrier_stack.pop_back();
-          it = mfs_log->operation_vec.erase(it);
+          mfs_log->operation_vec.erase(mfs_log->operation_vec.begin(), it + 1);
+          consumed = 0;
 
           // Retry absorption after processing a rename, if we are not exiting
           // this function.
-          if (mfs_log->operation_vec.size() > 1) {
+          mfs_log->absorbed = false;
+          if (mfs_log->operation_vec.size() > 1)
             absorb_file_link_unlink(mfs_log, absorb_mnum_list);
-            it = mfs_log->operation_vec.begin();
-          }
           continue;
         }
 
@@ -1131,8 +1464,8 @@ mfs_interface::process_ops_from_oplog(
     case MFS_OP_RENAME_UNLINK_FILE:
     case MFS_OP_RENAME_UNLINK_DIR:
       {
-        auto rename_link_op = dynamic_cast<mfs_operation_rename_link*>(*it);
-        auto rename_unlink_op = dynamic_cast<mfs_operation_rename_unlink*>(*it);
+        auto rename_link_op = mfs_op_cast<mfs_operation_rename_link>(*it);
+        auto rename_unlink_op = mfs_op_cast<mfs_operation_rename_unlink>(*it);
 
         // If this not a cross-directory rename, deal with it separately. If
         // that's the case indeed, we are guaranteed to find rename-link-op first,
@@ -1155,11 +1488,11 @@ mfs_interface::process_ops_from_oplog(
 #else
           op_vec.push_back({rename_link_op, true});
 #endif
-          it = mfs_log->operation_vec.erase(it);
+          it++;
 
           // The very next operation in this oplog *has* to be the corresponding
           // rename_unlink_op.
-          auto r_unlink_op = dynamic_cast<mfs_operation_rename_unlink*>(*it);
+          auto r_unlink_op = mfs_op_cast<mfs_operation_rename_unlink>(*it);
           assert(r_unlink_op && r_unlink_op->timestamp == rename_link_op->timestamp
                  && r_unlink_op->src_parent_mnum == r_unlink_op->dst_parent_mnum);
 
@@ -1168,14 +1501,14 @@ mfs_interface::process_ops_from_oplog(
 #else
           op_vec.push_back({r_unlink_op, true});
 #endif
-          it = mfs_log->operation_vec.erase(it);
+          mfs_log->operation_vec.erase(mfs_log->operation_vec.begin(), it + 1);
+          consumed = 0;
 
           // Retry absorption after processing a rename, if we are not exiting
           // this function.
-          if (mfs_log->operation_vec.size() > 1) {
+          mfs_log->absorbed = false;
+          if (mfs_log->operation_vec.size() > 1)
             absorb_file_link_unlink(mfs_log, absorb_mnum_list);
-            it = mfs_log->operation_vec.begin();
-          }
           continue;
         } else if (rename_unlink_op &&
                    rename_unlink_op->src_parent_mnum ==
@@ -1183,7 +1516,7 @@ mfs_interface::process_ops_from_oplog(
 
           // The very next operation in this oplog *has* to be the corresponding
           // rename_link_op.
-          auto r_link_op = dynamic_cast<mfs_operation_rename_link*>(*(it+1));
+          auto r_link_op = mfs_op_cast<mfs_operation_rename_link>(*(it+1));
           assert(r_link_op && r_link_op->timestamp == rename_unlink_op->timestamp
                  && r_link_op->src_parent_mnum == r_link_op->dst_parent_mnum);
 
@@ -1203,15 +1536,14 @@ mfs_interface::process_ops_from_oplog(
           op_vec.push_back({rename_unlink_op, true});
 #endif
 
-          it = mfs_log->operation_vec.erase(it);
-          it = mfs_log->operation_vec.erase(it);
+          mfs_log->operation_vec.erase(mfs_log->operation_vec.begin(), it + 2);
+          consumed = 0;
 
           // Retry absorption after processing a rename, if we are not exiting
           // this function.
-          if (mfs_log->operation_vec.size() > 1) {
+          mfs_log->absorbed = false;
+          if (mfs_log->operation_vec.size() > 1)
             absorb_file_link_unlink(mfs_log, absorb_mnum_list);
-            it = mfs_log->operation_vec.begin();
-          }
           continue;
         }
 
@@ -1262,13 +1594,16 @@ mfs_interface::process_ops_from_oplog(
     }
 
     op_vec.push_back({*it, false});
-    it = mfs_log->operation_vec.erase(it);
+    consumed++;
   }
 
-  assert(mfs_log->operation_vec.empty() ||
-         mfs_log->operation_vec.front()->timestamp > max_tsc);
+  assert(consumed == mfs_log->operation_vec.size() ||
+         mfs_log->operation_vec[consumed]->timestamp > max_tsc);
 
 out:
+  mfs_log->operation_vec.erase(mfs_log->operation_vec.begin(),
+                               mfs_log->operation_vec.begin() + consumed);
+
   if (retval == RET_INVALID)
     retval = RET_DONE;
 
@@ -1567,15 +1902,28 @@ mfs_interface::pre_process_transaction(transaction *tr)
   for (auto &b : tr->free_block_list)
     bnum_list.push_back(b);
 
-  // End of Phase 1 of the 2-Phase locking.
   acquire_inodebitmap_locks(bnum_list, BITMAP_BLOCK, tr);
 
+  // The orphan list blocks follow the bitmap blocks, so this preserves the
+  // lock ordering.
+  tr->cancel_orphan_updates();
+  std::vector<u64> orphan_list;
+  for (auto &o : tr->orphan_updates)
+    orphan_list.push_back(o.inum);
+
+  // End of Phase 1 of the 2-Phase locking.
+  acquire_inodebitmap_locks(orphan_list, ORPHAN_BLOCK, tr);
+
   // Update the free bitmap on the disk.
   if (!tr->allocated_block_list.empty())
     balloc_on_disk(tr->allocated_block_list, tr);
 
   if (!tr->free_block_list.empty())
     bfree_on_disk(tr->free_block_list, tr);
+
+  // Update the orphan list on the disk.
+  if (!tr->orphan_updates.empty())
+    orphan_update_on_disk(tr);
 }
 
 void
@@ -1901,6 +2249,18 @@ mfs_interface::flush_transaction_queue(int cpu, bool apply_transactions)
     apply_all_transactions(cpu);
 }
 
+void
+mfs_interface::flush_transaction_queue_async(int cpu)
+{
+  dwork_delay(&fs_journal[cpu]->commit_work_, cpu, FSYNC_ASYNC_DELAY);
+}
+
+void
+journal::commit_work::run()
+{
+  rootfs_interface->flush_transaction_queue(cpu_);
+}
+
 void
 mfs_interface::print_txq_stats()
 {
@@ -2252,6 +2612,69 @@ out:
   iunlock(sv6_journal[cpu]);
 }
 
+// Apply the transactions recovered from all the journals. Only transactions
+// that update the same block need to be ordered (by commit timestamp), and
+// since every journaled block is a full block image, the outcome for each
+// block is simply its most recently committed version. So instead of
+// replaying the transactions one by one, we pick that version for every block
+// and write them all out together, in block order, through a single
+// block-queue so that contiguous blocks coalesce into large disk writes.
+// Returns the number of distinct blocks written. Frees the transactions.
+u64
+mfs_interface::apply_recovered_transactions(std::vector<transaction*> &trans_vec)
+{
+  struct recovered_block {
+    u64 blocknum;
+    u64 commit_tsc;
+    transaction_diskblock *db;
+  };
+
+  std::vector<recovered_block> rblocks;
+  for (auto &tr : trans_vec) {
+    tr->deduplicate_blocks();
+    for (auto &db : tr->blocks)
+      rblocks.push_back({db->blocknum, tr->commit_tsc, db});
+  }
+
+  std::sort(rblocks.begin(), rblocks.end(),
+            [](const recovered_block &a, const recovered_block &b) {
+              if (a.blocknum != b.blocknum)
+                return a.blocknum < b.blocknum;
+              return a.commit_tsc < b.commit_tsc;
+            });
+
+  // Synchronous I/O, since we can't sleep at this stage of boot.
+  block_queue bqueue(true);
+  bitset<NDISK> disks_written;
+  u64 nblocks = 0;
+
+  for (auto b = rblocks.begin(); b != rblocks.end(); b++) {
+    if ((b+1) != rblocks.end() && b->blocknum == (b+1)->blocknum)
+      continue;
+
+    sref<buf> bp = buf::get(1, b->blocknum, true);
+    {
+      auto locked = bp->write();
+      memmove(locked->data, b->db->blockdata, BSIZE);
+    }
+    bqueue.write(1, b->db->blockdata, BSIZE, b->blocknum * BSIZE);
+    disks_written.set(blknum_to_dev(b->blocknum));
+    nblocks++;
+  }
+
+  bqueue.flush();
+
+  // The journals are reset right after this, so the applied blocks must be
+  // durable first.
+  for (auto d : disks_written)
+    disk_flush(d);
+
+  for (auto &tr : trans_vec)
+    delete tr;
+  trans_vec.clear();
+  return nblocks;
+}
+
 void
 mfs_interface::init_journal(int cpu)
 {
@@ -2647,52 +3070,145 @@ blkstatsread(mdev*, char *dst, u32 off, u32 n)
   return s.get_used();
 }
 
+// Applies the transaction's orphan list updates to the orphan list blocks.
+// Caller must hold the locks on those blocks.
 void
-mfs_interface::reclaim_unreachable_inodes()
+mfs_interface::orphan_update_on_disk(transaction *tr)
 {
-#if 0 // Resurrect this after rewriting the recovery code.
-  int cpu = myid();
-  bool do_flush = false;
-
   superblock sb;
   get_superblock(&sb);
 
-  for (u32 inum = 0; inum < sb.ninodes; inum += IPB) {
-    sref<buf> bp = buf::get(1, IBLOCK(inum));
-    auto copy = bp->read();
+  // cancel_orphan_updates() left the updates sorted by inode number, so all
+  // updates to the same orphan list block are adjacent.
+  auto &updates = tr->orphan_updates;
+  for (auto u = updates.begin(); u != updates.end(); ) {
+    u32 blocknum = OBLOCK(u->inum, sb.size, sb.ninodes);
+    sref<buf> bp = buf::get(1, blocknum);
+    auto locked = bp->write();
+    bool modified = false;
+
+    do {
+      // Adding an inode that is already listed, or removing one that is not,
+      // leaves the block as it is.
+      int bi = u->inum % BPB;
+      int m = 1 << (bi % 8);
+      if (u->add != ((locked->data[bi/8] & m) != 0)) {
+        locked->data[bi/8] ^= m;
+        modified = true;
+      }
+    } while (++u != updates.end() &&
+             OBLOCK(u->inum, sb.size, sb.ninodes) == blocknum);
+
+    if (modified)
+      bp->add_to_transaction(tr);
+  }
+}
 
-    int ninums = std::min((u32)IPB, sb.ninodes - inum);
+// Frees an unreachable inode. If it is a directory, its entries are unlinked
+// first, and the inodes that lose their last link that way are freed as well.
+// The orphan list may hold stale entries for inodes that got linked again, so
+// this checks the on-disk link counts before freeing anything. A directory
+// counts as unlinked if its link count is made up only of its sub-directories'
+// ".." entries; it may have been moved elsewhere before the crash.
+void
+mfs_interface::reclaim_orphan_inode(sref<inode> ip, transaction *tr)
+{
+  struct child {
+    sref<inode> ip;
+    char name[DIRSIZ];
+  };
+
+  // Work through the tree iteratively, since it can be arbitrarily deep.
+  std::vector<sref<inode>> worklist;
+  worklist.push_back(ip);
 
-    for (int i = 0; i < ninums; i++) {
-      const dinode *dip = (const struct dinode*)copy->data + (inum + i)%IPB;
+  while (!worklist.empty()) {
+    sref<inode> dp = std::move(worklist.back());
+    worklist.pop_back();
 
-      if (dip->nlink != 0)
+    if (dp->type != T_DIR) {
+      if (!dp->type || dp->nlink())
         continue;
+    } else {
+      // Read the directory once, both to count its sub-directories and to
+      // find the children to unlink.
+      std::vector<child> children;
+      u32 nsubdirs = 0;
+      dirent de;
+      for (size_t pos = 0; pos < dp->size; pos += sizeof(de)) {
+        assert(sizeof(de) == readi(dp, (char*) &de, pos, sizeof(de)));
+        if (!de.inum || !strncmp(de.name, ".", DIRSIZ) ||
+            !strncmp(de.name, "..", DIRSIZ))
+          continue;
 
-      u32 dead_inum = inum + i;
-      sref<inode> dead_ip = iget(1, dead_inum);
+        children.push_back(child());
+        child &c = children.back();
+        c.ip = iget(1, de.inum);
+        strncpy(c.name, de.name, DIRSIZ);
+        if (c.ip->type == T_DIR)
+          nsubdirs++;
+      }
 
-      transaction *tr = new transaction();
-      ilock(dead_ip, WRITELOCK);
-      itrunc(dead_ip, 0, tr);
-      iunlock(dead_ip);
+      if (dp->nlink() > nsubdirs)
+        continue;
+
+      for (auto &c : children) {
+        ilock(dp, WRITELOCK);
+        ilock(c.ip, WRITELOCK);
+        dirunlink(dp, c.name, c.ip->inum, c.ip->type == T_DIR, tr);
+        iunlock(c.ip);
+        iunlock(dp);
+        worklist.push_back(std::move(c.ip));
+      }
+    }
 
-      // TODO: This works fine when deleting files or empty directories, but we
-      // will have to do a recursive unlink/delete when dealing with unreachable
-      // non-empty directories.
-      free_inode(dead_ip, tr);
+    ilock(dp, WRITELOCK);
+    itrunc(dp, 0, tr);
+    iunlock(dp);
+    free_inode(dp, tr);
+  }
+}
+
+// Reclaims the inodes recorded in the orphan list, i.e., those that were left
+// unreachable on the disk by a crash. This only visits the orphan list blocks,
+// not the whole inode table. It runs before the other CPUs are started, so no
+// inode-block locks are needed.
+void
+mfs_interface::reclaim_unreachable_inodes()
+{
+  int cpu = myid();
+  bool do_flush = false;
+
+  superblock sb;
+  get_superblock(&sb);
+
+  for (u32 b = 0; b < NORPHANBLKS(sb.ninodes); b++) {
+    std::vector<u32> orphans;
+    {
+      sref<buf> bp = buf::get(1, OBLOCK(b * BPB, sb.size, sb.ninodes));
+      auto copy = bp->read();
+      for (u32 bi = 0; bi < BPB; bi++)
+        if (copy->data[bi/8] & (1 << (bi % 8)))
+          orphans.push_back(b * BPB + bi);
+    }
 
+    for (auto &inum : orphans) {
+      transaction *tr = new transaction();
+      tr->remove_orphan(inum);
+      reclaim_orphan_inode(iget(1, inum), tr);
       add_transaction_to_queue(tr, cpu);
       do_flush = true;
     }
   }
 
+  // We can't sleep here this early during boot, so let the journal's commit
+  // worker flush these out. If we crash before that, the orphan list still
+  // has these inodes and we will redo this on the next boot.
   if (do_flush)
-    flush_transaction_queue(cpu, true);
-#endif
+    flush_transaction_queue_async(cpu);
 }
 
-// Allocates a lock for every inode block and every bitmap block.
+// Allocates a lock for every inode block, bitmap block and orphan list block.
 void
 mfs_interface::alloc_inodebitmap_locks()
 {
@@ -2700,9 +3216,11 @@ mfs_interface::alloc_inodebitmap_locks()
   get_superblock(&sb);
 
   // The superblock is immediately followed by the inode blocks, which in turn
-  // are immediately followed by the bitmap blocks. So we allocate locks for
-  // block numbers 0 through the last bitmap block (inclusive).
-  int last_blocknum = BBLOCK(sb.size - 1, sb.ninodes);
+  // are immediately followed by the bitmap blocks and then the orphan list
+  // blocks. So we allocate locks for block numbers 0 through the last orphan
+  // list block (inclusive).
+  int last_blocknum = BBLOCK(sb.size - 1, sb.ninodes) +
+                      NORPHANBLKS(sb.ninodes);
 
   inodebitmap_locks.reserve(last_blocknum + 1);
 
@@ -2760,6 +3278,22 @@ mfs_interface::acquire_inodebitmap_locks(std::vector<u64> &num_list, int type,
       ;
     }
 
+    break;
+
+  case ORPHAN_BLOCK:
+    get_superblock(&sb);
+
+    for (auto &n : num_list) {
+      blocknum = OBLOCK(n, sb.size, sb.ninodes);
+      for (auto &b : block_numbers) {
+        if (b == blocknum)
+          goto skip_orphan; // Already locked
+      }
+      block_numbers.push_back(blocknum);
+     skip_orphan:
+      ;
+    }
+
     break;
   }
 
@@ -2793,38 +3327,21 @@ recover_scalefs()
   rootfs_interface = new mfs_interface();
 
   // Check all the journals and reapply committed transactions
+  u64 start = nsectime();
   std::vector<transaction*> txns_to_apply;
   for (int cpu = 0; cpu < NCPU; cpu++)
     rootfs_interface->recover_journal(cpu, txns_to_apply);
 
-  if (!txns_to_apply.empty()) {
-    std::sort(txns_to_apply.begin(), txns_to_apply.end(),
-              journal::compare_txn_tsc);
+  u64 ntxns = txns_to_apply.size();
+  u64 nblocks = 0;
+  if (!txns_to_apply.empty())
+    nblocks = rootfs_interface->apply_recovered_transactions(txns_to_apply);
 
-    for (auto &tr : txns_to_apply) {
-      cprintf("recover_scalefs: applying transaction with commit timestamp %lu\n",
-              tr->commit_tsc);
-      tr->write_to_disk_update_bufcache();
-      delete tr;
-    }
-
-    txns_to_apply.clear();
-  }
+  cprintf("recover_scalefs: applied %lu transactions (%lu blocks) in %lu ms\n",
+          ntxns, nblocks, (nsectime() - start) / 1000000);
 
   for (int cpu = 0; cpu < NCPU; cpu++)
     rootfs_interface->init_journal(cpu);
-
-  // If a newly created file (or directory) is fsynced, but its link in the
-  // parent is not flushed (by fsyncing the parent directory), the file is
-  // potentially unreachable on the disk. If we indeed crash without fsyncing
-  // the parent directory, the file (or child directory) must be deleted/
-  // reclaimed during crash-recovery upon reboot. A similar situation arises
-  // if the last link to an on-disk file or directory is removed (unlinked)
-  // but userspace still holds open file descriptors to it at the time of
-  // fsync; in that case, its inode cannot be deleted from the disk at the
-  // time of fsync, but must be postponed until reboot. We reclaim such
-  // dead/unreachable inodes here during reboot.
-  rootfs_interface->reclaim_unreachable_inodes();
 }
 
 void
@@ -2837,9 +3354,29 @@ init_scalefs()
 
   rootfs_interface->alloc_inodebitmap_locks();
 
+  // If a newly created file (or directory) is fsynced, but its link in the
+  // parent is not flushed (by fsyncing the parent directory), the file is
+  // unreachable on the disk. A similar situation arises if the last link to
+  // an on-disk file or directory is removed (unlinked) but userspace still
+  // holds open file descriptors to it at the time of fsync; in that case, its
+  // inode cannot be deleted from the disk at the time of fsync, but must be
+  // postponed until the file is closed. Such inodes are recorded in the
+  // on-disk orphan list until then, and if we crashed in the meantime, we
+  // reclaim them here. This needs the free block and inode allocators, so it
+  // can't be done along with the journal recovery.
+  rootfs_interface->reclaim_unreachable_inodes();
+
   devsw[MAJ_BLKSTATS].pread = blkstatsread;
   devsw[MAJ_EVICTCACHES].write = evict_caches;
+  devsw[MAJ_WRITEBACK].pread = writebackread;
+  devsw[MAJ_WRITEBACK].write = writebackwrite;
 
   root_mnum = rootfs_interface->load_root()->mnum_;
   /* the root mnode gets an extra reference because of its own ".." */
+
+  for (int c = 0; c < ncpu; c++) {
+    char namebuf[32];
+    snprintf(namebuf, sizeof(namebuf), "fsflush_%u", c);
+    threadpin(fsflush_thread, nullptr, namebuf, c);
+  }
 }
@@ -12,13 +12,89 @@
 #include "major.h"
 #include "rnd.hh"
 #include "lb.hh"
-#include "work.hh"
 #include "ilist.hh"
 #include "kstream.hh"
 #include "file.hh"
+#include "ipi.hh"
 
 enum { sched_debug = 0 };
 
+// A lock-free work-stealing queue of runnable procs.  Only the owning
+// core pushes, at bottom_, without locks.  Unlike a Chase-Lev deque,
+// whose owner pops LIFO from the bottom, the owner and idle cores
+// stealing work both take from top_ with a CAS, so a core runs its
+// procs in FIFO order and a thief takes the proc that has waited
+// longest.  FIFO keeps procs that yield from starving each other.
+struct runq {
+  enum { SIZE = 256 };          // Must be a power of two
+
+  runq() : top_(0), bottom_(0) { }
+
+  // Push p on the bottom.  Must be called by the owning core with
+  // interrupts disabled.  Returns false if the deque is full.
+  bool push(proc *p)
+  {
+    u64 b = bottom_.load(std::memory_order_relaxed);
+    u64 t = top_.load(std::memory_order_acquire);
+    if (b - t >= SIZE)
+      return false;
+    deque_[b % SIZE].store(p, std::memory_order_relaxed);
+    bottom_.store(b + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Take the proc at the top.  Thieves (steal is true) only take a proc
+  // that may migrate, and give up if they lose a race; the owner
+  // retries until the deque is empty.
+  proc* take(bool steal)
+  {
+    for (;;) {
+      u64 t = top_.load(std::memory_order_acquire);
+      u64 b = bottom_.load(std::memory_order_acquire);
+      if (t >= b)
+        return nullptr;
+      proc *p = deque_[t % SIZE].load(std::memory_order_relaxed);
+      // If top_ moved, p may be stale, but procs are never unmapped, so
+      // this check is only a hint; the CAS decides whether p is ours.
+      if (steal && !p->cansteal(true))
+        return nullptr;
+      if (top_.compare_exchange_strong(t, t + 1))
+        return p;
+      if (steal)
+        return nullptr;
+    }
+  }
+
+  u64 size() const
+  {
+    // Read top_ first: both only grow, so this never sees top_ > bottom_.
+    u64 t = top_.load(std::memory_order_acquire);
+    u64 b = bottom_.load(std::memory_order_acquire);
+    return b - t;
+  }
+
+private:
+  std::atomic<u64> top_ __mpalign__;
+  std::atomic<u64> bottom_ __mpalign__;
+  std::atomic<proc*> deque_[SIZE];
+};
+
+// The run queue a proc goes on.  A latency-class proc that used up a
+// whole quantum without blocking waits with the batch work for its
+// next turn, so a CPU-bound latency proc cannot starve batch procs.
+static int
+runq_class(proc *p)
+{
+  if (p->sched_class == PRIO_LATENCY && !p->sched_expired_)
+    return PRIO_LATENCY;
+  return PRIO_BATCH;
+}
+
+// Each core has a run queue per scheduling class and always runs
+// latency-class procs before batch procs.  Other cores cannot push to
+// the run queues, so procs that another core makes runnable here
+// (wakeups, forks) go to inbox_, which the owner moves to its run
+// queues before it picks the next proc.
 struct schedule : public balance_pool<schedule> {
 public:
   schedule(int id);
@@ -31,28 +107,41 @@ public:
   proc* deq();
   void dump(print_stream *);
 
-  void enq_dwork(dwork *w);
-  void try_dwork();
-
   void balance_move_to(schedule *other);
   u64 balance_count() const;
 
+  // Note the class of the proc this core is switching to.
+  void running(proc *p)
+  {
+    cur_class_.store(p == idleproc() ? PRIO_BATCH : p->sched_class,
+                     std::memory_order_relaxed);
+  }
+
+  // Return and clear whether a latency-class proc was made runnable
+  // here while this core was running something else.
+  bool need_resched()
+  {
+    return cpus[id_].resched.exchange(false);
+  }
+
+  // Only updated by the owning core.
   sched_stat stats_;
-  u64 ncansteal_;
 private:
-  void sanity(void);
+  bool push(proc *p);
+  void drain_inbox();
+
+  runq rq_[NPRIO];
+  std::atomic<int> cur_class_ __mpalign__;
 
   struct spinlock lock_ __mpalign__;
-  ilist<proc, &proc::sched_link> proc_;
-  isqueue<dwork, &dwork::link_> work_;
-  volatile bool cansteal_ __mpalign__;
+  ilist<proc, &proc::sched_link> inbox_;
   __padout__;
 };
 
 schedule::schedule(int id)
-  : balance_pool(1), id_(id), lock_("schedule::lock_", LOCKSTAT_SCHED)
+  : balance_pool(runq::SIZE), id_(id), cur_class_(PRIO_BATCH),
+    lock_("schedule::lock_", LOCKSTAT_SCHED)
 {
-  ncansteal_ = 0;
   stats_.enqs = 0;
   stats_.deqs = 0;
   stats_.steals = 0;
@@ -60,138 +149,111 @@ schedule::schedule(int id)
   stats_.idle = 0;
   stats_.busy = 0;
   stats_.schedstart = 0;
+  stats_.halts = 0;
+  stats_.preempts = 0;
 }
 
 u64 
 schedule::balance_count() const {
-  // 1 if the number of processes that in runnable state and have
-  // run long enough that they could be stolen is bigger than 1?
-  // XXX length of queue?
-  //
-  // XXX reading ncansteal could be expensive, but local core updates
-  // it and remote core reads it, experiencing a cache-line transfer
-  return cansteal_ > 0 ? 1 : 0;
+  u64 n = 0;
+  for (auto &rq : rq_)
+    n += rq.size();
+  return n;
+}
+
+bool
+schedule::push(proc *p)
+{
+  if (!rq_[runq_class(p)].push(p))
+    return false;
+  stats_.enqs++;
+  return true;
+}
+
+void
+schedule::drain_inbox(void)
+{
+  scoped_acquire x(&lock_);
+  while (!inbox_.empty()) {
+    proc &p = inbox_.front();
+    if (!push(&p))
+      break;
+    inbox_.pop_front();
+  }
 }
 
 void 
 schedule::balance_move_to(schedule* target)
 {
+  // Latency-class procs are waiting for a CPU most urgently.
   proc *victim = nullptr;
-
-  if (!cansteal_ || !tryacquire(&lock_))
-    return;
-
-  for (auto it = proc_.begin(); it != proc_.end(); ++it) {
-    if ((*it).cansteal(true)) {
-      proc_.erase(it);
-      if (--ncansteal_ == 0)
-        cansteal_ = false;
-      sanity();
-      victim = &(*it);
-    }
-  }
-  release(&lock_);
+  for (auto &rq : rq_)
+    if ((victim = rq.take(true)) != nullptr)
+      break;
   if (!victim) {
-    ++stats_.misses;
+    ++target->stats_.misses;
     return;
   }
 
+  // The proc is off every run queue, so nobody else can run or move it
+  // until we put it somewhere.
   acquire(&victim->lock);
-  if (victim->get_state() == RUNNABLE && !victim->cpu_pin &&
-      victim->curcycles != 0 && victim->curcycles > VICTIMAGE)
-  {
+  if (victim->cansteal(true)) {
     victim->curcycles = 0;
-    victim->cpuid = mycpu()->id;
+    victim->cpuid = target->id_;
     target->enq(victim);
     release(&victim->lock);
-    //cprintf("%d: stole %s from %d\n", mycpu()->id, victim->name, id_);
-    ++stats_.steals;
+    ++target->stats_.steals;
     return;
   }
-  ++stats_.misses;
-  cprintf("%d: don't steal %s---hasn't run long enough\n", 
-          mycpu()->id, victim->name);
-#if 0
-  // XXX why is this code here?  you should only steal a runnable process
-  // it has run for a while on the cpu, or not all.
-  if (victim->get_state() == RUNNABLE) {
-    target->enq(victim);
-  }
-#endif
+  // It looked stealable before we took it but is not; give it back.
+  ++target->stats_.misses;
+  enq(victim);
   release(&victim->lock);
 }
 
 void
 schedule::enq(proc* p)
 {
-  scoped_acquire x(&lock_);
-  proc_.push_back(p);
-  if (p->cansteal(true))
-    if (ncansteal_++ == 0) {
-      cansteal_ = true;
-    }
-  sanity();
-  stats_.enqs++;
+  pushcli();
+  bool local = myid() == id_;
+  bool pushed = local && push(p);
+  popcli();
+  if (!pushed) {
+    scoped_acquire x(&lock_);
+    inbox_.push_back(p);
+  }
+
+  // Wakeup preemption: ask this core to reschedule as soon as it
+  // returns from a trap or system call, rather than at the end of the
+  // running batch proc's quantum.
+  if (runq_class(p) == PRIO_LATENCY &&
+      cur_class_.load(std::memory_order_relaxed) != PRIO_LATENCY &&
+      !cpus[id_].resched.exchange(true) && !local)
+    poke_cpu(id_);
 }
 
 proc*
 schedule::deq(void)
 {   
-  if (proc_.empty())
-    return nullptr;
-  // Remove from head
-  scoped_acquire x(&lock_);
-  if (proc_.empty()) 
-    return nullptr;
-  proc &p = proc_.front();
-  proc_.pop_front();
-  if (p.cansteal(true))
-    if (--ncansteal_ == 0)
-      cansteal_ = false;
-  sanity();
-  stats_.deqs++;
-  return &p;
+  if (!inbox_.empty())
+    drain_inbox();
+  for (auto &rq : rq_) {
+    if (proc *p = rq.take(false)) {
+      stats_.deqs++;
+      return p;
+    }
+  }
+  return nullptr;
 }
 
 void
 schedule::dump(print_stream *s)
 {
-  s->print(" enq ", stats_.enqs, " deqs ", stats_.deqs, " steals ", stats_.steals, " misses ", stats_.misses);
-}
-
-void
-schedule::sanity(void)
-{
-#if DEBUG
-  u64 n = 0;
-
-  for (auto &p : proc_) 
-    if (p.cansteal(true))
-      n++;
-  
-  if (n != ncansteal_)
-    panic("schedule::sanity: %lu != %lu", n, ncansteal_);
-#endif
-}
-
-void
-schedule::enq_dwork(dwork *w)
-{
-  scoped_acquire x(&lock_);
-  work_.push_back(w);
-}
-
-void
-schedule::try_dwork(void)
-{
-  auto l = lock_.guard();
-  while (!work_.empty()) {
-    auto &w = work_.front();
-    work_.pop_front();
-    l.release();
-    w.run();
-    l = lock_.guard();
-  }
+  s->print(" enq ", stats_.enqs, " deqs ", stats_.deqs,
+           " steals ", stats_.steals, " misses ", stats_.misses,
+           " halts ", stats_.halts, " preempts ", stats_.preempts,
+           " idle ", stats_.idle, " busy ", stats_.busy);
 }
 
 struct sched_dir {
@@ -211,12 +273,21 @@ public:
     return schedule_[id];
   }
 
-  void steal() {
+  // Try to steal a proc for this core, first from random cores on
+  // this socket, then from random cores on other sockets.  Returns
+  // true if this core has something to run.
+  bool steal() {
     if (!SCHED_LOAD_BALANCE)
-      return;
+      return false;
     pushcli();
+    schedule *s = schedule_[mycpu()->id];
+    u64 steals = s->stats_.steals;
     b_.balance();
+    bool stolen = s->stats_.steals != steals;
+    if (!stolen)
+      s->stats_.halts++;
     popcli();
+    return stolen;
   }
 
   void addrun(struct proc* p) {
@@ -224,14 +295,6 @@ public:
     schedule_[p->cpuid]->enq(p);
   }
 
-  void pushwork(struct dwork *w, int cpu) {
-    schedule_[cpu]->enq_dwork(w);
-  }
-
-  void trywork() {
-    schedule_[mycpu()->id]->try_dwork();
-  }
-
   proc* next() {
     return schedule_[mycpu()->id]->deq();
   }
@@ -240,6 +303,7 @@ public:
   sched(void)
   {
     extern void forkret(void);
+    extern u64 cpuhz;
     int intena;
     proc* prev;
     proc* next;
@@ -259,9 +323,14 @@ public:
     if(readrflags()&FL_IF)
       panic("sched interruptible");
     intena = mycpu()->intena;
-    myproc()->curcycles += rdtsc() - myproc()->tsc;
-
-    // Interrupts are disabled
+    u64 burst = rdtsc() - myproc()->tsc;
+    myproc()->curcycles += burst;
+    myproc()->sched_expired_ = myproc()->get_state() == RUNNABLE &&
+      burst >= cpuhz / 1000 * QUANTUM;
+
+    // Interrupts are disabled.  Any preemption request is served by
+    // this pass; a wakeup after this point makes a new one.
+    schedule_[mycpu()->id]->need_resched();
     next = this->next();
 
     u64 t = rdtsc();
@@ -288,6 +357,7 @@ public:
       panic("non-RUNNABLE next %s %u", next->name, next->get_state());
 
     prev = myproc();
+    schedule_[mycpu()->id]->running(next);
     mycpu()->proc = next;
     mycpu()->prev = prev;
 
@@ -319,6 +389,16 @@ public:
     post_swtch();
   }
 
+  bool need_resched() {
+    pushcli();
+    schedule *s = schedule_[mycpu()->id];
+    bool r = s->need_resched();
+    if (r)
+      s->stats_.preempts++;
+    popcli();
+    return r;
+  }
+
   void
   scheddump(print_stream *s)
   {
@@ -340,7 +420,6 @@ post_swtch(void)
       mycpu()->prev != idleproc())
     addrun(mycpu()->prev);
   release(&mycpu()->prev->lock);
-  thesched_dir.trywork();
 }
 
 void
@@ -355,13 +434,6 @@ addrun(struct proc* p)
   thesched_dir.addrun(p);
 }
 
-int
-dwork_push(struct dwork *w, int cpu)
-{
-  thesched_dir.pushwork(w, cpu);
-  return 0;
-}
-
 static int
 statread(mdev* m, char *dst, u32 off, u32 n)
 {
@@ -370,11 +442,16 @@ statread(mdev* m, char *dst, u32 off, u32 n)
   return s.get_used();
 }
 
+bool
+need_resched(void)
+{
+  return thesched_dir.need_resched();
+}
+
 int
 steal(void)
 {
-  thesched_dir.steal();
-  return 0;
+  return thesched_dir.steal();
 }
 
 void
@@ -0,0 +1,266 @@
+#include "types.h"
+#include "kernel.hh"
+#include "cpu.hh"
+#include "spinlock.hh"
+#include "condvar.hh"
+#include "proc.hh"
+#include "vm.hh"
+#include "mnode.hh"
+#include "disk.hh"
+#include "swap.hh"
+#include "kstats.hh"
+#include "fs.h"
+#include <algorithm>
+
+// The swap area starts right after the file system image.
+static const u64 swap_base = (u64)NMEGS * BLKS_PER_MEG * BSIZE;
+
+// Number of slots in the swap area, or 0 if swapping is disabled.
+static u64 nslots;
+
+// A CPU's range of swap slots.
+struct swap_slots
+{
+  spinlock lock;
+  u64 base;                     // First slot in this range
+  u64 count;                    // Number of slots, a multiple of 64
+  u64 nfree;
+  u64 hint;                     // Bitmap word to search first
+  u64 *bitmap;                  // Set bits are allocated slots
+
+  swap_slots()
+    : lock("swap_slots", LOCKSTAT_SWAP), base(0), count(0), nfree(0),
+      hint(0), bitmap(nullptr) { }
+
+  bool alloc(u64 *slot)
+  {
+    scoped_acquire l(&lock);
+    if (nfree == 0)
+      return false;
+    u64 nwords = count / 64;
+    for (u64 i = 0; i < nwords; i++) {
+      u64 w = (hint + i) % nwords;
+      if (bitmap[w] == ~0ull)
+        continue;
+      int bit = __builtin_ctzll(~bitmap[w]);
+      bitmap[w] |= 1ull << bit;
+      nfree--;
+      hint = w;
+      *slot = base + w * 64 + bit;
+      return true;
+    }
+    panic("swap_slots::alloc: nfree %lu but bitmap full", nfree);
+  }
+
+  void free(u64 slot)
+  {
+    scoped_acquire l(&lock);
+    u64 i = slot - base;
+    assert(bitmap[i / 64] & (1ull << (i % 64)));
+    bitmap[i / 64] &= ~(1ull << (i % 64));
+    nfree++;
+  }
+} __mpalign__;
+
+// Not a per-CPU variable because initswap sets up every CPU's range
+// before the other CPUs boot.
+static swap_slots slots[NCPU];
+
+static u64 slots_per_cpu;
+
+static bool
+alloc_slot(u64 *slot)
+{
+  // Try this CPU's range first, then steal from the others.
+  int me = myid();
+  for (int i = 0; i < ncpu; i++)
+    if (slots[(me + i) % ncpu].alloc(slot))
+      return true;
+  return false;
+}
+
+static void
+free_slot(u64 slot)
+{
+  slots[slot / slots_per_cpu].free(slot);
+}
+
+/*
+ * swap_entry
+ */
+
+sref<swap_entry>
+swap_entry::alloc(sref<page_info> page)
+{
+  u64 slot;
+  if (!nslots || !alloc_slot(&slot))
+    return sref<swap_entry>();
+  swap_entry *e = new (std::nothrow) swap_entry(slot, std::move(page));
+  if (!e) {
+    free_slot(slot);
+    return sref<swap_entry>();
+  }
+  kstats::inc(&kstats::swap_out_count);
+  return sref<swap_entry>::transfer(e);
+}
+
+swap_entry::~swap_entry()
+{
+  free_slot(slot_);
+}
+
+u64
+swap_entry::offset() const
+{
+  return swap_base + slot_ * PGSIZE;
+}
+
+sref<page_info>
+swap_entry::get_page()
+{
+  {
+    scoped_acquire l(&lock_);
+    if (page_)
+      return page_;
+  }
+
+  // We must block.  If scheduling is disabled, this could lead to
+  // deadlock, so throw a blocking_io exception with an IO retry.
+  if (check_critical(critical_mask::NO_SCHED))
+    throw blocking_io(sref<swap_entry>::newref(this));
+
+  load();
+  scoped_acquire l(&lock_);
+  return page_;
+}
+
+void
+swap_entry::load()
+{
+  {
+    scoped_acquire l(&lock_);
+    if (page_)
+      return;
+  }
+
+  kstats::timer timer(&kstats::swap_in_cycles);
+  char *p = kalloc("swap page");
+  if (!p)
+    throw_bad_alloc();
+  disk_read(ROOTDEV, p, PGSIZE, offset());
+  auto pi = sref<page_info>::transfer(new (page_info::of(p)) page_info());
+
+  // If another vmap sharing this entry read it in concurrently, use
+  // its page and drop ours.
+  scoped_acquire l(&lock_);
+  if (!page_) {
+    page_ = std::move(pi);
+    kstats::inc(&kstats::swap_in_count);
+  }
+}
+
+void
+swap_entry::write(block_queue *bq)
+{
+  // Only kswapd calls this, before written(), so page_ is stable.
+  bq->write(ROOTDEV, (const char*)page_->va(), BSIZE, offset());
+}
+
+void
+swap_entry::written()
+{
+  scoped_acquire l(&lock_);
+  page_.reset();
+}
+
+/*
+ * kswapd
+ */
+
+static spinlock kswapd_lock("kswapd", LOCKSTAT_SWAP);
+static condvar kswapd_cv("kswapd");
+static std::atomic<bool> swap_pressure;
+
+void
+swap_note_pressure(void)
+{
+  swap_pressure = true;
+}
+
+void
+swap_wakeup(void)
+{
+  if (!nslots)
+    return;
+  swap_pressure = true;
+  scoped_acquire l(&kswapd_lock);
+  kswapd_cv.wake_all();
+}
+
+static void
+kswapd(void *x)
+{
+  std::vector<sref<swap_entry> > batch;
+  batch.reserve(SWAP_BATCH);
+
+  for (;;) {
+    {
+      scoped_acquire l(&kswapd_lock);
+      if (!swap_pressure)
+        kswapd_cv.sleep_to(&kswapd_lock,
+                           nsectime() + ((u64)SWAP_INTERVAL)*1000000ull);
+    }
+    if (!swap_pressure.exchange(false))
+      continue;
+
+    if (vmap::swap_out_all(&batch, SWAP_BATCH) == 0)
+      continue;
+
+    // Write the batch in slot order so block_queue can merge adjacent
+    // slots into large writes.
+    std::sort(batch.begin(), batch.end(),
+              [](const sref<swap_entry> &a, const sref<swap_entry> &b) {
+                return a->offset() < b->offset();
+              });
+    block_queue bq;
+    for (auto &e : batch)
+      e->write(&bq);
+    bq.flush();
+    for (auto &e : batch)
+      e->written();
+    batch.clear();
+  }
+}
+
+void
+initswap(void)
+{
+  if (!SWAP_MEGS || disk_capacity() < swap_base + ((u64)SWAP_MEGS << 20)) {
+    if (VERBOSE)
+      cprintf("initswap: no room for swap area, swapping disabled\n");
+    return;
+  }
+
+  // Give each CPU a range of slots that is a multiple of 64, so each
+  // range's bitmap is a whole number of words.
+  slots_per_cpu = ((u64)SWAP_MEGS << 20) / PGSIZE / ncpu / 64 * 64;
+  if (slots_per_cpu == 0)
+    return;
+  u64 bitmap_bytes = slots_per_cpu / 8 * ncpu;
+  u64 *bitmap = (u64*)kalloc("swap bitmap", PGROUNDUP(bitmap_bytes));
+  if (!bitmap)
+    panic("initswap: cannot allocate bitmap");
+  memset(bitmap, 0, bitmap_bytes);
+
+  for (int c = 0; c < ncpu; c++) {
+    slots[c].base = c * slots_per_cpu;
+    slots[c].count = slots_per_cpu;
+    slots[c].nfree = slots_per_cpu;
+    slots[c].bitmap = bitmap + c * (slots_per_cpu / 64);
+  }
+  nslots = slots_per_cpu * ncpu;
+
+  threadpin(kswapd, 0, "kswapd", 0);
+  cprintf("initswap: %lu MB swap at disk offset %#lx\n",
+          nslots * PGSIZE >> 20, swap_base);
+}
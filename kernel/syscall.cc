@@ -13,6 +13,7 @@ extern "C" int __uaccess_mem(void* dst, const void* src, u64 size);
 extern "C" int __uaccess_str(char* dst, const char* src, u64 size);
 extern "C" uptr __uaccess_strend(uptr src, u64 limit);
 extern "C" int __uaccess_int64(uptr addr, u64* ip);
+extern "C" int __uaccess_cmpxchg64(uptr addr, u64* oldp, u64 nval);
 
 // XXX(austin) Many of these functions should take userptr<void>
 // instead of regular pointers
@@ -65,6 +66,19 @@ fetchint64(uptr addr, u64 *ip)
   return __uaccess_int64(addr, ip);
 }
 
+// Atomically replace the user word at addr with nval if it equals
+// *oldp.  Returns 0 if it did, or 1 after storing the word's current
+// value in *oldp if it did not, or -1 if addr cannot be written.
+int
+cmpxchgint64(uptr addr, u64 *oldp, u64 nval)
+{
+  if(mycpu()->ncli != 0)
+    panic("cmpxchgint64: cli'd");
+  if ((uintptr_t)addr >= USERTOP || (uintptr_t)addr + sizeof(*oldp) >= USERTOP)
+    return -1;
+  return __uaccess_cmpxchg64(addr, oldp, nval);
+}
+
 std::unique_ptr<char[]>
 userptr_str::load_alloc(std::size_t limit, std::size_t *len_out) const
 {
@@ -185,6 +185,79 @@ sys_fsync(int fd)
   return f->fsync();
 }
 
+// Start an fsync of fd without waiting for it to reach the disk, and
+// store a token for it in *tok.  A pipeline can issue fsync_async()
+// for many files and then make them all durable with one fsync_wait()
+// on the last token, which costs a single journal commit.
+//SYSCALL
+int
+sys_fsync_async(int fd, userptr<struct fsync_token> tok)
+{
+  sref<file> f = getfile(fd);
+  if (!f)
+    return -1;
+  struct fsync_token t;
+  if (f->fsync_async(&t) < 0)
+    return -1;
+  if (!tok.store(&t))
+    return -1;
+  return 0;
+}
+
+// Wait until the fsync named by *tok is durable, committing its
+// journal now rather than waiting for the background commit.  With
+// FSYNC_WAIT_POLL, return 1 instead of waiting if it is not durable
+// yet.
+//SYSCALL
+int
+sys_fsync_wait(userptr<struct fsync_token> tok, int flags)
+{
+  struct fsync_token t;
+  if (!tok.load(&t))
+    return -1;
+  if (t.cpu < 0 || t.cpu >= NCPU)
+    return -1;
+
+  journal *j = rootfs_interface->fs_journal[t.cpu];
+  if (j->get_committed_tsc() >= t.tsc)
+    return 0;
+  // A token from fsync_async can't be ahead of its journal's queue;
+  // waiting for a forged one could block forever.
+  if (t.tsc > j->get_enqueued_tsc())
+    return -1;
+  if (flags & FSYNC_WAIT_POLL)
+    return 1;
+  rootfs_interface->flush_transaction_queue(t.cpu);
+  j->wait_for_commit(t.tsc);
+  return 0;
+}
+
+// Set the NUMA placement policy (NUMA_POLICY_*) of the page cache
+// pages of the file open as fd.
+//SYSCALL
+int
+sys_fnumapolicy(int fd, int policy)
+{
+  if (policy != NUMA_POLICY_FIRST_TOUCH && policy != NUMA_POLICY_INTERLEAVE &&
+      policy != NUMA_POLICY_MIGRATE)
+    return -1;
+
+  sref<file> f = getfile(fd);
+  if (!f)
+    return -1;
+
+  file* ff = f.get();
+  if (&typeid(*ff) != &typeid(file_mnode))
+    return -1;
+
+  file_mnode* fm = static_cast<file_mnode*>(ff);
+  if (fm->m->type() != mnode::types::file)
+    return -1;
+
+  fm->m->as_file()->set_numa_policy(policy);
+  return 0;
+}
+
 //SYSCALL
 ssize_t
 sys_read(int fd, userptr<void> p, size_t n)
@@ -344,6 +417,38 @@ sys_link(userptr_str old_path, userptr_str new_path)
   return 0;
 }
 
+// A directory on the path from a rename's destination to the root, with
+// a read section on its rename sequence count taken before reading its parent.
+struct dir_ancestor {
+  sref<mnode> md;
+  seqcount<u64>::reader seq;
+};
+
+// Collect md and its ancestors, up to and including the root directory.
+// Returns false if one of them was removed concurrently.
+static bool
+dir_ancestors(sref<mnode> md, std::vector<dir_ancestor> *chain)
+{
+  for (;;) {
+    chain->push_back({md, md->as_dir()->rename_seq.read_begin()});
+    if (md->mnum_ == root_mnum)
+      return true;
+    md = md->as_dir()->lookup(strbuf<DIRSIZ>(".."));
+    if (!md)
+      return false;
+  }
+}
+
+// Returns true if a directory in chain was moved since it was collected.
+static bool
+dir_ancestors_changed(const std::vector<dir_ancestor> &chain)
+{
+  for (auto &a : chain)
+    if (a.seq.need_retry())
+      return true;
+  return false;
+}
+
 //SYSCALL
 int
 sys_rename(userptr_str old_path, userptr_str new_path)
@@ -399,20 +504,29 @@ sys_rename(userptr_str old_path, userptr_str new_path)
       return 0;
     }
 
+    // A cross-directory directory rename must not move a directory into its
+    // own subtree, and needs the chain of ancestors of the destination to log
+    // rename barriers along.  Rather than serializing such renames on a
+    // filesystem-wide lock, read the ancestors of the destination
+    // optimistically and validate them against their rename sequence counts
+    // right before performing the rename (see below).  Only renames that move
+    // a directory on that chain force a retry.
+    bool dir_rename = mdold != mdnew && mfold->type() == mnode::types::dir;
+    std::vector<dir_ancestor> newchain;
     lock_guard<sleeplock> lk;
 
-    if (mdold != mdnew && mfold->type() == mnode::types::dir) {
-      lk = root_fs->dir_rename_lock.guard(); // Filesystem-wide lock.
+    if (dir_rename) {
+      if (!dir_ancestors(mdnew, &newchain))
+        return -1;
 
       // Loop avoidance: Abort if the source is an ancestor of the destination.
-      sref<mnode> md = mdnew;
-      while (1) {
-        if (mfold == md)
+      // Revalidated along with the chain before performing the rename.
+      for (auto &a : newchain)
+        if (a.md == mfold)
           return -1;
-        if (md->mnum_ == root_mnum)
-          break;
-        md = md->as_dir()->lookup(strbuf<DIRSIZ>(".."));
-      }
+
+      // Serializes renames of this directory, which write its sequence count.
+      lk = mfold->as_dir()->rename_lock.guard();
     }
 
     u64 tsc_val = get_tsc();
@@ -425,19 +539,10 @@ sys_rename(userptr_str old_path, userptr_str new_path)
     if (mdold != mdnew) {
       mnode_mnums.push_back(mdold->mnum_);
 
-      if (mfold->type() == mnode::types::dir) {
-        sref<mnode> mdparent, md = mdnew;
-        while (1) {
-          mdparent = md->as_dir()->lookup(strbuf<DIRSIZ>(".."));
-          // Don't add mdnew->mnum_ twice; we already added it once above.
-          if (md != mdnew)
-            mnode_mnums.push_back(md->mnum_);
-
-          if (md->mnum_ == root_mnum)
-            break;
-          md = mdparent;
-        }
-      }
+      // Don't add mdnew->mnum_ twice; we already added it once above.
+      for (size_t i = 1; i < newchain.size(); i++)
+        if (newchain[i].md != mdold)
+          mnode_mnums.push_back(newchain[i].md->mnum_);
     }
 
     std::sort(mnode_mnums.begin(), mnode_mnums.end());
@@ -453,44 +558,43 @@ sys_rename(userptr_str old_path, userptr_str new_path)
     // performing the rename, to make sure that the linearization point of the
     // rename is contained strictly between all pairs of _op_start() and _op_end().
     // Thus, there should be no call to _op_start() after performing the rename.
-    // Since we hold a global lock for directory renames, the directory hierarchy
-    // won't change here, which makes this job easy.
-    if (mdold != mdnew && mfold->type() == mnode::types::dir) {
-      sref<mnode> mdparent, md = mdnew;
-      while (1) {
-        mdparent = md->as_dir()->lookup(strbuf<DIRSIZ>(".."));
-        // Don't add to mdnew twice; we already added to it once above.
-        if (md != mdnew)
-          rootfs_interface->metadata_op_start(md->mnum_, cpu, tsc_val);
-
-        if (md->mnum_ == root_mnum)
-          break;
-        md = mdparent;
-      }
-    }
+    for (size_t i = 1; i < newchain.size(); i++)
+      if (newchain[i].md != mdold)
+        rootfs_interface->metadata_op_start(newchain[i].md->mnum_, cpu, tsc_val);
 
     // Perform the actual rename operation in MemFS.
-    if (mdnew->as_dir()->replace_from(newname, mfroadblock,
+    bool renamed;
+    {
+      seqcount<u64>::writer w;
+      if (dir_rename) {
+        // Announce the move before checking the chains, so that of two
+        // renames that would each move a directory into the other's subtree,
+        // at least one sees the other and retries.
+        w = mfold->as_dir()->rename_seq.write_begin();
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+      }
+
+      renamed = !(dir_rename && dir_ancestors_changed(newchain)) &&
+        mdnew->as_dir()->replace_from(newname, mfroadblock,
           mdold, oldname, mfold,
           (mfold->type() == mnode::types::dir) ? mfold->as_dir() : nullptr,
-          &tsc)) {
+          &tsc);
+    }
+
+    if (renamed) {
 
-      if (mdold != mdnew && mfold->type() == mnode::types::dir) {
+      if (dir_rename) {
 
         // Add rename barriers to the destination directory and all its
         // in-memory ancestors, with the same timestamp.
         mfs_operation *op_rename_barrier;
-        sref<mnode> mdparent, md = mdnew;
-        while (1) {
-          mdparent = md->as_dir()->lookup(strbuf<DIRSIZ>(".."));
+        for (size_t i = 0; i < newchain.size(); i++) {
+          auto &md = newchain[i].md;
+          auto &mdparent = i + 1 < newchain.size() ? newchain[i + 1].md : md;
           op_rename_barrier = new mfs_operation_rename_barrier(rootfs_interface,
                                   tsc, md->mnum_, mdparent->mnum_, mfold->type());
 
           rootfs_interface->add_to_metadata_log(md->mnum_, cpu, op_rename_barrier);
-
-          if (md->mnum_ == root_mnum)
-            break;
-          md = mdparent;
         }
       }
 
@@ -510,52 +614,26 @@ sys_rename(userptr_str old_path, userptr_str new_path)
                              oldname.buf_, mfold->mnum_, mdold->mnum_,
                              newname.buf_, mdnew->mnum_, mfold->type());
       rootfs_interface->add_to_metadata_log(mdold->mnum_, cpu, op_rename_unlink);
-
-      tsc_val = get_tsc();
-
-      if (mdold != mdnew && mfold->type() == mnode::types::dir) {
-        sref<mnode> mdparent, md = mdnew;
-        while (1) {
-          mdparent = md->as_dir()->lookup(strbuf<DIRSIZ>(".."));
-          // Don't add to mdnew twice; we will add to it again below anyway.
-          if (md != mdnew)
-            rootfs_interface->metadata_op_end(md->mnum_, cpu, tsc_val);
-
-          if (md->mnum_ == root_mnum)
-            break;
-          md = mdparent;
-        }
-      }
-
-      if (mdold != mdnew)
-        rootfs_interface->metadata_op_end(mdold->mnum_, cpu, tsc_val);
-      rootfs_interface->metadata_op_end(mdnew->mnum_, cpu, tsc_val);
-      return 0;
     }
 
     tsc_val = get_tsc();
 
-    if (mdold != mdnew && mfold->type() == mnode::types::dir) {
-      sref<mnode> mdparent, md = mdnew;
-      while (1) {
-        mdparent = md->as_dir()->lookup(strbuf<DIRSIZ>(".."));
-        // Don't add to mdnew twice; we will add to it again below anyway.
-        if (md != mdnew)
-          rootfs_interface->metadata_op_end(md->mnum_, cpu, tsc_val);
-
-        if (md->mnum_ == root_mnum)
-          break;
-        md = mdparent;
-      }
-    }
+    // Don't add to mdnew twice; we will add to it again below anyway.
+    for (size_t i = 1; i < newchain.size(); i++)
+      if (newchain[i].md != mdold)
+        rootfs_interface->metadata_op_end(newchain[i].md->mnum_, cpu, tsc_val);
 
     if (mdold != mdnew)
       rootfs_interface->metadata_op_end(mdold->mnum_, cpu, tsc_val);
     rootfs_interface->metadata_op_end(mdnew->mnum_, cpu, tsc_val);
 
+    if (renamed)
+      return 0;
+
     /*
      * The inodes for the source and/or the destination file names
-     * must have changed.  Retry.
+     * must have changed, or a concurrent rename moved one of the
+     * directories whose ancestry we checked.  Retry.
      */
   }
 
@@ -943,6 +1021,60 @@ sys_pipe(userptr<int> fd)
   return sys_pipe2(fd, 0);
 }
 
+// Move up to len bytes from fd_in to fd_out, at least one of which
+// must be a pipe, passing pages by reference where possible.  As with
+// pread/pwrite, a non-null offset is used (and updated) instead of
+// the file offset; offsets are not allowed for pipes.
+//SYSCALL
+ssize_t
+sys_splice(int fd_in, userptr<off_t> off_in, int fd_out,
+           userptr<off_t> off_out, size_t len, int flags)
+{
+  sref<file> in = getfile(fd_in);
+  sref<file> out = getfile(fd_out);
+  if (!in || !out)
+    return -1;
+
+  struct pipe *pin = in->get_pipe(false);
+  struct pipe *pout = out->get_pipe(true);
+  off_t offin, offout;
+  if (off_in && (pin || !off_in.load(&offin)))
+    return -1;
+  if (off_out && (pout || !off_out.load(&offout)))
+    return -1;
+
+  ssize_t r;
+  if (pin && pout) {
+    r = pipesplice(pin, pout, len, flags);
+  } else if (pout) {
+    r = pipesplicein(in.get(), off_in ? &offin : nullptr, pout, len, flags);
+    if (r > 0 && off_in && !off_in.store(&offin))
+      return -1;
+  } else if (pin) {
+    r = pipespliceout(pin, out.get(), off_out ? &offout : nullptr, len, flags);
+    if (r > 0 && off_out && !off_out.store(&offout))
+      return -1;
+  } else {
+    return -1;
+  }
+  return r;
+}
+
+// Append len bytes of memory at buf to the pipe fd by reference.  The
+// caller must not modify the memory until it has been read.
+//SYSCALL
+ssize_t
+sys_vmsplice(int fd, userptr<void> buf, size_t len, int flags)
+{
+  sref<file> f = getfile(fd);
+  if (!f)
+    return -1;
+  struct pipe *p = f->get_pipe(true);
+  if (!p)
+    return -1;
+  return pipevmsplice(p, (uptr)buf, len, flags);
+}
+
 //SYSCALL
 int
 sys_readdir(int dirfd, const userptr<char> prevptr, userptr<char> nameptr)
@@ -973,6 +1105,71 @@ sys_readdir(int dirfd, const userptr<char> prevptr, userptr<char> nameptr)
   return 1;
 }
 
+// Fill ents with up to n entries of directory dirfd, starting at *cursor,
+// and advance *cursor past them.  Returns the number of entries filled,
+// which is 0 at the end of the directory.  Unlike readdir, which finds
+// its place again from the previous name on every call, the cursor
+// points straight at a hash bucket, so enumerating a large directory
+// takes a few calls and one pass over its table.
+//SYSCALL
+ssize_t
+sys_getdents(int dirfd, userptr<struct getdents_cursor> ucursor,
+             userptr<struct getdents_ent> ents, size_t n)
+{
+  sref<file> df = getfile(dirfd);
+  if (!df)
+    return -1;
+
+  file* dff = df.get();
+  if (&typeid(*dff) != &typeid(file_mnode))
+    return -1;
+
+  file_mnode* dfm = static_cast<file_mnode*>(dff);
+  if (dfm->m->type() != mnode::types::dir)
+    return -1;
+
+  struct getdents_cursor cur;
+  if (!ucursor.load(&cur))
+    return -1;
+  static_assert(sizeof(cur.name) > DIRSIZ, "getdents_cursor name too short");
+  static_assert(sizeof(getdents_ent::name) > DIRSIZ, "getdents_ent name too short");
+  cur.name[DIRSIZ] = 0;
+
+  // Bound the kernel buffer; the caller can call again for more.
+  n = std::min(n, (size_t)256);
+  std::vector<struct getdents_ent> out;
+  std::vector<std::pair<strbuf<DIRSIZ>, u64>> names;
+  mdir* md = dfm->m->as_dir();
+
+  while (out.size() < n) {
+    strbuf<DIRSIZ> prev(cur.name);
+    names.clear();
+    if (!md->enumerate_bucket(cur.bucket, cur.name[0] ? &prev : nullptr,
+                              &names))
+      break;
+
+    for (auto &e : names) {
+      if (out.size() == n)
+        goto full;
+      struct getdents_ent ent{};
+      ent.mnum = e.second;
+      ent.type = mnode::type_of(e.second);
+      strncpy(ent.name, e.first.buf_, DIRSIZ);
+      out.push_back(ent);
+      strncpy(cur.name, e.first.buf_, DIRSIZ);
+    }
+    cur.bucket++;
+    cur.name[0] = 0;
+  }
+
+full:
+  if (!out.empty() && !ents.store(out.data(), out.size()))
+    return -1;
+  if (!ucursor.store(&cur))
+    return -1;
+  return out.size();
+}
+
 //SYSCALL {"uargs":["const char *upath", "char * const uargv[]", "const void *actions", "size_t actions_len"]}
 int
 sys_sys_spawn(userptr_str upath, userptr<userptr_str> uargv,
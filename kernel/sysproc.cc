@@ -268,22 +268,63 @@ sys_setaffinity(int cpu)
   return myproc()->set_cpu_pin(cpu);
 }
 
+// Set the scheduling class (PRIO_LATENCY or PRIO_BATCH) of the calling
+// thread.  which must be PRIO_CLASS, and who must be 0 or the caller's
+// pid.
 //SYSCALL
+int
+sys_setpriority(int which, int who, int prio)
+{
+  if (which != PRIO_CLASS || (who != 0 && who != myproc()->pid))
+    return -1;
+  if (prio != PRIO_LATENCY && prio != PRIO_BATCH)
+    return -1;
+  myproc()->sched_class = prio;
+  return 0;
+}
+
+//SYSCALL
+int
+sys_getpriority(int which, int who)
+{
+  if (which != PRIO_CLASS || (who != 0 && who != myproc()->pid))
+    return -1;
+  return myproc()->sched_class;
+}
+
+// val2 is the timeout for the wait operations and the second count
+// for the others; see futex.h.
+//SYSCALL {"uargs":["const u64* addr", "int op", "u64 val", "u64 val2", "const u64* addr2", "u64 val3"]}
 long
-sys_futex(const u64* addr, int op, u64 val, u64 timer)
+sys_futex(const u64* addr, int op, u64 val, u64 val2, const u64* addr2,
+          u64 val3)
 {
-  futexkey_t key;
+  futexkey_t key, key2;
 
   if (futexkey(addr, myproc()->vmap.get(), &key) < 0)
     return -1;
 
-  mt_ascope ascope("%s(%p,%d,%lu,%lu)", __func__, addr, op, val, timer);
+  mt_ascope ascope("%s(%p,%d,%lu,%lu,%p,%lu)", __func__, addr, op, val, val2,
+                   addr2, val3);
 
   switch(op) {
   case FUTEX_WAIT:
-    return futexwait(key, val, timer);
+    return futexwait(key, val, val2, FUTEX_BITSET_MATCH_ANY);
   case FUTEX_WAKE:
-    return futexwake(key, val);
+    return futexwake(key, val, FUTEX_BITSET_MATCH_ANY);
+  case FUTEX_WAIT_BITSET:
+    return futexwait(key, val, val2, val3);
+  case FUTEX_WAKE_BITSET:
+    return futexwake(key, val, val3);
+  case FUTEX_REQUEUE:
+  case FUTEX_CMP_REQUEUE:
+    if (futexkey(addr2, myproc()->vmap.get(), &key2) < 0)
+      return -1;
+    return futexrequeue(key, val, val2, key2, op == FUTEX_CMP_REQUEUE, val3);
+  case FUTEX_WAKE_OP:
+    if (futexkey(addr2, myproc()->vmap.get(), &key2) < 0)
+      return -1;
+    return futexwakeop(key, val, addr2, key2, val2, val3);
   default:
     return -1;
   }
@@ -351,3 +392,39 @@ sys_kmbalance(void)
 {
   kmbalance();
 }
+
+// Measure kmalloc from user space, for allocbench -k.  Allocate and
+// then free nobj objects of size bytes on the calling CPU, niter
+// times, and return the total cycles spent.  size is limited to
+// sub-page allocations and nobj to what fits in one page of pointers.
+// Returns -1 on invalid arguments or if an allocation fails.
+//SYSCALL
+long
+sys_kmallocbench(u64 size, u64 nobj, u64 niter)
+{
+  if (size == 0 || size > PGSIZE / 2 || nobj == 0 ||
+      nobj > PGSIZE / sizeof(void*))
+    return -1;
+
+  void **objs = (void**)kalloc("kmallocbench");
+  if (!objs)
+    return -1;
+
+  u64 start = rdtsc();
+  for (u64 i = 0; i < niter; i++) {
+    for (u64 j = 0; j < nobj; j++) {
+      if (!(objs[j] = kmalloc(size, "kmallocbench"))) {
+        while (j-- > 0)
+          kmfree(objs[j], size);
+        kfree(objs);
+        return -1;
+      }
+    }
+    for (u64 j = 0; j < nobj; j++)
+      kmfree(objs[j], size);
+  }
+  u64 cycles = rdtsc() - start;
+
+  kfree(objs);
+  return cycles;
+}
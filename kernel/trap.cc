@@ -16,6 +16,7 @@
 #include "hwvm.hh"
 #include "refcache.hh"
 #include "cpuid.hh"
+#include "work.hh"
 
 extern "C" void __uaccess_end(void);
 
@@ -49,6 +50,11 @@ sysentry_c(u64 a0, u64 a1, u64 a2, u64 a3, u64 a4, u64 a5, u64 num)
   myproc()->tf = tf;
   u64 r = syscall(a0, a1, a2, a3, a4, a5, num);
 
+  // Give up the CPU if the system call woke a latency-class proc that
+  // should preempt us.  Only take the slow path if one was flagged.
+  if (mycpu()->resched.load(std::memory_order_relaxed) && need_resched())
+    yield();
+
   if(myproc()->killed) {
     mtstart(trap, myproc());
     exit(-1);
@@ -199,6 +205,7 @@ trap(struct trapframe *tf)
     if (mycpu()->id == 0)
       timerintr();
     refcache::mycache->tick();
+    dwork_tick();
     lapiceoi();
     if (mycpu()->no_sched_count) {
       kstats::inc(&kstats::sched_blocked_tick_count);
@@ -323,7 +330,8 @@ trap(struct trapframe *tf)
   // Force process to give up CPU on clock tick.
   // If interrupts were on while locks held, would need to check nlock.
   if(myproc() && myproc()->get_state() == RUNNING &&
-     (tf->trapno == T_IRQ0+IRQ_TIMER || myproc()->yield_)) {
+     (tf->trapno == T_IRQ0+IRQ_TIMER || myproc()->yield_ ||
+      (mycpu()->resched.load(std::memory_order_relaxed) && need_resched()))) {
     yield();
   }
 
@@ -1,43 +1,162 @@
 // UNIX domain sockets
 
 #include "types.h"
+#include "mmu.h"
 #include "ilist.hh"
 #include "kstats.hh"
 #include "lb.hh"
 #include "atomic_util.hh"
 #include "proc.hh"
+#include "condvar.hh"
 #include "file.hh"
+#include "vm.hh"
+#include "page_info.hh"
 #include <uk/socket.h>
 #include <uk/un.h>
+#include <algorithm>
+#include <vector>
 
-#define QUEUELEN 10   // Number of message per queue of a local socket
 #define LB 0          // Run with load balancer?
 
+// Messages up to INLINE_MSG bytes are copied into the msghdr itself, so
+// they need no allocation beyond the (per-core cached) msghdr.
+#define INLINE_MSG 192
+// Messages of at least ZEROCOPY_MIN bytes share the sender's whole
+// pages copy-on-write rather than copying them.  For smaller messages
+// the TLB shootdown needed to mark the pages COW costs more than the
+// copy.
+#define ZEROCOPY_MIN (4 * PGSIZE)
+#define SOCKBUF_BYTES (1 << 20)  // Bytes queued per core socket before senders block
+#define MAX_MSG (16 << 20)       // Largest message
+
 struct msghdr {
   u32 len;
   struct sockaddr_un uaddr;
-  char *data;
   islink<msghdr> link;
   typedef isqueue<msghdr, &msghdr::link> list_t;
 
-  msghdr() {}
+  // A message of at most INLINE_MSG bytes is stored in inline_.  A
+  // longer one is stored in pages, starting at offset off of pages[0].
+  // Pages shared with the sender must not be written.
+  u32 off;
+  std::vector<sref<page_info> > pages;
+  char inline_[INLINE_MSG];
+
+  msghdr() : len(0), off(0) {}
   ~msghdr() {}
 
-  NEW_DELETE_OPS(msghdr);
+  NEW_DELETE_OPS_CACHED(msghdr);
+
+  // Load len bytes of user memory at va into this message.
+  bool load(uptr va, size_t len)
+  {
+    this->len = len;
+    if (len <= INLINE_MSG) {
+      kstats::inc(&kstats::socket_local_inline_cnt);
+      return fetchmem(inline_, (void*)va, len) >= 0;
+    }
+
+    // Share the whole pages of a large message.  The partial pages at
+    // either end, and any pages that cannot be shared, are copied.
+    uptr end = va + len;
+    if (end < va)
+      return false;
+    uptr zc_begin = 0, zc_end = 0;
+    if (len >= ZEROCOPY_MIN) {
+      zc_begin = PGROUNDUP(va);
+      zc_end = PGROUNDDOWN(end);
+    }
+    sref<vmap> vm = myproc()->vmap;
+    off = va % PGSIZE;
+    pages.reserve((off + len + PGSIZE - 1) / PGSIZE);
+    for (uptr p = PGROUNDDOWN(va); p < end; ) {
+      if (p >= zc_begin && p < zc_end) {
+        size_t n = vm->share_cow(p, zc_end - p, &pages);
+        kstats::inc(&kstats::socket_local_zerocopy_bytes, n);
+        p += n;
+        if (p < zc_end)
+          zc_end = p;
+        continue;
+      }
+      char *b = kalloc("unixsock page");
+      if (!b)
+        return false;
+      pages.push_back(
+        sref<page_info>::transfer(new(page_info::of(b)) page_info()));
+      uptr s = std::max(p, va), e = std::min(p + PGSIZE, end);
+      if (fetchmem(b + (s - p), (void*)s, e - s) < 0)
+        return false;
+      p += PGSIZE;
+    }
+    return true;
+  }
+
+  // Store this message to user memory at va.  Runs of whole pages that
+  // line up with pages of the destination are mapped there
+  // copy-on-write instead of being copied.
+  bool store(uptr va) const
+  {
+    if (len <= INLINE_MSG)
+      return putmem((void*)va, inline_, len) >= 0;
+
+    sref<vmap> vm = myproc()->vmap;
+    bool remap = (len >= ZEROCOPY_MIN);
+    size_t pos = 0;
+    for (size_t i = 0; pos < len; ) {
+      size_t poff = (i == 0) ? off : 0;
+      size_t n = std::min((size_t)PGSIZE - poff, len - pos);
+      uptr dst = va + pos;
+      if (remap && n == PGSIZE && dst % PGSIZE == 0) {
+        size_t run = 1;
+        while (pos + (run + 1) * PGSIZE <= len)
+          run++;
+        if (run * PGSIZE >= ZEROCOPY_MIN &&
+            vm->map_cow(dst, &pages[i], run) == 0) {
+          kstats::inc(&kstats::socket_local_zerocopy_bytes, run * PGSIZE);
+          pos += run * PGSIZE;
+          i += run;
+          continue;
+        }
+        remap = false;
+      }
+      if (putmem((void*)dst, (char*)pages[i]->va() + poff, n) < 0)
+        return false;
+      pos += n;
+      i++;
+    }
+    return true;
+  }
 };
 
 struct coresocket : public balance_pool<coresocket> {
   int len;
+  u64 bytes;                    // Total length of messages
   struct spinlock lock;
+  condvar nonempty;             // Signaled when a message is queued
+  condvar nonfull;              // Signaled when bytes drops
   msghdr::list_t messages;
 
-  coresocket() : balance_pool(QUEUELEN), len(0),
-                 lock("coresocket", LOCKSTAT_LOCALSOCK) {}
-  ~coresocket() {}
+  coresocket() : balance_pool(SOCKBUF_BYTES), len(0), bytes(0),
+                 lock("coresocket", LOCKSTAT_LOCALSOCK),
+                 nonempty("coresocket::nonempty"),
+                 nonfull("coresocket::nonfull") {}
+  ~coresocket() {
+    while (!messages.empty()) {
+      msghdr *m = &messages.front();
+      messages.pop_front();
+      delete m;
+    }
+  }
   NEW_DELETE_OPS(coresocket);
 
   u64 balance_count() const {
-    return len;
+    return bytes;
+  }
+
+  // A message of n bytes fits if it does not overflow the socket
+  // buffer.  A message larger than the buffer fits in an empty socket.
+  bool fits(u64 n) const {
+    return bytes == 0 || bytes + n <= SOCKBUF_BYTES;
   }
 
   void balance_move_to(coresocket* target) {
@@ -53,17 +172,21 @@ struct coresocket : public balance_pool<coresocket> {
     }
 
     int n = 0;
-    while (target->len < len) {
+    while (target->bytes < bytes) {
       n++;
-      target->len++;
-      len--;
       msghdr& m = messages.front();
       messages.pop_front();
       target->messages.push_back(&m);
+      target->len++;
+      target->bytes += m.len;
+      len--;
+      bytes -= m.len;
     }
 
     if (n > 0) {
       kstats::inc(&kstats::socket_load_balance);
+      target->nonempty.wake_all();
+      nonfull.wake_all();
     }
 
     lock.release();
@@ -74,8 +197,6 @@ struct coresocket : public balance_pool<coresocket> {
 struct localsock {
   bool ordered_;
   atomic<coresocket*> pipes[NCPU];
-  spinlock rw_cv_lock[NCPU];
-  condvar rw_cv[NCPU];
   balancer<localsock, coresocket> b;
   atomic<int> nreader;
 
@@ -135,95 +256,40 @@ struct localsock {
 #endif
   }
 
+  // Queue m, blocking while the socket buffer is full.
   int write(msghdr *m) {
-    bool toyield = true;
-    for (;;) {
+    coresocket *cp = mycoresocket();
+    if (!cp->fits(m->len))
+      balance();
+
+    scoped_acquire l(&cp->lock);
+    while (!cp->fits(m->len)) {
       if (myproc()->killed)
         return -1;
-
-      coresocket *cp;
-#if 0
-      // if there is only reader, deliver message to reader
-      // perhaps useful if sender and receiver are not on the same core
-      if (nreader > 1) {
-        cp = mycoresocket();
-        if (cp->len >= QUEUELEN)
-          balance();
-      } else {
-        cp = reader();
-      }
-      if (cp == NULL)
-        continue;
-#else
-      cp = mycoresocket();
-      if (cp->len >= QUEUELEN && toyield) {
-        yield();
-        toyield = false;
-        continue;
-      }
-
-      if (cp->len >= QUEUELEN)
-        balance();
-#endif
-
-      int cpu = myid();
-      scoped_acquire a(&rw_cv_lock[cpu]);
-
-      scoped_acquire l(&cp->lock);
-      if (cp->len < QUEUELEN) {
-        // cprintf("w %d(%d): coresocket %p\n", myproc()->pid, myproc()->cpuid, cp);
-        cp->messages.push_back(m);
-        cp->len++;
-        // Wake up the sleeping reader
-        rw_cv[cpu].wake_all();
-        return 0;
-      }
+      cp->nonfull.sleep(&cp->lock);
     }
+    cp->messages.push_back(m);
+    cp->len++;
+    cp->bytes += m->len;
+    // Wake up the sleeping reader
+    cp->nonempty.wake_all();
+    return 0;
   }
 
   msghdr* read() {
-    //bool toyield = true;
-    for (;;) {
+    coresocket* cp = mycoresocket();
+    scoped_acquire l(&cp->lock);
+    while (cp->len <= 0) {
       if (myproc()->killed)
         return NULL;
-
-      coresocket* cp = mycoresocket();
-
-#if 0 // We would like to avoid spinning...
-
-      if (cp->len <= 0 && toyield) {
-        // in case another proc is running on hopefully this processor,
-        // let's give them a chance to send a message
-        // cprintf("yield %d (id %d)\n", myproc()->pid, id);
-        yield();   // yields to another process on this core, if there is one
-        toyield = false;
-        continue;
-      }
-
-      if (cp->len <= 0)
-        balance();
-      else
-        kstats::inc(&kstats::socket_local_read);
-
-#else // So sleep on a condition variable instead
-
-      int cpu = myid();
-      scoped_acquire a(&rw_cv_lock[cpu]);
-      while (cp->len <= 0)
-        rw_cv[cpu].sleep(&rw_cv_lock[cpu]);
-
-#endif
-
-      scoped_acquire l(&cp->lock);
-      if (cp->len > 0) {
-        // cprintf("r %d(%d): coresocket %p\n", myproc()->pid, myproc()->cpuid, cp);
-        msghdr &m = cp->messages.front();
-        cp->messages.pop_front();
-        cp->len--;
-        return &m;
-      }
-      // toyield = true;   // iterate between yielding and balancing
+      cp->nonempty.sleep(&cp->lock);
     }
+    msghdr &m = cp->messages.front();
+    cp->messages.pop_front();
+    cp->len--;
+    cp->bytes -= m.len;
+    cp->nonfull.wake_all();
+    return &m;
   }
 };
 
@@ -297,26 +363,19 @@ public:
     if (ip->type() != mnode::types::sock)
       return -1;
 
-    char *b = kalloc("writebuf");
-    if (!b)
+    if (len > MAX_MSG)
       return -1;
 
-    if (len > PGSIZE)
-      len = PGSIZE;
-    if (!buf.load_bytes(b, len)) {
-      kfree(b);
+    msghdr *m = new msghdr();
+    if (!m->load((uptr)buf, len)) {
+      delete m;
       return -1;
     }
-
-    msghdr *m = new msghdr();
-    m->data = b;
-    m->len = len;
     m->uaddr.sun_family = AF_UNIX;
     strncpy(m->uaddr.sun_path, socketpath_, UNIX_PATH_MAX);
 
     int r = ip->as_sock()->get_sock()->write(m);
     if (r < 0) {
-      kfree(b);
       delete m;
       return -1;
     }
@@ -333,20 +392,15 @@ public:
     ssize_t r = -1;
 
     msghdr *m = localsock_->read();
+    if (!m)
+      return -1;
     if (src_addr) {
       *(struct sockaddr_un*)src_addr = m->uaddr;
       *addrlen = sizeof(m->uaddr);
     }
-    if (m->len > len)
-      goto done;
-
-    if (!buf.store_bytes(m->data, m->len))
-      goto done;
-
-    r = m->len;
+    if (m->len <= len && m->store((uptr)buf))
+      r = m->len;
 
-  done:
-    kfree(m->data);
     delete m;
     return r;
   }
@@ -0,0 +1,472 @@
+// System call submission rings.  See <uk/uring.h>.
+//
+// Entries run in the context of the submitting process: either the
+// process itself, in uring_enter, or a poller thread that shares the
+// process's address space, file table and working directory.  Both
+// run entries by calling the ordinary system call implementations, so
+// a batch of entries costs a single trap.  fsync entries are handed to
+// the ring's fsync thread, which queues the transactions of every
+// pending fsync and commits them with one journal flush before posting
+// their completions.
+
+#include "types.h"
+#include "amd64.h"
+#include "mmu.h"
+#include "kernel.hh"
+#include "spinlock.hh"
+#include "condvar.hh"
+#include "proc.hh"
+#include "cpu.hh"
+#include "sleeplock.hh"
+#include "vm.hh"
+#include "file.hh"
+#include "filetable.hh"
+#include "mfs.hh"
+#include "kstats.hh"
+#include "log2.hh"
+#include <uk/mman.h>
+#include <uk/uring.h>
+#include <vector>
+
+extern int sys_openat(int dirfd, userptr_str path, int omode, ...);
+extern ssize_t sys_read(int fd, userptr<void> p, size_t n);
+extern ssize_t sys_write(int fd, const userptr<void> p, size_t n);
+extern ssize_t sys_pwrite(int fd, const void *ubuf, size_t count,
+                          off_t offset);
+extern int sys_rename(userptr_str old_path, userptr_str new_path);
+extern int sys_unlink(userptr_str path);
+extern int sys_close(int fd);
+
+#define URING_MAX_ENTRIES 4096
+#define URING_POLL_IDLE 2000000 // ns the poller spins before sleeping
+
+static_assert(sizeof(uring_sqe) == 64, "uring_sqe size");
+static_assert(sizeof(uring_cqe) == 16, "uring_cqe size");
+static_assert(sizeof(uring_ctl) <= PGSIZE, "uring_ctl size");
+
+// An fsync waiting for the fsync thread.
+struct uring_fsync {
+  sref<file> f;
+  u64 user_data;
+  s64 res;
+  islink<uring_fsync> link;
+  typedef isqueue<uring_fsync, &uring_fsync::link> list_t;
+
+  uring_fsync(sref<file> &&f, u64 user_data)
+    : f(std::move(f)), user_data(user_data), res(-1) {}
+  NEW_DELETE_OPS(uring_fsync);
+};
+
+struct uring : public referenced
+{
+  // Allocate a ring with room for at least entries submissions and
+  // map it into the current process.  Sets *va to its address.
+  static sref<uring> alloc(u32 entries, bool sqpoll, int cpu, uptr *va);
+
+  // Run up to max queued submissions.  Returns the number run.
+  u32 submit(u32 max);
+
+  // Wait until at least min completions are queued.
+  int wait(u32 min);
+
+  int enter(u32 to_submit, u32 min_complete);
+
+  // Stop the poller and fsync threads once they finish their current
+  // work.
+  void shutdown();
+
+  void poll();
+  void sync();
+
+  NEW_DELETE_OPS(uring);
+
+private:
+  uring(sref<mnode> &&m, std::vector<sref<page_info> > &&pages,
+        u32 sq_entries, u32 cq_entries, bool sqpoll, int cpu)
+    : m_(std::move(m)), pages_(std::move(pages)),
+      ctl_((uring_ctl*)pages_[0]->va()),
+      sq_entries_(sq_entries), cq_entries_(cq_entries),
+      sq_off_(PGSIZE),
+      cq_off_(PGSIZE + PGROUNDUP(sq_entries * sizeof(uring_sqe))),
+      sqpoll_(sqpoll), cpu_(cpu), sq_head_(0), cq_tail_(0), inflight_(0),
+      dead_(false), lock_("uring", LOCKSTAT_FS), cq_cv_("uring::cq"),
+      poll_cv_("uring::poll"), fsync_cv_("uring::fsync")
+  {
+    ctl_->sq_entries = sq_entries_;
+    ctl_->sq_off = sq_off_;
+    ctl_->cq_entries = cq_entries_;
+    ctl_->cq_off = cq_off_;
+  }
+
+  // The ring's pages are not contiguous in the kernel, so entries are
+  // found page by page.  Entry sizes divide the page size.
+  template<class T>
+  T* at(u64 off)
+  {
+    return (T*)((char*)pages_[off / PGSIZE]->va() + off % PGSIZE);
+  }
+
+  uring_sqe* sqe_at(u32 idx)
+  {
+    return at<uring_sqe>(sq_off_ + (idx & (sq_entries_ - 1)) * sizeof(uring_sqe));
+  }
+
+  uring_cqe* cqe_at(u32 idx)
+  {
+    return at<uring_cqe>(cq_off_ + (idx & (cq_entries_ - 1)) * sizeof(uring_cqe));
+  }
+
+  void run(const uring_sqe &sqe);
+  bool queue_fsync(const uring_sqe &sqe);
+  void complete(u64 user_data, s64 res);
+
+  sref<mnode> m_;               // Backs the user mapping
+  std::vector<sref<page_info> > pages_;
+  uring_ctl *ctl_;              // Shared with user space
+  const u32 sq_entries_, cq_entries_;
+  const u64 sq_off_, cq_off_;
+  const bool sqpoll_;
+  const int cpu_;               // CPU of the poller and fsync thread
+
+  // The kernel's copies of the indexes it owns, which user space may
+  // scribble over in ctl_.
+  u32 sq_head_;                 // Protected by submit_lock_
+  u32 cq_tail_;                 // Protected by lock_
+
+  sleeplock submit_lock_;       // Serializes submit
+  u32 inflight_;                // Entries taken but not completed
+  uring_fsync::list_t fsyncs_;
+  bool dead_;
+  spinlock lock_;
+  condvar cq_cv_;               // Completions posted
+  condvar poll_cv_;             // Poller woken or shut down
+  condvar fsync_cv_;            // fsyncs queued or shut down
+};
+
+static void
+uring_poller(void *arg)
+{
+  sref<uring> r = sref<uring>::transfer((uring*)arg);
+  r->poll();
+}
+
+static void
+uring_syncer(void *arg)
+{
+  sref<uring> r = sref<uring>::transfer((uring*)arg);
+  r->sync();
+}
+
+sref<uring>
+uring::alloc(u32 entries, bool sqpoll, int cpu, uptr *va)
+{
+  u32 sq = 1u << ceil_log2(entries);
+  u32 cq = 2 * sq;
+  size_t len = PGSIZE + PGROUNDUP(sq * sizeof(uring_sqe)) +
+    PGROUNDUP(cq * sizeof(uring_cqe));
+
+  // Back the ring with a shared anonymous file, like a MAP_SHARED
+  // mapping, so it is neither swapped out nor copied on fork.
+  sref<mnode> m = anon_fs->alloc(mnode::types::file).mn();
+  std::vector<sref<page_info> > pages;
+  {
+    auto resizer = m->as_file()->write_size();
+    for (size_t i = 0; i < len; i += PGSIZE) {
+      void* p = zalloc("uring");
+      if (!p)
+        throw_bad_alloc();
+      auto pi = sref<page_info>::transfer(new (page_info::of(p)) page_info());
+      resizer.resize_append(i + PGSIZE, pi);
+      pages.push_back(std::move(pi));
+    }
+  }
+
+  vmdesc desc(m, 0);
+  desc.flags |= vmdesc::FLAG_SHARED;
+  *va = myproc()->vmap->insert(desc, 0, len);
+  if (*va == (uptr)-1)
+    return sref<uring>();
+
+  sref<uring> r = sref<uring>::transfer(
+    new uring(std::move(m), std::move(pages), sq, cq, sqpoll, cpu));
+
+  char name[16];
+  r->inc();
+  snprintf(name, sizeof(name), "uring_fs_%d", myproc()->pid);
+  threadpin(uring_syncer, r.get(), name, cpu);
+
+  if (sqpoll) {
+    proc *p = threadalloc(uring_poller, r.get());
+    if (!p)
+      panic("uring: threadalloc");
+    r->inc();
+    p->vmap = myproc()->vmap;
+    p->ftable = myproc()->ftable;
+    p->cwd_m = myproc()->cwd_m;
+    snprintf(p->name, sizeof(p->name), "uring_sq_%d", myproc()->pid);
+    p->cpuid = cpu;
+    p->cpu_pin = 1;
+    acquire(&p->lock);
+    addrun(p);
+    release(&p->lock);
+  }
+  return r;
+}
+
+u32
+uring::submit(u32 max)
+{
+  auto l = submit_lock_.guard();
+  u32 n;
+  for (n = 0; n < max && sq_head_ != ctl_->sq_tail; n++) {
+    // Don't take more entries than there is room to complete.
+    {
+      scoped_acquire cl(&lock_);
+      if (inflight_ + (cq_tail_ - ctl_->cq_head) >= cq_entries_)
+        break;
+      inflight_++;
+    }
+    // Read the entry after the tail that published it, and copy it,
+    // since user space may change it under us.
+    barrier();
+    uring_sqe sqe = *sqe_at(sq_head_);
+    ctl_->sq_head = ++sq_head_;
+    run(sqe);
+  }
+  return n;
+}
+
+void
+uring::run(const uring_sqe &sqe)
+{
+  kstats::inc(&kstats::uring_sqe_count);
+
+  s64 r = -1;
+#if EXCEPTIONS
+  try {
+#endif
+    switch (sqe.opcode) {
+    case URING_OP_NOP:
+      r = 0;
+      break;
+    case URING_OP_OPENAT:
+      r = sys_openat(sqe.fd, userptr_str((const char*)sqe.addr), sqe.oflags);
+      break;
+    case URING_OP_READ:
+      r = sys_read(sqe.fd, userptr<void>((void*)sqe.addr), sqe.len);
+      break;
+    case URING_OP_WRITE:
+      r = sys_write(sqe.fd, userptr<void>((void*)sqe.addr), sqe.len);
+      break;
+    case URING_OP_PWRITE:
+      r = sys_pwrite(sqe.fd, (const void*)sqe.addr, sqe.len, sqe.off);
+      break;
+    case URING_OP_FSYNC:
+      if (queue_fsync(sqe))
+        return;                 // The fsync thread completes it
+      break;
+    case URING_OP_RENAME:
+      r = sys_rename(userptr_str((const char*)sqe.addr),
+                     userptr_str((const char*)sqe.addr2));
+      break;
+    case URING_OP_UNLINK:
+      r = sys_unlink(userptr_str((const char*)sqe.addr));
+      break;
+    case URING_OP_CLOSE:
+      r = sys_close(sqe.fd);
+      break;
+    }
+#if EXCEPTIONS
+  } catch (std::bad_alloc &e) {
+    r = -1;
+  }
+#endif
+  complete(sqe.user_data, r);
+}
+
+bool
+uring::queue_fsync(const uring_sqe &sqe)
+{
+  sref<file> f = getfile(sqe.fd);
+  if (!f)
+    return false;
+  uring_fsync *fs = new uring_fsync(std::move(f), sqe.user_data);
+
+  scoped_acquire l(&lock_);
+  // The fsync thread only sleeps when the list is empty.
+  if (fsyncs_.empty())
+    fsync_cv_.wake_all();
+  fsyncs_.push_back(fs);
+  return true;
+}
+
+void
+uring::complete(u64 user_data, s64 res)
+{
+  scoped_acquire l(&lock_);
+  uring_cqe *cqe = cqe_at(cq_tail_);
+  cqe->user_data = user_data;
+  cqe->res = res;
+  // Publish the entry before the tail.
+  barrier();
+  ctl_->cq_tail = ++cq_tail_;
+  inflight_--;
+  cq_cv_.wake_all();
+}
+
+int
+uring::wait(u32 min)
+{
+  if (min > cq_entries_)
+    min = cq_entries_;
+  scoped_acquire l(&lock_);
+  while (cq_tail_ - ctl_->cq_head < min) {
+    if (myproc()->killed)
+      return -1;
+    // Without a poller, nothing else will complete once everything
+    // taken has completed.
+    if (!sqpoll_ && inflight_ == 0)
+      break;
+    cq_cv_.sleep(&lock_);
+  }
+  return 0;
+}
+
+int
+uring::enter(u32 to_submit, u32 min_complete)
+{
+  int n = 0;
+  if (sqpoll_) {
+    scoped_acquire l(&lock_);
+    poll_cv_.wake_all();
+  } else {
+    n = submit(to_submit);
+  }
+  if (min_complete && wait(min_complete) < 0)
+    return -1;
+  return n;
+}
+
+void
+uring::shutdown()
+{
+  scoped_acquire l(&lock_);
+  dead_ = true;
+  poll_cv_.wake_all();
+  fsync_cv_.wake_all();
+  cq_cv_.wake_all();
+}
+
+void
+uring::poll()
+{
+  u64 idle_since = nsectime();
+  while (!dead_) {
+    if (submit(sq_entries_)) {
+      idle_since = nsectime();
+      continue;
+    }
+    if (nsectime() - idle_since < URING_POLL_IDLE) {
+      if (mycpu()->resched.load(std::memory_order_relaxed) && need_resched())
+        yield();
+      else
+        nop_pause();
+      continue;
+    }
+
+    // Sleep until uring_enter wakes us.  User space checks
+    // NEED_WAKEUP after publishing its tail, so either it sees the
+    // flag or we see the new tail.
+    scoped_acquire l(&lock_);
+    ctl_->sq_flags |= URING_SQ_NEED_WAKEUP;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (!dead_ && sq_head_ == ctl_->sq_tail)
+      poll_cv_.sleep(&lock_);
+    ctl_->sq_flags &= ~URING_SQ_NEED_WAKEUP;
+    idle_since = nsectime();
+  }
+}
+
+void
+uring::sync()
+{
+  for (;;) {
+    uring_fsync::list_t batch;
+    {
+      scoped_acquire l(&lock_);
+      while (fsyncs_.empty() && !dead_)
+        fsync_cv_.sleep(&lock_);
+      if (fsyncs_.empty())
+        return;
+      batch = std::move(fsyncs_);
+    }
+
+    // Queue every file's transactions on this CPU's journal, then
+    // commit them together.  fsyncs queued meanwhile form the next
+    // batch.
+    kstats::inc(&kstats::uring_fsync_batch_count);
+    int cpu = myid();
+    for (uring_fsync &fs : batch) {
+      file *ff = fs.f.get();
+      if (&typeid(*ff) == &typeid(file_mnode))
+        fs.res = static_cast<file_mnode*>(ff)->fsync_queue(cpu);
+      else
+        fs.res = ff->fsync();
+    }
+    rootfs_interface->flush_transaction_queue(cpu);
+
+    while (!batch.empty()) {
+      uring_fsync *fs = &batch.front();
+      batch.pop_front();
+      complete(fs->user_data, fs->res);
+      delete fs;
+    }
+  }
+}
+
+void
+uring_exit(struct proc *p)
+{
+  uring *r = p->uring_;
+  if (!r)
+    return;
+  p->uring_ = nullptr;
+  r->shutdown();
+  r->dec();
+}
+
+// Set up the calling process's submission ring.  Returns its address,
+// or MAP_FAILED.
+//SYSCALL
+void *
+sys_uring_setup(u32 entries, int flags, int cpu)
+{
+  proc *p = myproc();
+  if (p->uring_ || entries == 0 || entries > URING_MAX_ENTRIES ||
+      (flags & ~URING_SETUP_SQPOLL))
+    return MAP_FAILED;
+
+  bool sqpoll = flags & URING_SETUP_SQPOLL;
+  if (!sqpoll)
+    cpu = myid();
+  else if (cpu < 0 || cpu >= ncpu)
+    return MAP_FAILED;
+
+  uptr va;
+  sref<uring> r = uring::alloc(entries, sqpoll, cpu, &va);
+  if (!r)
+    return MAP_FAILED;
+  r->inc();
+  p->uring_ = r.get();
+  return (void*)va;
+}
+
+//SYSCALL
+int
+sys_uring_enter(u32 to_submit, u32 min_complete)
+{
+  uring *r = myproc()->uring_;
+  if (!r)
+    return -1;
+  return r->enter(to_submit, min_complete);
+}
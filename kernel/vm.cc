@@ -39,9 +39,12 @@ void to_stream(class print_stream *s, const vmdesc &vmd)
         {"ANON", vmdesc::FLAG_ANON},
         {"WRITE", vmdesc::FLAG_WRITE},
         {"SHARED", vmdesc::FLAG_SHARED},
+        {"ACCESSED", vmdesc::FLAG_ACCESSED},
       }), " ");
   if (vmd.page)
     s->print((void*)vmd.page->pa(), "}");
+  else if (vmd.swap)
+    s->print("swap:", shex(vmd.swap->offset()), "}");
   else
     s->print("null}");
 }
@@ -124,6 +127,18 @@ public:
  * vmap
  */
 
+// Every vmap is on the list of the CPU that created it, so swap_out_all
+// can find them without going through the process table.
+struct vmap::all_list
+{
+  spinlock lock;
+  ilist<vmap, &vmap::all_link_> vmaps;
+
+  all_list() : lock("vmap::all_list", LOCKSTAT_VM) { }
+} __mpalign__;
+
+vmap::all_list vmap::all_[NCPU];
+
 sref<vmap>
 vmap::alloc(void)
 {
@@ -131,12 +146,19 @@ vmap::alloc(void)
 }
 
 vmap::vmap() : 
-  brk_(0), brklock_("brk_lock", LOCKSTAT_VM)
+  brk_(0), all_cpu_(myid()), swap_hand_(0), brklock_("brk_lock", LOCKSTAT_VM)
 {
+  scoped_acquire l(&all_[all_cpu_].lock);
+  all_[all_cpu_].vmaps.push_back(this);
 }
 
 vmap::~vmap()
 {
+  {
+    scoped_acquire l(&all_[all_cpu_].lock);
+    all_[all_cpu_].vmaps.erase(all_[all_cpu_].vmaps.iterator_to(this));
+  }
+
   for (auto it = vpfs_.begin(), end = vpfs_.end(); it != end; ) {
     // Skip unset spans
     if (!it.is_set()) {
@@ -176,8 +198,10 @@ vmap::copy()
         sdebug.println("vm: dup ", *it, " at ", shex(it.index() * PGSIZE));
 
       // If the original vmdesc isn't COW, mark it so and fix the page
-      // table.
-      if (it->page && !(it->flags & vmdesc::FLAG_SHARED) && !(it->flags & vmdesc::FLAG_COW)) {
+      // table.  A swapped out page is shared the same way; both vmaps
+      // fault in the swap entry's page and copy it on write.
+      if ((it->page || it->swap) && !(it->flags & vmdesc::FLAG_SHARED) &&
+          !(it->flags & vmdesc::FLAG_COW)) {
         if (SDEBUG)
           sdebug.println("vm: mark COW");
         it->flags |= vmdesc::FLAG_COW;
@@ -305,38 +329,108 @@ vmap::remove(uptr start, uptr len)
 void
 vmap::delete_mapping(uptr addr)
 {
-  mmu::shootdown shootdown;
-  auto vpf = vpfs_.find(addr/PGSIZE);
-  auto lock = vpfs_.acquire(vpf,vpf+1);
-  if (vpf.is_set())
-    vpfs_.unset(vpf,vpf+1);
-  cache.invalidate(addr, PGSIZE, vpf, &shootdown);
-  shootdown.perform();
+  unmap_pages(&addr, 1, true);
 }
 
 void
 vmap::clear_mapping(uptr addr)
+{
+  unmap_pages(&addr, 1, false);
+}
+
+void
+vmap::delete_mappings(const uptr *addrs, size_t n)
+{
+  unmap_pages(addrs, n, true);
+}
+
+void
+vmap::clear_mappings(const uptr *addrs, size_t n)
+{
+  unmap_pages(addrs, n, false);
+}
+
+void
+vmap::unmap_pages(const uptr *addrs, size_t n, bool unset)
 {
   mmu::shootdown shootdown;
-  auto vpf = vpfs_.find(addr/PGSIZE);
-  auto lock = vpfs_.acquire(vpf);
-
-  if (vpf.is_set()) {
-    auto &desc = *vpf;
-    if (vpf.base_span() == 1) {
-      // Safe to update in place
-      desc.page = sref<page_info>();
-    } else {
-      vmdesc n(desc);
-      n.page = sref<page_info>();
-      vpfs_.fill(vpf, std::move(n));
+  // Keep the unmapped pages alive until no TLB can refer to them.
+  page_holder pages;
+
+  for (size_t i = 0; i < n; ++i) {
+    uptr addr = addrs[i];
+    auto vpf = vpfs_.find(addr/PGSIZE);
+    auto lock = vpfs_.acquire(vpf,vpf+1);
+
+    if (vpf.is_set()) {
+      auto &desc = *vpf;
+      if (desc.page)
+        pages.add(sref<page_info>(desc.page));
+      if (unset) {
+        vpfs_.unset(vpf,vpf+1);
+      } else if (vpf.base_span() == 1) {
+        // Safe to update in place
+        desc.page = sref<page_info>();
+      } else {
+        vmdesc nd(desc);
+        nd.page = sref<page_info>();
+        vpfs_.fill(vpf, std::move(nd));
+      }
     }
+
+    cache.invalidate(addr, PGSIZE, vpf, &shootdown);
   }
 
-  cache.invalidate(addr, PGSIZE, vpf, &shootdown);
   shootdown.perform();
 }
 
+template<class F>
+void
+rmap_batch::for_each_vmap(F fn)
+{
+  // Group the entries by vmap, in address order within each vmap.
+  // stdinc's std::pair can't be assigned, so sort copies of them.
+  struct mapping {
+    vmap *vm;
+    uptr va;
+  };
+  std::vector<mapping> maps;
+  maps.reserve(entries_.size());
+  for (auto &e : entries_)
+    maps.push_back({e.first, e.second});
+  entries_.clear();
+
+  std::sort(maps.begin(), maps.end(), [](const mapping &a, const mapping &b) {
+      return a.vm < b.vm || (a.vm == b.vm && a.va < b.va);
+    });
+
+  std::vector<uptr> addrs;
+  for (auto it = maps.begin(); it != maps.end(); ) {
+    vmap *vm = it->vm;
+    addrs.clear();
+    for (; it != maps.end() && it->vm == vm; ++it)
+      if (addrs.empty() || addrs.back() != it->va)
+        addrs.push_back(it->va);
+    fn(vm, addrs.data(), addrs.size());
+  }
+}
+
+void
+rmap_batch::delete_mappings()
+{
+  for_each_vmap([](vmap *vm, const uptr *addrs, size_t n) {
+      vm->delete_mappings(addrs, n);
+    });
+}
+
+void
+rmap_batch::clear_mappings()
+{
+  for_each_vmap([](vmap *vm, const uptr *addrs, size_t n) {
+      vm->clear_mappings(addrs, n);
+    });
+}
+
 int
 vmap::willneed(uptr start, uptr len)
 {
@@ -537,6 +631,7 @@ vmap::pagefault(uptr va, u32 err)
     }
     if (!page)
       return -1;
+    it->flags |= vmdesc::FLAG_ACCESSED;
 
     // If this is a read COW fault, we can reuse the COW page, but
     // don't mark it writable!
@@ -576,6 +671,7 @@ pagefault(vmap *vmap, uptr va, u32 err)
     } catch (std::bad_alloc& e) {
       cprintf("%d: pagefault retry\n", myproc()->pid);
       gc_wakeup();
+      swap_wakeup();
       yield();
     }
 #endif
@@ -615,6 +711,126 @@ retry:
   }
 }
 
+sref<page_info>
+vmap::pageref(uptr va)
+{
+  if (va >= USERTOP)
+    return sref<page_info>();
+
+retry:
+  try {
+    auto it = vpfs_.find(va / PGSIZE);
+    if (!it.is_set())
+      return sref<page_info>();
+    auto lock = vpfs_.acquire(it);
+    if (!it.is_set())
+      return sref<page_info>();
+
+    page_info* pi = ensure_page(it, access_type::READ);
+    if (!pi)
+      return sref<page_info>();
+    it->flags |= vmdesc::FLAG_ACCESSED;
+    return sref<page_info>::newref(pi);
+  } catch (blocking_io &e) {
+    // ensure_page attempted to do IO.  Retry the IO now that we've
+    // dropped the vpf range lock.
+    e.retry();
+    goto retry;
+  }
+}
+
+size_t
+vmap::share_cow(uptr start, uptr len, std::vector<sref<page_info> > *out)
+{
+  assert(start % PGSIZE == 0);
+  assert(len % PGSIZE == 0);
+  if (start >= USERTOP || len > USERTOP - start)
+    return 0;
+
+  // Pages marked COW before a retry stay marked, so a single
+  // shootdown at the end covers them all.
+  mmu::shootdown shootdown;
+  size_t base = out->size();
+  auto begin = vpfs_.find(start / PGSIZE);
+  auto end = vpfs_.find((start + len) / PGSIZE);
+
+retry:
+  while (out->size() > base)
+    out->pop_back();
+  try {
+    auto lock = vpfs_.acquire(begin, end);
+    for (auto it = begin; it < end; ++it) {
+      if (!it.is_set() || !(it->flags & vmdesc::FLAG_ANON) ||
+          (it->flags & vmdesc::FLAG_SHARED))
+        break;
+      page_info *pi = ensure_page(it, access_type::READ);
+      if (!pi)
+        break;
+      // ensure_page left this page with its own descriptor, so the
+      // flags can be changed in place.
+      if (!(it->flags & vmdesc::FLAG_COW)) {
+        it->flags |= vmdesc::FLAG_COW;
+        cache.invalidate(it.index() * PGSIZE, PGSIZE, it, &shootdown);
+      }
+      out->push_back(sref<page_info>::newref(pi));
+    }
+    shootdown.perform();
+  } catch (blocking_io &e) {
+    e.retry();
+    goto retry;
+  }
+  return (out->size() - base) * PGSIZE;
+}
+
+int
+vmap::map_cow(uptr start, const sref<page_info> *pages, size_t npages)
+{
+  assert(start % PGSIZE == 0);
+  uptr len = npages * PGSIZE;
+  if (start >= USERTOP || len > USERTOP - start)
+    return -1;
+
+  auto begin = vpfs_.find(start / PGSIZE);
+  auto end = vpfs_.find((start + len) / PGSIZE);
+  mmu::shootdown shootdown;
+  page_holder old;
+
+  {
+    auto lock = vpfs_.acquire(begin, end);
+
+    for (auto it = begin; it < end; it += it.span()) {
+      if (!it.is_set())
+        return -1;
+      auto flags = it->flags & (vmdesc::FLAG_ANON | vmdesc::FLAG_WRITE |
+                                vmdesc::FLAG_SHARED);
+      if (flags != (vmdesc::FLAG_ANON | vmdesc::FLAG_WRITE))
+        return -1;
+    }
+
+    cache.invalidate(start, len, begin, &shootdown);
+
+    auto it = begin;
+    for (size_t i = 0; i < npages; ++i, ++it) {
+      if (it->page)
+        old.add(std::move(it->page));
+      if (it.base_span() == 1) {
+        it->page = pages[i];
+        it->swap.reset();
+        it->flags |= vmdesc::FLAG_COW;
+      } else {
+        vmdesc n(*it);
+        n.page = pages[i];
+        n.swap.reset();
+        n.flags |= vmdesc::FLAG_COW;
+        vpfs_.fill(it, std::move(n));
+      }
+    }
+
+    shootdown.perform();
+  }
+  return 0;
+}
+
 void*
 pagelookup(vmap* vmap, uptr va)
 {
@@ -632,6 +848,7 @@ pagelookup(vmap* vmap, uptr va)
     } catch (std::bad_alloc& e) {
       cprintf("%d: pagelookup retry\n", myproc()->pid);
       gc_wakeup();
+      swap_wakeup();
       yield();
     }
 #endif
@@ -787,8 +1004,13 @@ vmap::ensure_page(const vmap::vpf_array::iterator &it, vmap::access_type type,
     return desc.page.get();
 
   sref<page_info> page = desc.page;
+  bool mapped = false;
   if (!page) {
-    if (desc.flags & vmdesc::FLAG_ANON) {
+    if (desc.swap) {
+      // Swapped out.  If another vmap shares the swap entry, this is
+      // still marked COW, so a write fault copies it below.
+      page = desc.swap->get_page();
+    } else if (desc.flags & vmdesc::FLAG_ANON) {
       assert(!(desc.flags & vmdesc::FLAG_COW));
       if (allocated)
         *allocated = true;
@@ -798,9 +1020,22 @@ vmap::ensure_page(const vmap::vpf_array::iterator &it, vmap::access_type type,
       page = sref<page_info>::transfer(new(page_info::of(p)) page_info());
     } else {
       u64 page_idx = (it.index() * PGSIZE - desc.start) / PGSIZE;
-      page = desc.inode->as_file()->get_page(page_idx).get_page_info();
-      if (!page)
-        return nullptr;
+      mfile *mf = desc.inode->as_file();
+      for (;;) {
+        page = mf->get_page(page_idx).get_page_info();
+        if (!page)
+          return nullptr;
+        // Add the page's rmap entry before installing it, so
+        // migrate_page can't replace it in between.  A COW fault maps
+        // a copy instead.
+        if (need_copy || myproc() == bootproc)
+          break;
+        if (mf->add_mapping(page_idx, page.get(),
+                            std::make_pair(&*this, it.index()*PGSIZE))) {
+          mapped = true;
+          break;
+        }
+      }
     }
   }
 
@@ -823,24 +1058,101 @@ vmap::ensure_page(const vmap::vpf_array::iterator &it, vmap::access_type type,
   if (it.base_span() == 1) {
     // Safe to update in place
     desc.page = page;
+    desc.swap.reset();
     if (need_copy)
       desc.flags &= ~vmdesc::FLAG_COW;
   } else {
     vmdesc n(desc);
     n.page = page;
+    n.swap.reset();
     if (need_copy)
       n.flags &= ~vmdesc::FLAG_COW;
     // XXX(austin) Fill could do a move in this case, which would
     // save extraneous reference counting
     vpfs_.fill(it, std::move(n));
   }
-  if (myproc() != bootproc && it->page && it->inode) {
+  if (myproc() != bootproc && it->page && it->inode && !mapped) {
     std::pair<vmap*, uptr> rmap = std::make_pair(&*this, it.index()*PGSIZE);
     it->page->add_pte(rmap);
   }
   return page.get();
 }
 
+size_t
+vmap::swap_out(std::vector<sref<swap_entry> > *out, size_t want)
+{
+  mmu::shootdown shootdown;
+  size_t n = 0;
+
+  auto it = vpfs_.find(swap_hand_ / PGSIZE), end = vpfs_.end();
+  for (; it < end && n < want; it += it.span()) {
+    if (!it.is_set())
+      continue;
+    auto lock = vpfs_.acquire(it);
+    if (!it.is_set())
+      continue;
+
+    // Only private anonymous pages are swapped.  Pages shared COW
+    // with another vmap stay resident until one side copies them.
+    auto &desc = *it;
+    if (!desc.page || !(desc.flags & vmdesc::FLAG_ANON) ||
+        (desc.flags & (vmdesc::FLAG_COW | vmdesc::FLAG_SHARED)) ||
+        it.base_span() != 1)
+      continue;
+    kstats::inc(&kstats::swap_scan_count);
+
+    uptr va = it.index() * PGSIZE;
+    if (desc.flags & vmdesc::FLAG_ACCESSED) {
+      // Second chance.  Invalidating the PTE makes the next access
+      // fault and set FLAG_ACCESSED again.
+      desc.flags &= ~vmdesc::FLAG_ACCESSED;
+      cache.invalidate(va, PGSIZE, it, &shootdown);
+      continue;
+    }
+
+    sref<swap_entry> e = swap_entry::alloc(desc.page);
+    if (!e)
+      break;
+    if (SDEBUG)
+      sdebug.println("vm: swap out ", shex(va), " to ", shex(e->offset()));
+    // The entry holds the page until it has been written, which is
+    // after the shootdown below.
+    cache.invalidate(va, PGSIZE, it, &shootdown);
+    desc.page.reset();
+    desc.swap = e;
+    out->push_back(std::move(e));
+    ++n;
+  }
+
+  swap_hand_ = it < end ? it.index() * PGSIZE : 0;
+  shootdown.perform();
+  return n;
+}
+
+size_t
+vmap::swap_out_all(std::vector<sref<swap_entry> > *out, size_t want)
+{
+  // Rotate the starting vmap so the same address spaces are not
+  // always scanned first.
+  static size_t first;
+
+  std::vector<sref<vmap> > vms;
+  for (int c = 0; c < ncpu; c++) {
+    scoped_acquire l(&all_[c].lock);
+    for (vmap &vm : all_[c].vmaps)
+      if (vm.tryinc())
+        vms.push_back(sref<vmap>::transfer(&vm));
+  }
+  if (vms.empty())
+    return 0;
+
+  size_t n = 0;
+  first = (first + 1) % vms.size();
+  for (size_t i = 0; i < vms.size() && n < want; i++)
+    n += vms[(first + i) % vms.size()]->swap_out(out, want - n);
+  return n;
+}
+
 void
 vmap::dump()
 {
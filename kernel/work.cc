@@ -0,0 +1,222 @@
+#include "types.h"
+#include "kernel.hh"
+#include "amd64.h"
+#include "spinlock.hh"
+#include "condvar.hh"
+#include "proc.hh"
+#include "cpu.hh"
+#include "kstats.hh"
+#include "work.hh"
+#include <algorithm>
+
+// A core's deferred-work engine.  Delayed work waits on a three-level
+// hierarchical timer wheel with 64 slots per level.  Level 0 holds work
+// due within 64 ticks, one slot per tick; each higher level covers 64
+// times the range of the level below, one slot per lower level's
+// range.  When a level wraps around, the next slot of the level above
+// is redistributed (cascaded) into the lower levels, so arming and
+// firing a timer take constant time.
+struct dwork_engine
+{
+  enum { WHEEL_BITS = 6,
+         WHEEL_SLOTS = 1 << WHEEL_BITS,
+         WHEEL_LEVELS = 3,
+         MAX_DELAY = (1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1 };
+
+  typedef ilist<dwork, &dwork::link_> list;
+
+  spinlock lock;
+  condvar cv;
+  list runq[NDWORK_PRIO];
+  list wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+  u64 now;                      // Ticks since boot
+
+  dwork_engine()
+    : lock("dwork_engine", LOCKSTAT_SCHED), cv("dwork_engine"), now(0) { }
+
+  // The following must be called with lock held.
+
+  void enqueue(dwork *w)
+  {
+    w->state_ = dwork::QUEUED;
+    w->queued_ = rdtsc();
+    runq[w->prio_].push_back(w);
+    if (w->prio_ != DWORK_IDLE)
+      cv.wake_all();
+  }
+
+  void arm(dwork *w)
+  {
+    u64 delta = w->expires_ - now;
+    if (delta > MAX_DELAY) {
+      delta = MAX_DELAY;
+      w->expires_ = now + delta;
+    }
+    int level = 0;
+    while (delta >= (1ull << (WHEEL_BITS * (level + 1))))
+      level++;
+    u64 slot = (w->expires_ >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    w->state_ = dwork::TIMER;
+    wheel[level][slot].push_back(w);
+  }
+
+  void cascade(int level)
+  {
+    u64 slot = (now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    list l(std::move(wheel[level][slot]));
+    while (!l.empty()) {
+      dwork *w = &l.front();
+      l.pop_front();
+      arm(w);
+    }
+  }
+
+  void tick()
+  {
+    now++;
+    // Cascade from the top down, so work moved out of a higher level
+    // can land in the slot of a lower level that cascades next.
+    for (int level = WHEEL_LEVELS - 1; level > 0; level--)
+      if ((now & ((1ull << (WHEEL_BITS * level)) - 1)) == 0)
+        cascade(level);
+
+    list &due = wheel[0][now & (WHEEL_SLOTS - 1)];
+    while (!due.empty()) {
+      dwork *w = &due.front();
+      due.pop_front();
+      kstats::inc(&kstats::dwork_timer_count);
+      enqueue(w);
+    }
+  }
+
+  // Dequeue the next work item of priority prio or better.
+  dwork* next(int prio)
+  {
+    for (int p = 0; p <= prio; p++) {
+      if (!runq[p].empty()) {
+        dwork *w = &runq[p].front();
+        runq[p].pop_front();
+        w->state_ = dwork::IDLE;
+        kstats::inc(&kstats::dwork_run_count);
+        kstats::inc(&kstats::dwork_delay_cycles, rdtsc() - w->queued_);
+        return w;
+      }
+    }
+    return nullptr;
+  }
+
+  // Queue w to run on this engine's core as soon as possible, taking
+  // it off the timer wheel if it is waiting there.  Returns false if w
+  // was already queued.
+  bool queue(dwork *w, int cpu)
+  {
+    if (w->state_ == dwork::QUEUED) {
+      kstats::inc(&kstats::dwork_coalesced_count);
+      return false;
+    }
+    if (w->state_ == dwork::TIMER) {
+      // Unlinking only touches w's neighbours, so any wheel slot's list
+      // can do it.
+      wheel[0][0].erase(list::iterator_to(w));
+    }
+    w->cpu_ = cpu;
+    enqueue(w);
+    return true;
+  }
+
+  // Arm a timer for w, msec from now.  Returns false if w was already
+  // pending.
+  bool delay(dwork *w, int cpu, u64 msec)
+  {
+    if (w->state_ != dwork::IDLE) {
+      kstats::inc(&kstats::dwork_coalesced_count);
+      return false;
+    }
+    w->cpu_ = cpu;
+    w->expires_ = now + std::max<u64>((msec + QUANTUM - 1) / QUANTUM, 1);
+    arm(w);
+    return true;
+  }
+
+  // Run a work item returned by next().  Must be called without lock.
+  static void run(dwork *w)
+  {
+    kstats::timer timer(&kstats::dwork_run_cycles);
+    w->run();
+  }
+} __mpalign__;
+
+// Not a per-CPU variable because work can be queued for a CPU before
+// it boots.
+static dwork_engine engines[NCPU];
+
+bool
+dwork_queue(dwork *w, int cpu)
+{
+  dwork_engine *e = &engines[cpu];
+  scoped_acquire l(&e->lock);
+  return e->queue(w, cpu);
+}
+
+bool
+dwork_delay(dwork *w, int cpu, u64 msec)
+{
+  dwork_engine *e = &engines[cpu];
+  scoped_acquire l(&e->lock);
+  return e->delay(w, cpu, msec);
+}
+
+int
+dwork_push(struct dwork *w, int cpu)
+{
+  dwork_queue(w, cpu);
+  return 0;
+}
+
+bool
+dwork_run_idle(void)
+{
+  dwork *w;
+  {
+    dwork_engine *e = &engines[myid()];
+    scoped_acquire l(&e->lock);
+    w = e->next(DWORK_IDLE);
+  }
+  if (!w)
+    return false;
+  dwork_engine::run(w);
+  return true;
+}
+
+void
+dwork_tick(void)
+{
+  dwork_engine *e = &engines[myid()];
+  scoped_acquire l(&e->lock);
+  e->tick();
+}
+
+static void
+dwork_worker(void *x)
+{
+  dwork_engine *e = &engines[myid()];
+  for (;;) {
+    dwork *w;
+    {
+      scoped_acquire l(&e->lock);
+      while ((w = e->next(DWORK_NORMAL)) == nullptr)
+        e->cv.sleep(&e->lock);
+    }
+    dwork_engine::run(w);
+  }
+}
+
+void
+initwork(void)
+{
+  for (int c = 0; c < ncpu; c++) {
+    char namebuf[32];
+    snprintf(namebuf, sizeof(namebuf), "dwork_%u", c);
+    threadpin(dwork_worker, nullptr, namebuf, c);
+  }
+}
@@ -18,52 +18,44 @@ struct free_page
   typedef ilist<free_page, &free_page::link> list_t;
 };
 
+// Refills the local CPU's zeroed pages.  This is idle-priority work,
+// so background zeroing only happens when the CPU would otherwise be
+// idle.
+struct zwork : public dwork {
+  zwork() : dwork(DWORK_IDLE) {}
+
+  virtual void run() override;
+};
+
 struct zallocator {
   // pages and nPages must only be accessed by the local CPU and must
   // be accessed with interrupts disabled.
   free_page::list_t pages;
   unsigned nPages;
-  dwframe frame;
+  zwork refill;
 };
 DEFINE_PERCPU(zallocator, z_);
 
-struct zwork : public dwork {
-  zwork(dwframe* frame)
-    : frame_(frame)
-  {
-    frame_->inc();
-  }
-
-  virtual void run() override {
-    for (int i = 0; i < 32; i++) {
-      auto *r = (struct free_page*)kalloc("zpage");
-      if (r == nullptr)
-        break;
-      zpage_nc(r);
-      scoped_cli cli;
-      z_->pages.push_front(r);
-      ++z_->nPages;
-    }
-    frame_->dec();
-    delete this;
+void
+zwork::run()
+{
+  for (int i = 0; i < 32; i++) {
+    auto *r = (struct free_page*)kalloc("zpage");
+    if (r == nullptr)
+      break;
+    zpage_nc(r);
+    scoped_cli cli;
+    z_->pages.push_front(r);
+    ++z_->nPages;
   }
-
-  dwframe* frame_;
-
-  NEW_DELETE_OPS(zwork);
-};
+}
 
 static void
 tryrefill(void)
 {
   int cpu = myid();
-  if (prezero && z_[cpu].nPages < 16 && z_[cpu].frame.zero()) {
-    zwork* w = new zwork(&z_[cpu].frame);
-    // XXX This is higher priority than doing actual work.  We should
-    // only do background zeroing if we would otherwise be idle.
-    if (dwork_push(w, cpu) < 0)
-      delete w;
-  }
+  if (prezero && z_[cpu].nPages < 16)
+    dwork_queue(&z_[cpu].refill, cpu);
 }
 
 // Allocate a zeroed page.  This page can be freed with kfree or, if
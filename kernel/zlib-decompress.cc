@@ -76,11 +76,64 @@ zlib_decompress(unsigned char *src, u64 srclen, u64 dstlen,
     // done when inflate() says its done!
   } while (err != Z_STREAM_END);
 
-  if (stream.total_out != dstlen)
+  // A dstlen of 0 means that the caller doesn't know the output size.
+  if (dstlen && stream.total_out != dstlen)
     panic("%s: inflate() total_out != dstlen\n", __func__);
 
-  assert(i == dstlen/CHUNK);
+  assert(!dstlen || i == dstlen/CHUNK);
   inflateEnd(&stream);
   assert(err == Z_STREAM_END);
   return 0;
 }
+
+// State of sparse_decompress(), which zlib_decompress() feeds one block of
+// the sparse image at a time.
+static struct {
+  void (*copy_block)(const char *buf, u64 blknum);
+  u64 blknum;   // Disk block of the next data block in the current extent
+  u32 left;     // Data blocks left in the current extent
+  bool done;
+} sparse;
+
+static void
+sparse_output(const char *buf, u64 offset, u64 size)
+{
+  assert(size == BSIZE);
+  if (sparse.done)
+    panic("%s: data past the last extent\n", __func__);
+
+  if (sparse.left) {
+    sparse.copy_block(buf, sparse.blknum++);
+    sparse.left--;
+    return;
+  }
+
+  const sparse_extent *ext = (const sparse_extent *) buf;
+  if (ext->magic != SPARSE_MAGIC)
+    panic("%s: bad extent header at offset %lu\n", __func__, offset);
+
+  if (!ext->nblocks) {
+    sparse.done = true;
+  } else if (ext->type == SPARSE_ZERO) {
+    for (u32 i = 0; i < ext->nblocks; i++)
+      sparse.copy_block(nullptr, ext->blknum + i);
+  } else {
+    sparse.blknum = ext->blknum;
+    sparse.left = ext->nblocks;
+  }
+}
+
+int
+sparse_decompress(unsigned char *src, u64 srclen,
+                  void (*copy_block)(const char *buf, u64 blknum))
+{
+  sparse.copy_block = copy_block;
+  sparse.left = 0;
+  sparse.done = false;
+
+  zlib_decompress(src, srclen, 0, sparse_output);
+
+  if (!sparse.done)
+    panic("%s: sparse image is truncated\n", __func__);
+  return 0;
+}
@@ -3,6 +3,8 @@
 #include "user.h"
 #include <atomic>
 #include "elfuser.hh"
+#include "futex.h"
+#include "amd64.h"
 #include <unistd.h>
 #include <sched.h>
 #include <stdio.h>
@@ -12,6 +14,12 @@ enum { stack_size = 8192 };
 static std::atomic<int> nextkey;
 enum { max_keys = 128 };
 enum { elf_tls_reserved = 1 };
+// Rounds of key destructors to run at thread exit
+enum { destructor_iterations = 4 };
+static void (*key_destructors[max_keys])(void*);
+// Iterations to spin on a contended mutex or an incomplete barrier
+// before sleeping in the kernel.
+enum { spin_iters = 1000 };
 
 struct tlsdata {
   void* tlsptr[elf_tls_reserved];
@@ -92,9 +100,27 @@ xthread_create(pthread_t* tid, int flags,
   return 0;
 }
 
+// Threads also end up here when their start function returns.  The
+// process's main thread doesn't, since nothing outlives it.
 void
 pthread_exit(void* retval)
 {
+  // Run the destructors of this thread's non-null keys.  A destructor
+  // may set keys again, so repeat a few times, like POSIX.
+  for (int i = 0; i < destructor_iterations; i++) {
+    bool ran = false;
+    int n = nextkey < max_keys ? nextkey.load() : max_keys;
+    for (int k = 0; k < n; k++) {
+      void *v = pthread_getspecific(k + elf_tls_reserved);
+      if (v && key_destructors[k]) {
+        pthread_setspecific(k + elf_tls_reserved, nullptr);
+        key_destructors[k](v);
+        ran = true;
+      }
+    }
+    if (!ran)
+      break;
+  }
   exit(0);
 }
 
@@ -119,11 +145,11 @@ pthread_self()
 int
 pthread_key_create(pthread_key_t *key, void (*destructor)(void*))
 {
-  // Ignore the destructor for now.
   int k = nextkey++;
   if (k >= max_keys)
     return -1;
 
+  key_destructors[k] = destructor;
   *key = k + elf_tls_reserved;   // skip a few slots for ELF-TLS
   return 0;
 }
@@ -147,16 +173,45 @@ int
 pthread_barrier_init(pthread_barrier_t *b,
                      const pthread_barrierattr_t *attr, unsigned count)
 {
-  b->store(count);
+  b->count = count;
+  b->arrived = 0;
+  b->seq = 0;
+  b->wake = 0;
   return 0;
 }
 
+// Wake up to two threads from the barrier's wake tree.  Every thread
+// leaving the barrier does this, so waking n waiters takes O(log n)
+// rounds spread across their cores, rather than n wakeups issued
+// serially by the last thread to arrive.
+static void
+barrier_fanout(pthread_barrier_t *b)
+{
+  futex(&b->wake, FUTEX_WAKE, 2, 0, 0, 0);
+}
+
 int
 pthread_barrier_wait(pthread_barrier_t *b)
 {
-  (*b)--;
-  while (*b != 0)
-    ;   // spin
+  u64 seq = __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE);
+  if (__atomic_add_fetch(&b->arrived, 1, __ATOMIC_ACQ_REL) == b->count) {
+    // Last to arrive.  Reset for the next round before releasing the
+    // others, then move every sleeper onto the wake tree.
+    b->arrived = 0;
+    __atomic_store_n(&b->seq, seq + 1, __ATOMIC_RELEASE);
+    futex(&b->seq, FUTEX_CMP_REQUEUE, 0, ~0ul, &b->wake, seq + 1);
+    barrier_fanout(b);
+    return PTHREAD_BARRIER_SERIAL_THREAD;
+  }
+
+  for (int i = 0; i < spin_iters; i++) {
+    if (__atomic_load_n(&b->seq, __ATOMIC_ACQUIRE) != seq)
+      return 0;
+    nop_pause();
+  }
+  while (__atomic_load_n(&b->seq, __ATOMIC_ACQUIRE) == seq)
+    futex(&b->seq, FUTEX_WAIT, seq, 0, 0, 0);
+  barrier_fanout(b);
   return 0;
 }
 
@@ -167,24 +222,117 @@ sched_setaffinity(int pid, size_t cpusetsize, cpu_set_t *mask)
   return setaffinity(mask->the_cpu);
 }
 
-int       
+int
 pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr)
 {
   *mutex = 0;
   return 0;
 }
 
-int 
+int
+pthread_mutex_destroy(pthread_mutex_t *mutex)
+{
+  return 0;
+}
+
+int
+pthread_mutex_trylock(pthread_mutex_t *mutex)
+{
+  pthread_mutex_t c = 0;
+  if (__atomic_compare_exchange_n(mutex, &c, 1, false,
+                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return 0;
+  return -1;
+}
+
+// Take mutex, marking it as having waiters so that its unlock wakes
+// the next one.
+static void
+mutex_lock_contended(pthread_mutex_t *mutex)
+{
+  while (__atomic_exchange_n(mutex, 2, __ATOMIC_ACQUIRE) != 0)
+    futex(mutex, FUTEX_WAIT, 2, 0, 0, 0);
+}
+
+int
 pthread_mutex_lock(pthread_mutex_t *mutex)
 {
-  while(!__sync_bool_compare_and_swap(mutex, 0, 1)) ;
+  pthread_mutex_t c = 0;
+  if (__atomic_compare_exchange_n(mutex, &c, 1, false,
+                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return 0;
+
+  // Spin while the holder has no waiters, since it is likely running
+  // and about to release the mutex.
+  for (int i = 0; c == 1 && i < spin_iters; i++) {
+    nop_pause();
+    c = 0;
+    if (__atomic_compare_exchange_n(mutex, &c, 1, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return 0;
+  }
+
+  mutex_lock_contended(mutex);
   return 0;
 }
 
-int 
+int
 pthread_mutex_unlock(pthread_mutex_t *mutex)
 {
-  int b = __sync_bool_compare_and_swap(mutex, 1, 0);
-  return !b;
+  if (__atomic_fetch_sub(mutex, 1, __ATOMIC_RELEASE) != 1) {
+    __atomic_store_n(mutex, 0, __ATOMIC_RELEASE);
+    futex(mutex, FUTEX_WAKE, 1, 0, 0, 0);
+  }
+  return 0;
+}
+
+int
+pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr)
+{
+  cond->seq = 0;
+  cond->mutex = nullptr;
+  return 0;
+}
+
+int
+pthread_cond_destroy(pthread_cond_t *cond)
+{
+  return 0;
+}
+
+int
+pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+  u64 seq = __atomic_load_n(&cond->seq, __ATOMIC_RELAXED);
+  __atomic_store_n(&cond->mutex, mutex, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(mutex);
+  futex(&cond->seq, FUTEX_WAIT, seq, 0, 0, 0);
+  // pthread_cond_broadcast may have requeued other waiters onto the
+  // mutex, so take it contended to make sure its unlock wakes them.
+  mutex_lock_contended(mutex);
+  return 0;
 }
 
+int
+pthread_cond_signal(pthread_cond_t *cond)
+{
+  __atomic_add_fetch(&cond->seq, 1, __ATOMIC_RELEASE);
+  futex(&cond->seq, FUTEX_WAKE, 1, 0, 0, 0);
+  return 0;
+}
+
+int
+pthread_cond_broadcast(pthread_cond_t *cond)
+{
+  pthread_mutex_t *mutex = __atomic_load_n(&cond->mutex, __ATOMIC_RELAXED);
+  u64 seq = __atomic_add_fetch(&cond->seq, 1, __ATOMIC_RELEASE);
+  if (mutex == nullptr)
+    return 0;                   // Nobody has ever waited
+  // Wake one waiter and move the rest onto the mutex, where its
+  // unlocks wake them one at a time, instead of waking them all to
+  // stampede for it.  If another signal raced with us, fall back to
+  // waking everyone.
+  if (futex(&cond->seq, FUTEX_CMP_REQUEUE, 1, ~0ul, mutex, seq) < 0)
+    futex(&cond->seq, FUTEX_WAKE, ~0ul, 0, 0, 0);
+  return 0;
+}
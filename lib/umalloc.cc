@@ -3,11 +3,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/mman.h>
-#ifndef XV6_USER
-#include <linux/unistd.h>       // __NR_gettid
-#endif
 
+#include <atomic>
 #include <memory>
 #include <new>
 #include <utility>
@@ -17,12 +16,16 @@
 #include "log2.hh"
 
 // This allocator strongly weighs its own scalability over other forms
-// of efficiency.  In particular, when memory is freed via a given
-// thread, only that thread can then reuse that memory.  Also, after a
-// page is carved up in to sub-page regions, it can never be used for
-// any other size class (allocations that involve a page or more of
-// memory can be re-partitioned, however).  It also never returns
-// memory to the system.
+// of efficiency.  All of its fast paths touch only thread-local state.
+// Small objects freed by a thread other than the one that allocated
+// them are handed back to the allocating thread through a lock-free
+// remote free queue, which that thread drains the next time it calls
+// malloc.  The same goes for large allocations.  Pages carved in to
+// sub-page regions are returned to the large allocator once all of
+// their regions are free, so they can be re-used for other size
+// classes.  Large free runs are returned to the system with munmap.
+// When a thread exits, its heap, along with its free lists and the
+// pages they hold, is left for the next new thread to adopt.
 
 // == Overall architecture ==
 //
@@ -60,17 +63,29 @@
 // This could result in an arbitrary size region, so it is split in to
 // the largest size classes possible.
 //
+// Once a merged free run reaches release_bytes, the large allocator
+// unmaps it and marks its pages unmapped in the radix array, rather
+// than keeping it on a free list.  The radix array also records which
+// thread allocated each allocated region, so a region freed by
+// another thread can be handed back to its allocating thread's remote
+// free queue.
+//
 // Finally, a *small allocator* handles allocations for size classes
 // half-a-page and smaller (where multiple objects will fit on one
 // page).  Like the large allocation, this allocator maintains
 // per-core per-size-class free lists; however, the small allocator
 // does no splitting or merging.  If the free list for an allocation
 // is empty, it obtains a page from the large allocator, carves it up
-// in to equal size regions, and stores the size class at the
-// beginning of the page.  As a result, there is no per-object space
-// overhead; only per-page overhead.  Freeing an object simply checks
-// the page header to find the object's size class and adds it to the
-// appropriate free list.
+// in to equal size regions, and stores the size class, the owning
+// thread, and a count of free regions at the beginning of the page.
+// As a result, there is no per-object space overhead; only per-page
+// overhead.  Freeing an object checks the page header to find the
+// object's size class and owner.  If the caller owns the page, the
+// object goes on the appropriate free list, and if that makes the
+// whole page free (and this size class already has a spare free
+// page), the page's regions are pulled off the free list and the page
+// goes back to the large allocator.  Otherwise, the object is pushed
+// on the owner's remote free queue.
 //
 // malloc determines whether to use the large allocator or the small
 // allocator based on the requested object size.  free determines
@@ -95,14 +110,9 @@ namespace {
   // Must be >= 4096 and a valid size class
   size_t min_map_bytes = 256 * 1024;
 
-  pid_t gettid()
-  {
-#if defined(XV6_USER)
-    return getpid();
-#else
-    return syscall(__NR_gettid);
-#endif
-  }
+  // Free runs of at least this many bytes are returned to the
+  // system.  Must be >= min_map_bytes.
+  size_t release_bytes = 1024 * 1024;
 
   // Assert that ptr looks like a valid pointer.
   void check_ptr(void *ptr)
@@ -138,9 +148,9 @@ namespace {
     block_list &operator=(block_list &&) = delete;
 
   public:
-    // NOTE: block_list is used in __thread globals, which means it
-    // must have a default constructor.  Since this is the *only*
-    // place it's used, the global will take care of zeroing head.
+    // NOTE: block_list is used in thread_heap, which means it must
+    // have a trivial default constructor.  thread_heaps are
+    // value-initialized, which takes care of zeroing head.
     block_list() = default;
     ~block_list() = default;
 
@@ -215,6 +225,12 @@ namespace {
   // At this many bytes, the size class will be one page large
   enum { LARGE_THRESHOLD = 2049 };
 
+  // The number of size classes the small allocator may use
+  enum { NSMALL_CLASSES = ceil_log2_const(LARGE_THRESHOLD - 1) + 1 };
+
+  // The number of size classes the large allocator may use
+  enum { MAX_LARGE_CLASS = 48 };
+
   // Compute the size class of a byte size.
   size_t size_to_class(size_t bytes)
   {
@@ -238,7 +254,8 @@ namespace {
   // Linear allocator (used for pages radix array)
   //
 
-  __thread char *linear_pos, *linear_end;
+  // Allocate bytes from this thread's heap's linear pool.
+  void *linear_alloc(size_t bytes);
 
   template<typename T>
   class linear_allocator
@@ -282,19 +299,7 @@ namespace {
 
     T* allocate(std::size_t n, const void *hint = 0)
     {
-      size_t bytes = n * sizeof(T);
-      if (!linear_pos || linear_end - linear_pos < bytes) {
-        // Get more memory
-        void *p = mmap(0, min_map_bytes, PROT_READ|PROT_WRITE,
-                       MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-        if (p == MAP_FAILED)
-          throw std::bad_alloc();
-        linear_pos = (char*)p;
-        linear_end = linear_pos + min_map_bytes;
-      }
-      T *p = static_cast<T*>(static_cast<void*>(linear_pos));
-      linear_pos += bytes;
-      return p;
+      return static_cast<T*>(linear_alloc(n * sizeof(T)));
     }
 
     void deallocate(T* p, std::size_t n)
@@ -322,10 +327,177 @@ namespace {
   };
 
   //
-  // Large allocator (size classes one page large and up)
+  // Thread heaps
   //
 
-  enum { MAX_LARGE_CLASS = 48 };
+  struct page_hdr;
+
+  // A thread's allocator state.  Heaps are mmapped and never freed, so
+  // other threads can always safely push to one.  When its thread
+  // exits, a heap is put on the orphans list and the next new thread
+  // adopts it, so objects freed to it later and the pages on its free
+  // lists are not leaked.
+  struct thread_heap
+  {
+    // Objects freed by other threads, linked through their first
+    // word.  Other threads push to this and the owning thread takes
+    // the whole list at once, so there's no ABA problem.
+    std::atomic<void*> remote_frees;
+    // Index of this heap in heaps, or 0 if it didn't fit.
+    unsigned id;
+    // The owner of this heap's free runs in the pages radix array.
+    // Unique to this heap and never 0 or +/-1, which mark unmapped
+    // and allocated pages.
+    pid_t tag;
+    // The next heap on the orphans list.
+    thread_heap *next_orphan;
+
+    // The rest is only accessed by the thread using this heap.
+
+    // Page free lists indexed by size class.  The smaller size
+    // classes are unused.
+    block_list free_runs[MAX_LARGE_CLASS];
+    // Fragment free lists by size class (ceil(log2(bytes))).
+    // Fragments must be at least sizeof(block_list::block), so the
+    // smaller classes are unused.
+    block_list free_fragments[NSMALL_CLASSES];
+    // A completely free page we keep around for each size class, so
+    // alternating allocations and frees don't repeatedly carve up and
+    // release the same page.
+    page_hdr *spare_page[NSMALL_CLASSES];
+    // The linear allocator's current pool.
+    char *linear_pos, *linear_end;
+  };
+
+  // All thread heaps, so the large allocator can find the owner of an
+  // allocation from the index in its page_info.  Threads beyond
+  // MAX_HEAPS get id 0 and their large allocations are freed locally
+  // by whichever thread frees them.
+  enum { MAX_HEAPS = 4096 };
+  thread_heap *heaps[MAX_HEAPS];
+  std::atomic<unsigned> nheaps(1);
+
+  // Heaps whose threads have exited, linked through next_orphan.
+  // Threads take the whole list at once, so there's no ABA problem.
+  std::atomic<thread_heap*> orphans;
+
+  __thread thread_heap *my_heap;
+
+  // The key whose destructor orphans a thread's heap when it exits.
+  pthread_key_t heap_key;
+  // 0 until heap_key is being created, 1 while it is, 2 once it is,
+  // and 3 if there was no key left.
+  std::atomic<int> heap_key_state;
+
+  void drain_remote_frees(thread_heap *heap);
+
+  void push_orphan(thread_heap *heap)
+  {
+    thread_heap *head = orphans.load(std::memory_order_relaxed);
+    do {
+      heap->next_orphan = head;
+    } while (!orphans.compare_exchange_weak(
+               head, heap, std::memory_order_release,
+               std::memory_order_relaxed));
+  }
+
+  // Called when a thread exits.  Move what other threads have freed
+  // to us on to our free lists and leave the heap for the next new
+  // thread.
+  void orphan_heap(void *arg)
+  {
+    thread_heap *heap = static_cast<thread_heap*>(arg);
+    assert(heap == my_heap);
+    drain_remote_frees(heap);
+    my_heap = nullptr;
+    push_orphan(heap);
+  }
+
+  // Take a heap off the orphans list, or return nullptr if there is
+  // none.
+  thread_heap *adopt_heap()
+  {
+    thread_heap *heap = orphans.exchange(nullptr, std::memory_order_acquire);
+    if (!heap)
+      return nullptr;
+    for (thread_heap *rest = heap->next_orphan, *next; rest; rest = next) {
+      next = rest->next_orphan;
+      push_orphan(rest);
+    }
+    heap->next_orphan = nullptr;
+    return heap;
+  }
+
+  thread_heap *new_heap()
+  {
+    size_t bytes = (sizeof(thread_heap) + PGSIZE - 1) & ~(PGSIZE - 1);
+    void *p = mmap(0, bytes, PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+      throw std::bad_alloc();
+    thread_heap *heap = new (p) thread_heap();
+    unsigned n = nheaps++;
+    heap->tag = n + 1;
+    heap->id = n < MAX_HEAPS ? n : 0;
+    if (heap->id)
+      heaps[heap->id] = heap;
+    return heap;
+  }
+
+  thread_heap *get_heap()
+  {
+    if (my_heap)
+      return my_heap;
+
+    int state = heap_key_state.load(std::memory_order_acquire);
+    if (state == 0 && heap_key_state.compare_exchange_strong(state, 1)) {
+      state = pthread_key_create(&heap_key, orphan_heap) == 0 ? 2 : 3;
+      heap_key_state.store(state, std::memory_order_release);
+    }
+    while (state == 1)
+      state = heap_key_state.load(std::memory_order_acquire);
+
+    thread_heap *heap = adopt_heap();
+    if (!heap)
+      heap = new_heap();
+    // Set my_heap first, in case pthread_setspecific allocates.
+    my_heap = heap;
+    if (state == 2)
+      pthread_setspecific(heap_key, heap);
+    return heap;
+  }
+
+  void *linear_alloc(size_t bytes)
+  {
+    thread_heap *heap = get_heap();
+    if (!heap->linear_pos || heap->linear_end - heap->linear_pos < bytes) {
+      // Get more memory
+      void *p = mmap(0, min_map_bytes, PROT_READ|PROT_WRITE,
+                     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED)
+        throw std::bad_alloc();
+      heap->linear_pos = (char*)p;
+      heap->linear_end = heap->linear_pos + min_map_bytes;
+    }
+    void *p = heap->linear_pos;
+    heap->linear_pos += bytes;
+    return p;
+  }
+
+  // Push ptr on heap's remote free queue.
+  void push_remote_free(thread_heap *heap, void *ptr)
+  {
+    void *head = heap->remote_frees.load(std::memory_order_relaxed);
+    do {
+      *(void**)ptr = head;
+    } while (!heap->remote_frees.compare_exchange_weak(
+               head, ptr, std::memory_order_release,
+               std::memory_order_relaxed));
+  }
+
+  //
+  // Large allocator (size classes one page large and up)
+  //
 
   enum
   {
@@ -337,14 +509,18 @@ namespace {
   struct page_info
   {
     // * For unmapped pages, UNMAPPED.
-    // * For the first page of a free run, the thread ID that owns the
-    //   run.
-    // * For the non-first page of a free run, the negative thread ID
+    // * For the first page of a free run, the tag of the thread_heap
     //   that owns the run.
+    // * For the non-first page of a free run, the negative tag of the
+    //   thread_heap that owns the run.
     // * For allocated pages, the first page of the allocation is
     //   ALLOCATED_HEAD and the rest are ALLOCATED_REST.
     pid_t owner;
 
+    // For the first page of an allocated run, the id of the
+    // thread_heap it was allocated by.  Otherwise 0.
+    unsigned heap;
+
     // XXX The information about free pages could be written on the
     // pages themselves, rather than requiring lots of space in a
     // radix tree.  There could be races with checking the data, so
@@ -353,7 +529,8 @@ namespace {
     // more efficiently (we could even use a straight 16GB mapping).
 
     page_info() = default;
-    explicit page_info(pid_t owner) : owner(owner) { }
+    explicit page_info(pid_t owner, unsigned heap = 0)
+      : owner(owner), heap(heap) { }
 
     dummy_bit_spinlock get_lock()
     {
@@ -366,10 +543,6 @@ namespace {
     }
   };
 
-  // Page free lists indexed by size class.  The smaller size classes
-  // are unused.
-  __thread block_list free_runs[MAX_LARGE_CLASS] = {};
-
   // Page info radix array.  The +1 on the size is a lame way to avoid
   // having to constantly check our iterators against pages.end().
   radix_array<page_info, (1ULL<<47)/PGSIZE + 1, 4096,
@@ -396,7 +569,7 @@ namespace {
     assert(bytes >= PGSIZE);
     assert(bytes % PGSIZE == 0);
 
-    pid_t tid = gettid();
+    thread_heap *heap = get_heap();
     void *end = (char*)run + bytes;
     auto it = pages.find(idx(run));
     // Divide the run up in to size-class-sized pieces
@@ -404,13 +577,13 @@ namespace {
       size_t fsc = size_fit_class((char*)end - (char*)run);
       size_t fbytes = class_max_size(fsc);
       pdebug("adding free run %p class %zu\n", run, fsc);
-      free_runs[fsc].push(run, fsc);
+      heap->free_runs[fsc].push(run, fsc);
       auto nextit = it + fbytes / PGSIZE;
 
       // Mark pages as free to this thread
-      pages.fill(it++, page_info(tid));
+      pages.fill(it++, page_info(heap->tag));
       if (it != nextit) {
-        pages.fill(it, nextit, page_info(-tid));
+        pages.fill(it, nextit, page_info(-heap->tag));
         it = nextit;
       }
       run = (char*)run + fbytes;
@@ -439,7 +612,7 @@ namespace {
 
     // Mark pages allocated
     auto start = pages.find(idx(run));
-    pages.fill(start, page_info(ALLOCATED_HEAD));
+    pages.fill(start, page_info(ALLOCATED_HEAD, get_heap()->id));
     if (used_pages > 1)
       pages.fill(start + 1, start + used_pages, page_info(ALLOCATED_REST));
 
@@ -453,9 +626,10 @@ namespace {
     size_t sc = size_to_class(bytes);
 
     // Find a free run of at least this size class
+    thread_heap *heap = get_heap();
     for (size_t i = sc; i < MAX_LARGE_CLASS; ++i)
-      if (free_runs[i])
-        return alloc_from_run(free_runs[i].pop(i), i, bytes);
+      if (heap->free_runs[i])
+        return alloc_from_run(heap->free_runs[i].pop(i), i, bytes);
 
     // Can't satisfy request.  Get more pages from the system.
     size_t map_bytes = class_max_size(sc);
@@ -478,7 +652,7 @@ namespace {
   // Free the memory at ptr to the large allocator.
   void free_large(void *ptr)
   {
-    pid_t tid = gettid();
+    pid_t tag = get_heap()->tag;
 
     // Find length of run at start
     auto start = pages.find(idx(ptr));
@@ -498,10 +672,10 @@ namespace {
     auto pre = start;
     if (DO_MERGE) {
       for (--pre; pre.is_set(); --pre) {
-        if (pre->owner == tid) {
+        if (pre->owner == tag) {
           // This is the beginning of a run we can merge with
           block_list::remove(idx_to_ptr(pre.index()));
-        } else if (pre->owner != -tid) {
+        } else if (pre->owner != -tag) {
           // We can't merge with this
           break;
         }
@@ -513,23 +687,52 @@ namespace {
     auto post = end;
     if (DO_MERGE) {
       for (; post.is_set(); ++post) {
-        if (post->owner == tid) {
+        if (post->owner == tag) {
           block_list::remove(idx_to_ptr(post.index()));
-        } else if (post->owner != -tid) {
+        } else if (post->owner != -tag) {
           break;
         }
       }
     }
 
+    pdebug("free_large %p of %lu pages (expanded %p %lu pages)\n",
+           ptr, end - start, idx_to_ptr(pre.index()), post - pre);
+
+    // If the run is big enough, give it back to the system.  Any
+    // pages of it we got from separate mmaps are contiguous, so a
+    // single munmap covers them.
+    if ((post - pre) * PGSIZE >= release_bytes) {
+      pdebug("free_large releasing %p %lu pages\n",
+             idx_to_ptr(pre.index()), post - pre);
+      pages.unset(pre, post);
+      if (munmap(idx_to_ptr(pre.index()), (post - pre) * PGSIZE) == 0)
+        return;
+      // Keep the pages if we couldn't unmap them for some reason
+    }
+
     // Add (possibly expanded) run to free list
     // XXX Because we add the largest size class first when adding a
     // run, this may re-create lots of runs we just absorbed.  There
     // should be a way to avoid this.
-    pdebug("free_large %p of %lu pages (expanded %p %lu pages)\n",
-           ptr, end - start, idx_to_ptr(pre.index()), post - pre);
     add_free_run(idx_to_ptr(pre.index()), (post - pre) * PGSIZE);
   }
 
+  // Free the memory at ptr to the large allocator of the thread that
+  // allocated it.
+  void free_large_owner(void *ptr)
+  {
+    auto start = pages.find(idx(ptr));
+    if (start.is_set() && start->owner == ALLOCATED_HEAD) {
+      unsigned heap = start->heap;
+      if (heap && heap != get_heap()->id) {
+        pdebug("free_large %p to remote heap %u\n", ptr, heap);
+        push_remote_free(heaps[heap], ptr);
+        return;
+      }
+    }
+    free_large(ptr);
+  }
+
   // Get the allocated size of the large allocation at ptr.
   size_t get_size_large(void *ptr)
   {
@@ -545,23 +748,75 @@ namespace {
   // Small allocator (size classes less than a page)
   //
 
-  // XXX This never frees pages back to the large allocator, so once a
-  // page has been reserved for a size class, it will stay that size
-  // class forever.
-
-  // Fragment free lists by size class (ceil(log2(bytes))).  Fragments
-  // must be at least sizeof(block_list::block), so the smaller
-  // classes are unused.
-  __thread block_list free_fragments[13] = {};
-
   // Header for pages owned by the small allocator.  Following this
   // header, a page is divided into equal-size fragments.
   struct page_hdr
   {
     uintptr_t magic;
     size_t size_class;
+    // The thread whose free list this page's fragments go on.
+    thread_heap *owner;
+    // The number of this page's fragments on the owner's free list.
+    // Only accessed by the owner.
+    size_t nfree;
   };
   enum { PAGE_HDR_MAGIC = 0x2065c977e3516564 };
+  // Fragments start here.  This keeps them 16-byte aligned.  (This
+  // could be less aligned for smaller size classes, but there are no
+  // smaller size classes.)
+  enum { PAGE_HDR_BYTES = 32 };
+
+  page_hdr *page_of(void *ptr)
+  {
+    return (page_hdr*)(((uintptr_t)ptr) & ~(PGSIZE-1));
+  }
+
+  // The number of fragments that fit on a page of size class sc.
+  size_t fragments_per_page(size_t sc)
+  {
+    return (PGSIZE - PAGE_HDR_BYTES) / class_max_size(sc);
+  }
+
+  // Free ptr on this thread's page hdr.
+  void free_small_local(page_hdr *hdr, void *ptr)
+  {
+    size_t sc = hdr->size_class;
+    thread_heap *heap = get_heap();
+    pdebug("free_small %p to class %zu\n", ptr, sc);
+    heap->free_fragments[sc].push(ptr, sc);
+    if (++hdr->nfree < fragments_per_page(sc))
+      return;
+
+    // The whole page is free.  Keep one such page per size class; give
+    // the rest back to the large allocator so they can be used for
+    // other size classes.
+    if (!heap->spare_page[sc] || heap->spare_page[sc] == hdr) {
+      heap->spare_page[sc] = hdr;
+      return;
+    }
+    pdebug("free_small releasing page %p of class %zu\n", hdr, sc);
+    size_t sbytes = class_max_size(sc);
+    char *fragment = (char*)hdr + PAGE_HDR_BYTES;
+    char *last = (char*)hdr + PGSIZE - sbytes;
+    for (; fragment <= last; fragment += sbytes)
+      block_list::remove(fragment);
+    hdr->magic = 0;
+    free_large(hdr);
+  }
+
+  // Move objects other threads have freed to us on to our free lists.
+  void drain_remote_frees(thread_heap *heap)
+  {
+    void *ptr = heap->remote_frees.exchange(nullptr, std::memory_order_acquire);
+    while (ptr) {
+      void *next = *(void**)ptr;
+      if ((uintptr_t)ptr % PGSIZE == 0)
+        free_large(ptr);
+      else
+        free_small_local(page_of(ptr), ptr);
+      ptr = next;
+    }
+  }
 
   // Allocate bytes bytes from the small allocator
   void *alloc_small(size_t bytes)
@@ -574,7 +829,11 @@ namespace {
 
     // Check for a free fragment
     size_t sc = size_to_class(bytes);
-    if (!free_fragments[sc]) {
+    thread_heap *heap = get_heap();
+    if (!heap->free_fragments[sc] &&
+        heap->remote_frees.load(std::memory_order_relaxed))
+      drain_remote_frees(heap);
+    if (!heap->free_fragments[sc]) {
       // There are no free fragments of this size.  Get a page from
       // the large allocator and chop it up.
       void *page = alloc_large(PGSIZE);
@@ -583,21 +842,25 @@ namespace {
       page_hdr *hdr = static_cast<page_hdr*>(page);
       hdr->magic = PAGE_HDR_MAGIC;
       hdr->size_class = sc;
+      hdr->owner = heap;
+      hdr->nfree = 0;
 
       size_t sbytes = class_max_size(sc);
-      // Make sure fragments are always 16-byte aligned.  (This could
-      // be less aligned for smaller size classes, but there are no
-      // smaller size classes.)
-      char *fragment = (char*)page + 16;
-      assert(sizeof(page_hdr) <= 16);
+      char *fragment = (char*)page + PAGE_HDR_BYTES;
+      static_assert(sizeof(page_hdr) <= PAGE_HDR_BYTES, "page_hdr too big");
       char *last = (char*)page + PGSIZE - sbytes;
       int i = 0;
       for (; fragment <= last; fragment += sbytes, ++i)
-        free_fragments[sc].push(fragment, sc);
+        heap->free_fragments[sc].push(fragment, sc);
+      hdr->nfree = i;
       pdebug("alloc_small growing class %zu by %d objects\n", sc, i);
     }
 
-    void *ptr = free_fragments[sc].pop(sc);
+    void *ptr = heap->free_fragments[sc].pop(sc);
+    page_hdr *hdr = page_of(ptr);
+    hdr->nfree--;
+    if (heap->spare_page[sc] == hdr)
+      heap->spare_page[sc] = nullptr;
     pdebug("alloc_small %zu bytes from class %zu => %p\n", bytes, sc, ptr);
     return ptr;
   }
@@ -606,17 +869,24 @@ namespace {
   void free_small(void *ptr)
   {
     // Round ptr to the page start to get the page metadata
-    page_hdr *hdr = (page_hdr*)(((uintptr_t)ptr) & ~(PGSIZE-1));
+    page_hdr *hdr = page_of(ptr);
     if (hdr->magic != PAGE_HDR_MAGIC)
       throw std::runtime_error("Bad free or corrupted page magic");
-    pdebug("free_small %p to class %zu\n", ptr, hdr->size_class);
-    free_fragments[hdr->size_class].push(ptr, hdr->size_class);
+    thread_heap *heap = get_heap();
+    if (hdr->owner == heap) {
+      free_small_local(hdr, ptr);
+      return;
+    }
+
+    // Hand ptr back to the thread that owns its page
+    pdebug("free_small %p to remote heap %u\n", ptr, hdr->owner->id);
+    push_remote_free(hdr->owner, ptr);
   }
 
   // Get the allocated size of the small allocation at ptr.
   size_t get_size_small(void *ptr)
   {
-    page_hdr *hdr = (page_hdr*)(((uintptr_t)ptr) & ~(PGSIZE-1));
+    page_hdr *hdr = page_of(ptr);
     if (hdr->magic != PAGE_HDR_MAGIC)
       throw std::runtime_error("Bad free or corrupted page magic");
     return class_max_size(hdr->size_class);
@@ -626,6 +896,10 @@ namespace {
 extern "C" void *
 malloc(size_t size)
 {
+  thread_heap *heap = get_heap();
+  if (heap->remote_frees.load(std::memory_order_relaxed))
+    drain_remote_frees(heap);
+
   if (size < LARGE_THRESHOLD)
     return alloc_small(size);
   return alloc_large(size);
@@ -639,7 +913,7 @@ free(void *ptr)
   uintptr_t x = reinterpret_cast<uintptr_t>(ptr);
   if (x % PGSIZE == 0) {
     // This memory came from the large allocator
-    free_large(ptr);
+    free_large_owner(ptr);
   } else {
     // This memory came from the small allocator
     free_small(ptr);
@@ -690,6 +964,8 @@ malloc_set_alloc_unit(size_t bytes)
   if (bytes < 4096)
     bytes = 4096;
   min_map_bytes = class_max_size(size_to_class(bytes));
+  if (release_bytes < min_map_bytes)
+    release_bytes = min_map_bytes;
 }
 
 extern "C" void
@@ -1,3 +1,5 @@
+#pragma once
+
 // Format of an ELF executable file
 // From linux/include/linux/elf.h
 
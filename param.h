@@ -2,11 +2,10 @@
 #define NPROC        64  // maximum number of processes
 #define KSTACKSIZE 32768 // size of per-process kernel stack
 
-// Originally NOFILE was 100. We increased it to 250 for dbench.
-// Be careful though; using large values for NOFILE can slow down
-// fork/exec/clone/spawn etc because filetable::copy() will take
-// longer to complete.
-#define NOFILE      250  // open files per process
+// The filetable is sparse, so NOFILE only bounds FD numbers: copying
+// a filetable on fork/exec/spawn costs in proportion to the open FDs,
+// not to NOFILE.  It must fit in filetable's 16-bit FD index.
+#define NOFILE    65536  // open files per process per CPU
 
 #if 0 // These parameters are currently unused.
 #define NFILE       100  // open files per system
@@ -39,6 +38,11 @@
 #define USTACKPAGES   8
 #define GCINTERVAL    10000 // max. time between GC runs (in msec)
 #define GC_GLOBAL     true
+#define WRITEBACK_INTERVAL 1000 // time between writeback passes (in msec)
+#define WRITEBACK_AGE 5000      // write back mnodes dirty for longer (in msec)
+#define WRITEBACK_BYTES (4<<20) // or files with more dirty data (in bytes)
+#define FSYNC_ASYNC_DELAY 10 // max. time before fsync_async()'s changes
+                             // are committed (in msec)
 // The MMU scheme.  One of:
 //  mmu_shared_page_table
 //  mmu_per_core_page_table
@@ -47,6 +51,9 @@
 //  batched_shootdown
 //  core_tracking_shootdown
 #define TLB_SCHEME    core_tracking_shootdown
+// Invalidating more than this many pages at once flushes the whole
+// TLB instead of issuing an invlpg per page.
+#define TLB_FLUSH_THRESHOLD 32
 // Physical page reference counting scheme.  One of:
 //  :: for shared reference counters
 //  refcache:: for refcache counters
@@ -62,12 +69,30 @@
 // If 1, create a buddy per CPU.
 #define KALLOC_BUDDY_PER_CPU 1
 // Whether or not to load balance in the scheduler.
-#define SCHED_LOAD_BALANCE 0
+#define SCHED_LOAD_BALANCE 1
 // Reference counting scheme for inode's nlink.  One of:
 //  :: for shared reference counters
 //  refcache:: for refcache counters
 #define FS_NLINK_REFCOUNT refcache::
 #define RANDOMIZE_KMALLOC 1
+// kmalloc allocation scheme.  If 1, use per-CPU magazines backed by a
+// shared depot.  If 0, use per-CPU spinlock-protected free lists.
+#define KMALLOC_MAGAZINES 1
+// Number of remote-node accesses after which a page cache page of a
+// file with NUMA_POLICY_MIGRATE is moved to the accessing node.
+#define NUMA_MIGRATE_THRESHOLD 64
+// Buffer cache placement.  If 1, interleave blocks across NUMA nodes
+// by block number.  If 0, allocate on the node of the CPU that first
+// reads the block.
+#define BUFCACHE_NUMA_INTERLEAVE 1
+// Size of the swap area, which follows the file system image on
+// disk.  Swapping is disabled if the disk has no room for it (e.g.,
+// with MEMIDE).  0 disables swapping.
+#define SWAP_MEGS     256
+// Pages kswapd evicts each time it runs under memory pressure.
+#define SWAP_BATCH    256
+// Milliseconds between kswapd's checks for allocation failures.
+#define SWAP_INTERVAL 100
 // Track kernel memory usage
 #define KERNEL_HEAP_PROFILE 0
 
@@ -12,13 +12,29 @@ typedef int pthread_t;
 typedef int pthread_attr_t;
 typedef int pthread_key_t;
 typedef int pthread_barrierattr_t;
-typedef int pthread_mutex_t;
 typedef int pthread_mutexattr_t;
-#ifdef __cplusplus
-typedef std::atomic<unsigned> pthread_barrier_t;
-#else
-typedef unsigned pthread_barrier_t;
-#endif
+typedef int pthread_condattr_t;
+
+// Mutexes and condition variables are futex words (see futex.h).
+// A mutex is 0 when unlocked, 1 when locked and 2 when locked with
+// possible waiters.
+typedef unsigned long pthread_mutex_t;
+
+typedef struct {
+  unsigned long seq;            // Advanced by every signal
+  pthread_mutex_t *mutex;       // The waiters' mutex, for requeue
+} pthread_cond_t;
+
+typedef struct {
+  unsigned long count;          // Threads per round
+  unsigned long arrived;        // Threads arrived this round
+  unsigned long seq;            // Round number
+  unsigned long wake;           // Waiters being woken by the wake tree
+} pthread_barrier_t;
+
+#define PTHREAD_MUTEX_INITIALIZER       0
+#define PTHREAD_COND_INITIALIZER        { 0, 0 }
+#define PTHREAD_BARRIER_SERIAL_THREAD   (-1)
 
 BEGIN_DECLS
 
@@ -44,6 +60,13 @@ int       pthread_mutex_lock(pthread_mutex_t *mutex);
 int       pthread_mutex_trylock(pthread_mutex_t *mutex);
 int       pthread_mutex_unlock(pthread_mutex_t *mutex);
 
+int       pthread_cond_init(pthread_cond_t *cond,
+                            const pthread_condattr_t *attr);
+int       pthread_cond_destroy(pthread_cond_t *cond);
+int       pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+int       pthread_cond_signal(pthread_cond_t *cond);
+int       pthread_cond_broadcast(pthread_cond_t *cond);
+
 int       pthread_join(pthread_t tid, void **retvalp);
 void      pthread_exit(void *retval) __noret__;
 
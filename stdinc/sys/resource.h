@@ -0,0 +1,11 @@
+#pragma once
+
+#include "compiler.h"
+#include <uk/resource.h>
+
+BEGIN_DECLS
+
+int setpriority(int which, int who, int prio);
+int getpriority(int which, int who);
+
+END_DECLS
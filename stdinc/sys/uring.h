@@ -0,0 +1,76 @@
+#pragma once
+
+#include "compiler.h"
+#include <stdint.h>
+#include <uk/uring.h>
+
+BEGIN_DECLS
+
+// Set up the calling process's ring with room for at least entries
+// submissions.  cpu is the CPU of the poller for URING_SETUP_SQPOLL.
+// Returns the ring, or (void*)-1 on failure.
+void *uring_setup(uint32_t entries, int flags, int cpu);
+
+// Run up to to_submit queued submissions (or wake the poller), then
+// wait until at least min_complete completions are queued.  Returns
+// the number of submissions run.
+int uring_enter(uint32_t to_submit, uint32_t min_complete);
+
+END_DECLS
+
+// Helpers for driving a ring from user space.
+
+static inline struct uring_sqe *
+uring_sqe_at(struct uring_ctl *r, uint32_t idx)
+{
+  return (struct uring_sqe*)((char*)r + r->sq_off) + (idx & (r->sq_entries - 1));
+}
+
+static inline struct uring_cqe *
+uring_cqe_at(struct uring_ctl *r, uint32_t idx)
+{
+  return (struct uring_cqe*)((char*)r + r->cq_off) + (idx & (r->cq_entries - 1));
+}
+
+// Return the next free submission entry, or null if the queue is
+// full.  The entry is not visible to the kernel until uring_submit.
+static inline struct uring_sqe *
+uring_get_sqe(struct uring_ctl *r, uint32_t *tail)
+{
+  if (*tail - r->sq_head >= r->sq_entries)
+    return 0;
+  return uring_sqe_at(r, (*tail)++);
+}
+
+// Publish submission entries up to tail and have the kernel run them.
+// With a poller, this only enters the kernel if the poller is asleep.
+static inline int
+uring_submit(struct uring_ctl *r, uint32_t tail, int sqpoll)
+{
+  uint32_t n = tail - r->sq_tail;
+  __atomic_store_n(&r->sq_tail, tail, __ATOMIC_RELEASE);
+  if (!sqpoll)
+    return uring_enter(n, 0);
+  // Pairs with the poller's fence between setting NEED_WAKEUP and
+  // rechecking sq_tail.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (r->sq_flags & URING_SQ_NEED_WAKEUP)
+    uring_enter(0, 0);
+  return n;
+}
+
+// Return the oldest unconsumed completion, or null if there is none.
+static inline struct uring_cqe *
+uring_peek_cqe(struct uring_ctl *r)
+{
+  if (r->cq_head == __atomic_load_n(&r->cq_tail, __ATOMIC_ACQUIRE))
+    return 0;
+  return uring_cqe_at(r, r->cq_head);
+}
+
+// Consume the completion returned by uring_peek_cqe.
+static inline void
+uring_cqe_seen(struct uring_ctl *r)
+{
+  __atomic_store_n(&r->cq_head, r->cq_head + 1, __ATOMIC_RELEASE);
+}
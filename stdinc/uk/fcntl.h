@@ -17,3 +17,17 @@
 #define O_DIRECTORY 0
 
 #define AT_FDCWD  -100
+
+// Flags for splice and vmsplice.  SPLICE_F_MOVE, SPLICE_F_MORE and
+// SPLICE_F_GIFT are accepted for compatibility; pages always move by
+// reference when they can.
+#define SPLICE_F_MOVE     0x01
+#define SPLICE_F_NONBLOCK 0x02
+#define SPLICE_F_MORE     0x04
+#define SPLICE_F_GIFT     0x08
+
+// (xv6) Page cache placement policies for fnumapolicy
+#define NUMA_POLICY_FIRST_TOUCH 0 // allocate on the faulting CPU's node
+#define NUMA_POLICY_INTERLEAVE  1 // spread pages round-robin over nodes
+#define NUMA_POLICY_MIGRATE     2 // first touch, then migrate pages that
+                                  // are repeatedly accessed remotely
@@ -0,0 +1,13 @@
+#pragma once
+
+// setpriority/getpriority 'which' value.  There are no nice values;
+// instead, the 'priority' of PRIO_CLASS is the thread's scheduling
+// class.  (PRIO_PROCESS, PRIO_PGRP and PRIO_USER are 0 through 2
+// elsewhere, so this can't be mistaken for them.)
+#define PRIO_CLASS    3
+
+// Scheduling classes, used as PRIO_CLASS priorities.  Runnable
+// latency-class threads run before batch threads, and waking one
+// preempts a batch thread running on its CPU.
+#define PRIO_LATENCY  0
+#define PRIO_BATCH    1         // The default
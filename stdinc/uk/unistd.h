@@ -15,3 +15,32 @@ enum stat_flags {
 #define SEEK_SET 0
 #define SEEK_CUR 1
 #define SEEK_END 2
+
+// fsync_async completion token.  It names a point in one per-core
+// journal; the fsync is durable once that journal has committed up to
+// tsc.  Tokens from the same cpu are ordered by tsc, so waiting for
+// the latest one covers every earlier one.
+struct fsync_token {
+  uint64_t tsc;
+  int cpu;
+};
+
+// getdents position in a directory.  Zero it to start from the
+// beginning; getdents advances it past the entries it returns.  It
+// names a bucket of the directory's name hash table and the last name
+// returned from that bucket, so it stays valid while the directory
+// changes: names present throughout are returned exactly once.
+struct getdents_cursor {
+  uint64_t bucket;
+  char name[16];                // >= DIRSIZ + 1; empty at a bucket's start
+};
+
+// A directory entry returned by getdents.
+struct getdents_ent {
+  uint64_t mnum;
+  uint8_t type;                 // T_DIR, T_FILE, ... (see uk/fs.h)
+  char name[15];                // DIRSIZ + 1, NUL-terminated
+};
+
+// fsync_wait flags
+#define FSYNC_WAIT_POLL     (1<<0) // Return 1 instead of waiting
@@ -0,0 +1,70 @@
+// User/kernel shared definitions for the system call submission ring
+#pragma once
+
+// A process may set up one ring with uring_setup, which maps it into
+// the process and returns its address.  The ring starts with a struct
+// uring_ctl, followed by the submission queue (an array of sq_entries
+// struct uring_sqe at sq_off) and the completion queue (an array of
+// cq_entries struct uring_cqe at cq_off).
+//
+// The process fills submission entries, then advances sq_tail; the
+// kernel consumes them and advances sq_head.  The kernel posts a
+// completion for every entry and advances cq_tail; the process
+// advances cq_head once it has read them.  Entries run in submission
+// order, except that URING_OP_FSYNC completes asynchronously once the
+// journal holding its changes has been committed.
+
+// Operations.  res is the return value of the corresponding system
+// call.
+#define URING_OP_NOP     0
+#define URING_OP_OPENAT  1      // fd is the dirfd, addr the path
+#define URING_OP_READ    2      // fd, addr, len
+#define URING_OP_WRITE   3      // fd, addr, len
+#define URING_OP_PWRITE  4      // fd, addr, len, off
+#define URING_OP_FSYNC   5      // fd
+#define URING_OP_RENAME  6      // addr is the old path, addr2 the new
+#define URING_OP_UNLINK  7      // addr is the path
+#define URING_OP_CLOSE   8      // fd
+
+// uring_setup flags
+#define URING_SETUP_SQPOLL  0x1 // Poll the submission queue from a
+                                // kernel thread pinned to a CPU
+
+// uring_ctl sq_flags
+#define URING_SQ_NEED_WAKEUP 0x1 // The poller is asleep; call
+                                 // uring_enter to wake it
+
+struct uring_sqe {
+  uint8_t  opcode;
+  uint8_t  flags;
+  uint16_t __pad;
+  int fd;
+  uint64_t off;
+  uint64_t addr;
+  uint64_t addr2;
+  uint32_t len;
+  int oflags;                   // For URING_OP_OPENAT
+  uint64_t user_data;           // Copied to the completion
+  uint64_t __reserved[2];
+};
+
+struct uring_cqe {
+  uint64_t user_data;
+  int64_t res;
+};
+
+struct uring_ctl {
+  volatile uint32_t sq_head;
+  volatile uint32_t sq_tail;
+  uint32_t sq_entries;          // A power of two
+  volatile uint32_t sq_flags;
+  uint64_t sq_off;
+  char __pad0[40];
+
+  volatile uint32_t cq_head;
+  volatile uint32_t cq_tail;
+  uint32_t cq_entries;          // A power of two
+  uint32_t __pad1;
+  uint64_t cq_off;
+  char __pad2[40];
+};
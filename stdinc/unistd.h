@@ -24,6 +24,8 @@ int pipe(int pipefd[2]);
 int pipe2(int pipefd[2], int flags);
 void sync(void);
 int fsync(int fd);
+int fsync_async(int fd, struct fsync_token *tok);
+int fsync_wait(struct fsync_token *tok, int flags);
 
 unsigned sleep(unsigned);
 unsigned usleep(unsigned);
@@ -26,6 +26,7 @@ void rinode(u32 inum, struct dinode *ip);
 void rsect(u32 sec, void *buf);
 u32 ialloc(u16 type);
 void iappend(u32 inum, void *p, int n);
+void sparsify(char *img, char *out);
 
 // convert to intel byte order
 u16
@@ -60,8 +61,14 @@ main(int argc, char *argv[])
   struct dinode din;
   int nblocks;
 
+  if(argc == 4 && strcmp(argv[1], "-s") == 0){
+    sparsify(argv[2], argv[3]);
+    exit(0);
+  }
+
   if(argc < 2){
     fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "       mkfs -s fs.img fs.sparse\n");
     exit(1);
   }
 
@@ -75,7 +82,7 @@ main(int argc, char *argv[])
   }
 
   bitblocks = (size+BSIZE*8-1)/(BSIZE*8);
-  usedblocks = ninodes / IPB + 3 + bitblocks;
+  usedblocks = ninodes / IPB + 3 + bitblocks + NORPHANBLKS(ninodes);
   freeblock = usedblocks;
 
   nblocks = size - usedblocks;
@@ -83,8 +90,11 @@ main(int argc, char *argv[])
   printf("used %d (bit %d ninode %zu) free %u total %d\n", usedblocks,
          bitblocks, ninodes/IPB + 1, freeblock, nblocks+usedblocks);
 
-  for(i = 0; i < nblocks + usedblocks; i++)
-    wsect(i, zeroes);
+  // Leave the image sparse; blocks that are never written read as zeroes.
+  if(ftruncate(fsfd, (off_t)(nblocks + usedblocks) * BSIZE) < 0){
+    perror("ftruncate");
+    exit(1);
+  }
 
   sb.size = xint(size);
   sb.nblocks = xint(nblocks); // so whole disk is size sectors
@@ -330,3 +340,97 @@ iappend(u32 inum, void *xp, int n)
   din.size = xint(off);
   winode(inum, &din);
 }
+
+// Write out the sparse version of the image (see struct sparse_extent) that
+// gets embedded in the kernel: the contents of the allocated blocks that are
+// not all zeroes, and just the extents of the ones that are. Free blocks are
+// left out altogether, which keeps the kernel from having to write out the
+// whole disk at boot.
+void
+sparsify(char *img, char *out)
+{
+  char buf[BSIZE], bitmap[BSIZE];
+  struct sparse_extent ext;
+  u32 b, n, bbn, nextents, ndata;
+  u8 *type;
+  int outfd;
+
+  if((fsfd = open(img, O_RDONLY)) < 0){
+    perror(img);
+    exit(1);
+  }
+  if((outfd = open(out, O_WRONLY|O_CREAT|O_TRUNC, 0666)) < 0){
+    perror(out);
+    exit(1);
+  }
+
+  rsect(1, buf);
+  memmove(&sb, buf, sizeof(sb));
+  size = xint(sb.size);
+  ninodes = xint(sb.ninodes);
+
+  // Classify every block first, so that we know the length of each extent
+  // before writing out its header.
+  type = calloc(size, 1);
+  assert(type);
+  bbn = -1;
+  for(b = 0; b < size; b++){
+    if(b / BPB != bbn){
+      bbn = b / BPB;
+      rsect(ninodes / IPB + 3 + bbn, bitmap);
+    }
+    if(!(bitmap[(b % BPB) / 8] & (1 << (b % 8))))
+      continue;
+
+    rsect(b, buf);
+    type[b] = memcmp(buf, zeroes, BSIZE) ? SPARSE_DATA : SPARSE_ZERO;
+  }
+
+  nextents = ndata = 0;
+  for(b = 0; b < size; b += n){
+    for(n = 1; b + n < size && type[b + n] == type[b]; n++)
+      ;
+    if(!type[b])
+      continue;
+
+    memset(buf, 0, sizeof(buf));
+    ext.magic = xint(SPARSE_MAGIC);
+    ext.type = xint(type[b]);
+    ext.blknum = xint(b);
+    ext.nblocks = xint(n);
+    memmove(buf, &ext, sizeof(ext));
+    if(write(outfd, buf, BSIZE) != BSIZE){
+      perror("write");
+      exit(1);
+    }
+    nextents++;
+
+    if(type[b] != SPARSE_DATA)
+      continue;
+    for(u32 i = 0; i < n; i++){
+      rsect(b + i, buf);
+      if(write(outfd, buf, BSIZE) != BSIZE){
+        perror("write");
+        exit(1);
+      }
+    }
+    ndata += n;
+  }
+
+  // Terminating extent.
+  memset(buf, 0, sizeof(buf));
+  ext.magic = xint(SPARSE_MAGIC);
+  ext.type = xint(SPARSE_DATA);
+  ext.blknum = xint(size);
+  ext.nblocks = 0;
+  memmove(buf, &ext, sizeof(ext));
+  if(write(outfd, buf, BSIZE) != BSIZE){
+    perror("write");
+    exit(1);
+  }
+
+  printf("sparsify: %u extents, %u data blocks of %u\n", nextents, ndata, size);
+  free(type);
+  close(outfd);
+  close(fsfd);
+}